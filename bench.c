@@ -0,0 +1,428 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAS_GNUTLS
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#else
+#include <polarssl/gcm.h>
+#include <polarssl/version.h>
+#endif
+
+#include "main.h"
+#include "bench.h"
+
+
+typedef struct __bench_cipher
+{
+  const char* name;
+#ifdef HAS_GNUTLS
+  gnutls_cipher_algorithm_t algorithm;
+#endif
+  unsigned int key_bits;
+} bench_cipher_t;
+
+static const bench_cipher_t bench_candidates[BENCH_MAX_CIPHERS] =
+  {
+#ifdef HAS_GNUTLS
+    { "AES-128-GCM", GNUTLS_CIPHER_AES_128_GCM, 128 },
+    { "AES-256-GCM", GNUTLS_CIPHER_AES_256_GCM, 256 },
+    { "CHACHA20-POLY1305", GNUTLS_CIPHER_CHACHA20_POLY1305, 256 },
+#else
+    /* no ChaCha20-Poly1305 in PolarSSL */
+    { "AES-128-GCM", 128 },
+    { "AES-256-GCM", 256 },
+    { NULL, 0 },
+#endif
+  };
+
+/* fastest first, as a priority string fragment "+A:+B:+C" */
+static char bench_order[128];
+static const char* bench_ranked[BENCH_MAX_CIPHERS];
+
+
+/**
+ * @return monotonic time, in nanoseconds
+ */
+static uint64_t bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * Encrypts BENCH_BUFFER_SIZE bytes records for BENCH_DURATION_MS.
+ *
+ * @param cipher : candidate cipher
+ * @param buffer : plain text
+ * @param out : cipher text (BENCH_BUFFER_SIZE + 16 bytes)
+ * @return throughput in MB/s, negative value if cipher is unavailable
+ */
+static double bench_cipher(const bench_cipher_t* cipher, unsigned char* buffer, unsigned char* out)
+{
+  unsigned char key[32], nonce[12], aad[13];
+  uint64_t start, elapsed, bytes = 0;
+  int retcode;
+
+  memset(key, 0x42, sizeof(key));
+  memset(nonce, 0, sizeof(nonce));
+  memset(aad, 0, sizeof(aad));
+
+#ifdef HAS_GNUTLS
+  gnutls_aead_cipher_hd_t handle;
+  gnutls_datum_t key_datum = { key, cipher->key_bits / 8 };
+  size_t out_len;
+
+  if (gnutls_aead_cipher_init(&handle, cipher->algorithm, &key_datum) < 0)
+    return -1;
+
+  start = bench_now();
+  do
+    {
+      out_len = BENCH_BUFFER_SIZE + 16;
+      retcode = gnutls_aead_cipher_encrypt(handle, nonce, sizeof(nonce), aad, sizeof(aad), 16,
+					   buffer, BENCH_BUFFER_SIZE, out, &out_len);
+      if (retcode < 0)
+	break;
+
+      nonce[11]++;
+      bytes += BENCH_BUFFER_SIZE;
+      elapsed = bench_now() - start;
+    }
+  while (elapsed < BENCH_DURATION_MS * 1000000ULL);
+
+  gnutls_aead_cipher_deinit(handle);
+#else
+  gcm_context ctx;
+  unsigned char tag[16];
+
+  if (gcm_init(&ctx, POLARSSL_CIPHER_ID_AES, key, cipher->key_bits) != 0)
+    return -1;
+
+  start = bench_now();
+  do
+    {
+      retcode = gcm_crypt_and_tag(&ctx, GCM_ENCRYPT, BENCH_BUFFER_SIZE, nonce, sizeof(nonce),
+				  aad, sizeof(aad), buffer, out, sizeof(tag), tag);
+      if (retcode != 0)
+	break;
+
+      nonce[11]++;
+      bytes += BENCH_BUFFER_SIZE;
+      elapsed = bench_now() - start;
+    }
+  while (elapsed < BENCH_DURATION_MS * 1000000ULL);
+
+  gcm_free(&ctx);
+#endif
+
+  if (retcode < 0 || !bytes)
+    return -1;
+
+  return (double) bytes / ((double) elapsed / 1000.0);
+}
+
+
+/**
+ * Times every candidate cipher available in TLS library.
+ *
+ * @param results : BENCH_MAX_CIPHERS results, sorted fastest first
+ * @return number of results
+ */
+int bench_ciphers(bench_result_t* results)
+{
+  unsigned char *buffer, *out;
+  bench_result_t r;
+  double mbps;
+  int i, j, round, n = 0;
+
+  buffer = (unsigned char*) xmalloc(BENCH_BUFFER_SIZE);
+  out = (unsigned char*) xmalloc(BENCH_BUFFER_SIZE + 16);
+
+  for (i=0; i<BENCH_MAX_CIPHERS; i++)
+    {
+      if (!bench_candidates[i].name)
+	continue;
+
+      /* first run warms up caches and CPU frequency, best round is kept */
+      bench_cipher(&bench_candidates[i], buffer, out);
+
+      r.name = bench_candidates[i].name;
+      r.mbps = -1;
+      for (round=0; round<BENCH_ROUNDS; round++)
+	{
+	  mbps = bench_cipher(&bench_candidates[i], buffer, out);
+	  if (mbps > r.mbps)
+	    r.mbps = mbps;
+	}
+      if (r.mbps < 0)
+	continue;
+
+      /* insertion sort, fastest first */
+      for (j = n; j > 0 && results[j-1].mbps < r.mbps; j--)
+	results[j] = results[j-1];
+      results[j] = r;
+      n++;
+    }
+
+  xfree(buffer);
+  xfree(out);
+  return n;
+}
+
+
+/**
+ * Sets preferred cipher order from sorted names.
+ *
+ * @param names : cipher names, fastest first
+ * @param n : number of names
+ */
+static void bench_set_order(const char** names, int n)
+{
+  size_t len = 0;
+  int i;
+
+  bench_order[0] = '\0';
+  memset(bench_ranked, 0, sizeof(bench_ranked));
+
+  for (i=0; i<n && i<BENCH_MAX_CIPHERS; i++)
+    {
+      bench_ranked[i] = names[i];
+      len += snprintf(bench_order + len, sizeof(bench_order) - len, "%s+%s",
+		      i ? ":" : "", names[i]);
+      if (len >= sizeof(bench_order))
+	break;
+    }
+}
+
+
+/**
+ * @param name : cipher name from a cache file
+ * @return candidate name (static storage), NULL if unknown
+ */
+static const char* bench_candidate(const char* name)
+{
+  int i;
+
+  for (i=0; i<BENCH_MAX_CIPHERS; i++)
+    if (bench_candidates[i].name && !strcmp(name, bench_candidates[i].name))
+      return bench_candidates[i].name;
+
+  return NULL;
+}
+
+
+/**
+ * Identifies host and library, so that a cache copied to another box (or
+ * kept across a library upgrade) is not trusted.
+ *
+ * @param id : buffer
+ * @param len : `id` length
+ */
+static void bench_host_id(char* id, size_t len)
+{
+  char line[256], *model = "unknown", *c;
+  FILE* fd;
+
+  fd = fopen("/proc/cpuinfo", "r");
+  while (fd && fgets(line, sizeof(line), fd))
+    {
+      if (strncmp(line, "model name", 10))
+	continue;
+
+      c = strchr(line, ':');
+      if (c)
+	{
+	  model = c + 1 + strspn(c + 1, " \t");
+	  model[strcspn(model, "\n")] = '\0';
+	}
+      break;
+    }
+
+  snprintf(id, len,
+#ifdef HAS_GNUTLS
+	   "GnuTLS %s, %s",
+	   gnutls_check_version(NULL),
+#else
+	   "PolarSSL %s, %s",
+	   POLARSSL_VERSION_STRING,
+#endif
+	   model);
+
+  if (fd)
+    fclose(fd);
+}
+
+
+/**
+ * `--bench-ciphers` mode: prints every candidate throughput.
+ *
+ * @return 0 if all good, -1 if no cipher could be timed
+ */
+int bench_print(void)
+{
+  bench_result_t results[BENCH_MAX_CIPHERS];
+  char id[512];
+  int i, n;
+
+  bench_host_id(id, sizeof(id));
+  printf("Host: %s\n", id);
+
+  n = bench_ciphers(results);
+  for (i=0; i<n; i++)
+    printf("  %-20s %10.1f MB/s\n", results[i].name, results[i].mbps);
+
+  if (!n)
+    {
+      printf("No AEAD cipher available\n");
+      return -1;
+    }
+
+  printf("Preferred: %s\n", results[0].name);
+  return 0;
+}
+
+
+/**
+ * Automatic mode: loads cached cipher order of this host, or runs benchmark
+ * and caches its result. Must be called before privileges are dropped.
+ *
+ * @param cache_dir : cache directory, NULL to skip cache
+ * @param verbose : verbose level
+ * @return 0 if all good, -1 otherwise
+ */
+int bench_auto(const char* cache_dir, int verbose)
+{
+  bench_result_t results[BENCH_MAX_CIPHERS];
+  const char* names[BENCH_MAX_CIPHERS];
+  char path[PATH_MAX], id[512], line[512], *name, *saveptr;
+  FILE* fd = NULL;
+  int i, n = 0;
+
+  bench_host_id(id, sizeof(id));
+
+  if (cache_dir)
+    {
+      snprintf(path, sizeof(path), "%s/%s", cache_dir, BENCH_CACHE_FILE);
+      fd = fopen(path, "r");
+    }
+
+  /* cache is "host id" line, then "order" line */
+  if (fd && fgets(line, sizeof(line), fd) &&
+      !strncmp(line, id, strlen(id)) && line[strlen(id)] == '\n' &&
+      fgets(line, sizeof(line), fd))
+    {
+      line[strcspn(line, "\n")] = '\0';
+      for (name = strtok_r(line, ":", &saveptr); name && n < BENCH_MAX_CIPHERS;
+	   name = strtok_r(NULL, ":", &saveptr))
+	if ((names[n] = bench_candidate(name)))
+	  n++;
+    }
+
+  if (fd)
+    fclose(fd);
+
+  if (n)
+    {
+      bench_set_order(names, n);
+      if (verbose)
+	xlog(LOG_INFO, "Cipher order (cached): %s\n", bench_order);
+      return 0;
+    }
+
+  n = bench_ciphers(results);
+  if (!n)
+    {
+      xlog(LOG_WARNING, "No AEAD cipher could be timed, keeping default order\n");
+      return -1;
+    }
+
+  for (i=0; i<n; i++)
+    {
+      names[i] = results[i].name;
+      if (verbose > 1)
+	xlog(LOG_DEBUG, "%s: %.1f MB/s\n", results[i].name, results[i].mbps);
+    }
+  bench_set_order(names, n);
+
+  if (verbose)
+    xlog(LOG_INFO, "Cipher order (measured): %s\n", bench_order);
+
+  if (!cache_dir)
+    return 0;
+
+  fd = fopen(path, "w");
+  if (!fd)
+    {
+      xlog(LOG_WARNING, "Failed to cache cipher order in '%s': %s\n", path, strerror(errno));
+      return 0;
+    }
+
+  fprintf(fd, "%s\n", id);
+  for (i=0; i<n; i++)
+    fprintf(fd, "%s%s", i ? ":" : "", names[i]);
+  fprintf(fd, "\n");
+  fclose(fd);
+
+  return 0;
+}
+
+
+/**
+ * @return measured cipher order as a GnuTLS priority fragment, NULL if none
+ */
+const char* bench_cipher_order(void)
+{
+  return bench_order[0] ? bench_order : NULL;
+}
+
+
+/**
+ * Rank of a ciphersuite in measured order, used to sort PolarSSL
+ * ciphersuites.
+ *
+ * @param name : ciphersuite name
+ * @return index of first measured cipher it uses, BENCH_MAX_CIPHERS if none
+ */
+int bench_cipher_rank(const char* name)
+{
+  int i;
+
+  for (i=0; i<BENCH_MAX_CIPHERS && bench_ranked[i]; i++)
+    if (strstr(name, bench_ranked[i]))
+      return i;
+
+  return BENCH_MAX_CIPHERS;
+}
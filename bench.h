@@ -0,0 +1,48 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define BENCH_DURATION_MS 5
+#define BENCH_BUFFER_SIZE 16384
+#define BENCH_ROUNDS 3
+#define BENCH_MAX_CIPHERS 3
+#define BENCH_CACHE_FILE "ciphers.bench"
+
+/*
+ * AEAD cipher micro-benchmark: bulk encryption of each candidate cipher is
+ * timed through the TLS library, and the fastest one on this CPU goes first
+ * in default TLS priority. Results are cached (in TLS cache directory) along
+ * with CPU model and library version.
+ */
+typedef struct __bench_result
+{
+  const char* name;		/* GnuTLS priority name, eg. "AES-128-GCM" */
+  double mbps;
+} bench_result_t;
+
+
+int bench_ciphers(bench_result_t* results);
+int bench_print(void);
+int bench_auto(const char* cache_dir, int verbose);
+const char* bench_cipher_order(void);
+int bench_cipher_rank(const char* name);
@@ -0,0 +1,419 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event.h"
+
+
+static int event_timer_event(int fd, uint32_t events, void* data);
+
+
+/**
+ * Creates the epoll instance backing an event loop, and the timerfd of its
+ * timers.
+ *
+ * @param loop : event loop to initialize
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int event_loop_init(event_loop_t* loop)
+{
+  memset(loop, 0, sizeof(event_loop_t));
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+
+  if (loop->epfd < 0 || loop->timerfd < 0)
+    return -1;
+
+  loop->timer_handler.fd = loop->timerfd;
+  loop->timer_handler.cb = event_timer_event;
+  loop->timer_handler.data = loop;
+
+  return event_add(loop, &loop->timer_handler, EPOLLIN);
+}
+
+
+/**
+ * Releases an event loop. Registered fds are not closed, pending timers are
+ * dropped.
+ *
+ * @param loop : event loop to close
+ */
+void event_loop_close(event_loop_t* loop)
+{
+  unsigned int i;
+
+  if (loop->epfd >= 0)
+    close(loop->epfd);
+  if (loop->timerfd >= 0)
+    close(loop->timerfd);
+
+  for (i=0; i<loop->ntimers; i++)
+    loop->timers[i]->index = 0;
+  free(loop->timers);
+
+  loop->epfd = loop->timerfd = -1;
+  loop->nfds = 0;
+  loop->timers = NULL;
+  loop->ntimers = loop->timers_size = 0;
+}
+
+
+/**
+ * Registers a handler. For edge-triggered registration (EPOLLET), the handler
+ * is expected to drain its fd until EAGAIN.
+ *
+ * @param loop : event loop
+ * @param handler : handler to register, must stay valid until event_del()
+ * @param events : epoll event mask
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int event_add(event_loop_t* loop, event_handler_t* handler, uint32_t events)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events = events;
+  ev.data.ptr = handler;
+
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, handler->fd, &ev) < 0)
+    return -1;
+
+  loop->nfds++;
+  return 0;
+}
+
+
+/**
+ * Changes events a registered handler waits for. Readiness is checked again,
+ * so that an edge-triggered handler is called if its fd is already ready.
+ *
+ * @param loop : event loop
+ * @param handler : registered handler
+ * @param events : epoll event mask
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int event_mod(event_loop_t* loop, event_handler_t* handler, uint32_t events)
+{
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events = events;
+  ev.data.ptr = handler;
+
+  return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, handler->fd, &ev);
+}
+
+
+/**
+ * Unregisters a handler.
+ *
+ * @param loop : event loop
+ * @param handler : handler to remove
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int event_del(event_loop_t* loop, event_handler_t* handler)
+{
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, handler->fd, NULL) < 0)
+    return -1;
+
+  loop->nfds--;
+  return 0;
+}
+
+
+/**
+ * Waits for events and calls matching handlers.
+ *
+ * @param loop : event loop
+ * @param timeout : maximum wait in milliseconds, -1 for infinite
+ * @return number of events processed, -1 if epoll failed (errno is set) or
+ * the negative value returned by a failing handler
+ */
+int event_dispatch(event_loop_t* loop, int timeout)
+{
+  struct epoll_event events[EVENT_MAX_EVENTS];
+  int i, n, retcode;
+
+  n = epoll_wait(loop->epfd, events, EVENT_MAX_EVENTS, timeout);
+  if (n < 0)
+    return (errno == EINTR) ? 0 : -1;
+
+  for (i=0; i<n; i++)
+    {
+      event_handler_t* handler = (event_handler_t*) events[i].data.ptr;
+
+      retcode = handler->cb(handler->fd, events[i].events, handler->data);
+      if (retcode < 0)
+	return retcode;
+    }
+
+  return n;
+}
+
+
+/**
+ * Switches a fd to non-blocking mode, required for edge-triggered handlers.
+ *
+ * @param fd : file descriptor
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int event_set_nonblock(int fd)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return -1;
+
+  return 0;
+}
+
+
+/*
+ * Timers. Heap slots are 0-based, timer->index is slot + 1 so that a zeroed
+ * timer is not armed.
+ */
+
+/**
+ * @return negative, zero or positive value as `a` is before, equal to or
+ * after `b`
+ */
+static int event_timespec_cmp(const struct timespec* a, const struct timespec* b)
+{
+  if (a->tv_sec != b->tv_sec)
+    return (a->tv_sec < b->tv_sec) ? -1 : 1;
+  if (a->tv_nsec != b->tv_nsec)
+    return (a->tv_nsec < b->tv_nsec) ? -1 : 1;
+  return 0;
+}
+
+
+/**
+ * Stores `timer` at heap `slot`.
+ */
+static void event_timer_set(event_loop_t* loop, unsigned int slot, event_timer_t* timer)
+{
+  loop->timers[slot] = timer;
+  timer->index = slot + 1;
+}
+
+
+/**
+ * Moves timer at heap `slot` up or down to its place.
+ */
+static void event_timer_sift(event_loop_t* loop, unsigned int slot)
+{
+  event_timer_t* timer = loop->timers[slot];
+  unsigned int parent, child;
+
+  while (slot > 0)
+    {
+      parent = (slot - 1) / 2;
+      if (event_timespec_cmp(&loop->timers[parent]->expire, &timer->expire) <= 0)
+	break;
+      event_timer_set(loop, slot, loop->timers[parent]);
+      slot = parent;
+    }
+
+  for (;;)
+    {
+      child = 2 * slot + 1;
+      if (child >= loop->ntimers)
+	break;
+      if (child + 1 < loop->ntimers &&
+	  event_timespec_cmp(&loop->timers[child + 1]->expire, &loop->timers[child]->expire) < 0)
+	child++;
+      if (event_timespec_cmp(&timer->expire, &loop->timers[child]->expire) <= 0)
+	break;
+      event_timer_set(loop, slot, loop->timers[child]);
+      slot = child;
+    }
+
+  event_timer_set(loop, slot, timer);
+}
+
+
+/**
+ * Removes timer from heap, without touching the timerfd.
+ */
+static void event_timer_remove(event_loop_t* loop, event_timer_t* timer)
+{
+  unsigned int slot = timer->index - 1;
+
+  timer->index = 0;
+  loop->ntimers--;
+
+  if (slot == loop->ntimers)
+    return;
+
+  event_timer_set(loop, slot, loop->timers[loop->ntimers]);
+  event_timer_sift(loop, slot);
+}
+
+
+/**
+ * Arms the loop timerfd on the earliest timer, unless it already is.
+ */
+static void event_timer_update(event_loop_t* loop)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(struct itimerspec));
+  if (loop->ntimers)
+    its.it_value = loop->timers[0]->expire;
+
+  if (!event_timespec_cmp(&its.it_value, &loop->timer_next))
+    return;
+
+  loop->timer_next = its.it_value;
+  timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+/**
+ * Loop timerfd handler: calls back every expired timer, earliest first.
+ *
+ * @return 0, or the negative value returned by a failing timer
+ */
+static int event_timer_event(int fd, uint32_t events, void* data)
+{
+  event_loop_t* loop = (event_loop_t*) data;
+  event_timer_t* timer;
+  struct timespec now;
+  uint64_t expirations;
+  int retcode = 0;
+
+  (void) events;
+
+  if (read(fd, &expirations, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+    return 0;
+
+  /* timerfd has to be armed again */
+  memset(&loop->timer_next, 0, sizeof(struct timespec));
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  while (retcode >= 0 && loop->ntimers &&
+	 event_timespec_cmp(&loop->timers[0]->expire, &now) <= 0)
+    {
+      /* callback may arm it again */
+      timer = loop->timers[0];
+      event_timer_remove(loop, timer);
+      retcode = timer->cb(timer->data);
+    }
+
+  event_timer_update(loop);
+  return (retcode < 0) ? retcode : 0;
+}
+
+
+/**
+ * @param timer : timer to initialize, not armed
+ * @param cb : expiration callback
+ * @param data : callback argument
+ */
+void event_timer_init(event_timer_t* timer, event_timer_cb_t cb, void* data)
+{
+  memset(timer, 0, sizeof(event_timer_t));
+  timer->cb = cb;
+  timer->data = data;
+}
+
+
+/**
+ * Arms a timer, replacing its pending expiration if any.
+ *
+ * @param loop : event loop
+ * @param timer : timer, must stay valid until it expires or is cancelled
+ * @param usec : delay in microseconds
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int event_timer_arm(event_loop_t* loop, event_timer_t* timer, long usec)
+{
+  event_timer_t** timers;
+  unsigned int size;
+
+  clock_gettime(CLOCK_MONOTONIC, &timer->expire);
+  timer->expire.tv_sec += usec / 1000000;
+  timer->expire.tv_nsec += (usec % 1000000) * 1000;
+  if (timer->expire.tv_nsec >= 1000000000)
+    {
+      timer->expire.tv_sec++;
+      timer->expire.tv_nsec -= 1000000000;
+    }
+
+  if (!timer->index)
+    {
+      if (loop->ntimers == loop->timers_size)
+	{
+	  size = loop->timers_size ? 2 * loop->timers_size : EVENT_TIMERS_MIN;
+	  timers = (event_timer_t**) realloc(loop->timers, size * sizeof(event_timer_t*));
+	  if (!timers)
+	    return -1;
+
+	  loop->timers = timers;
+	  loop->timers_size = size;
+	}
+
+      event_timer_set(loop, loop->ntimers++, timer);
+    }
+
+  event_timer_sift(loop, timer->index - 1);
+  event_timer_update(loop);
+  return 0;
+}
+
+
+/**
+ * Cancels a timer, if armed.
+ *
+ * @param loop : event loop
+ * @param timer : timer
+ */
+void event_timer_cancel(event_loop_t* loop, event_timer_t* timer)
+{
+  if (!timer->index)
+    return;
+
+  event_timer_remove(loop, timer);
+  event_timer_update(loop);
+}
+
+
+/**
+ * @param timer : timer
+ * @return 1 if timer is pending, 0 otherwise
+ */
+int event_timer_armed(event_timer_t* timer)
+{
+  return (timer->index != 0);
+}
@@ -0,0 +1,84 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#define EVENT_MAX_EVENTS 16
+#define EVENT_TIMERS_MIN 16
+
+/*
+ * An event handler is called with the epoll event mask of its fd. A negative
+ * return value stops event_dispatch() and is propagated to its caller.
+ */
+typedef int (*event_cb_t)(int fd, uint32_t events, void* data);
+
+typedef struct __event_handler
+{
+  int fd;
+  event_cb_t cb;
+  void* data;
+} event_handler_t;
+
+/*
+ * A timer is a one-shot expiration, called back from event_dispatch() like a
+ * handler. Any number of timers share the event loop timerfd: they are kept
+ * in a min-heap on their expiration, the earliest one arming the timerfd.
+ */
+typedef int (*event_timer_cb_t)(void* data);
+
+typedef struct __event_timer
+{
+  struct timespec expire;	/* CLOCK_MONOTONIC */
+  unsigned int index;		/* heap slot + 1, 0 if not armed */
+  event_timer_cb_t cb;
+  void* data;
+} event_timer_t;
+
+typedef struct __event_loop
+{
+  int epfd;
+  int nfds;
+
+  int timerfd;
+  event_handler_t timer_handler;
+  struct timespec timer_next;	/* timerfd expiration, zero if disarmed */
+  event_timer_t** timers;	/* min-heap */
+  unsigned int ntimers;
+  unsigned int timers_size;
+} event_loop_t;
+
+
+int event_loop_init(event_loop_t* loop);
+void event_loop_close(event_loop_t* loop);
+int event_add(event_loop_t* loop, event_handler_t* handler, uint32_t events);
+int event_mod(event_loop_t* loop, event_handler_t* handler, uint32_t events);
+int event_del(event_loop_t* loop, event_handler_t* handler);
+int event_dispatch(event_loop_t* loop, int timeout);
+int event_set_nonblock(int fd);
+void event_timer_init(event_timer_t* timer, event_timer_cb_t cb, void* data);
+int event_timer_arm(event_loop_t* loop, event_timer_t* timer, long usec);
+void event_timer_cancel(event_loop_t* loop, event_timer_t* timer);
+int event_timer_armed(event_timer_t* timer);
@@ -0,0 +1,296 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+
+#include "main.h"
+#include "http.h"
+
+
+/**
+ * @param r : response to be received
+ */
+void http_response_init(http_response_t* r)
+{
+  r->len = r->header_len = 0;
+  r->minor = r->status = 0;
+  r->content_length = -1;
+  r->keep_alive = 0;
+  r->nheaders = 0;
+}
+
+
+/**
+ * @param start : where to look from
+ * @param end : end of received bytes
+ * @return end of header block (past empty line), NULL if not received yet
+ */
+static char* http_header_end(char* start, char* end)
+{
+  char* c;
+
+  for (c = start; c + 3 < end; c++)
+    if (c[0] == '\r' && c[1] == '\n' && c[2] == '\r' && c[3] == '\n')
+      return c + 4;
+
+  return NULL;
+}
+
+
+/**
+ * Splits complete header block into status line and header fields, in place.
+ *
+ * @param r : response
+ * @return 0 if all good, -1 if malformed
+ */
+static int http_response_split(http_response_t* r)
+{
+  char *line, *next, *end, *colon, *value;
+  const char* connection;
+  int keep_alive;
+
+  end = r->buf + r->header_len - 2;
+
+  for (line = r->buf; line < end; line = next)
+    {
+      next = strstr(line, "\r\n");
+      if (!next || next > end)
+	break;
+      next[0] = next[1] = '\0';
+      next += 2;
+
+      if (line == r->buf)
+	{
+	  if (sscanf(line, "HTTP/1.%d %d", &r->minor, &r->status) != 2)
+	    return -1;
+	  continue;
+	}
+
+      colon = strchr(line, ':');
+      if (!colon || r->nheaders == HTTP_MAX_HEADERS)
+	continue;
+
+      *colon = '\0';
+      for (value = colon + 1; *value == ' ' || *value == '\t'; value++);
+      r->headers[r->nheaders].name = line;
+      r->headers[r->nheaders].value = value;
+      r->nheaders++;
+    }
+
+  if (!r->status)
+    return -1;
+
+  if ((value = (char*) http_header(r, "Content-Length", 0)))
+    r->content_length = strtol(value, NULL, 10);
+
+  /* HTTP/1.1 connections persist unless told otherwise, 1.0 ones do not */
+  keep_alive = (r->minor >= 1);
+  connection = http_header(r, "Proxy-Connection", 0);
+  if (!connection)
+    connection = http_header(r, "Connection", 0);
+  if (connection)
+    keep_alive = !strcasecmp(connection, "keep-alive");
+
+  /* body length must be known to reach next response */
+  r->keep_alive = keep_alive && r->content_length >= 0;
+
+  return 0;
+}
+
+
+/**
+ * Parses bytes just received at the end of response buffer.
+ *
+ * @param r : response
+ * @param n : number of bytes appended at r->buf + r->len
+ * @return 1 if header block is complete, 0 if more bytes are needed, -1 if
+ * response is malformed or too large
+ */
+int http_response_parse(http_response_t* r, size_t n)
+{
+  char* end;
+  size_t from;
+
+  if (r->header_len)
+    return 1;
+
+  from = (r->len > 3) ? r->len - 3 : 0;
+  r->len += n;
+  r->buf[r->len] = '\0';
+
+  end = http_header_end(r->buf + from, r->buf + r->len);
+  if (!end)
+    return (r->len < HTTP_MAX_HEADER_SIZE) ? 0 : -1;
+
+  r->header_len = end - r->buf;
+  return (http_response_split(r) < 0) ? -1 : 1;
+}
+
+
+/**
+ * Looks up a header field, case-insensitive.
+ *
+ * @param r : response with a complete header block
+ * @param name : field name
+ * @param index : 0 for first occurence, 1 for second, etc.
+ * @return field value, NULL if not found
+ */
+const char* http_header(http_response_t* r, const char* name, unsigned int index)
+{
+  unsigned int i;
+
+  for (i=0; i<r->nheaders; i++)
+    if (!strcasecmp(r->headers[i].name, name) && index-- == 0)
+      return r->headers[i].value;
+
+  return NULL;
+}
+
+
+/**
+ * Receives a response header block from a plain socket, consuming exactly
+ * up to its empty line: following bytes are left in the socket.
+ *
+ * @param fd : socket
+ * @param r : response
+ * @return 0 if all good, -1 otherwise
+ */
+int http_read_header(int fd, http_response_t* r)
+{
+  ssize_t n;
+  char* end;
+  size_t from;
+  int retcode;
+
+  http_response_init(r);
+
+  do
+    {
+      do
+	n = recv(fd, r->buf + r->len, HTTP_MAX_HEADER_SIZE - r->len, MSG_PEEK);
+      while (n < 0 && errno == EINTR);
+
+      if (n <= 0)
+	{
+	  if (n < 0)
+	    xlog(LOG_ERROR, "http_read_header: %s\n", strerror(errno));
+	  return -1;
+	}
+
+      /* only take what belongs to header block */
+      from = (r->len > 3) ? r->len - 3 : 0;
+      end = http_header_end(r->buf + from, r->buf + r->len + n);
+      if (end)
+	n = end - (r->buf + r->len);
+
+      n = recv(fd, r->buf + r->len, n, 0);
+      if (n <= 0)
+	return -1;
+
+      retcode = http_response_parse(r, n);
+    }
+  while (retcode == 0);
+
+  return (retcode < 0) ? -1 : 0;
+}
+
+
+/**
+ * Consumes response body, so that connection can be reused.
+ *
+ * @param fd : socket
+ * @param r : response with a complete header block
+ * @return 0 if all good, -1 otherwise
+ */
+int http_skip_body(int fd, http_response_t* r)
+{
+  char buf[1024];
+  long left = r->content_length;
+  ssize_t n;
+
+  while (left > 0)
+    {
+      n = read(fd, buf, (left < (long) sizeof(buf)) ? (size_t) left : sizeof(buf));
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return -1;
+      left -= n;
+    }
+
+  return 0;
+}
+
+
+/**
+ * @param out : NUL-terminated base64 string
+ * @param out_len : `out` length, at least 4 * (len + 2) / 3 + 1
+ * @param in : data
+ * @param len : `in` length
+ * @return base64 string length, 0 if `out` is too short
+ */
+size_t http_base64_encode(char* out, size_t out_len, const unsigned char* in, size_t len)
+{
+  if (out_len < 4 * ((len + 2) / 3) + 1)
+    return 0;
+
+  return EVP_EncodeBlock((unsigned char*) out, in, len);
+}
+
+
+/**
+ * @param out : decoded data
+ * @param out_len : `out` length
+ * @param in : base64 string, ends at first space or NUL
+ * @return decoded length, -1 if `in` is not valid base64 or too long
+ */
+int http_base64_decode(unsigned char* out, size_t out_len, const char* in)
+{
+  size_t len = strcspn(in, " \t\r\n");
+  int n;
+
+  if (len % 4 || 3 * (len / 4) > out_len)
+    return -1;
+
+  n = EVP_DecodeBlock(out, (const unsigned char*) in, len);
+  if (n < 0)
+    return -1;
+
+  /* EVP_DecodeBlock() counts padding */
+  if (len && in[len-1] == '=')
+    n--;
+  if (len > 1 && in[len-2] == '=')
+    n--;
+
+  return n;
+}
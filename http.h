@@ -0,0 +1,63 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADER_SIZE 8192
+#define HTTP_MAX_HEADERS 32
+
+typedef struct __http_header
+{
+  const char* name;
+  const char* value;
+} http_header_t;
+
+/*
+ * HTTP response, parsed as its bytes come: header block ends at the first
+ * empty line, bytes past it (`len` - `header_len`) belong to what follows
+ * (body, or SSTP stream).
+ */
+typedef struct __http_response
+{
+  char buf[HTTP_MAX_HEADER_SIZE + 1];
+  size_t len;			/* bytes received */
+  size_t header_len;		/* header block length, 0 until complete */
+
+  int minor;			/* HTTP/1.x */
+  int status;
+  long content_length;		/* -1 if unknown */
+  int keep_alive;		/* connection may be reused after body */
+
+  http_header_t headers[HTTP_MAX_HEADERS];
+  unsigned int nheaders;
+} http_response_t;
+
+
+void http_response_init(http_response_t* r);
+int http_response_parse(http_response_t* r, size_t n);
+const char* http_header(http_response_t* r, const char* name, unsigned int index);
+int http_read_header(int fd, http_response_t* r);
+int http_skip_body(int fd, http_response_t* r);
+size_t http_base64_encode(char* out, size_t out_len, const unsigned char* in, size_t len);
+int http_base64_decode(unsigned char* out, size_t out_len, const char* in);
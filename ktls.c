@@ -0,0 +1,387 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Kernel TLS offload: once the TLS handshake is done, traffic keys are handed
+ * to the kernel, which then encrypts and decrypts records itself. See also:
+ * - https://www.kernel.org/doc/html/latest/networking/tls.html
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/tls.h>
+
+#ifdef HAS_GNUTLS
+#include <gnutls/x509.h>
+#include <gnutls/gnutls.h>
+#else
+#include <polarssl/net.h>
+#include <polarssl/ssl.h>
+#include <polarssl/entropy.h>
+#include <polarssl/ctr_drbg.h>
+#endif
+
+#include "main.h"
+#include "libsstp.h"
+#include "event.h"
+#include "ktls.h"
+#include "tunnel.h"
+
+
+#ifdef HAS_GNUTLS
+
+typedef union
+{
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+  struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+  struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+} ktls_crypto_info_t;
+
+
+/**
+ * Gets kernel crypto info of one direction of the TLS session.
+ *
+ * @param t : tunnel
+ * @param direction : TLS_TX or TLS_RX
+ * @param crypto : crypto info, to be wiped by caller
+ * @param crypto_len : set to `crypto` length
+ * @return 0 if all good, -1 if kernel cannot take this session
+ */
+static int ktls_get_key(sstp_tunnel_t* t, int direction, ktls_crypto_info_t* crypto,
+			socklen_t* crypto_len)
+{
+  gnutls_datum_t mac_key, iv, cipher_key;
+  unsigned char seq[8];
+  unsigned char *c_iv, *c_salt, *c_key, *c_seq;
+  size_t iv_len, salt_len, key_len;
+  int version, retcode;
+
+  memset(crypto, 0, sizeof(ktls_crypto_info_t));
+
+  switch (gnutls_protocol_get_version(t->tls))
+    {
+    case GNUTLS_TLS1_2: version = TLS_1_2_VERSION; break;
+    case GNUTLS_TLS1_3: version = TLS_1_3_VERSION; break;
+    default: return -1;
+    }
+
+  switch (gnutls_cipher_get(t->tls))
+    {
+    case GNUTLS_CIPHER_AES_128_GCM:
+      crypto->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+      c_iv = crypto->aes_gcm_128.iv;
+      c_salt = crypto->aes_gcm_128.salt;
+      c_key = crypto->aes_gcm_128.key;
+      c_seq = crypto->aes_gcm_128.rec_seq;
+      iv_len = TLS_CIPHER_AES_GCM_128_IV_SIZE;
+      salt_len = TLS_CIPHER_AES_GCM_128_SALT_SIZE;
+      key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+      *crypto_len = sizeof(struct tls12_crypto_info_aes_gcm_128);
+      break;
+
+    case GNUTLS_CIPHER_AES_256_GCM:
+      crypto->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+      c_iv = crypto->aes_gcm_256.iv;
+      c_salt = crypto->aes_gcm_256.salt;
+      c_key = crypto->aes_gcm_256.key;
+      c_seq = crypto->aes_gcm_256.rec_seq;
+      iv_len = TLS_CIPHER_AES_GCM_256_IV_SIZE;
+      salt_len = TLS_CIPHER_AES_GCM_256_SALT_SIZE;
+      key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+      *crypto_len = sizeof(struct tls12_crypto_info_aes_gcm_256);
+      break;
+
+    case GNUTLS_CIPHER_CHACHA20_POLY1305:
+      crypto->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+      c_iv = crypto->chacha20_poly1305.iv;
+      c_salt = crypto->chacha20_poly1305.salt;
+      c_key = crypto->chacha20_poly1305.key;
+      c_seq = crypto->chacha20_poly1305.rec_seq;
+      iv_len = TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE;
+      salt_len = TLS_CIPHER_CHACHA20_POLY1305_SALT_SIZE;
+      key_len = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+      *crypto_len = sizeof(struct tls12_crypto_info_chacha20_poly1305);
+      break;
+
+    default:
+      if (t->cfg->verbose)
+	xlog(LOG_INFO, "kTLS: cipher %s is not supported by kernel\n",
+	     gnutls_cipher_get_name(gnutls_cipher_get(t->tls)));
+      return -1;
+    }
+
+  crypto->info.version = version;
+
+  retcode = gnutls_record_get_state(t->tls, direction == TLS_RX, &mac_key, &iv, &cipher_key, seq);
+  if (retcode < 0)
+    {
+      xlog(LOG_ERROR, "kTLS: %s\n", gnutls_strerror(retcode));
+      return -1;
+    }
+
+  if (cipher_key.size != key_len || iv.size < salt_len)
+    return -1;
+
+  memcpy(c_key, cipher_key.data, key_len);
+  memcpy(c_seq, seq, sizeof(seq));
+  memcpy(c_salt, iv.data, salt_len);
+
+  /* TLS 1.2 AES-GCM nonce is the implicit salt followed by an explicit part,
+     which GnuTLS sets to the record sequence number */
+  if (version == TLS_1_2_VERSION && salt_len)
+    memcpy(c_iv, seq, iv_len);
+  else
+    {
+      if (iv.size != salt_len + iv_len)
+	return -1;
+      memcpy(c_iv, iv.data + salt_len, iv_len);
+    }
+
+  return 0;
+}
+
+#endif
+
+
+/**
+ * Offloads established TLS session to the kernel, both directions or none.
+ * Keys of both are checked before any is set, and RX is set first: a socket
+ * without TX key still sends what TLS library wrote. Only a kernel accepting
+ * RX key but refusing TX one leaves the session half offloaded: it must then
+ * be closed, and kTLS is not tried again on this tunnel. Must be called while
+ * no record is buffered by the TLS library.
+ *
+ * @param t : tunnel
+ * @return t->ktls_mode (0 if user space TLS is used), -1 if session is lost
+ */
+int ktls_enable(sstp_tunnel_t* t)
+{
+#ifdef HAS_GNUTLS
+  ktls_crypto_info_t tx, rx;
+  socklen_t tx_len, rx_len;
+  int retcode = 0;
+#endif
+
+  t->ktls_mode = 0;
+
+#ifdef HAS_GNUTLS
+  if (gnutls_record_check_pending(t->tls))
+    {
+      if (t->cfg->verbose)
+	xlog(LOG_INFO, "kTLS: TLS data pending, using user space TLS\n");
+      return 0;
+    }
+
+  if (ktls_get_key(t, TLS_TX, &tx, &tx_len) < 0 || ktls_get_key(t, TLS_RX, &rx, &rx_len) < 0)
+    goto end;
+
+  if (setsockopt(t->sockfd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0)
+    {
+      if (t->cfg->verbose)
+	xlog(LOG_INFO, "kTLS: not available (%s), using user space TLS\n", strerror(errno));
+      goto end;
+    }
+
+  if (setsockopt(t->sockfd, SOL_TLS, TLS_RX, &rx, rx_len) < 0)
+    {
+      if (t->cfg->verbose)
+	xlog(LOG_INFO, "kTLS: failed to set RX key (%s), using user space TLS\n", strerror(errno));
+      goto end;
+    }
+
+  if (setsockopt(t->sockfd, SOL_TLS, TLS_TX, &tx, tx_len) < 0)
+    {
+      xlog(LOG_ERROR, "kTLS: failed to set TX key after RX one (%s), closing session\n",
+	   strerror(errno));
+      t->cfg->ktls = 0;
+      retcode = -1;
+      goto end;
+    }
+
+  t->ktls_mode = KTLS_TX | KTLS_RX;
+
+ end:
+  memset(&tx, 0, sizeof(ktls_crypto_info_t));
+  memset(&rx, 0, sizeof(ktls_crypto_info_t));
+  if (retcode < 0)
+    return -1;
+
+#else
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "kTLS: not supported with PolarSSL, using user space TLS\n");
+#endif
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "kTLS: %s\n", t->ktls_mode ? "TX and RX in kernel" : "using user space TLS");
+
+  return t->ktls_mode;
+}
+
+
+/**
+ * Checks post-handshake messages of a handshake record read from kernel:
+ * session tickets are of no use, as session cache gets them before kTLS is
+ * enabled. A key update cannot be followed, kernel keeps receive key given
+ * by ktls_enable(), and later records would fail to decrypt.
+ *
+ * @param buf : record
+ * @param len : `buf` length
+ * @return 0 if record can be skipped, -1 otherwise
+ */
+static int ktls_check_handshake(const unsigned char* buf, size_t len)
+{
+  size_t off, msg_len;
+
+  for (off = 0; off + 4 <= len; off += 4 + msg_len)
+    {
+      msg_len = (buf[off+1] << 16) | (buf[off+2] << 8) | buf[off+3];
+
+      switch (buf[off])
+	{
+	case KTLS_HANDSHAKE_NEW_SESSION_TICKET:
+	  continue;
+
+	case KTLS_HANDSHAKE_KEY_UPDATE:
+	  xlog(LOG_ERROR, "kTLS: server updated its traffic keys, which kernel cannot follow\n");
+	  return -1;
+
+	default:
+	  xlog(LOG_ERROR, "kTLS: unexpected post-handshake message %d\n", buf[off]);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+
+/**
+ * Reads application data from a kTLS socket. Handshake records sent after
+ * the handshake are skipped if they only hold TLS 1.3 session tickets, a key
+ * update fails the read: link is then lost, and reconnected if configured.
+ *
+ * @param t : tunnel
+ * @param buf : buffer to read into
+ * @param len : `buf` size
+ * @return size read if >0, 0 on close_notify or EOF, -1 otherwise (errno is
+ * EAGAIN if socket has nothing to read)
+ */
+ssize_t ktls_recv(sstp_tunnel_t* t, void* buf, size_t len)
+{
+  char control[CMSG_SPACE(sizeof(unsigned char))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  unsigned char record_type;
+  ssize_t rbytes;
+
+  while (1)
+    {
+      memset(&msg, 0, sizeof(struct msghdr));
+      iov.iov_base = buf;
+      iov.iov_len = len;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      rbytes = recvmsg(t->sockfd, &msg, 0);
+      if (rbytes <= 0)
+	return rbytes;
+
+      record_type = KTLS_RECORD_DATA;
+      cmsg = CMSG_FIRSTHDR(&msg);
+      if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+	record_type = *((unsigned char*) CMSG_DATA(cmsg));
+
+      switch (record_type)
+	{
+	case KTLS_RECORD_DATA:
+	  return rbytes;
+
+	case KTLS_RECORD_HANDSHAKE:
+	  if (ktls_check_handshake(buf, rbytes) < 0)
+	    {
+	      errno = EPROTO;
+	      return -1;
+	    }
+	  if (t->cfg->verbose > 1)
+	    xlog(LOG_DEBUG, "kTLS: skipping session ticket\n");
+	  continue;
+
+	case KTLS_RECORD_ALERT:
+	  /* warning close_notify */
+	  if (rbytes == 2 && ((unsigned char*) buf)[1] == 0)
+	    return 0;
+	  xlog(LOG_ERROR, "kTLS: received alert %d\n", ((unsigned char*) buf)[1]);
+	  errno = EPROTO;
+	  return -1;
+
+	default:
+	  xlog(LOG_ERROR, "kTLS: unexpected record type %d\n", record_type);
+	  errno = EPROTO;
+	  return -1;
+	}
+    }
+}
+
+
+/**
+ * Sends a close_notify alert through kernel TLS transmit path.
+ *
+ * @param fd : TCP socket
+ * @return 0 if all good, -1 otherwise
+ */
+int ktls_send_close_notify(int fd)
+{
+  char control[CMSG_SPACE(sizeof(unsigned char))];
+  unsigned char alert[2] = { 1, 0 };
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+
+  memset(&msg, 0, sizeof(struct msghdr));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = alert;
+  iov.iov_len = sizeof(alert);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+  *((unsigned char*) CMSG_DATA(cmsg)) = KTLS_RECORD_ALERT;
+
+  return sendmsg(fd, &msg, 0) < 0 ? -1 : 0;
+}
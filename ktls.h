@@ -0,0 +1,49 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* kTLS directions, see ktls_mode in tunnel.h */
+#define KTLS_TX 0x01
+#define KTLS_RX 0x02
+
+/* TLS record content types */
+#define KTLS_RECORD_ALERT 21
+#define KTLS_RECORD_HANDSHAKE 22
+#define KTLS_RECORD_DATA 23
+
+/* post-handshake messages, see ktls_recv() */
+#define KTLS_HANDSHAKE_NEW_SESSION_TICKET 4
+#define KTLS_HANDSHAKE_KEY_UPDATE 24
+
+/*
+ * Records offloaded to the kernel are plain read()/write() on the socket, and
+ * must no longer go through the TLS library. Both directions are offloaded,
+ * or none: TLS library would otherwise send its own records (alerts, key
+ * updates) through kernel as application data.
+ */
+int ktls_enable(sstp_tunnel_t* t);
+ssize_t ktls_recv(sstp_tunnel_t* t, void* buf, size_t len);
+int ktls_send_close_notify(int fd);
@@ -34,8 +34,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sched.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -43,6 +44,7 @@
 #include <openssl/sha.h>
 #include <openssl/md4.h>
 #include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <openssl/md4.h>
 
 #ifdef HAS_GNUTLS
@@ -62,6 +64,12 @@
 
 #include "libsstp.h"
 #include "main.h"
+#include "event.h"
+#include "ppp.h"
+#include "ktls.h"
+#include "uring.h"
+#include "tunnel.h"
+#include "http.h"
 
 #if defined __linux__
 #include <pty.h>
@@ -71,16 +79,33 @@
 /**
  * SSTP I/O primitive for reading
  *
+ * @param t : tunnel
  * @param buf : buffer to read
  * @param buflen : number of bytes to read
- * @return size read if >0 or error if <0
+ * @return size read if >0, SSTP_IO_AGAIN if socket has nothing to read, or
+ * error if <0
  */
-static ssize_t sstp_read(unsigned char *buf, size_t buflen)
+static ssize_t sstp_read(sstp_tunnel_t* t, unsigned char *buf, size_t buflen)
 {
         ssize_t rbytes;
 
+        if (t->ktls_mode & KTLS_RX)
+          {
+            rbytes = ktls_recv(t, buf, buflen);
+            if (rbytes < 0 && (errno == EAGAIN || errno == EINTR))
+                    return SSTP_IO_AGAIN;
+
+            if (rbytes < 0)
+                    xlog(LOG_ERROR, "sstp_read: %s\n", strerror(errno));
+
+            goto end;
+          }
+
 #ifdef HAS_GNUTLS
-        rbytes = gnutls_record_recv(tls, buf, buflen);
+        rbytes = gnutls_record_recv(t->tls, buf, buflen);
+        if (rbytes == GNUTLS_E_AGAIN || rbytes == GNUTLS_E_INTERRUPTED)
+                return SSTP_IO_AGAIN;
+
         if (rbytes < 0)
                 xlog(LOG_ERROR, "sstp_read: %s\n", gnutls_strerror(rbytes));
 
@@ -89,11 +114,15 @@ static ssize_t sstp_read(unsigned char *buf, size_t buflen)
 
         char msg[512] = {0,};
         do {
-                rbytes = ssl_read(&tls, buf, buflen);
+                rbytes = ssl_read(&t->tls, buf, buflen);
+                if (rbytes == POLARSSL_ERR_NET_WANT_READ ||
+                    rbytes == POLARSSL_ERR_NET_WANT_WRITE)
+                        return SSTP_IO_AGAIN;
+
                 if (rbytes < 0)
                 {
                         error_strerror(rbytes, msg, sizeof(msg)-1);
-                        xlog(LOG_ERROR, "sstp_read() failed: %d - %s\n", rbytes, msg);
+                        xlog(LOG_ERROR, "sstp_read(t) failed: %d - %s\n", rbytes, msg);
                         return -1;
                 }
 
@@ -116,7 +145,8 @@ static ssize_t sstp_read(unsigned char *buf, size_t buflen)
         } while( do_loop );
 #endif
 
-  if (cfg->verbose)
+ end:
+  if (t->cfg->verbose)
           xlog(LOG_INFO, " <-- %lu bytes\n", rbytes);
 
   return rbytes;
@@ -124,101 +154,348 @@ static ssize_t sstp_read(unsigned char *buf, size_t buflen)
 
 
 /**
- * SSTP I/O primitive for writing
+ * Sends at most one TLS record. A record the socket could not take whole is
+ * kept by the TLS library: it must be completed first, by a call with the
+ * same length (GnuTLS only needs NULL data, PolarSSL checks the length).
  *
+ * @param t : tunnel
  * @param buf : buffer to write
  * @param buflen : number of bytes to write
- * @return size written if >0 or error if <0
+ * @return size sent if >0, SSTP_IO_AGAIN if socket is full, or error if <0
  */
-static ssize_t sstp_write(unsigned char *buf, size_t buflen)
+static ssize_t sstp_send(sstp_tunnel_t* t, unsigned char *buf, size_t buflen)
 {
   ssize_t sbytes;
 
+  if (t->ktls_mode & KTLS_TX)
+    {
+      sbytes = write(t->sockfd, buf, buflen);
+      if (sbytes < 0 && (errno == EAGAIN || errno == EINTR))
+        return SSTP_IO_AGAIN;
+
+      if (sbytes < 0)
+        xlog(LOG_ERROR, "sstp_write: %s\n", strerror(errno));
+
+      return sbytes;
+    }
+
+  if (t->sess->out_again)
+    buflen = t->sess->out_again;
+
 #ifdef HAS_GNUTLS
-  sbytes = gnutls_record_send(tls, buf, buflen);
-  if (sbytes < 0){
-          xlog(LOG_ERROR, "sstp_write: %s\n", gnutls_strerror(sbytes));
-          return -1;
-  }
+  if (t->sess->out_again)
+    sbytes = gnutls_record_send(t->tls, NULL, 0);
+  else
+    sbytes = gnutls_record_send(t->tls, buf, buflen);
+
+  if (sbytes == GNUTLS_E_AGAIN || sbytes == GNUTLS_E_INTERRUPTED)
+    {
+      t->sess->out_again = buflen;
+      return SSTP_IO_AGAIN;
+    }
+
+  if (sbytes < 0)
+    {
+      xlog(LOG_ERROR, "sstp_write: %s\n", gnutls_strerror(sbytes));
+      return -1;
+    }
 
 #else
   char msg[512] = {0,};
 
-  sbytes = ssl_write(&tls, buf, buflen);
+  sbytes = ssl_write(&t->tls, buf, buflen);
+  if (sbytes == POLARSSL_ERR_NET_WANT_READ || sbytes == POLARSSL_ERR_NET_WANT_WRITE)
+    {
+      t->sess->out_again = buflen;
+      return SSTP_IO_AGAIN;
+    }
+
   if (sbytes < 0)
-  {
-          if(sbytes != POLARSSL_ERR_NET_WANT_READ && sbytes != POLARSSL_ERR_NET_WANT_WRITE )
-          {
-                  error_strerror(sbytes, msg, sizeof(msg)-1);
-                  xlog(LOG_ERROR, "sstp_write() failed: %x: %s\n", sbytes, msg);
-                  return -1;
-          }
-  }
+    {
+      error_strerror(sbytes, msg, sizeof(msg)-1);
+      xlog(LOG_ERROR, "sstp_write(t) failed: %x: %s\n", sbytes, msg);
+      return -1;
+    }
 
 #endif
 
-  if (cfg->verbose)
-          xlog(LOG_INFO, " --> %lu bytes\n", sbytes);
-
+  t->sess->out_again = 0;
   return sbytes;
 }
 
 
 /**
- * Encapsulated data provided as argument inside a SSTP packet. SSTP packet type
- * (control|data) should be specified throught `type` argument.
+ * Keeps bytes the socket could not take, until sstp_out_flush(). A buffer
+ * not fitting is dropped whole, as a congested link would do: SSTP packets
+ * are never cut.
+ *
+ * @param t : tunnel
+ * @param buf : buffer
+ * @param len : `buf` length
+ */
+static void sstp_out_queue(sstp_tunnel_t* t, unsigned char* buf, size_t len)
+{
+  sstp_session_t* sess = t->sess;
+
+  if (sess->out_len + len > SSTP_OUT_BUFFER_SIZE && sess->out_head)
+    {
+      memmove(sess->out, sess->out + sess->out_head, sess->out_len - sess->out_head);
+      sess->out_len -= sess->out_head;
+      sess->out_head = 0;
+    }
+
+  if (sess->out_len + len > SSTP_OUT_BUFFER_SIZE)
+    {
+      if (t->cfg->verbose > 1)
+	xlog(LOG_DEBUG, "%s: socket is congested, %lu bytes dropped\n", t->name, len);
+      return;
+    }
+
+  /* socket tells once it can take more */
+  if (!sess->out_len && t->tls_handler.data == t &&
+      event_mod(&t->worker->loop, &t->tls_handler, EPOLLIN|EPOLLOUT|EPOLLET) < 0)
+    xlog(LOG_ERROR, "sstp_out_queue: %s\n", strerror(errno));
+
+  memcpy(sess->out + sess->out_len, buf, len);
+  sess->out_len += len;
+}
+
+
+/**
+ * SSTP I/O primitive for writing. Never waits for the socket: what it cannot
+ * take is kept, and sent by sstp_out_flush() once the socket is writable.
+ * Older bytes still kept are sent first.
+ *
+ * @param t : tunnel
+ * @param buf : buffer to write
+ * @param buflen : number of bytes to write
+ * @return size written (or kept) if >0 or error if <0
+ */
+static ssize_t sstp_write(sstp_tunnel_t* t, unsigned char *buf, size_t buflen)
+{
+  ssize_t sbytes;
+  size_t sent;
+
+  /* a buffer larger than a TLS record is sent by several calls */
+  for (sent = 0; sent < buflen && !t->sess->out_len; sent += sbytes)
+    {
+      sbytes = sstp_send(t, buf + sent, buflen - sent);
+      if (sbytes == SSTP_IO_AGAIN)
+        break;
+
+      if (sbytes < 0)
+        return -1;
+    }
+
+  if (sent < buflen)
+    sstp_out_queue(t, buf + sent, buflen - sent);
+
+  t->sess->tx_bytes += buflen;
+
+  if (t->cfg->verbose)
+          xlog(LOG_INFO, " --> %lu bytes\n", buflen);
+
+  return buflen;
+}
+
+
+/**
+ * Sends bytes kept by sstp_write(), as far as socket takes them.
+ *
+ * @param t : tunnel
+ * @return 0 if all were sent, SSTP_IO_AGAIN if some are left, -1 on error
+ */
+static int sstp_out_flush(sstp_tunnel_t* t)
+{
+  sstp_session_t* sess = t->sess;
+  ssize_t sbytes;
+
+  while (sess->out_head < sess->out_len)
+    {
+      sbytes = sstp_send(t, sess->out + sess->out_head, sess->out_len - sess->out_head);
+      if (sbytes < 0)
+	return sbytes;
+
+      sess->out_head += sbytes;
+    }
+
+  sess->out_head = sess->out_len = 0;
+
+  if (t->tls_handler.data == t &&
+      event_mod(&t->worker->loop, &t->tls_handler, EPOLLIN|EPOLLET) < 0)
+    xlog(LOG_ERROR, "sstp_out_flush: %s\n", strerror(errno));
+
+  return 0;
+}
+
+
+/**
+ * Number of decrypted bytes already buffered by the TLS library, ie. that
+ * can be read without the socket becoming readable again.
+ *
+ * @param t : tunnel
+ * @return number of pending bytes
+ */
+static size_t sstp_pending(sstp_tunnel_t* t)
+{
+#ifdef HAS_GNUTLS
+  return gnutls_record_check_pending(t->tls);
+#else
+  return ssl_get_bytes_avail(&t->tls);
+#endif
+}
+
+
+/**
+ * Transport to the server is gone: socket error (such as TCP user or
+ * keepalive timeout), EOF or dead peer. A link that was up may then be
+ * resumed by a reconnection, see tunnel_suspend().
+ *
+ * @param t : tunnel
+ */
+static void sstp_link_lost(sstp_tunnel_t* t)
+{
+  if (!t->ctx)
+    return;
+
+  if (t->ctx->state == CLIENT_CALL_CONNECTED)
+    t->ctx->flags |= LINK_FAILURE;
+
+  set_client_status(t, CLIENT_CALL_DISCONNECTED);
+}
+
+
+/**
+ * Sends every packet queued in session transmit buffer, as a single write.
+ *
+ * @param t : tunnel
+ */
+static void sstp_tx_flush(sstp_tunnel_t* t)
+{
+  if (!t->sess->tx_len)
+    return;
+
+  if (t->cfg->verbose > 2)
+    xlog(LOG_DEBUG, "Flushing %u frames (%lu bytes)\n", t->sess->tx_frames, t->sess->tx_len);
+
+  if (sstp_write(t, t->sess->tx, t->sess->tx_len) < 0)
+    sstp_link_lost(t);
+  t->sess->tx_len = 0;
+  t->sess->tx_frames = 0;
+
+  event_timer_cancel(&t->worker->loop, &t->tx_timer);
+}
+
+
+/**
+ * Writes the SSTP header inside the SSTP_HEADROOM bytes preceding `data`.
  *
  * @param type : set packet type (Control or Data)
- * @param data : buffer to be sent
+ * @param data : packet payload, preceded by SSTP_HEADROOM writable bytes
  * @param data_length : `data` length
+ * @return total packet length
  */
-void send_sstp_packet(uint8_t type, void* data, size_t data_length)
+static size_t sstp_set_header(uint8_t type, unsigned char* data, size_t data_length)
 {
-  sstp_header_t sstp_header;
+  sstp_header_t *sstp_header;
   size_t total_length;
-  void *packet = NULL;
 
   total_length = sizeof(sstp_header_t) + data_length;
-  memset(&sstp_header, 0, sizeof(sstp_header_t));
+  sstp_header = (sstp_header_t*) (data - SSTP_HEADROOM);
+
+  sstp_header->version = SSTP_VERSION;
+  sstp_header->reserved = type;
+  sstp_header->length = htons(total_length);
 
-  sstp_header.version = SSTP_VERSION;
-  sstp_header.reserved = type;
-  sstp_header.length = htons(total_length);
+  return total_length;
+}
 
-  packet = xmalloc(total_length);
 
-  memcpy(packet, &sstp_header, sizeof(sstp_header_t));
-  memcpy(packet + sizeof(sstp_header_t), data, data_length);
+/**
+ * Encapsulated data provided as argument inside a SSTP packet. SSTP packet type
+ * (control|data) should be specified throught `type` argument. SSTP header is
+ * written in place, inside the SSTP_HEADROOM bytes preceding `data`, so that
+ * packet is sent without any copy. Packets still queued for transmission are
+ * sent first to keep ordering.
+ *
+ * @param t : tunnel
+ * @param type : set packet type (Control or Data)
+ * @param data : buffer to be sent, preceded by SSTP_HEADROOM writable bytes
+ * @param data_length : `data` length
+ */
+void send_sstp_packet(sstp_tunnel_t* t, uint8_t type, unsigned char* data, size_t data_length)
+{
+  size_t total_length;
 
-  sstp_write(packet, total_length);
+  sstp_tx_flush(t);
 
-  xfree(packet);
+  total_length = sstp_set_header(type, data, data_length);
+  if (sstp_write(t, data - SSTP_HEADROOM, total_length) < 0)
+    sstp_link_lost(t);
 }
 
 
 /**
- * Generic function to send an SSTP Data packet. Data to send is encapsulated
- * inside an SSTP packet, and transmitted througth TLS session.
- * As this function intercepts PPP packets, it is also used to detect PPP
+ * As this function intercepts PPP packets, it is used to detect PPP
  * negociation success, and stores NT Response code inside client chap_ctx.
  *
- * @param data : buffer to be sent
+ * @param t : tunnel
+ * @param data : outgoing PPP frame
  * @param len : `data` length
  */
-void send_sstp_data_packet(void* data, size_t len)
+static void sstp_chap_sniff(sstp_tunnel_t* t, unsigned char* data, size_t len)
 {
-  if ( ntohs(*((uint16_t*)data)) == 0xc223 )
+  size_t offset;
+
+  if (ppp_frame_protocol(data, len, &offset) == PPP_CHAP && len >= offset + 5 + MSCHAPV2_RESPONSE_LEN)
     {
-      uint8_t chap_handshake_code = *(uint8_t*)(data + 2);
+      uint8_t chap_handshake_code = *(uint8_t*)(data + offset);
 
       /* if msg is PPP-CHAP response */
-      if (chap_handshake_code == 0x02 )
+      if (chap_handshake_code == PPP_CHAP_RESPONSE )
 	{
-	  memcpy(chap_ctx, data+7, 49);
+	  memcpy(t->chap_ctx, data + offset + 5, MSCHAPV2_RESPONSE_LEN);
 	}
     }
+}
+
+
+/**
+ * Generic function to send an SSTP Data packet. Data to send is encapsulated
+ * inside an SSTP packet, and transmitted througth TLS session.
+ *
+ * @param t : tunnel
+ * @param data : buffer to be sent, preceded by SSTP_HEADROOM writable bytes
+ * @param len : `data` length
+ */
+void send_sstp_data_packet(sstp_tunnel_t* t, unsigned char* data, size_t len)
+{
+  sstp_chap_sniff(t, data, len);
+  t->sess->data_packets++;
+  send_sstp_packet(t, SSTP_DATA_PACKET, data, len);
+}
+
+
+/**
+ * Queues a PPP frame read in place at the end of session transmit buffer
+ * (after SSTP_HEADROOM bytes). Buffer is flushed when batch size is reached.
+ *
+ * @param t : tunnel
+ * @param len : frame length
+ */
+static void sstp_tx_queue(sstp_tunnel_t* t, size_t len)
+{
+  unsigned char *data;
+
+  data = t->sess->tx + t->sess->tx_len + SSTP_HEADROOM;
+  sstp_chap_sniff(t, data, len);
 
-  send_sstp_packet(SSTP_DATA_PACKET, data, len);
+  t->sess->tx_len += sstp_set_header(SSTP_DATA_PACKET, data, len);
+  t->sess->tx_frames++;
+  t->sess->data_packets++;
+
+  if (t->sess->tx_frames >= t->cfg->tx_batch)
+    sstp_tx_flush(t);
 }
 
 
@@ -227,18 +504,19 @@ void send_sstp_data_packet(void* data, size_t len)
  * Generic function to send an SSTP control packet. As a control packet embeds one
  * or many attributes, they also should be specified.
  *
+ * @param t : tunnel
  * @param msg_type : SSTP control message type
  * @param attributes : pointer to the attributes buffer
  * @param attribute_number : number of attributes inside buffer
  * @param attributes_len : `attributes` length
  */
-void send_sstp_control_packet(uint16_t msg_type, void* attributes,
+void send_sstp_control_packet(sstp_tunnel_t* t, uint16_t msg_type, void* attributes,
 			      uint16_t attribute_number, size_t attributes_len)
 {
   sstp_control_header_t control_header;
   size_t control_length;
   uint16_t i;
-  void *data, *data_ptr, *attr_ptr;
+  unsigned char *packet, *data, *data_ptr, *attr_ptr;
 
   if (!attributes && attribute_number)
     {
@@ -253,7 +531,7 @@ void send_sstp_control_packet(uint16_t msg_type, void* attributes,
   control_header.message_type = htons(msg_type);
   control_header.num_attributes = htons(attribute_number);
 
-  if (cfg->verbose > 2)
+  if (t->cfg->verbose > 2)
     {
       xlog(LOG_DEBUG, "\t-> Control packet\n");
       xlog(LOG_DEBUG, "\t-> type: %s (%#.2x)\n",
@@ -263,8 +541,16 @@ void send_sstp_control_packet(uint16_t msg_type, void* attributes,
     }
 
 
-  /* filling control with attributes */
-  data = xmalloc(control_length);
+  if (SSTP_HEADROOM + control_length > t->packet_pool.size)
+    {
+      xlog(LOG_ERROR, "Control packet too large (%lu bytes). Cannot send message.\n",
+	   control_length);
+      return;
+    }
+
+  /* filling control with attributes, after SSTP header headroom */
+  packet = pool_get(&t->packet_pool);
+  data = packet + SSTP_HEADROOM;
   memcpy(data, &control_header, sizeof(sstp_control_header_t));
 
   attr_ptr = attributes;
@@ -275,7 +561,7 @@ void send_sstp_control_packet(uint16_t msg_type, void* attributes,
       sstp_attribute_header_t* cur_attr = (sstp_attribute_header_t*)attr_ptr;
       uint16_t plen = ntohs(cur_attr->packet_length);
 
-      if (cfg->verbose > 2)
+      if (t->cfg->verbose > 2)
 	{
 	  xlog(LOG_DEBUG, "\t\t--> Attribute %d\n", i);
 	  xlog(LOG_DEBUG, "\t\t--> type: %s (%x)\n",
@@ -290,37 +576,41 @@ void send_sstp_control_packet(uint16_t msg_type, void* attributes,
 
 
   /* yield to lower */
-  send_sstp_packet(SSTP_CONTROL_PACKET, data, control_length);
+  send_sstp_packet(t, SSTP_CONTROL_PACKET, data, control_length);
 
-  xfree(data);
+  pool_put(&t->packet_pool, packet);
 }
 
 
 /**
- * Generate an GUID identifier for the SSTP connection
+ * Generate an GUID identifier for the SSTP connection: a random (version 4)
+ * GUID, from the thread-safe OpenSSL generator, so that tunnels started at
+ * once by different workers never share one.
  *
- * @param data : buffer to store guid
+ * @param t : tunnel
+ * @param data : buffer to store guid, 39 bytes at least
  */
-static void generate_guid(char data[])
+static void generate_guid(sstp_tunnel_t* t, char data[])
 {
-  uint32_t data1, data4;
-  uint16_t data2, data3;
-  struct timeval tv;
-  unsigned int seed;
+  unsigned char guid[16];
+  unsigned int seed, i;
+
+  if (RAND_bytes(guid, sizeof(guid)) != 1)
+    {
+      xlog(LOG_WARNING, "generate_guid: RAND_bytes failed, using rand_r()\n");
+      seed = time(NULL) ^ getpid() ^ (unsigned int) (uintptr_t) t;
+      for (i=0; i<sizeof(guid); i++)
+	guid[i] = rand_r(&seed);
+    }
 
-  gettimeofday(&tv, NULL);
-  seed = tv.tv_usec * tv.tv_sec;
-  seed ^= getpid();
+  guid[6] = (guid[6] & 0x0f) | 0x40;
+  guid[8] = (guid[8] & 0x3f) | 0x80;
 
-  memset(data, 0, 39);
-  srand (seed);
-  data1 = (rand() + 1) * (sizeof(uint32_t) * 8);
-  data2 = (rand() + 1) * (sizeof(uint16_t) * 8);
-  data3 = (rand() + 1) * (sizeof(uint16_t) * 8);
-  data4 = (rand() + 1) * (sizeof(uint32_t) * 8);
-  snprintf(data, 38, "{%.4X-%.2X-%.2X-%.4X}", data1, data2, data3, data4);
+  snprintf(data, 39, "{%.2X%.2X%.2X%.2X-%.2X%.2X-%.2X%.2X-%.2X%.2X-%.2X%.2X%.2X%.2X%.2X%.2X}",
+	   guid[0], guid[1], guid[2], guid[3], guid[4], guid[5], guid[6], guid[7],
+	   guid[8], guid[9], guid[10], guid[11], guid[12], guid[13], guid[14], guid[15]);
 
-  if (cfg->verbose > 2)
+  if (t->cfg->verbose > 2)
     xlog(LOG_DEBUG, "Using GUID %s\n", data);
 }
 
@@ -328,468 +618,1985 @@ static void generate_guid(char data[])
 /**
  * Change client state
  *
+ * @param t : tunnel
  * @param status : new status
  */
-void set_client_status(uint8_t status)
+void set_client_status(sstp_tunnel_t* t, uint8_t status)
 {
-  if (ctx->state == status)
+  if (t->ctx->state == status)
     return;
 
-  if (cfg->verbose)
+  if (t->cfg->verbose)
     xlog(LOG_INFO, "status: %s (%#x) -> %s (%#x)\n",
-	 client_status_str[ctx->state], ctx->state,
+	 client_status_str[t->ctx->state], t->ctx->state,
 	 client_status_str[status], status);
 
-  ctx->state = status;
+  t->ctx->state = status;
+}
+
+
+/**
+ * Arms one of tunnel timers on the worker event loop, replacing its pending
+ * expiration. Other timers are left untouched.
+ *
+ * @param t : tunnel
+ * @param timer : tunnel timer
+ * @param msec : delay in milliseconds, 0 disarms the timer
+ */
+static void sstp_timer_arm(sstp_tunnel_t* t, event_timer_t* timer, long msec)
+{
+  if (!msec)
+    event_timer_cancel(&t->worker->loop, timer);
+  else if (event_timer_arm(&t->worker->loop, timer, msec * 1000) < 0)
+    xlog(LOG_ERROR, "sstp_timer_arm: %s\n", strerror(errno));
 }
 
 
 /**
  * Header validation.
  *
+ * @param t : tunnel
  * @param header : sstp header to analyse
  * @param recv_len : number of bytes received
  * @return TRUE if valid, FALSE otherwise
  */
-static int is_valid_header(sstp_header_t* header, ssize_t recv_len)
+static int is_valid_header(sstp_tunnel_t* t, sstp_header_t* header, ssize_t recv_len)
+{
+
+  if (header->version != SSTP_VERSION)
+    {
+      if (t->cfg->verbose)
+	xlog(LOG_ERROR, "Invalid version (%#x)\n", header->version);
+      return FALSE;
+    }
+
+  if (header->reserved != SSTP_DATA_PACKET &&
+      header->reserved != SSTP_CONTROL_PACKET)
+    {
+      if (t->cfg->verbose)
+	xlog(LOG_ERROR, "Invalid packet type (%#x)\n", header->reserved);
+      return FALSE;
+    }
+
+  header->length = ntohs(header->length);
+  if (header->length > recv_len)
+    {
+      if ( header->reserved == SSTP_CONTROL_PACKET)
+	{
+	  if (t->cfg->verbose > 2)
+	    xlog(LOG_DEBUG, "Unmatching length: annonced %lu, received %lu\n",
+		 header->length, recv_len);
+
+	  return FALSE;
+	}
+    }
+
+  return TRUE;
+}
+
+
+/**
+ * Check whether received packet has Control flag raised.
+ *
+ * @param packet_header : received SSTP header
+ * @return TRUE if valid, FALSE otherwise
+ */
+static int is_control_packet(sstp_header_t* packet_header)
+{
+  return (packet_header->reserved == SSTP_CONTROL_PACKET);
+}
+
+
+/**
+ * Formats HTTP request starting a new SSTP connection, with a new
+ * correlation ID.
+ *
+ * @param t : tunnel
+ * @param buf : request buffer
+ * @param len : `buf` length
+ * @return request length
+ */
+size_t https_request(sstp_tunnel_t* t, char* buf, size_t len)
+{
+  char guid[39] = {0, };
+  int rbytes;
+
+  generate_guid(t, guid);
+  rbytes = snprintf(buf, len,
+		    "SSTP_DUPLEX_POST %s HTTP/1.1\r\n"
+		    "Host: %s\r\n"
+		    "SSTPCORRELATIONID: %s\r\n"
+		    "Content-Length: %llu\r\n"
+		    "\r\n",
+		    SSTP_HTTPS_RESOURCE,
+		    t->cfg->server,
+		    guid,
+  		    __UNSIGNED_LONG_LONG_MAX__);
+
+  return (rbytes < 0 || (size_t) rbytes >= len) ? 0 : (size_t) rbytes;
+}
+
+
+/**
+ * Send HTTP request to start a new SSTP connection, unless server already
+ * got it as TLS early data.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, negative value otherwise
+ */
+int https_session_negociation(sstp_tunnel_t* t)
 {
+  http_response_t* r;
+  ssize_t rbytes;
+  int retcode;
+  unsigned char buf[1024] = {0, };
+
+  rbytes = -1;
+
+  /* Allocate SSTP session */
+  t->sess = (sstp_session_t*) xmalloc(sizeof(sstp_session_t));
+
+  if (t->early_data)
+    {
+      if (t->cfg->verbose)
+	xlog(LOG_INFO, "SSTP_DUPLEX_POST request was sent as TLS early data\n");
+    }
+  else
+    {
+      rbytes = https_request(t, (char*) buf, sizeof(buf));
+
+      if (t->cfg->verbose > 2)
+	xlog(LOG_DEBUG, "Sending: %lu bytes\n%s\n", rbytes, buf);
+
+      /* Start negociation */
+      if (sstp_write(t, buf, rbytes) < 0)
+	{
+	  xlog(LOG_ERROR, "%s", "Failed to send the SSTP_DUPLEX_POST request\n");
+	  return -1;
+	}
+    }
+
+  /*
+   * Response header may come in several records, TLS 1.3 post-handshake
+   * messages (session tickets) first, and server may send its first SSTP
+   * packets right behind it.
+   */
+  r = (http_response_t*) xmalloc(sizeof(http_response_t));
+  http_response_init(r);
+  retcode = 0;
+  while (retcode == 0)
+    {
+      do
+	rbytes = sstp_read(t, (unsigned char*) r->buf + r->len, HTTP_MAX_HEADER_SIZE - r->len);
+      while (rbytes == SSTP_IO_AGAIN);
+
+      if (rbytes <= 0)
+	break;
+
+      t->sess->rx_bytes += rbytes;
+      retcode = http_response_parse(r, rbytes);
+    }
+
+  if (rbytes < 0 || retcode < 0)
+    {
+      xlog(LOG_ERROR, "%s", "Failed to receive the SSTP_DUPLEX_POST response\n");
+      xfree(r);
+      return -1;
+    }
+
+  if (rbytes == 0)
+    {
+      xlog(LOG_INFO, "Unexpected close notification from %s.\n", t->cfg->server);
+      xfree(r);
+      return -1;
+    }
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG , "Received: HTTP/1.%d %d (%lu header bytes)\n",
+	 r->minor, r->status, r->header_len);
+
+  if (r->status != 200)
+    {
+      xlog(LOG_ERROR, "Incorrect HTTP response header (%d)\n", r->status);
+      xfree(r);
+      return -1;
+    }
+
+  /* SSTP bytes already read are left for sstp_tunnel_start() */
+  t->sess->rx.tail = r->len - r->header_len;
+  memcpy(t->sess->rx.data, r->buf + r->header_len, t->sess->rx.tail);
+  xfree(r);
+
+  return 0;
+}
+
+
+/**
+ * Fills an attribute with specified data, in a block of tunnel small buffer
+ * pool. Attribute must be given back with pool_put().
+ *
+ * @param t : tunnel
+ * @param attribute_id : attribute code
+ * @param data : data to be inserted
+ * @param data_length : `data` length
+ * @return a pointer to the new attribute buffer
+ */
+void* create_attribute(sstp_tunnel_t* t, uint8_t attribute_id, void* data, size_t data_length)
+{
+  sstp_attribute_header_t attribute_header;
+  size_t attribute_length;
+  void* attribute;
+
+  if (!data) return NULL;
+
+  attribute_length = sizeof(sstp_attribute_header_t) + data_length;
+  if (attribute_length > t->small_pool.size)
+    {
+      xlog(LOG_ERROR, "Attribute too large (%lu bytes)\n", attribute_length);
+      return NULL;
+    }
+
+  attribute = pool_get(&t->small_pool);
+
+  attribute_header.reserved = 0;
+  attribute_header.attribute_id = attribute_id;
+  attribute_header.packet_length = htons(attribute_length);
+
+  memcpy(attribute, &attribute_header, sizeof(sstp_attribute_header_t));
+  memcpy(attribute + sizeof(sstp_attribute_header_t), data, data_length);
+
+  return attribute;
+}
+
+
+/**
+ * Emits SSTP negociation request, ie Control message with
+ * ENCAPSULATED_PROTOCOL_ID attribute. Negociation timer is set up and state is
+ * changed.
+ */
+static void sstp_init(sstp_tunnel_t* t)
+{
+  uint16_t attribute_data;
+  void* attribute;
+  size_t attribute_len;
+
+  attribute_data = htons(SSTP_ENCAPSULATED_PROTOCOL_PPP);
+  attribute_len = sizeof(sstp_attribute_header_t) + sizeof(uint16_t);
+  attribute = create_attribute(t, SSTP_ATTRIB_ENCAPSULATED_PROTOCOL_ID,
+			       (void*)&attribute_data, sizeof(uint16_t));
+
+  send_sstp_control_packet(t, SSTP_MSG_CALL_CONNECT_REQUEST, attribute,
+			   1, attribute_len);
+
+  pool_put(&t->small_pool, attribute);
+
+  sstp_timer_arm(t, &t->negociation_timer, SSTP_NEGOCIATION_TIMER * 1000);
+
+  set_client_status(t, CLIENT_CONNECT_REQUEST_SENT);
+
+}
+
+
+/**
+ * Print attribute information.
+ *
+ * @param data
+ * @param attr_len
+ */
+int attribute_status_info(sstp_tunnel_t* t, void* data, uint16_t attr_len)
+{
+  sstp_attribute_status_info_t* info;
+  uint8_t attribute_id;
+  uint32_t status;
+  int rbytes;
+
+  info = (sstp_attribute_status_info_t*) data;
+  attribute_id = info->attrib_id;
+  status = ntohl(info->status);
+
+  /* check attribute */
+  if (attribute_id > ATTRIB_STATUS_STATUS_INFO_NOT_SUPPORTED_IN_MSG)
+    {
+      xlog(LOG_ERROR, "Attribute id is not valid.\n");
+      return -1;
+    }
+
+  if (t->cfg->verbose > 2)
+    {
+      /* show attribute */
+      xlog(LOG_DEBUG, "\t\t--> attr_ref\t%s (%#.2x)\n", attr_types_str[attribute_id], attribute_id);
+      xlog(LOG_DEBUG, "\t\t--> status\t%s (%#.2x)\n", attrib_status_str[status], status);
+    }
+
+  if (t->ctx->state != CLIENT_CONNECT_REQUEST_SENT)
+    return 0;
+
+  /* attrib_value is at most 64 bytes (ie full attr len <= 64 + 12 bytes) */
+  rbytes = sizeof(sstp_attribute_header_t) + 2*sizeof(uint32_t);
+
+  while (rbytes < (64+12) && rbytes < attr_len)
+    {
+      uint32_t attrib_value;
+      attrib_value = ntohl(*((uint32_t*)data + rbytes));
+      if (t->cfg->verbose > 2)
+	xlog(LOG_DEBUG, "\t\t--> attribute value: %#.4x\n", attrib_value);
+      rbytes += sizeof(uint32_t);
+    }
+
+  return 0;
+}
+
+
+/**
+ * Reads from TLS session into receive buffer. Buffer is first compacted if the
+ * free space left at its end is too small, then filled as long as the TLS
+ * library holds decrypted data, so that several records can be pulled on a
+ * single socket wake-up.
+ *
+ * @param rx : receive buffer
+ * @return number of bytes read, 0 on EOF, negative value on error
+ */
+static ssize_t sstp_rx_fill(sstp_tunnel_t* t, sstp_rx_buffer_t* rx)
+{
+  ssize_t rbytes, total;
+
+  if (rx->head && SSTP_RX_BUFFER_SIZE - rx->tail < SSTP_RX_CHUNK_MIN)
+    {
+      memmove(rx->data, rx->data + rx->head, rx->tail - rx->head);
+      rx->tail -= rx->head;
+      rx->head = 0;
+    }
+
+  total = 0;
+  do
+    {
+      rbytes = sstp_read(t, rx->data + rx->tail, SSTP_RX_BUFFER_SIZE - rx->tail);
+      if (rbytes <= 0)
+	return total ? total : rbytes;
+
+      rx->tail += rbytes;
+      total += rbytes;
+    }
+  while (rx->tail < SSTP_RX_BUFFER_SIZE && sstp_pending(t) > 0);
+
+  return total;
+}
+
+
+/**
+ * Splits receive buffer into SSTP packets and decodes every complete one. An
+ * incomplete trailing packet is kept in buffer until next sstp_rx_fill().
+ *
+ * @param rx : receive buffer
+ * @return 0 if all good, negative value otherwise
+ */
+static int sstp_rx_dispatch(sstp_tunnel_t* t, sstp_rx_buffer_t* rx)
+{
+  sstp_header_t* header;
+  size_t packet_length;
+  int retcode;
+
+  while (rx->tail - rx->head >= sizeof(sstp_header_t))
+    {
+      header = (sstp_header_t*) (rx->data + rx->head);
+      packet_length = ntohs(header->length) & SSTP_LENGTH_MASK;
+
+      if (packet_length < sizeof(sstp_header_t))
+	{
+	  xlog(LOG_ERROR, "SSTP stream is out of sync (announced length %lu)\n",
+	       packet_length);
+	  return -1;
+	}
+
+      if (rx->tail - rx->head < packet_length)
+	break;
+
+      retcode = sstp_decode(t, header, packet_length);
+      rx->head += packet_length;
+
+      if (retcode < 0)
+	return retcode;
+    }
+
+  if (rx->head == rx->tail)
+    rx->head = rx->tail = 0;
+
+  return 0;
+}
+
+
+/**
+ * Sends the transmit batch once the PPP side is drained, or arms the transmit
+ * delay timer if a delay is set.
+ *
+ * @param was_empty : TRUE if batch was empty before the frames just queued
+ */
+static void sstp_tx_schedule(sstp_tunnel_t* t, int was_empty)
+{
+  if (!t->sess->tx_len)
+    return;
+
+  if (t->cfg->tx_delay <= 0)
+    {
+      sstp_tx_flush(t);
+      return;
+    }
+
+  /* delay runs from the first frame of the batch */
+  if (was_empty && event_timer_arm(&t->worker->loop, &t->tx_timer, t->cfg->tx_delay) < 0)
+    sstp_tx_flush(t);
+}
+
+
+/**
+ * Event handler for PPP side while the link to the server is down: frames
+ * are parked, as [length][frame] records, until sstp_tunnel_resume() sends
+ * them over the new session. Once SSTP_PARK_SIZE bytes are parked, newer
+ * frames are dropped. With pppd, nothing is parked: the new SSTP session
+ * carries a new PPP session, that every frame read meanwhile belongs to.
+ *
+ * @return 0
+ */
+static int sstp_park_event(int fd, uint32_t events UNUSED, void* data)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) data;
+  unsigned char drop[PPP_MAX_MRU];
+  unsigned char* frame;
+  uint16_t len;
+  ssize_t rbytes;
+  int room;
+
+  while (1)
+    {
+      room = (t->park && t->park_len + sizeof(uint16_t) + PPP_MAX_MRU <= SSTP_PARK_SIZE);
+      frame = room ? t->park + t->park_len + sizeof(uint16_t) : drop;
+
+      rbytes = read(fd, frame, PPP_MAX_MRU);
+      if (rbytes <= 0)
+	break;
+
+      if (!room)
+	{
+	  t->park_dropped++;
+	  continue;
+	}
+
+      len = rbytes;
+      memcpy(t->park + t->park_len, &len, sizeof(uint16_t));
+      t->park_len += sizeof(uint16_t) + len;
+      t->park_frames++;
+    }
+
+  return 0;
+}
+
+
+/**
+ * Event handler for pppd pty, or TUN interface in native PPP mode: every
+ * pending PPP frame (or IP packet, PPP header being written in front of it)
+ * is read in place in the session transmit buffer, with neither allocation
+ * nor copy. Frames are sent by batches of cfg->tx_batch; an incomplete batch
+ * is sent once the pty is drained, or at most cfg->tx_delay microseconds
+ * later if a delay is set. While the socket is congested, frames are left in
+ * the pty, see sstp_out_resume().
+ *
+ * @return 0 if all good, negative value otherwise
+ */
+static int sstp_pty_event(int fd, uint32_t events, void* data)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) data;
+  ssize_t rbytes;
+  size_t headroom, len;
+  int was_empty;
+
+  /* TUN is parked until IPCP is up again, see ppp_reset() */
+  if (t->reconnecting && t->ppp)
+    return sstp_park_event(fd, events, data);
+
+  was_empty = (t->sess->tx_len == 0);
+  headroom = SSTP_HEADROOM + (t->ppp ? PPP_HEADROOM : 0);
+
+  while (1)
+    {
+      /* a whole frame of MRU size must always fit */
+      if (t->sess->tx_len + headroom + PPP_MAX_MRU > SSTP_TX_BUFFER_SIZE)
+	sstp_tx_flush(t);
+
+      if (t->sess->out_len)
+	{
+	  rbytes = 0;
+	  break;
+	}
+
+      rbytes = read(fd, t->sess->tx + t->sess->tx_len + headroom, PPP_MAX_MRU);
+      if (rbytes <= 0)
+	break;
+
+      len = rbytes;
+      if (t->ppp)
+	{
+	  len = ppp_encapsulate(t->ppp, t->sess->tx + t->sess->tx_len + headroom, rbytes);
+	  if (!len)
+	    continue;
+	}
+
+      sstp_tx_queue(t, len);
+    }
+
+  if (rbytes < 0 && errno != EAGAIN && t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "sstp_pty_event: %s\n", strerror(errno));
+
+  sstp_tx_schedule(t, was_empty);
+  return 0;
+}
+
+
+/**
+ * Transmit delay expiration, sends pending batch.
+ *
+ * @return 0
+ */
+static int sstp_tx_timer_event(void* data)
+{
+  sstp_tx_flush((sstp_tunnel_t*) data);
+  return 0;
+}
+
+
+/**
+ * Socket takes bytes again: sends those kept by sstp_write(), then reads
+ * frames left in PPP side meanwhile.
+ *
+ * @param t : tunnel
+ */
+static void sstp_out_resume(sstp_tunnel_t* t)
+{
+  int retcode;
+
+  retcode = sstp_out_flush(t);
+  if (retcode == SSTP_IO_AGAIN)
+    return;
+
+  if (retcode < 0)
+    {
+      sstp_link_lost(t);
+      return;
+    }
+
+  if (t->pty_handler.data == t)
+    sstp_pty_event(t->pty_handler.fd, EPOLLIN, t);
+}
+
+
+/**
+ * Event handler for TLS socket: sends bytes it could not take before, then
+ * drains the socket, decoding packets as they are completed. An error only
+ * disconnects this tunnel, other tunnels of the event loop keep running.
+ *
+ * @return 0
+ */
+static int sstp_tls_event(int fd UNUSED, uint32_t events, void* data)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) data;
+  ssize_t rbytes;
+
+  if ((events & EPOLLOUT) && t->sess->out_len)
+    sstp_out_resume(t);
+
+  while (t->ctx->state != CLIENT_CALL_DISCONNECTED)
+    {
+      rbytes = sstp_rx_fill(t, &t->sess->rx);
+      if (rbytes == SSTP_IO_AGAIN)
+	break;
+
+      if (rbytes < 0)
+	{
+	  sstp_link_lost(t);
+	  break;
+	}
+
+      if (rbytes == 0)
+	{
+	  if (t->cfg->verbose)
+	    xlog(LOG_INFO, "%s: EOF\n", t->name);
+	  sstp_link_lost(t);
+	  break;
+	}
+
+      if (t->cfg->verbose)
+	xlog(LOG_INFO,"<--  %lu bytes\n", rbytes);
+
+      t->sess->rx_bytes += rbytes;
+      if (sstp_rx_dispatch(t, &t->sess->rx) < 0)
+	set_client_status(t, CLIENT_CALL_DISCONNECTED);
+    }
+
+  return 0;
+}
+
+
+/**
+ * Negociation timer expiration: server did not acknowledge connection
+ * request in time.
+ *
+ * @return 0
+ */
+static int sstp_negociation_timer_event(void* data)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) data;
+
+  xlog(LOG_ERROR, "Negociation timer has expired, disconnecting\n");
+  set_client_status(t, CLIENT_CALL_DISCONNECTED);
+  return 0;
+}
+
+
+/**
+ * @return echo response timeout in ms: smoothed RTT plus four times its
+ * deviation (as TCP RTO, RFC 6298), within SSTP_ECHO_TIMEOUT_MIN and
+ * SSTP_ECHO_TIMEOUT_MAX
+ */
+static long sstp_echo_timeout(sstp_tunnel_t* t)
+{
+  long timeout;
+
+  if (!t->rtt)
+    return SSTP_ECHO_TIMEOUT_MAX;
+
+  timeout = (t->rtt + 4 * t->rtt_var) / 1000;
+  if (timeout < SSTP_ECHO_TIMEOUT_MIN)
+    timeout = SSTP_ECHO_TIMEOUT_MIN;
+  if (timeout > SSTP_ECHO_TIMEOUT_MAX)
+    timeout = SSTP_ECHO_TIMEOUT_MAX;
+
+  return timeout;
+}
+
+
+/**
+ * Sends an echo request, timestamped for RTT measurement, and arms keepalive
+ * timer for its response.
+ *
+ * @param t : tunnel
+ */
+static void sstp_keepalive_send(sstp_tunnel_t* t)
+{
+  clock_gettime(CLOCK_MONOTONIC, &t->echo_sent);
+  t->keepalive_rx = t->sess->rx_bytes;
+
+  send_sstp_control_packet(t, SSTP_MSG_ECHO_REQUEST, NULL, 0, 0);
+  sstp_timer_arm(t, &t->keepalive_timer, sstp_echo_timeout(t));
+}
+
+
+/**
+ * Logs buffer allocations since last report, along with data packets handled
+ * meanwhile. Data path uses session buffers only, so in steady state both heap
+ * counters stay at zero whatever the traffic. Worker heap allocations count
+ * every xmalloc() of this thread, ie. of all tunnels of the worker.
+ *
+ * @param t : tunnel
+ */
+static void sstp_alloc_report(sstp_tunnel_t* t)
+{
+  unsigned long requests, pool_allocs;
+
+  requests = t->packet_pool.requests + t->small_pool.requests;
+  pool_allocs = t->packet_pool.heap_allocs + t->small_pool.heap_allocs;
+
+  xlog(LOG_DEBUG, "%s: %lu data packets, %lu pool requests, %lu pool heap allocations, "
+       "%lu worker heap allocations\n", t->name,
+       t->sess->data_packets - t->report_packets,
+       requests - t->report_requests,
+       pool_allocs - t->report_pool_allocs,
+       xmalloc_count - t->report_heap_allocs);
+
+  t->report_packets = t->sess->data_packets;
+  t->report_requests = requests;
+  t->report_pool_allocs = pool_allocs;
+  t->report_heap_allocs = xmalloc_count;
+}
+
+
+/**
+ * Keepalive timer expiration. Server is only probed when link is idle, that
+ * is when nothing was received since last expiration. An unanswered echo
+ * request is sent again after a timeout derived from RTT, and server is
+ * considered dead once SSTP_ECHO_MAX_LOST requests in a row were lost.
+ *
+ * @return 0
+ */
+static int sstp_keepalive_event(void* data)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) data;
+  int idle = (t->sess->rx_bytes == t->keepalive_rx);
+
+  if (t->cfg->verbose > 1)
+    sstp_alloc_report(t);
+
+  if (t->echo_sent.tv_sec && idle)
+    {
+      t->echo_lost++;
+      if (t->echo_lost >= SSTP_ECHO_MAX_LOST)
+	{
+	  xlog(LOG_ERROR, "%s: no echo response after %u requests, disconnecting\n",
+	       t->name, t->echo_lost);
+	  sstp_link_lost(t);
+	  return 0;
+	}
+
+      if (t->cfg->verbose)
+	xlog(LOG_WARNING, "%s: echo response timed out after %ld ms (%u/%u)\n",
+	     t->name, sstp_echo_timeout(t), t->echo_lost, SSTP_ECHO_MAX_LOST);
+
+      t->keepalive_interval = SSTP_PING_TIMER_MIN;
+      sstp_keepalive_send(t);
+      return 0;
+    }
+
+  if (idle)
+    {
+      sstp_keepalive_send(t);
+      return 0;
+    }
+
+  /* server is alive, pending request (if any) is not waited for anymore */
+  memset(&t->echo_sent, 0, sizeof(struct timespec));
+  t->echo_lost = 0;
+  t->keepalive_rx = t->sess->rx_bytes;
+  sstp_timer_arm(t, &t->keepalive_timer, t->keepalive_interval * 1000);
+  return 0;
+}
+
+
+/**
+ * Starts a change of phases, RTT or server (see servers_use()). These are
+ * read from main thread by tunnel_phases_json() on SIGUSR2, without locking:
+ * reader copies them again if the sequence number was odd or changed
+ * meanwhile. A tunnel has one writer at a time, its worker or the thread
+ * reconnecting it.
+ *
+ * @param t : tunnel
+ */
+void tunnel_stats_begin(sstp_tunnel_t* t)
+{
+  t->stats_seq++;
+  __sync_synchronize();
+}
+
+
+/**
+ * Ends a change of phases, RTT or server, see tunnel_stats_begin().
+ *
+ * @param t : tunnel
+ */
+void tunnel_stats_end(sstp_tunnel_t* t)
+{
+  __sync_synchronize();
+  t->stats_seq++;
+}
+
+
+/**
+ * Echo response: updates smoothed RTT and jitter, and schedules next check.
+ * Interval doubles as long as server answers, up to SSTP_PING_TIMER.
+ *
+ * @param t : tunnel
+ */
+static void sstp_keepalive_response(sstp_tunnel_t* t)
+{
+  struct timespec now;
+  long sample;
+
+  /* response to a request given up on */
+  if (!t->echo_sent.tv_sec)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  sample = (now.tv_sec - t->echo_sent.tv_sec) * 1000000L +
+    (now.tv_nsec - t->echo_sent.tv_nsec) / 1000;
+  if (sample <= 0)
+    sample = 1;
+
+  tunnel_stats_begin(t);
+  if (!t->rtt)
+    {
+      t->rtt = sample;
+      t->rtt_var = sample / 2;
+    }
+  else
+    {
+      t->rtt_var = (3 * t->rtt_var + labs(t->rtt - sample)) / 4;
+      t->rtt = (7 * t->rtt + sample) / 8;
+    }
+  tunnel_stats_end(t);
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: echo RTT %.3f ms (smoothed %.3f ms, jitter %.3f ms)\n",
+	 t->name, sample / 1e3, t->rtt / 1e3, t->rtt_var / 1e3);
+
+  memset(&t->echo_sent, 0, sizeof(struct timespec));
+  t->echo_lost = 0;
+
+  t->keepalive_interval *= 2;
+  if (t->keepalive_interval > SSTP_PING_TIMER)
+    t->keepalive_interval = SSTP_PING_TIMER;
+
+  t->keepalive_rx = t->sess->rx_bytes;
+  sstp_timer_arm(t, &t->keepalive_timer, t->keepalive_interval * 1000);
+}
+
+
+/**
+ * Starts echo keepalive once SSTP link is up: first request is sent at once.
+ *
+ * @param t : tunnel
+ */
+static void sstp_keepalive_start(sstp_tunnel_t* t)
+{
+  /* reports start from link establishment, see sstp_alloc_report() */
+  t->report_packets = t->sess->data_packets;
+  t->report_requests = t->packet_pool.requests + t->small_pool.requests;
+  t->report_pool_allocs = t->packet_pool.heap_allocs + t->small_pool.heap_allocs;
+  t->report_heap_allocs = xmalloc_count;
+
+  t->echo_lost = 0;
+  tunnel_stats_begin(t);
+  t->rtt = t->rtt_var = 0;
+  tunnel_stats_end(t);
+  t->keepalive_interval = SSTP_PING_TIMER_MIN;
+
+  sstp_keepalive_send(t);
+}
+
+
+/*
+ * io_uring backend: TLS socket and PPP side (pty or TUN) are read into a ring
+ * of registered buffers, the next read being queued as soon as the previous
+ * one completes, while data already read is handled. Only one read is in
+ * flight per fd: concurrent reads on a stream may complete out of order, and
+ * are not reassembled. TLS goes through GnuTLS transport callbacks: records
+ * are pulled from completed socket reads and pushed to an outgoing buffer,
+ * written in one request. This is still a copying backend: PPP frames are
+ * copied into the SSTP transmit buffer, and records into the outgoing one.
+ * What it saves are system calls: every request queued while handling a wake
+ * up is submitted by a single io_uring_enter(2).
+ */
+
+enum sstp_uring_requests
+  {
+    URING_SOCKET_READ = 1,
+    URING_SOCKET_WRITE,
+    URING_PPP_READ,
+    URING_PPP_WRITE
+  };
+
+/* registered files */
+enum sstp_uring_files
+  {
+    URING_FILE_SOCKET,
+    URING_FILE_PPP
+  };
+
+typedef struct __sstp_uring_slot
+{
+  unsigned char* buf;
+  int res;			/* read result, or length of a queued write */
+  size_t off;
+} sstp_uring_slot_t;
+
+/* completed reads are [head, tail[, next read goes to tail */
+typedef struct __sstp_uring_rx
+{
+  sstp_uring_slot_t slots[SSTP_URING_DEPTH];
+  unsigned head, tail;
+  int type;
+  int pending;
+  int eof;
+} sstp_uring_rx_t;
+
+struct __sstp_uring
+{
+  uring_t ring;
+  int fds[2];
+  unsigned char* arena;
+  size_t arena_size;
+
+  sstp_uring_rx_t sock_rx;
+  sstp_uring_rx_t ppp_rx;
+
+  /* frames to PPP side: [head, mid[ in flight as one linked chain, [mid, tail[ queued */
+  sstp_uring_slot_t ppp_tx[SSTP_URING_PPP_SLOTS];
+  unsigned ppp_tx_head, ppp_tx_mid, ppp_tx_tail;
+
+  /* TLS records to socket: `fill` is appended to while `wire` is written */
+  unsigned char *tx_fill, *tx_wire;
+  size_t tx_fill_len, tx_wire_len, tx_wire_off;
+  int tx_busy;
+};
+
+
+static int sstp_uring_fd(sstp_tunnel_t* t, int file)
+{
+  return t->uring->ring.fixed_files ? file : t->uring->fds[file];
+}
+
+
+/**
+ * Queues a read or write request.
+ *
+ * @return SQE, NULL if submission queue is full
+ */
+static struct io_uring_sqe* sstp_uring_prep(sstp_tunnel_t* t, int type, int file, unsigned index,
+					    void* buf, size_t len)
+{
+  struct io_uring_sqe* sqe;
+
+  sqe = uring_get_sqe(&t->uring->ring);
+  if (!sqe)
+    return NULL;
+
+  uring_prep_rw(sqe, &t->uring->ring,
+		(type == URING_SOCKET_READ || type == URING_PPP_READ) ? IORING_OP_READ : IORING_OP_WRITE,
+		sstp_uring_fd(t, file), buf, len, ((uint64_t) type << 32) | index);
+  return sqe;
+}
+
+
+/**
+ * Queues a request the tunnel cannot go on without: it is disconnected if
+ * the submission queue is full.
+ */
+static void sstp_uring_prep_or_fail(sstp_tunnel_t* t, int type, int file, unsigned index,
+				    void* buf, size_t len)
+{
+  if (!sstp_uring_prep(t, type, file, index, buf, len))
+    {
+      xlog(LOG_ERROR, "sstp_uring_prep: submission queue is full\n");
+      set_client_status(t, CLIENT_CALL_DISCONNECTED);
+    }
+}
+
+
+/**
+ * Queues next read on `rx`, unless one is already pending, all buffers are
+ * waiting to be consumed, or EOF was reached.
+ */
+static void sstp_uring_read(sstp_tunnel_t* t, sstp_uring_rx_t* rx)
+{
+  unsigned index;
+  sstp_uring_slot_t* slot;
+
+  if (rx->pending || rx->eof || rx->tail - rx->head == SSTP_URING_DEPTH)
+    return;
+
+  index = rx->tail % SSTP_URING_DEPTH;
+  slot = &rx->slots[index];
+  slot->res = 0;
+  slot->off = 0;
+  rx->pending = TRUE;
+
+  if (rx->type == URING_SOCKET_READ)
+    sstp_uring_prep_or_fail(t, rx->type, URING_FILE_SOCKET, index, slot->buf, SSTP_URING_RX_SIZE);
+  else
+    sstp_uring_prep_or_fail(t, rx->type, URING_FILE_PPP, index, slot->buf + PPP_HEADROOM, PPP_MAX_MRU);
+}
+
+
+/**
+ * @return first completed read of `rx`, or NULL if there is none
+ */
+static sstp_uring_slot_t* sstp_uring_rx_peek(sstp_uring_rx_t* rx)
+{
+  if (rx->head == rx->tail)
+    return NULL;
+
+  return &rx->slots[rx->head % SSTP_URING_DEPTH];
+}
+
+
+/**
+ * Releases first completed read of `rx`, and queues next read if needed.
+ */
+static void sstp_uring_rx_next(sstp_tunnel_t* t, sstp_uring_rx_t* rx)
+{
+  rx->head++;
+  sstp_uring_read(t, rx);
+}
+
+
+/**
+ * Queues pending writes: frames for PPP side as a linked chain (so that they
+ * are written in order), and outgoing TLS records. Then submits everything
+ * queued so far.
+ *
+ * A chain must go to the kernel in one submission: it is only as long as
+ * free submission queue entries, frames left are chained by a next call.
+ */
+static void sstp_uring_kick(sstp_tunnel_t* t)
+{
+  struct io_uring_sqe *sqe, *prev = NULL;
+  uring_t* ring = &t->uring->ring;
+  unsigned i, n;
+
+  if (t->uring->ppp_tx_head == t->uring->ppp_tx_mid && t->uring->ppp_tx_mid != t->uring->ppp_tx_tail)
+    {
+      n = t->uring->ppp_tx_tail - t->uring->ppp_tx_mid;
+      if (uring_sq_space(ring) < n && ring->queued && uring_submit(ring, 0) < 0)
+	{
+	  xlog(LOG_ERROR, "sstp_uring_kick: %s\n", strerror(errno));
+	  set_client_status(t, CLIENT_CALL_DISCONNECTED);
+	  return;
+	}
+
+      if (n > uring_sq_space(ring))
+	n = uring_sq_space(ring);
+
+      for (i=0; i<n; i++)
+	{
+	  unsigned index = (t->uring->ppp_tx_mid + i) % SSTP_URING_PPP_SLOTS;
+	  sstp_uring_slot_t* slot = &t->uring->ppp_tx[index];
+
+	  sqe = sstp_uring_prep(t, URING_PPP_WRITE, URING_FILE_PPP, index, slot->buf, slot->res);
+	  if (!sqe)
+	    break;
+
+	  if (prev)
+	    prev->flags |= IOSQE_IO_LINK;
+	  prev = sqe;
+	}
+      t->uring->ppp_tx_mid += i;
+    }
+
+  if (!t->uring->tx_busy && t->uring->tx_fill_len)
+    {
+      unsigned char* buf = t->uring->tx_wire;
+
+      t->uring->tx_wire = t->uring->tx_fill;
+      t->uring->tx_wire_len = t->uring->tx_fill_len;
+      t->uring->tx_wire_off = 0;
+      t->uring->tx_fill = buf;
+      t->uring->tx_fill_len = 0;
+      t->uring->tx_busy = TRUE;
+
+      sstp_uring_prep_or_fail(t, URING_SOCKET_WRITE, URING_FILE_SOCKET, 0,
+			      t->uring->tx_wire, t->uring->tx_wire_len);
+    }
+
+  if (t->uring->ring.queued && uring_submit(&t->uring->ring, 0) < 0)
+    {
+      xlog(LOG_ERROR, "sstp_uring_kick: %s\n", strerror(errno));
+      set_client_status(t, CLIENT_CALL_DISCONNECTED);
+    }
+}
+
+
+/**
+ * Consumes available completions. Only slots state is updated, data is
+ * handled by sstp_uring_event().
+ */
+static void sstp_uring_reap(sstp_tunnel_t* t)
+{
+  struct io_uring_cqe* cqe;
+  sstp_uring_rx_t* rx;
+  unsigned type, index;
+  int res;
+
+  while ((cqe = uring_peek_cqe(&t->uring->ring)))
+    {
+      type = cqe->user_data >> 32;
+      index = cqe->user_data & 0xffffffff;
+      res = cqe->res;
+      uring_cqe_seen(&t->uring->ring);
+
+      switch (type)
+	{
+	case URING_SOCKET_READ:
+	case URING_PPP_READ:
+	  rx = (type == URING_SOCKET_READ) ? &t->uring->sock_rx : &t->uring->ppp_rx;
+	  rx->slots[index].res = res;
+	  rx->pending = FALSE;
+	  rx->tail++;
+
+	  /* EOF or error stays on the slot */
+	  if (res <= 0)
+	    rx->eof = TRUE;
+
+	  sstp_uring_read(t, rx);
+	  break;
+
+	case URING_SOCKET_WRITE:
+	  if (res <= 0)
+	    {
+	      xlog(LOG_ERROR, "sstp_uring_reap: write: %s\n", strerror(-res));
+	      sstp_link_lost(t);
+	      t->uring->tx_busy = FALSE;
+	      break;
+	    }
+
+	  t->uring->tx_wire_off += res;
+	  if (t->uring->tx_wire_off < t->uring->tx_wire_len)
+	    sstp_uring_prep_or_fail(t, URING_SOCKET_WRITE, URING_FILE_SOCKET, 0,
+				    t->uring->tx_wire + t->uring->tx_wire_off,
+				    t->uring->tx_wire_len - t->uring->tx_wire_off);
+	  else
+	    t->uring->tx_busy = FALSE;
+	  break;
+
+	case URING_PPP_WRITE:
+	  /* a failed write cancels the rest of its chain: frames are lost */
+	  if (res < 0 && t->cfg->verbose > 2)
+	    xlog(LOG_DEBUG, "sstp_uring_reap: PPP write: %s\n", strerror(-res));
+
+	  t->uring->ppp_tx_head++;
+	  break;
+	}
+    }
+}
+
+
+/**
+ * Waits for outgoing TLS records to be written.
+ */
+static void sstp_uring_flush(sstp_tunnel_t* t)
+{
+  sstp_uring_kick(t);
+
+  while (t->uring->tx_busy)
+    {
+      if (uring_submit(&t->uring->ring, 1) < 0)
+	break;
+      sstp_uring_reap(t);
+      sstp_uring_kick(t);
+    }
+}
+
+
+/**
+ * Queues a frame to be written to PPP side (pty, or TUN in native mode). As a
+ * congested link would do, frame is dropped if all slots are busy.
+ *
+ * @return 0
+ */
+static int sstp_uring_ppp_write(sstp_tunnel_t* t, unsigned char* data, size_t len)
+{
+  sstp_uring_slot_t* slot;
+
+  if (t->uring->ppp_tx_tail - t->uring->ppp_tx_head >= SSTP_URING_PPP_SLOTS || len > PPP_MAX_MRU)
+    {
+      if (t->cfg->verbose > 2)
+	xlog(LOG_DEBUG, "PPP side is full, %lu bytes dropped\n", len);
+      return 0;
+    }
+
+  slot = &t->uring->ppp_tx[t->uring->ppp_tx_tail % SSTP_URING_PPP_SLOTS];
+  memcpy(slot->buf, data, len);
+  slot->res = len;
+  t->uring->ppp_tx_tail++;
+
+  return 0;
+}
+
+
+#ifdef HAS_GNUTLS
+/**
+ * GnuTLS pull function: returns data from completed socket reads, in order.
+ */
+static ssize_t sstp_uring_pull(gnutls_transport_ptr_t ptr, void* buf, size_t len)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) ptr;
+  sstp_uring_slot_t* slot;
+  size_t n;
+
+  if (!t->uring)
+    return recv(t->sockfd, buf, len, 0);
+
+  slot = sstp_uring_rx_peek(&t->uring->sock_rx);
+  if (!slot)
+    {
+      gnutls_transport_set_errno(t->tls, EAGAIN);
+      return -1;
+    }
+
+  if (slot->res <= 0)
+    {
+      if (slot->res < 0)
+	gnutls_transport_set_errno(t->tls, -slot->res);
+      return slot->res < 0 ? -1 : 0;
+    }
+
+  n = slot->res - slot->off;
+  if (n > len)
+    n = len;
+
+  memcpy(buf, slot->buf + slot->off, n);
+  slot->off += n;
+
+  if (slot->off == (size_t) slot->res)
+    sstp_uring_rx_next(t, &t->uring->sock_rx);
+
+  return n;
+}
+
+
+/**
+ * GnuTLS push function: appends records to outgoing buffer. Never waits for
+ * the previous write: if buffer is still full once handed over, fails with
+ * EAGAIN, and the record is kept in session until next socket completion (see
+ * sstp_uring_event()).
+ */
+static ssize_t sstp_uring_push(gnutls_transport_ptr_t ptr, const void* buf, size_t len)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) ptr;
+  size_t n;
+
+  if (!t->uring)
+    return send(t->sockfd, buf, len, MSG_NOSIGNAL);
+
+  if (t->uring->tx_fill_len == SSTP_URING_TX_SIZE)
+    sstp_uring_kick(t);
+
+  if (t->uring->tx_fill_len == SSTP_URING_TX_SIZE)
+    {
+      gnutls_transport_set_errno(t->tls, EAGAIN);
+      return -1;
+    }
+
+  n = SSTP_URING_TX_SIZE - t->uring->tx_fill_len;
+  if (n > len)
+    n = len;
+
+  memcpy(t->uring->tx_fill + t->uring->tx_fill_len, buf, n);
+  t->uring->tx_fill_len += n;
+
+  return n;
+}
+#endif
+
+
+/**
+ * Event handler for io_uring completions: decodes SSTP packets received, sends
+ * records outgoing buffer could not take before, and queues frames read from
+ * PPP side for sending. Frames are left in their slots while records are
+ * kept, so PPP side reads stop once all slots are used.
+ *
+ * @return 0
+ */
+static int sstp_uring_event(int fd UNUSED, uint32_t events UNUSED, void* data)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) data;
+  sstp_uring_slot_t* slot;
+  unsigned char* frame;
+  size_t len;
+  int was_empty;
+
+  sstp_uring_reap(t);
+
+  if (t->sess->out_len && sstp_out_flush(t) == -1)
+    {
+      sstp_link_lost(t);
+      return 0;
+    }
+
+  if (sstp_uring_rx_peek(&t->uring->sock_rx))
+    sstp_tls_event(t->sockfd, EPOLLIN, t);
+
+  if (t->ctx->state == CLIENT_CALL_DISCONNECTED)
+    return 0;
+
+  was_empty = (t->sess->tx_len == 0);
+
+  while (!t->sess->out_len && (slot = sstp_uring_rx_peek(&t->uring->ppp_rx)))
+    {
+      if (slot->res <= 0)
+	{
+	  /* pppd is gone, SIGCHLD will tell */
+	  if (slot->res < 0 && t->cfg->verbose > 1)
+	    xlog(LOG_DEBUG, "sstp_uring_event: %s\n", strerror(-slot->res));
+	  break;
+	}
+
+      frame = slot->buf + PPP_HEADROOM;
+      len = slot->res;
+      if (t->ppp)
+	{
+	  len = ppp_encapsulate(t->ppp, frame, len);
+	  frame -= PPP_HEADROOM;
+	}
+
+      if (len)
+	{
+	  if (t->sess->tx_len + SSTP_HEADROOM + len > SSTP_TX_BUFFER_SIZE)
+	    sstp_tx_flush(t);
+
+	  memcpy(t->sess->tx + t->sess->tx_len + SSTP_HEADROOM, frame, len);
+	  sstp_tx_queue(t, len);
+	}
+
+      sstp_uring_rx_next(t, &t->uring->ppp_rx);
+    }
+
+  sstp_tx_schedule(t, was_empty);
+  return 0;
+}
+
+
+/**
+ * Switches socket and PPP side I/O to io_uring. On failure, nothing is changed
+ * and the epoll path is used.
+ *
+ * @param ppp_fd : pppd pty or TUN interface
+ * @return 0 if all good, -1 otherwise
+ */
+static int sstp_uring_init(sstp_tunnel_t* t, int ppp_fd)
+{
+#ifdef HAS_GNUTLS
+  struct iovec iov;
+  unsigned char* ptr;
+  int i;
+
+  t->uring = (struct __sstp_uring*) xmalloc(sizeof(struct __sstp_uring));
+
+  if (uring_init(&t->uring->ring, SSTP_URING_ENTRIES) < 0)
+    {
+      xlog(LOG_WARNING, "io_uring is not available (%s), using epoll\n", strerror(errno));
+      xfree(t->uring);
+      t->uring = NULL;
+      return -1;
+    }
+
+  t->uring->arena_size = SSTP_URING_DEPTH * SSTP_URING_RX_SIZE
+    + SSTP_URING_DEPTH * (PPP_HEADROOM + PPP_MAX_MRU)
+    + SSTP_URING_PPP_SLOTS * PPP_MAX_MRU
+    + 2 * SSTP_URING_TX_SIZE;
+  t->uring->arena = xmalloc(t->uring->arena_size);
+
+  ptr = t->uring->arena;
+  for (i = 0; i < SSTP_URING_DEPTH; i++, ptr += SSTP_URING_RX_SIZE)
+    t->uring->sock_rx.slots[i].buf = ptr;
+  for (i = 0; i < SSTP_URING_DEPTH; i++, ptr += PPP_HEADROOM + PPP_MAX_MRU)
+    t->uring->ppp_rx.slots[i].buf = ptr;
+  for (i = 0; i < SSTP_URING_PPP_SLOTS; i++, ptr += PPP_MAX_MRU)
+    t->uring->ppp_tx[i].buf = ptr;
+  t->uring->tx_fill = ptr;
+  t->uring->tx_wire = ptr + SSTP_URING_TX_SIZE;
+
+  /* both are optimizations, requests work without them */
+  iov.iov_base = t->uring->arena;
+  iov.iov_len = t->uring->arena_size;
+  if (uring_register_buffers(&t->uring->ring, &iov, 1) < 0 && t->cfg->verbose)
+    xlog(LOG_INFO, "io_uring: cannot register buffers: %s\n", strerror(errno));
+
+  t->uring->fds[URING_FILE_SOCKET] = t->sockfd;
+  t->uring->fds[URING_FILE_PPP] = ppp_fd;
+  if (uring_register_files(&t->uring->ring, t->uring->fds, 2) < 0 && t->cfg->verbose)
+    xlog(LOG_INFO, "io_uring: cannot register files: %s\n", strerror(errno));
+
+  /* io_uring would fail with EAGAIN rather than wait on non-blocking fds */
+  fcntl(t->sockfd, F_SETFL, fcntl(t->sockfd, F_GETFL) & ~O_NONBLOCK);
+  fcntl(ppp_fd, F_SETFL, fcntl(ppp_fd, F_GETFL) & ~O_NONBLOCK);
+
+  gnutls_transport_set_ptr(t->tls, t);
+  gnutls_transport_set_pull_function(t->tls, sstp_uring_pull);
+  gnutls_transport_set_push_function(t->tls, sstp_uring_push);
+
+  t->uring->sock_rx.type = URING_SOCKET_READ;
+  t->uring->ppp_rx.type = URING_PPP_READ;
+  sstp_uring_read(t, &t->uring->sock_rx);
+  sstp_uring_read(t, &t->uring->ppp_rx);
+
+  sstp_uring_kick(t);
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "Using io_uring (one read in flight per fd, %d buffers)\n", SSTP_URING_DEPTH);
+
+  return 0;
+#else
+  xlog(LOG_WARNING, "io_uring backend needs GnuTLS, using epoll\n");
+  return -1;
+#endif
+}
+
+
+/**
+ * Sends pending TLS records, and goes back to plain blocking socket I/O.
+ */
+static void sstp_uring_close(sstp_tunnel_t* t)
+{
+  sstp_uring_flush(t);
+
+  uring_close(&t->uring->ring);
+  xfree(t->uring->arena);
+  xfree(t->uring);
+  t->uring = NULL;
+}
+
+
+/**
+ * Registers one of tunnel handlers into the worker event loop.
+ *
+ * @param t : tunnel
+ * @param handler : tunnel handler, fd and cb set
+ * @param events : epoll event mask
+ * @return 0 if all good, -1 otherwise
+ */
+static int sstp_event_add(sstp_tunnel_t* t, event_handler_t* handler, uint32_t events)
+{
+  if (event_add(&t->worker->loop, handler, events) < 0)
+    {
+      xlog(LOG_ERROR, "sstp_event_add: %s\n", strerror(errno));
+      return -1;
+    }
+
+  handler->data = t;
+  return 0;
+}
+
+
+/**
+ * Called right after the end of HTTPS negociation, from the thread running
+ * the tunnel event loop:
+ * - allocates SSTP client context regions
+ * - registers tunnel fds into the worker event loop
+ * - starts an SSTP negociation
+ *
+ * Packets are then handled by the worker event loop, shared with its other
+ * tunnels: pppd pty (or TUN interface in native mode) and TLS socket, which
+ * are edge-triggered, and tunnel timers (negociation, keepalive, transmit
+ * delay and PPP restart), which share the event loop timerfd.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise (tunnel must be stopped)
+ */
+int sstp_tunnel_start(sstp_tunnel_t* t)
+{
+  gettimeofday(&t->sess->tv_start, NULL);
+
+  t->ctx = (sstp_context_t*) xmalloc(sizeof(sstp_context_t));
+  t->ctx->retry                       = SSTP_MAX_INIT_RETRY;
+  t->ctx->state                       = CLIENT_CALL_DISCONNECTED;
+
+  t->chap_ctx = (chap_context_t*) xmalloc(sizeof(chap_context_t));
 
-  if (header->version != SSTP_VERSION)
+  /* control path buffers; data path uses the session rx and tx buffers */
+  pool_init(&t->packet_pool, SSTP_HEADROOM + PPP_MAX_MRU);
+  pool_init(&t->small_pool, POOL_SMALL_SIZE);
+
+  /* PPP side was parked, see sstp_tunnel_suspend() */
+  if (t->pty_handler.data == t)
+    event_del(&t->worker->loop, &t->pty_handler);
+
+  /* handlers not registered are skipped by sstp_tunnel_stop() */
+  t->pty_handler.data = t->tls_handler.data = t->uring_handler.data = NULL;
+
+  /* timers share the worker event loop timerfd */
+  event_timer_init(&t->negociation_timer, sstp_negociation_timer_event, t);
+  event_timer_init(&t->keepalive_timer, sstp_keepalive_event, t);
+  event_timer_init(&t->tx_timer, sstp_tx_timer_event, t);
+
+  t->pty_handler.fd = t->ppp_fd;
+  t->pty_handler.cb = sstp_pty_event;
+  t->tls_handler.fd = t->sockfd;
+  t->tls_handler.cb = sstp_tls_event;
+
+  if (t->cfg->io_uring && t->ktls_mode)
+    xlog(LOG_WARNING, "io_uring backend is not used along with kTLS\n");
+
+  if (t->cfg->io_uring && !t->ktls_mode && t->ppp_fd >= 0 &&
+      sstp_uring_init(t, t->ppp_fd) == 0)
     {
-      if (cfg->verbose)
-	xlog(LOG_ERROR, "Invalid version (%#x)\n", header->version);
-      return FALSE;
-    }
+      t->uring_handler.fd = t->uring->ring.fd;
+      t->uring_handler.cb = sstp_uring_event;
 
-  if (header->reserved != SSTP_DATA_PACKET &&
-      header->reserved != SSTP_CONTROL_PACKET)
+      if (t->ppp)
+	t->ppp->ip_output = sstp_uring_ppp_write;
+
+      if (sstp_event_add(t, &t->uring_handler, EPOLLIN) < 0)
+	return -1;
+    }
+  else
     {
-      if (cfg->verbose)
-	xlog(LOG_ERROR, "Invalid packet type (%#x)\n", header->reserved);
-      return FALSE;
+      if (event_set_nonblock(t->sockfd) < 0 ||
+	  sstp_event_add(t, &t->tls_handler, EPOLLIN|EPOLLET) < 0)
+	return -1;
+
+      if (t->ppp_fd >= 0 &&
+	  (event_set_nonblock(t->ppp_fd) < 0 ||
+	   sstp_event_add(t, &t->pty_handler, EPOLLIN|EPOLLET) < 0))
+	return -1;
     }
 
-  header->length = ntohs(header->length);
-  if (header->length > recv_len)
-    {
-      if ( header->reserved == SSTP_CONTROL_PACKET)
-	{
-	  if (cfg->verbose > 2)
-	    xlog(LOG_DEBUG, "Unmatching length: annonced %lu, received %lu\n",
-		 header->length, recv_len);
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "%s: running on worker %u\n", t->name, t->worker->id);
 
-	  return FALSE;
-	}
-    }
+  /* start negociation */
+  sstp_init(t);
 
-  return TRUE;
+  /* SSTP packets received along with HTTP response */
+  if (t->sess->rx.tail && sstp_rx_dispatch(t, &t->sess->rx) < 0)
+    return -1;
+
+  return 0;
 }
 
 
 /**
- * Check whether received packet has Control flag raised.
+ * Called before the worker waits for events: with io_uring, requests queued
+ * by last handlers are submitted at once.
  *
- * @param packet_header : received SSTP header
- * @return TRUE if valid, FALSE otherwise
+ * @param t : tunnel
  */
-static int is_control_packet(sstp_header_t* packet_header)
+void sstp_tunnel_kick(sstp_tunnel_t* t)
 {
-  return (packet_header->reserved == SSTP_CONTROL_PACKET);
+  if (t->uring && t->ctx && t->ctx->state != CLIENT_CALL_DISCONNECTED)
+    sstp_uring_kick(t);
 }
 
 
 /**
- * Send HTTP request to start a new SSTP connection.
+ * Removes tunnel fds and timers from the worker event loop, then releases
+ * SSTP client context. PPP side is left untouched.
  *
- * @return 0 if all good, negative value otherwise
+ * @param t : tunnel
  */
-int https_session_negociation()
+static void sstp_tunnel_release(sstp_tunnel_t* t)
 {
-  ssize_t rbytes;
-  unsigned char buf[1024] = {0, };
-  char guid[39] = {0, };
+  event_handler_t* handlers[] = { &t->tls_handler, &t->pty_handler, &t->uring_handler };
+  event_timer_t* timers[] = { &t->negociation_timer, &t->keepalive_timer, &t->tx_timer };
+  unsigned int i, leaked;
 
-  rbytes = -1;
+  for (i=0; i<sizeof(handlers)/sizeof(handlers[0]); i++)
+    if (handlers[i]->data == t)
+      {
+	event_del(&t->worker->loop, handlers[i]);
+	handlers[i]->data = NULL;
+      }
 
-  /* Allocate SSTP session */
-  sess = (sstp_session_t*) xmalloc(sizeof(sstp_session_t));
+  for (i=0; i<sizeof(timers)/sizeof(timers[0]); i++)
+    event_timer_cancel(&t->worker->loop, timers[i]);
+  if (t->ppp)
+    event_timer_cancel(&t->worker->loop, &t->ppp->restart_timer);
 
-  generate_guid(guid);
-  rbytes = snprintf((char *)buf, 1024,
-		    "SSTP_DUPLEX_POST %s HTTP/1.1\r\n"
-		    "Host: %s\r\n"
-		    "SSTPCORRELATIONID: %s\r\n"
-		    "Content-Length: %llu\r\n"
-		    "\r\n",
-		    SSTP_HTTPS_RESOURCE,
-		    cfg->server,
-		    guid,
-  		    __UNSIGNED_LONG_LONG_MAX__);
+  if (t->uring)
+    sstp_uring_close(t);
 
-  if (cfg->verbose > 2)
-    xlog(LOG_DEBUG, "Sending: %lu bytes\n%s\n", rbytes, buf);
+  gettimeofday(&t->sess->tv_end, NULL);
 
-  /* Start negociation */
-  if (sstp_write(buf, rbytes) < 0)
-  {
-          xlog(LOG_ERROR, "%s", "Failed to send the SSTP_DUPLEX_POST request\n");
-          return -1;
-  }
+  if (t->cfg->verbose)
+    {
+      double session_time = (t->sess->tv_end.tv_sec - t->sess->tv_start.tv_sec) +
+	(t->sess->tv_end.tv_usec - t->sess->tv_start.tv_usec) / 1e6;
 
-  memset(buf, 0, 1024);
-  rbytes = sstp_read(buf, 1024);
-  if (rbytes < 0)
-  {
-          xlog(LOG_ERROR, "%s", "Failed to receive the SSTP_DUPLEX_POST response\n");
-          return -1;
-  }
+      xlog(LOG_INFO, "%s: SSTP session duration: %.1f sec\n", t->name, session_time);
 
-  if (rbytes == 0)
-  {
-          xlog(LOG_INFO, "Unexpected close notification from %s.\n", cfg->server);
-          return -1;
-  }
+      /* session may end within the same clock tick */
+      if (session_time <= 0)
+	session_time = 1;
 
-  if (cfg->verbose)
-  {
-          if (cfg->verbose > 1)
-                  xlog(LOG_DEBUG , "Received: %s\n", buf);
-  }
+      xlog(LOG_INFO, "Sent %lu bytes (avg: %.2f B/s), received %lu bytes (avg: %.2f B/s)\n",
+	   t->sess->tx_bytes,
+	   t->sess->tx_bytes / session_time,
+	   t->sess->rx_bytes,
+	   t->sess->rx_bytes / session_time
+	   );
 
-  sess->rx_bytes += rbytes;
-  if (cfg->verbose > 2)
-          xlog(LOG_DEBUG, "Received: %lu bytes\n%s\n", rbytes, buf);
+      if (t->rtt)
+	xlog(LOG_INFO, "Echo RTT %.3f ms, jitter %.3f ms\n", t->rtt / 1e3, t->rtt_var / 1e3);
+    }
 
-  if (memcmp(buf, "HTTP/1.1 200", 12) && memcmp(buf, "HTTP/1.0 200", 12))
-    {
-      xlog(LOG_ERROR, "Incorrect HTTP response header\n");
-      if (cfg->verbose > 2)
-	{
-	  buf[sizeof(buf)-1] = '\0';
-	  xlog(LOG_DEBUG, "%s\n", buf);
-	}
+  leaked = pool_destroy(&t->packet_pool);
+  leaked += pool_destroy(&t->small_pool);
+  if (leaked)
+    xlog(LOG_WARNING, "%s: %u pool buffers not released\n", t->name, leaked);
 
-      return -1;
-    }
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: buffer pools: %lu requests, %lu heap allocations, for %lu data packets\n",
+	 t->name, t->packet_pool.requests + t->small_pool.requests,
+	 t->packet_pool.heap_allocs + t->small_pool.heap_allocs, t->sess->data_packets);
 
-  return 0;
+  xfree(t->chap_ctx);
+  xfree(t->ctx);
+  t->chap_ctx = NULL;
+  t->ctx = NULL;
 }
 
 
 /**
- * Allocates and fills an attribute with specified data.
+ * Tears down a disconnected tunnel, or one that failed to start: removes its
+ * fds from the worker event loop, waits for pppd, says goodbye to the server
+ * and releases SSTP client context. TLS session and socket are left to the
+ * caller.
  *
- * @param attribute_id : attribute code
- * @param data : data to be inserted
- * @param data_length : `data` length
- * @return a pointer to the new attribute buffer
+ * @param t : tunnel
  */
-void* create_attribute(uint8_t attribute_id, void* data, size_t data_length)
+void sstp_tunnel_stop(sstp_tunnel_t* t)
 {
-  sstp_attribute_header_t attribute_header;
-  size_t attribute_length;
-  void* attribute;
+  uint16_t msg_type = 0;
+  int retcode;
 
-  if (!data) return NULL;
+  if (!t->ctx)
+    return;
 
-  attribute_length = sizeof(sstp_attribute_header_t) + data_length;
-  attribute = xmalloc(attribute_length);
+  if (t->pppd_pid > 0)
+    {
+      if (t->cfg->verbose)
+	xlog(LOG_INFO, "Waiting for %s process (PID:%d) to end\n",
+	     t->cfg->pppd_path, t->pppd_pid);
 
-  attribute_header.reserved = 0;
-  attribute_header.attribute_id = attribute_id;
-  attribute_header.packet_length = htons(attribute_length);
+      kill(t->pppd_pid, SIGINT);
+      waitpid(t->pppd_pid, &retcode, 0);
+      t->pppd_pid = 0;
 
-  memcpy(attribute, &attribute_header, sizeof(sstp_attribute_header_t));
-  memcpy(attribute + sizeof(sstp_attribute_header_t), data, data_length);
+      if (retcode)
+	xlog(LOG_ERROR, "Failed to quit pppd, retcode %d\n", retcode);
+    }
 
-  return attribute;
+  msg_type = t->ctx->flags & REMOTE_DISCONNECTION ? SSTP_MSG_CALL_DISCONNECT_ACK : SSTP_MSG_CALL_DISCONNECT;
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "Sending %s message.\n", control_messages_types_str[msg_type]);
+  send_sstp_control_packet(t, msg_type, NULL, 0, 0);
+
+  sstp_tunnel_release(t);
 }
 
 
 /**
- * Emits SSTP negociation request, ie Control message with
- * ENCAPSULATED_PROTOCOL_ID attribute. Negociation timer is set up and state is
- * changed.
+ * Link to the server is lost, or a reconnection attempt failed: SSTP session
+ * is released as by sstp_tunnel_stop(), but pppd (or TUN interface) is kept,
+ * its frames being parked by sstp_park_event() meanwhile. Nothing is sent to
+ * the server. TLS session and socket are left to the caller.
+ *
+ * @param t : tunnel
  */
-static void sstp_init()
+void sstp_tunnel_suspend(sstp_tunnel_t* t)
 {
-  uint16_t attribute_data;
-  void* attribute;
-  size_t attribute_len;
-
-  attribute_data = htons(SSTP_ENCAPSULATED_PROTOCOL_PPP);
-  attribute_len = sizeof(sstp_attribute_header_t) + sizeof(uint16_t);
-  attribute = create_attribute(SSTP_ATTRIB_ENCAPSULATED_PROTOCOL_ID,
-			       (void*)&attribute_data, sizeof(uint16_t));
+  if (t->ctx)
+    sstp_tunnel_release(t);
 
-  send_sstp_control_packet(SSTP_MSG_CALL_CONNECT_REQUEST, attribute,
-			   1, attribute_len);
+  /* pppd frames are only drained, see sstp_park_event() */
+  if (t->ppp)
+    ppp_reset(t->ppp);
 
-  xfree(attribute);
+  if (t->ppp && !t->park)
+    t->park = (unsigned char*) xmalloc(SSTP_PARK_SIZE);
 
-  alarm(ctx->negociation_timer.tv_sec);
-  ctx->flags |= NEGOCIATION_TIMER_RAISED;
+  if (t->ppp_fd < 0 || t->pty_handler.data == t)
+    return;
 
-  set_client_status(CLIENT_CONNECT_REQUEST_SENT);
+  t->pty_handler.fd = t->ppp_fd;
+  t->pty_handler.cb = sstp_park_event;
 
+  if (event_set_nonblock(t->ppp_fd) < 0)
+    xlog(LOG_ERROR, "sstp_tunnel_suspend: %s\n", strerror(errno));
+  else
+    sstp_event_add(t, &t->pty_handler, EPOLLIN|EPOLLET);
 }
 
 
 /**
- * Print attribute information.
+ * New SSTP session carries the PPP side again: frames parked meanwhile are
+ * sent, in order. Called once PPP is up: on SSTP_MSG_CALL_CONNECTED with
+ * pppd, on IPCP up in native mode.
  *
- * @param data
- * @param attr_len
+ * @param t : tunnel
  */
-int attribute_status_info(void* data, uint16_t attr_len)
+void sstp_tunnel_resume(sstp_tunnel_t* t)
 {
-  sstp_attribute_status_info_t* info;
-  uint8_t attribute_id;
-  uint32_t status;
-  int rbytes;
+  size_t headroom, off, n;
+  uint16_t len;
+  int was_empty;
 
-  info = (sstp_attribute_status_info_t*) data;
-  attribute_id = info->attrib_id;
-  status = ntohl(info->status);
+  if (!t->reconnecting)
+    return;
 
-  /* check attribute */
-  if (attribute_id > ATTRIB_STATUS_STATUS_INFO_NOT_SUPPORTED_IN_MSG)
-    {
-      xlog(LOG_ERROR, "Attribute id is not valid.\n");
-      return -1;
-    }
+  xlog(LOG_INFO, "%s: link resumed after %u attempt(s), %u parked frames sent, %u dropped\n",
+       t->name, t->reconnects, t->park_frames, t->park_dropped);
 
-  if (cfg->verbose > 2)
+  t->reconnecting = FALSE;
+  t->reconnects = 0;
+
+  was_empty = (t->sess->tx_len == 0);
+  headroom = SSTP_HEADROOM + (t->ppp ? PPP_HEADROOM : 0);
+
+  for (off = 0; off < t->park_len; off += sizeof(uint16_t) + len)
     {
-      /* show attribute */
-      xlog(LOG_DEBUG, "\t\t--> attr_ref\t%s (%#.2x)\n", attr_types_str[attribute_id], attribute_id);
-      xlog(LOG_DEBUG, "\t\t--> status\t%s (%#.2x)\n", attrib_status_str[status], status);
-    }
+      memcpy(&len, t->park + off, sizeof(uint16_t));
 
-  if (ctx->state != CLIENT_CONNECT_REQUEST_SENT)
-    return 0;
+      if (t->sess->tx_len + headroom + PPP_MAX_MRU > SSTP_TX_BUFFER_SIZE)
+	sstp_tx_flush(t);
 
-  /* attrib_value is at most 64 bytes (ie full attr len <= 64 + 12 bytes) */
-  rbytes = sizeof(sstp_attribute_header_t) + 2*sizeof(uint32_t);
+      memcpy(t->sess->tx + t->sess->tx_len + headroom, t->park + off + sizeof(uint16_t), len);
 
-  while (rbytes < (64+12) && rbytes < attr_len)
-    {
-      uint32_t attrib_value;
-      attrib_value = ntohl(*((uint32_t*)data + rbytes));
-      if (cfg->verbose > 2)
-	xlog(LOG_DEBUG, "\t\t--> attribute value: %#.4x\n", attrib_value);
-      rbytes += sizeof(uint32_t);
+      n = len;
+      if (t->ppp)
+	n = ppp_encapsulate(t->ppp, t->sess->tx + t->sess->tx_len + headroom, len);
+
+      if (n)
+	sstp_tx_queue(t, n);
     }
 
-  return 0;
+  t->park_len = 0;
+  t->park_frames = t->park_dropped = 0;
+
+  sstp_tx_schedule(t, was_empty);
 }
 
 
 /**
- * The main loop will be called right after the end of HTTPS negociation and
- * - allocates SSTP client context regions
- * - start an SSTP negociation
- * - handle receive packets
- * - send packets
+ * Stamps a connection milestone. TUNNEL_PHASE_OPEN starts over, the first
+ * data packet is only stamped once: it is the one reporting every phase.
+ *
+ * @param t : tunnel
+ * @param phase : TUNNEL_PHASE_* milestone
  */
-void sstp_loop(pid_t pppd_pid)
+void tunnel_phase(sstp_tunnel_t* t, int phase)
 {
-  fd_set rcv_fd;
-  int retcode;
-  uint16_t msg_type = 0;
+  char buf[1024];
 
-  gettimeofday(&sess->tv_start, NULL);
+  if (phase == TUNNEL_PHASE_DATA && t->phases[phase].tv_sec)
+    return;
 
-  ctx = (sstp_context_t*) xmalloc(sizeof(sstp_context_t));
-  ctx->retry                       = SSTP_MAX_INIT_RETRY;
-  ctx->state                       = CLIENT_CALL_DISCONNECTED;
-  ctx->negociation_timer.tv_sec    = SSTP_NEGOCIATION_TIMER;
-  ctx->hello_timer.tv_sec          = SSTP_NEGOCIATION_TIMER;
-  ctx->pppd_pid                    = pppd_pid;
+  tunnel_stats_begin(t);
+  if (phase == TUNNEL_PHASE_OPEN)
+    memset(t->phases, 0, sizeof(t->phases));
+  clock_gettime(CLOCK_MONOTONIC, &t->phases[phase]);
+  tunnel_stats_end(t);
 
-  chap_ctx = (chap_context_t*) xmalloc(sizeof(chap_context_t));
+  if (phase == TUNNEL_PHASE_DATA && tunnel_phases_json(t, buf, sizeof(buf)) > 0)
+    xlog(LOG_INFO, "%s\n", buf);
+}
 
 
-  /* start negociation */
-  sstp_init();
+/**
+ * Appends a JSON string: quotes, backslashes and control characters are
+ * escaped.
+ *
+ * @param buf : destination buffer
+ * @param len : `buf` length
+ * @param n : formatted length so far, updated
+ * @param str : string
+ * @return 0 if all good, -1 if `buf` is too small
+ */
+static int json_string(char* buf, size_t len, size_t* n, const char* str)
+{
+  const unsigned char* c;
+  int rbytes;
 
+  if (*n + 1 >= len)
+    return -1;
+  buf[(*n)++] = '"';
 
-  while(ctx->state != CLIENT_CALL_DISCONNECTED)
+  for (c = (const unsigned char*) str; *c; c++)
     {
-      FD_ZERO(&rcv_fd);
-
-      if (ctx->pppd_pid > 0)
-	FD_SET(0, &rcv_fd);
+      if (*c == '"' || *c == '\\')
+	rbytes = snprintf(buf + *n, len - *n, "\\%c", *c);
+      else if (*c < 0x20 || *c == 0x7f)
+	rbytes = snprintf(buf + *n, len - *n, "\\u%04x", *c);
+      else
+	rbytes = snprintf(buf + *n, len - *n, "%c", *c);
+
+      if (rbytes < 0 || (size_t) rbytes >= len - *n)
+	return -1;
+      *n += rbytes;
+    }
 
-      FD_SET(sockfd, &rcv_fd);
+  if (*n + 1 >= len)
+    return -1;
+  buf[(*n)++] = '"';
+  buf[*n] = '\0';
 
-      retcode = select(sockfd + 1, &rcv_fd, NULL, NULL, NULL);
-      if ( retcode < 0 )
-	{
-	  xlog(LOG_ERROR, "sstp_loop: %s\n", strerror(errno));
-	  set_client_status(CLIENT_CALL_DISCONNECTED);
-	  break;
-	}
+  return 0;
+}
 
-      if (ctx->pppd_pid > 0 && FD_ISSET(0, &rcv_fd))
-	{
-	  unsigned char rbuffer[PPP_MAX_MRU];
-	  ssize_t rbytes = -1;
-	  memset(rbuffer, 0 , PPP_MAX_MRU);
 
-	  rbytes = read(0, rbuffer, PPP_MAX_MRU);
-	  if (rbytes > 0)
-	    send_sstp_data_packet(rbuffer, rbytes);
-	}
+/**
+ * Formats connection milestones as one JSON object, each phase in ms from
+ * tunnel_open(), null if not reached, followed by echo RTT and jitter:
+ * {"tunnel":"sstp0","server":"vpn","dns_ms":0.8,"tcp_ms":1.2,...}
+ * May be called from another thread than tunnel's one: a consistent copy
+ * is taken first, see tunnel_stats_begin().
+ *
+ * @param t : tunnel
+ * @param buf : destination buffer
+ * @param len : `buf` length
+ * @return formatted length, -1 if `buf` is too small
+ */
+int tunnel_phases_json(sstp_tunnel_t* t, char* buf, size_t len)
+{
+  static const char* names[TUNNEL_PHASE_MAX] =
+    {
+      NULL, "dns", "tcp", "proxy", "tls", "http",
+      "connect_ack", "chap", "connected", "data",
+    };
+  struct timespec phases[TUNNEL_PHASE_MAX];
+  struct timespec* open = &phases[TUNNEL_PHASE_OPEN];
+  struct timespec* ts;
+  const char* server;
+  long rtt, rtt_var;
+  unsigned int seq;
+  size_t n;
+  int i, rbytes;
+
+  do
+    {
+      while ((seq = *(volatile unsigned int*) &t->stats_seq) & 1)
+	sched_yield();
+      __sync_synchronize();
 
-      if (FD_ISSET(sockfd, &rcv_fd))
-	{
-	  unsigned char rbuffer[PPP_MAX_MRU];
-	  ssize_t rbytes;
-	  memset(rbuffer, 0 , PPP_MAX_MRU);
+      memcpy(phases, t->phases, sizeof(phases));
+      rtt = t->rtt;
+      rtt_var = t->rtt_var;
+      server = t->cfg->server;
 
-	  rbytes = sstp_read(rbuffer, PPP_MAX_MRU);
-	  if (rbytes < 0)
-	      retcode = rbytes;
+      __sync_synchronize();
+    }
+  while (seq != *(volatile unsigned int*) &t->stats_seq);
 
-	  else if (rbytes == 0)
-	    {
-	      if (cfg->verbose)
-		xlog(LOG_INFO, "sstp_loop: EOF\n");
-	    }
+  rbytes = snprintf(buf, len, "{\"tunnel\":");
+  if (rbytes < 0 || (size_t) rbytes >= len)
+    return -1;
+  n = rbytes;
 
-	  else
-	    {
-	      if (cfg->verbose)
-		xlog(LOG_INFO,"<--  %lu bytes\n", rbytes);
+  if (json_string(buf, len, &n, t->name) < 0)
+    return -1;
 
-	      sess->rx_bytes += rbytes;
-	      retcode = sstp_decode(rbuffer, rbytes);
-	    }
+  rbytes = snprintf(buf + n, len - n, ",\"server\":");
+  if (rbytes < 0 || (size_t) rbytes >= len - n)
+    return -1;
+  n += rbytes;
 
-	  if (retcode < 0)
-	    break;
-	}
-    }
+  /* names of the pool stay allocated, only the pointer needs a snapshot */
+  if (json_string(buf, len, &n, server) < 0)
+    return -1;
 
-  if (ctx->pppd_pid > 0)
+  for (i=TUNNEL_PHASE_DNS; i<TUNNEL_PHASE_MAX; i++)
     {
-      if (cfg->verbose)
-	xlog(LOG_INFO, "Waiting for %s process (PID:%d) to end\n",
-	     cfg->pppd_path, ctx->pppd_pid);
-
-      kill(ctx->pppd_pid, SIGINT);
-      waitpid(ctx->pppd_pid, &retcode, 0);
-
-      if (retcode)
-	xlog(LOG_ERROR, "Failed to quit pppd, retcode %d\n", retcode);
+      ts = &phases[i];
+      if (ts->tv_sec && open->tv_sec)
+	rbytes = snprintf(buf + n, len - n, ",\"%s_ms\":%.3f", names[i],
+			  (ts->tv_sec - open->tv_sec) * 1e3 + (ts->tv_nsec - open->tv_nsec) / 1e6);
+      else
+	rbytes = snprintf(buf + n, len - n, ",\"%s_ms\":null", names[i]);
+
+      if (rbytes < 0 || (size_t) rbytes >= len - n)
+	return -1;
+      n += rbytes;
     }
 
-  msg_type = ctx->flags & REMOTE_DISCONNECTION ? SSTP_MSG_CALL_DISCONNECT_ACK : SSTP_MSG_CALL_DISCONNECT;
-
-  if (cfg->verbose)
-    xlog(LOG_INFO, "Sending %s message.\n", control_messages_types_str[msg_type]);
-  send_sstp_control_packet(msg_type, NULL, 0, 0);
-
-  gettimeofday(&sess->tv_end, NULL);
-
-  if (cfg->verbose)
-    {
-      unsigned int session_time = sess->tv_end.tv_sec - sess->tv_start.tv_sec;
+  /* echo keepalive, see sstp_keepalive_response() */
+  if (rtt)
+    rbytes = snprintf(buf + n, len - n, ",\"rtt_ms\":%.3f,\"jitter_ms\":%.3f",
+		      rtt / 1e3, rtt_var / 1e3);
+  else
+    rbytes = snprintf(buf + n, len - n, ",\"rtt_ms\":null,\"jitter_ms\":null");
+  if (rbytes < 0 || (size_t) rbytes >= len - n)
+    return -1;
+  n += rbytes;
 
-      xlog(LOG_INFO, "SSTP session duration: %lu sec\n", session_time);
-      xlog(LOG_INFO, "Sent %lu bytes (avg: %.2f B/s), received %lu bytes (avg: %.2f B/s)\n",
-	   sess->rx_bytes,
-	   (float)(sess->rx_bytes/session_time),
-	   sess->tx_bytes,
-	   (float)(sess->tx_bytes/session_time)
-	   );
-    }
+  if (n + 2 > len)
+    return -1;
+  buf[n++] = '}';
+  buf[n] = '\0';
 
-  xfree(chap_ctx);
-  xfree(sess);
-  xfree(ctx);
+  return n;
 }
 
 
 /**
- * This function is called by crypto_set_binding() and computes server certificate
- * hash. Since certificate is provided as PEM format, it is first exported to DER
- * binary format, hashed with context-defined algorithm, and stored inside client
- * SSTP context.
+ * Called once TLS session is checked: exports server certificate to DER
+ * binary format, and computes both of its hashes, so that crypto binding
+ * does not have to. With PolarSSL, certificate is read from CA file (PEM
+ * format).
  *
+ * @param t : tunnel
  * @return 0 if all good, negative value otherwise
  */
-int crypto_set_certhash()
+int crypto_load_certificate(sstp_tunnel_t* t)
 {
-  int val,i;
-  unsigned char dst[32] = {0, };
-  unsigned char* (*HASH)();
+  int val;
 
+  if (t->cert_der)
+    xfree(t->cert_der);
+  t->cert_der = NULL;
+  t->cert_der_len = 0;
 
-  /* export certificate to DER format */
 #ifdef HAS_GNUTLS
-  unsigned char buffer[8192] = {0, };
-  size_t buffer_len = sizeof(buffer);
+  gnutls_datum_t der;
 
-  val = gnutls_x509_crt_export (certificate, GNUTLS_X509_FMT_DER, buffer, &buffer_len);
+  val = gnutls_x509_crt_export2 (t->certificate, GNUTLS_X509_FMT_DER, &der);
   if (val != GNUTLS_E_SUCCESS)
     {
-      xlog(LOG_ERROR, "crypto_set_certhash: fail to export certificate\n");
-      if (val == GNUTLS_E_SHORT_MEMORY_BUFFER)
-	xlog(LOG_ERROR, "Missing memory (expected %d)\n", buffer_len);
+      xlog(LOG_ERROR, "crypto_load_certificate: fail to export certificate: %s\n",
+	   gnutls_strerror(val));
       return -1;
     }
+
+  t->cert_der = (unsigned char*) xmalloc(der.size);
+  t->cert_der_len = der.size;
+  memcpy(t->cert_der, der.data, der.size);
+  gnutls_free(der.data);
 #else
   unsigned char *ibuf;
 
   unsigned char obuf[8192] = {0, };
   size_t ibuflen, obuflen;
 
-  if(cfg->verbose > 1)
-          xlog(LOG_DEBUG, "[polarssl] converting '%s' PEM -> DER format\n", cfg->ca_file);
+  if(t->cfg->verbose > 1)
+          xlog(LOG_DEBUG, "[polarssl] converting '%s' PEM -> DER format\n", t->cfg->ca_file);
 
-  if (load_file(cfg->ca_file, (unsigned char **)&ibuf, &ibuflen) < 0)
+  if (load_file(t->cfg->ca_file, (unsigned char **)&ibuf, &ibuflen) < 0)
   {
-          xlog(LOG_ERROR, "Failed to load '%s': %d - %s\n", cfg->ca_file, errno, strerror(errno));
+          xlog(LOG_ERROR, "Failed to load '%s': %d - %s\n", t->cfg->ca_file, errno, strerror(errno));
           return -1;
   }
 
-  if (convert_pem_to_der(ibuf, ibuflen, obuf, &obuflen) < 0)
+  val = convert_pem_to_der(ibuf, ibuflen, obuf, &obuflen);
+  xfree(ibuf);
+
+  if (val < 0)
   {
-          xlog(LOG_ERROR, "Failed to convert '%s' to DER\n", cfg->ca_file);
-          xfree(ibuf);
+          xlog(LOG_ERROR, "Failed to convert '%s' to DER\n", t->cfg->ca_file);
           return -1;
   }
 
-  xfree(ibuf);
-
-  if(cfg->verbose > 2)
-          xlog(LOG_DEBUG, "Converted '%s' PEM=%d bytes -> DER=%d bytes\n", cfg->ca_file, ibuflen, obuflen);
+  if(t->cfg->verbose > 2)
+          xlog(LOG_DEBUG, "Converted '%s' PEM=%d bytes -> DER=%d bytes\n", t->cfg->ca_file, ibuflen, obuflen);
 
+  t->cert_der = (unsigned char*) xmalloc(obuflen);
+  t->cert_der_len = obuflen;
+  memcpy(t->cert_der, obuf, obuflen);
 #endif
 
-  /* select hash algorithm */
-  if (ctx->hash_algorithm == CERT_HASH_PROTOCOL_SHA256)
-    {
-      val = SHA256_HASH_LEN;
-      HASH = &SHA256;
-    }
-  else
+  SHA1(t->cert_der, t->cert_der_len, t->cert_sha1);
+  SHA256(t->cert_der, t->cert_der_len, t->cert_sha256);
+
+  return 0;
+}
+
+
+/**
+ * This function is called by crypto_set_binding() and copies server certificate
+ * hash computed by crypto_load_certificate(), with context-defined algorithm,
+ * into client SSTP context.
+ *
+ * @return 0 if all good, negative value otherwise
+ */
+int crypto_set_certhash(sstp_tunnel_t* t)
+{
+  if (!t->cert_der)
     {
-      val = SHA1_HASH_LEN;
-      HASH = &SHA1;
+      xlog(LOG_ERROR, "crypto_set_certhash: no server certificate\n");
+      return -1;
     }
 
-  /* compute hash  */
-#ifdef HAS_GNUTLS
-  HASH(buffer, buffer_len, dst);
-#else
-  HASH(obuf, obuflen, dst);
-#endif
+  /* SHA1 hash is zero-padded */
+  memset(t->ctx->certhash, 0, sizeof(t->ctx->certhash));
 
-  /* move hash to client context variable */
-  for(i=0; i<8; i++) ctx->certhash[i] = *(uint32_t*)(dst+(i*4));
+  if (t->ctx->hash_algorithm == CERT_HASH_PROTOCOL_SHA256)
+    memcpy(t->ctx->certhash, t->cert_sha256, SHA256_HASH_LEN);
+  else
+    memcpy(t->ctx->certhash, t->cert_sha1, SHA1_HASH_LEN);
 
   return 0;
 }
@@ -804,26 +2611,25 @@ int crypto_set_certhash()
  * @param data : pointer to crypto binding request packet
  * @return 0 if all good, negative value otherwise
  */
-int crypto_set_binding(void* data)
+int crypto_set_binding(sstp_tunnel_t* t, void* data)
 {
   sstp_attribute_crypto_bind_req_t* req;
 
   /* Validating client state */
-  if (ctx->state != CLIENT_CONNECT_REQUEST_SENT)
+  if (t->ctx->state != CLIENT_CONNECT_REQUEST_SENT)
     {
       xlog(LOG_ERROR, "Incorrect message for this state\n");
-      if (cfg->verbose)
+      if (t->cfg->verbose)
 	{
 	  xlog(LOG_ERROR, "Current state: %#x. Expected %#x\n",
-	       ctx->state, CLIENT_CONNECT_REQUEST_SENT);
+	       t->ctx->state, CLIENT_CONNECT_REQUEST_SENT);
 	}
 
       return -1;
     }
 
   /* Disable negociation timer */
-  alarm(0);
-  ctx->flags &= ~NEGOCIATION_TIMER_RAISED;
+  sstp_timer_arm(t, &t->negociation_timer, 0);
 
   /* Setting crypto properties */
   req = (sstp_attribute_crypto_bind_req_t*) data;
@@ -832,11 +2638,11 @@ int crypto_set_binding(void* data)
   switch(req->hash_bitmask)
     {
     case CERT_HASH_PROTOCOL_SHA256:
-      ctx->hash_algorithm = CERT_HASH_PROTOCOL_SHA256;
+      t->ctx->hash_algorithm = CERT_HASH_PROTOCOL_SHA256;
       break;
 
     case CERT_HASH_PROTOCOL_SHA1:
-      ctx->hash_algorithm = CERT_HASH_PROTOCOL_SHA1;
+      t->ctx->hash_algorithm = CERT_HASH_PROTOCOL_SHA1;
       break;
 
     default:
@@ -844,14 +2650,14 @@ int crypto_set_binding(void* data)
       return -1;
     }
 
-  memcpy(ctx->nonce, req->nonce, sizeof(uint32_t) * 8);
+  memcpy(t->ctx->nonce, req->nonce, sizeof(uint32_t) * 8);
 
   /* compute ca file hash with chosen algorithm */
-  if (crypto_set_certhash() < 0)
+  if (crypto_set_certhash(t) < 0)
     return -1;
 
   /* change client state */
-  set_client_status(CLIENT_CONNECT_ACK_RECEIVED);
+  set_client_status(t, CLIENT_CONNECT_ACK_RECEIVED);
 
   return 0;
 }
@@ -863,7 +2669,7 @@ int crypto_set_binding(void* data)
  *
  * @return 0 on SUCCESS, < 0 on ERROR
  */
-int crypto_set_cmac()
+int crypto_set_cmac(sstp_tunnel_t* t)
 {
   uint16_t hash_len;
   unsigned char Call_Connected_buffer[112];
@@ -896,9 +2702,9 @@ int crypto_set_cmac()
   /* Crypto super fun time */
 
   /* Setting HLAK */
-  NtPasswordHash( PasswordHash, (const uint8_t *)cfg->password, strlen(cfg->password) );
+  NtPasswordHash( PasswordHash, (const uint8_t *)t->cfg->password, strlen(t->cfg->password) );
   HashNtPasswordHash( PasswordHashHash, PasswordHash );
-  memcpy( NT_Response, chap_ctx->response_nt_response, 24 );
+  memcpy( NT_Response, t->chap_ctx->response_nt_response, 24 );
   GetMasterKey( Master_Key, PasswordHashHash, NT_Response );
   GetAsymmetricStartKey( Master_Send_Key, Master_Key, 16, TRUE, TRUE );
   GetAsymmetricStartKey( Master_Receive_Key, Master_Key,  16, FALSE, TRUE );
@@ -931,11 +2737,11 @@ int crypto_set_cmac()
    * PRF+ seed value as the input to a PRF+ operation, and MUST generate 32 bytes.
    */
 
-  hash_len = (ctx->hash_algorithm==CERT_HASH_PROTOCOL_SHA1) ? SHA1_HASH_LEN : SHA256_HASH_LEN;
+  hash_len = (t->ctx->hash_algorithm==CERT_HASH_PROTOCOL_SHA1) ? SHA1_HASH_LEN : SHA256_HASH_LEN;
   memcpy(ptr, &hash_len, sizeof(uint16_t)); ptr += sizeof(uint16_t);
   *ptr = 0x01; ptr ++;
 
-  if ( (cmk = sstp_hmac(hlak, msg, 32)) == NULL)
+  if ( (cmk = sstp_hmac(t, hlak, msg, 32)) == NULL)
     return -1;
 
 
@@ -947,22 +2753,25 @@ int crypto_set_cmac()
 
   ptr = Call_Connected_buffer;
   memcpy(ptr, Call_Connected_header, 16); ptr+= 16;
-  memcpy(ptr, ctx->nonce, 32); ptr += 32;
-  memcpy(ptr, ctx->certhash, 32); ptr += 32;
+  memcpy(ptr, t->ctx->nonce, 32); ptr += 32;
+  memcpy(ptr, t->ctx->certhash, 32); ptr += 32;
 
-  if ( !(cmac = sstp_hmac(cmk, Call_Connected_buffer, 112)) )
-    return -1;
+  if ( !(cmac = sstp_hmac(t, cmk, Call_Connected_buffer, 112)) )
+    {
+      pool_put(&t->small_pool, cmk);
+      return -1;
+    }
 
-  memcpy(ctx->cmk, cmk, 32);
-  memcpy(ctx->cmac, cmac, 32);
+  memcpy(t->ctx->cmk, cmk, 32);
+  memcpy(t->ctx->cmac, cmac, 32);
 
-  xfree(cmk);
-  xfree(cmac);
+  pool_put(&t->small_pool, cmk);
+  pool_put(&t->small_pool, cmac);
 
 
   /* Verbose output displays brief crypto information */
   #ifdef DEBUG
-  if (cfg->verbose > 2)
+  if (t->cfg->verbose > 2)
     {
 
       int i=0;
@@ -970,16 +2779,16 @@ int crypto_set_cmac()
 
       /* display hash algorithm */
       xlog(LOG_DEBUG, "[Crypto debug] %-20s\t%s (%#2x)\n",
-	   "Hash algorithm", crypto_req_attrs_str[ctx->hash_algorithm], ctx->hash_algorithm);
+	   "Hash algorithm", crypto_req_attrs_str[t->ctx->hash_algorithm], t->ctx->hash_algorithm);
 
       /* display nonce sent by server for authentication */
       memset(dbg_msg, 0, MAX_LINE_LENGTH);
-      for (i=0; i<8; i++) snprintf(dbg_msg+(i*8), 9, "%8x", ntohl(ctx->nonce[i]));
+      for (i=0; i<8; i++) snprintf(dbg_msg+(i*8), 9, "%8x", ntohl(t->ctx->nonce[i]));
       xlog(LOG_DEBUG, "[Crypto debug] %-20s\t0x%s\n", "Nonce", dbg_msg);
 
       /* display certificate hash */
       memset(dbg_msg, 0, MAX_LINE_LENGTH);
-      for(i=0; i<8; i++) snprintf(dbg_msg+(i*8), 9, "%8x", ntohl(ctx->certhash[i]));
+      for(i=0; i<8; i++) snprintf(dbg_msg+(i*8), 9, "%8x", ntohl(t->ctx->certhash[i]));
       xlog(LOG_DEBUG, "[Crypto debug] %-20s\t0x%s\n", "CA Hash", dbg_msg);
 
       /* display T1 message */
@@ -1024,18 +2833,17 @@ int crypto_set_cmac()
 
       /* display Compound MAC  */
       memset(dbg_msg, 0, MAX_LINE_LENGTH);
-      for(i=0; i<8; i++) snprintf(dbg_msg+(i*8), 9, "%8x", ntohl(ctx->cmac[i]));
+      for(i=0; i<8; i++) snprintf(dbg_msg+(i*8), 9, "%8x", ntohl(t->ctx->cmac[i]));
       xlog(LOG_DEBUG, "[Crypto debug] %-20s\t0x%s\n", "CMac", dbg_msg);
 
       /* display Compound MAC Key used by PPP */
       memset(dbg_msg, 0, MAX_LINE_LENGTH);
-      for(i=0;i<8;i++) snprintf(dbg_msg+(i*8), 9, "%8x", ntohl(ctx->cmk[i]));
+      for(i=0;i<8;i++) snprintf(dbg_msg+(i*8), 9, "%8x", ntohl(t->ctx->cmk[i]));
       xlog(LOG_DEBUG, "[Crypto debug] %-20s\t0x%s\n", "CMK", dbg_msg);
     }
 #endif
   /* disable negociation timer */
-  alarm(0);
-  ctx->flags &= ~NEGOCIATION_TIMER_RAISED;
+  sstp_timer_arm(t, &t->negociation_timer, 0);
 
   return 0;
 }
@@ -1049,7 +2857,7 @@ int crypto_set_cmac()
  * @param bytes_to_read : `data` length
  * @return 0 if all good, negative value otherwise
  */
-static int sstp_decode_attributes(uint16_t attrnum, void* data, size_t bytes_to_read)
+static int sstp_decode_attributes(sstp_tunnel_t* t, uint16_t attrnum, void* data, size_t bytes_to_read)
 {
   void* attr_ptr;
   int retcode;
@@ -1094,7 +2902,7 @@ static int sstp_decode_attributes(uint16_t attrnum, void* data, size_t bytes_to_
       }
 
       /* parsing attribute header */
-      if (cfg->verbose > 2)
+      if (t->cfg->verbose > 2)
 	{
 	  xlog(LOG_DEBUG, "\t\t--> attr_id\t%s (%#.2x)\n",attr_types_str[attribute_id], attribute_id);
 	  xlog(LOG_DEBUG, "\t\t--> len\t\t%d bytes\n", attribute_length);
@@ -1106,11 +2914,11 @@ static int sstp_decode_attributes(uint16_t attrnum, void* data, size_t bytes_to_
 	  break;
 
 	case SSTP_ATTRIB_STATUS_INFO:
-	  retcode = attribute_status_info(attribute_data, attribute_length);
+	  retcode = attribute_status_info(t, attribute_data, attribute_length);
 	  break;
 
 	case SSTP_ATTRIB_CRYPTO_BINDING_REQ:
-	  retcode = crypto_set_binding(attribute_data);
+	  retcode = crypto_set_binding(t, attribute_data);
 	  break;
 
 	  /* case not to be treated on client side, ignoring */
@@ -1142,13 +2950,13 @@ static int sstp_decode_attributes(uint16_t attrnum, void* data, size_t bytes_to_
  * for invalid header since there seems to be a problem with server packet length. In this
  * case, received packet is just dropped.
  */
-int sstp_decode(void* rbuffer, ssize_t sstp_length)
+int sstp_decode(sstp_tunnel_t* t, void* rbuffer, ssize_t sstp_length)
 {
   sstp_header_t* sstp_header;
   int is_control, retcode;
 
   sstp_header = (sstp_header_t*) rbuffer;
-  if (!is_valid_header(sstp_header, sstp_length))
+  if (!is_valid_header(t, sstp_header, sstp_length))
     {
       xlog(LOG_WARNING, "SSTP packet has invalid header. Dropped\n");
       return 0;
@@ -1156,7 +2964,7 @@ int sstp_decode(void* rbuffer, ssize_t sstp_length)
 
   is_control = is_control_packet(sstp_header);
 
-  if (cfg->verbose > 2)
+  if (t->cfg->verbose > 2)
     xlog(LOG_DEBUG, "\t-> %s packet\n", is_control ? "Control" : "Data");
 
   sstp_length -= sizeof(sstp_header_t);
@@ -1195,7 +3003,7 @@ int sstp_decode(void* rbuffer, ssize_t sstp_length)
 
 
       /* parsing control header */
-      if (cfg->verbose > 2)
+      if (t->cfg->verbose > 2)
 	{
 	  xlog(LOG_DEBUG, "\t-> type: %s (%#.2x)\n",
 	       control_messages_types_str[control_type], control_type);
@@ -1206,61 +3014,65 @@ int sstp_decode(void* rbuffer, ssize_t sstp_length)
       switch (control_type)
 	{
 	case SSTP_MSG_CALL_CONNECT_ACK:
-	  retcode = sstp_decode_attributes(control_num_attributes, attribute_ptr, sstp_length);
+	  retcode = sstp_decode_attributes(t, control_num_attributes, attribute_ptr, sstp_length);
 	  if (retcode < 0) return -1;
 
+	  tunnel_phase(t, TUNNEL_PHASE_CONNECT_ACK);
+
+	  /* with no pppd, client starts LCP negociation */
+	  if (t->ppp)
+	    ppp_open(t->ppp);
+
 	  break;
 
 	case SSTP_MSG_CALL_CONNECT_NAK:
-	  if ( ctx->state==CLIENT_CONNECT_REQUEST_SENT ) return -1;
+	  if ( t->ctx->state==CLIENT_CONNECT_REQUEST_SENT ) return -1;
 
-	  retcode = sstp_decode_attributes(control_num_attributes, attribute_ptr, sstp_length);
+	  retcode = sstp_decode_attributes(t, control_num_attributes, attribute_ptr, sstp_length);
 	  if (retcode < 0) return -1;
 
-	  if ( ctx->retry )
+	  if ( t->ctx->retry )
 	    {
-	      if (cfg->verbose)
+	      if (t->cfg->verbose)
 		xlog(LOG_INFO, "Retrying ... (%d/%d)\n",
-		     SSTP_MAX_INIT_RETRY - ctx->retry, SSTP_MAX_INIT_RETRY);
+		     SSTP_MAX_INIT_RETRY - t->ctx->retry, SSTP_MAX_INIT_RETRY);
 
-	      ctx->negociation_timer.tv_sec = SSTP_NEGOCIATION_TIMER;
-	      ctx->retry--;
-	      sstp_init();
+	      t->ctx->retry--;
+	      sstp_init(t);
 	    }
 
 	  break;
 
 	case SSTP_MSG_CALL_ABORT:
-	  retcode = sstp_decode_attributes(control_num_attributes, attribute_ptr, sstp_length);
+	  retcode = sstp_decode_attributes(t, control_num_attributes, attribute_ptr, sstp_length);
 	  if (retcode < 0) return -1;
 
-	  set_client_status(CLIENT_CALL_DISCONNECTED);
+	  set_client_status(t, CLIENT_CALL_DISCONNECTED);
 	  break;
 
 	case SSTP_MSG_CALL_DISCONNECT:
-	  retcode = sstp_decode_attributes(control_num_attributes, attribute_ptr, sstp_length);
+	  retcode = sstp_decode_attributes(t, control_num_attributes, attribute_ptr, sstp_length);
 	  if (retcode < 0) return -1;
 
-	  ctx->flags |= REMOTE_DISCONNECTION;
-	  set_client_status(CLIENT_CALL_DISCONNECTED);
+	  t->ctx->flags |= REMOTE_DISCONNECTION;
+	  set_client_status(t, CLIENT_CALL_DISCONNECTED);
 	  break;
 
 	case SSTP_MSG_ECHO_REQUEST:
-	  if (ctx->state != CLIENT_CALL_CONNECTED) return -1;
-	  send_sstp_control_packet(SSTP_MSG_ECHO_REPONSE, NULL, 0, 0);
+	  if (t->ctx->state != CLIENT_CALL_CONNECTED) return -1;
+	  send_sstp_control_packet(t, SSTP_MSG_ECHO_REPONSE, NULL, 0, 0);
 	  break;
 
 	case SSTP_MSG_ECHO_REPONSE:
-	  if (ctx->state != CLIENT_CALL_CONNECTED) return -1;
-	  alarm(0);
-	  ctx->flags &= ~HELLO_TIMER_RAISED;
+	  if (t->ctx->state != CLIENT_CALL_CONNECTED) return -1;
+	  sstp_keepalive_response(t);
 	  break;
 
 	case SSTP_MSG_CALL_CONNECT_REQUEST:
 	case SSTP_MSG_CALL_DISCONNECT_ACK:
 	default :
 	  xlog(LOG_ERROR, "Client cannot handle type %#x\n", control_type);
-	  set_client_status(CLIENT_CALL_DISCONNECTED);
+	  set_client_status(t, CLIENT_CALL_DISCONNECTED);
 	  return -1;
 	}
 
@@ -1268,7 +3080,13 @@ int sstp_decode(void* rbuffer, ssize_t sstp_length)
   else
     {
       void* data_ptr;
+      size_t offset;
+
       data_ptr = rbuffer + sizeof(sstp_header_t);
+      t->sess->data_packets++;
+
+      if (t->ctx->state == CLIENT_CALL_CONNECTED)
+	tunnel_phase(t, TUNNEL_PHASE_DATA);
 
       /*
        * On intercepting a PPP success message, sstoper will also send
@@ -1277,59 +3095,83 @@ int sstp_decode(void* rbuffer, ssize_t sstp_length)
        * See also : http://tools.ietf.org/search/rfc2759#section-4
        */
 
-      if ( ntohs(*((uint16_t*)data_ptr)) == 0xc223 )
+      if ( ppp_frame_protocol(data_ptr, sstp_length, &offset) == PPP_CHAP &&
+	   (size_t) sstp_length > offset )
 	{
-	  uint8_t chap_handshake_code = *(uint8_t*)(data_ptr + 2);
+	  uint8_t chap_handshake_code = *(uint8_t*)(data_ptr + offset);
 
 	  /* if Success on PPP-CHAP */
-	  if (chap_handshake_code == 0x03 )
+	  if (chap_handshake_code == PPP_CHAP_SUCCESS )
 	    {
 	      size_t attribute_len;
 	      void* attribute;
 	      sstp_attribute_crypto_bind_t crypto_settings;
+	      struct timespec* ts;
+
+	      tunnel_phase(t, TUNNEL_PHASE_CHAP);
 
 	      /* compute cmac */
-	      if (crypto_set_cmac() < 0)
+	      if (crypto_set_cmac(t) < 0)
 		return -1;
 
 	      memset(&crypto_settings, 0, sizeof(sstp_attribute_crypto_bind_t));
 
 	      /* send SSTP_MSG_CALL_CONNECTED */
 	      attribute_len = sizeof(sstp_attribute_header_t) + sizeof(sstp_attribute_crypto_bind_t);
-	      crypto_settings.hash_bitmask = ctx->hash_algorithm;
-	      memcpy(crypto_settings.nonce, ctx->nonce, sizeof(uint32_t)*8);
-	      memcpy(crypto_settings.certhash, ctx->certhash, sizeof(uint32_t)*8);
-	      memcpy(crypto_settings.cmac, ctx->cmac, sizeof(uint32_t)*8);
+	      crypto_settings.hash_bitmask = t->ctx->hash_algorithm;
+	      memcpy(crypto_settings.nonce, t->ctx->nonce, sizeof(uint32_t)*8);
+	      memcpy(crypto_settings.certhash, t->ctx->certhash, sizeof(uint32_t)*8);
+	      memcpy(crypto_settings.cmac, t->ctx->cmac, sizeof(uint32_t)*8);
 
-	      attribute = create_attribute(SSTP_ATTRIB_CRYPTO_BINDING, &crypto_settings,
+	      attribute = create_attribute(t, SSTP_ATTRIB_CRYPTO_BINDING, &crypto_settings,
 					   sizeof(sstp_attribute_crypto_bind_t));
 
-	      send_sstp_control_packet(SSTP_MSG_CALL_CONNECTED, attribute, 1, attribute_len);
+	      send_sstp_control_packet(t, SSTP_MSG_CALL_CONNECTED, attribute, 1, attribute_len);
+
+	      pool_put(&t->small_pool, attribute);
+
+	      set_client_status(t, CLIENT_CALL_CONNECTED);
 
-	      xfree(attribute);
+	      tunnel_phase(t, TUNNEL_PHASE_CONNECTED);
+	      ts = t->phases;
+	      t->link_time = (ts[TUNNEL_PHASE_CONNECTED].tv_sec - ts[TUNNEL_PHASE_OPEN].tv_sec) * 1000 +
+		(ts[TUNNEL_PHASE_CONNECTED].tv_nsec - ts[TUNNEL_PHASE_OPEN].tv_nsec) / 1000000;
 
-	      /* and set hello timer */
-	      ctx->flags |= HELLO_TIMER_RAISED;
-	      set_client_status(CLIENT_CALL_CONNECTED);
-	      alarm(ctx->hello_timer.tv_sec);
+	      xlog(LOG_INFO, "SSTP link established in %ld ms\n", t->link_time);
 
-	      xlog(LOG_INFO, "SSTP link established\n");
+	      /* first echo request measures RTT at once */
+	      sstp_keepalive_start(t);
 
-	      /* send an sstp ping, response will stop the alarm */
-	      send_sstp_control_packet(SSTP_MSG_ECHO_REQUEST, NULL, 0, 0);
+	      /* with pppd, PPP is up again along with SSTP link */
+	      if (!t->ppp)
+		sstp_tunnel_resume(t);
 	    }
 
-	  else if (chap_handshake_code == 0x04 )
+	  else if (chap_handshake_code == PPP_CHAP_FAILURE )
 	    {
 	      xlog(LOG_ERROR, "PPP Authentication failure\n");
 	    }
 
 	}
 
-      retcode = write(1, data_ptr, sstp_length);
+      if (t->ppp)
+	return ppp_input(t->ppp, data_ptr, sstp_length);
+
+      if (t->uring)
+	return sstp_uring_ppp_write(t, data_ptr, sstp_length);
+
+      retcode = write(t->ppp_fd, data_ptr, sstp_length);
       if (retcode < 0)
 	{
-	  xlog(LOG_ERROR, "write: %s\n", strerror(retcode));
+	  /* pty is full, drop frame as a congested link would do */
+	  if (errno == EAGAIN)
+	    {
+	      if (t->cfg->verbose > 2)
+		xlog(LOG_DEBUG, "pty is full, %lu bytes dropped\n", sstp_length);
+	      return 0;
+	    }
+
+	  xlog(LOG_ERROR, "write: %s\n", strerror(errno));
 	  return -1;
 	}
     }
@@ -1347,19 +3189,21 @@ int sstp_decode(void* rbuffer, ssize_t sstp_length)
  *
  * Prepare pppd options and execute pppd daemon in a fork child. For an obscure
  * reason, probably voodoo, EAP fails while negociation so it has been explicitly
- * deactivated.
+ * deactivated. pppd runs on the slave side of a new pty, whose master side is
+ * stored as tunnel PPP fd.
  *
+ * @param t : tunnel
  * @return child pid if process is the father or error otherwise (execv pppd)
  */
-int sstp_fork()
+int sstp_fork(sstp_tunnel_t* t)
 {
   pid_t ppp_pid;
-  int retcode, amaster, aslave, i;
+  int retcode, amaster, aslave, i, ready[2];
   struct termios pty;
   char *pppd_path;
   char *pppd_args[32];
 
-  pppd_path = cfg->pppd_path;
+  pppd_path = t->cfg->pppd_path;
   i = 0;
 
   pppd_args[i++] = "pppd";
@@ -1374,23 +3218,23 @@ int sstp_fork()
   pppd_args[i++] = "1412";
   */
   pppd_args[i++] = "user";
-  pppd_args[i++] = cfg->username;
+  pppd_args[i++] = t->cfg->username;
   pppd_args[i++] = "password";
-  pppd_args[i++] = cfg->password;
+  pppd_args[i++] = t->cfg->password;
 
 
-  if (cfg->logfile != NULL)
+  if (t->cfg->logfile != NULL)
     {
       pppd_args[i++] = "logfile";
-      pppd_args[i++] = cfg->logfile;
+      pppd_args[i++] = t->cfg->logfile;
       pppd_args[i++] = "debug";
       pppd_args[i++] = "dump";
     }
 
-  if (cfg->domain != NULL)
+  if (t->cfg->domain != NULL)
     {
       pppd_args[i++] = "domain";
-      pppd_args[i++] = cfg->domain;
+      pppd_args[i++] = t->cfg->domain;
     }
 
   pppd_args[i++] = NULL;
@@ -1407,18 +3251,27 @@ int sstp_fork()
       return -1;
     }
 
+  /* closed by a successful execv(), see pppd_wait_ready() */
+  if (pipe2(ready, O_CLOEXEC) < 0)
+    {
+      xlog (LOG_ERROR, "pipe2 failed: %s", strerror(errno));
+      close(amaster);
+      close(aslave);
+      return -1;
+    }
+
   ppp_pid = fork();
 
 
   if (ppp_pid > 0)
     {
+      /* other tunnels' pppd must not inherit it */
+      fcntl(amaster, F_SETFD, FD_CLOEXEC);
+      close(aslave);
+      close(ready[1]);
 
-      dup2(amaster, 0);
-      dup2(amaster, 1);
-
-      if (aslave > 2) close(aslave);
-      if (amaster > 2) close(amaster);
-
+      t->ppp_fd = amaster;
+      t->pppd_ready_fd = ready[0];
       return ppp_pid;
     }
 
@@ -1432,7 +3285,7 @@ int sstp_fork()
       sigemptyset(&newmask);
       sigaddset(&newmask, SIGUSR1);
 
-      if (cfg->verbose > 1)
+      if (t->cfg->verbose > 1)
 	xlog(LOG_DEBUG, "[%d] Waiting for SIGUSR1\n", getpid());
 
       if (sigprocmask(SIG_BLOCK, &newmask, &oldmask) < 0)
@@ -1448,18 +3301,19 @@ int sstp_fork()
 	  if (errno == EFAULT)
 	    {
 	      xlog(LOG_ERROR, "sstp_fork : sigsuspend failed\n");
-	      if (cfg->verbose)
+	      if (t->cfg->verbose)
 		{
 		  xlog(LOG_DEBUG, strerror(errno));
 		}
- 	      close(sockfd);
+ 	      close(t->sockfd);
 	      return -1;
 	    };
 	}
 
       /* do_loop = FALSE; */
 
-      if (sigprocmask(SIG_SETMASK, &oldmask, NULL) < 0)
+      /* parent may have blocked signals it reads from a signalfd */
+      if (sigprocmask(SIG_SETMASK, &zeromask, NULL) < 0)
 	{
 	  xlog(LOG_ERROR, "Fail to reset SIGMASK\n");
 	  return -1;
@@ -1467,13 +3321,14 @@ int sstp_fork()
 
 
       /* close fds */
-      close(sockfd);
+      close(t->sockfd);
+      close(amaster);
+      close(ready[0]);
 
       dup2(aslave, 0);
       dup2(aslave, 1);
 
       if (aslave > 2) close (aslave);
-      if (amaster > 2) close (amaster);
 
       if (getuid()!=0)
 	{
@@ -1484,12 +3339,12 @@ int sstp_fork()
 	    }
 
 	  /* raise power */
-	  if (cfg->verbose > 1)
+	  if (t->cfg->verbose > 1)
 	    xlog(LOG_DEBUG, "[%d] Promoted to UID %d\n", getpid(), getuid());
 	}
 
       /* spawn pppd */
-      if (cfg->verbose > 1)
+      if (t->cfg->verbose > 1)
 	{
 	  int i = 0, max_len = MAX_LINE_LENGTH;
 	  char cmdline[max_len], *ptr=NULL;
@@ -1512,8 +3367,11 @@ int sstp_fork()
       /* yield to pppd */
       if (execv (pppd_path, pppd_args) == -1)
 	{
-	  xlog (LOG_ERROR, "sstp_fork: execv: %s\n", strerror(errno));
-	  return -1;
+	  retcode = errno;
+	  xlog (LOG_ERROR, "sstp_fork: execv: %s\n", strerror(retcode));
+	  if (write(ready[1], &retcode, sizeof(int)) != sizeof(int))
+	    xlog (LOG_ERROR, "sstp_fork: %s\n", strerror(errno));
+	  _exit(EXIT_FAILURE);
 	}
 
     }
@@ -1521,9 +3379,9 @@ int sstp_fork()
   else
     {
       xlog (LOG_ERROR, "sstp_fork: you should never be here\n");
-      if (cfg->verbose > 1)
+      if (t->cfg->verbose > 1)
 	xlog(LOG_ERROR,"FATAL: %s\n", strerror(errno));
-      set_client_status(CLIENT_CALL_DISCONNECTED);
+      set_client_status(t, CLIENT_CALL_DISCONNECTED);
 
       return -1;
     }
@@ -1534,21 +3392,23 @@ int sstp_fork()
 
 /**
  * HMAC function wrapper, this function calculates HMAC value of a n-length message
- * with the key `key`. Created HMAC buffered has to be freed later.
+ * with the key `key`. HMAC buffer is taken from tunnel small buffer pool, and
+ * has to be given back with pool_put().
  *
+ * @param t : tunnel
  * @param key is the HMAC key
  * @param d is the message to be hashed
  * @param n is `d` string length
  * @return a pointer to HMAC result buffer.
  */
-uint8_t* sstp_hmac(unsigned char* key, unsigned char* d, uint16_t n)
+uint8_t* sstp_hmac(sstp_tunnel_t* t, unsigned char* key, unsigned char* d, uint16_t n)
 {
   uint8_t *md = NULL;
   unsigned int mdlen;
   const EVP_MD* (*hmac)();
   unsigned int hash_len;
 
-  switch (ctx->hash_algorithm)
+  switch (t->ctx->hash_algorithm)
     {
     case CERT_HASH_PROTOCOL_SHA1:
       hmac = &EVP_sha1;
@@ -1562,20 +3422,21 @@ uint8_t* sstp_hmac(unsigned char* key, unsigned char* d, uint16_t n)
       break;
     }
 
-  md = (uint8_t*) xmalloc(32);
+  md = (uint8_t*) pool_get(&t->small_pool);
+  memset(md, 0, 32);
 
   if (HMAC(hmac(), key, 32, d, n, md, &mdlen) == NULL)
     {
       xlog(LOG_ERROR, "Failed to compute HMAC\n");
-      xfree(md);
+      pool_put(&t->small_pool, md);
       return NULL;
     }
 
   if (mdlen != hash_len)
     {
       xlog(LOG_ERROR, "%s function didn't return valid data!\n",
-	   crypto_req_attrs_str[ctx->hash_algorithm]);
-      xfree(md);
+	   crypto_req_attrs_str[t->ctx->hash_algorithm]);
+      pool_put(&t->small_pool, md);
       return NULL;
     }
 
@@ -45,8 +45,14 @@
 #define SSTP_MIN_LEN 4
 #define SSTP_MAX_ATTR 256
 #define SSTP_NEGOCIATION_TIMER 60
-#define SSTP_PING_TIMER 30
+#define SSTP_PING_TIMER 30		/* s, echo interval of an idle healthy link */
+#define SSTP_PING_TIMER_MIN 5		/* s, after connection or a lost echo */
+#define SSTP_ECHO_TIMEOUT_MIN 1000	/* ms, see sstp_echo_timeout() */
+#define SSTP_ECHO_TIMEOUT_MAX 10000	/* ms */
+#define SSTP_ECHO_MAX_LOST 3
+#define SSTP_PARK_SIZE 65536		/* PPP side bytes kept while reconnecting */
 #define SSTP_MAX_INIT_RETRY 5
+#define PPPD_READY_TIMEOUT 5000	/* ms, see sstp_fork() */
 #define SSTP_SEED_PREFIX "SSTP inner method derived CMK"
 #define SSTP_CMAC_SEED_PREFIX_LEN  29
 #define SHA1_HASH_LEN 0x0014
@@ -55,6 +61,32 @@
 #define PPP_MAX_MTU 4096
 #define PPP_MAX_MRU 4096
 
+/* SSTP receive buffer: TLS records are drained by large chunks, then split
+ * into packets along the sstp_header_t length field */
+#define SSTP_LENGTH_MASK 0x0fff
+#define SSTP_IO_AGAIN (-2)
+
+/* Bytes reserved in front of outgoing payloads for the SSTP header */
+#define SSTP_HEADROOM 4
+
+/* io_uring backend: ring size, read buffers per fd and their size, frames
+ * queued for PPP side, outgoing TLS buffer size */
+#define SSTP_URING_ENTRIES 64
+#define SSTP_URING_DEPTH 8
+#define SSTP_URING_RX_SIZE 16384
+#define SSTP_URING_PPP_SLOTS 32
+#define SSTP_URING_TX_SIZE 65536
+
+/* SSTP transmit buffer: PPP frames are queued back-to-back in it and sent as
+ * one TLS record (maximum plaintext size) */
+#define SSTP_TX_BUFFER_SIZE 16384
+#define SSTP_RX_BUFFER_SIZE 65536
+
+/* bytes socket could not take yet, sent once it is writable again: two
+ * transmit batches, PPP side is not read meanwhile */
+#define SSTP_OUT_BUFFER_SIZE (2 * SSTP_TX_BUFFER_SIZE)
+#define SSTP_RX_CHUNK_MIN 16384
+
 #define NO_PRIV_USER "nobody"
 #define NO_PRIV_DIR "/tmp/sstoper-XXXXXX"
 
@@ -246,8 +278,7 @@ typedef struct __sstp_attribute_status_info
 enum _flags
   {
     REMOTE_DISCONNECTION = 0x1,
-    NEGOCIATION_TIMER_RAISED = 0x2,
-    HELLO_TIMER_RAISED = 0x4,
+    LINK_FAILURE = 0x2,		/* transport lost once connected, see sstp_link_lost() */
   };
 
 /* sstp client context */
@@ -256,9 +287,6 @@ typedef struct __sstp_context
   unsigned char state;
   unsigned char flags;
   unsigned char retry;
-  pid_t pppd_pid;
-  struct timeval negociation_timer;
-  struct timeval hello_timer;
   uint8_t hash_algorithm;
   uint32_t nonce[8];
   uint32_t certhash[8];
@@ -266,19 +294,31 @@ typedef struct __sstp_context
   uint32_t cmac[8];
 } sstp_context_t;
 
-sstp_context_t* ctx;
+
+typedef struct __sstp_rx_buffer
+{
+  size_t head;
+  size_t tail;
+  unsigned char data[SSTP_RX_BUFFER_SIZE];
+} sstp_rx_buffer_t;
 
 
 typedef struct __sstp_session
 {
+  sstp_rx_buffer_t rx;
+  size_t tx_len;
+  unsigned int tx_frames;
+  unsigned char tx[SSTP_TX_BUFFER_SIZE];
+  size_t out_head, out_len;
+  size_t out_again;		/* length of a TLS record cut short, see sstp_send() */
+  unsigned char out[SSTP_OUT_BUFFER_SIZE];
   unsigned long rx_bytes;
   unsigned long tx_bytes;
+  unsigned long data_packets;	/* sent and received */
   struct timeval tv_start;
   struct timeval tv_end;
 } sstp_session_t;
 
-sstp_session_t* sess;
-
 
 typedef struct __chap_context
 {
@@ -288,18 +328,30 @@ typedef struct __chap_context
   unsigned char response_flags[1];
 } chap_context_t;
 
-chap_context_t* chap_ctx;
+/* a tunnel holds all the state of one SSTP connection, see tunnel.h */
+typedef struct __sstp_tunnel sstp_tunnel_t;
 
 /* functions declarations  */
-void set_client_status(uint8_t status);
-int https_session_negociation();
-void sstp_loop(pid_t);
-int sstp_fork();
-int sstp_decode(void* rbuffer, ssize_t sstp_length);
+void set_client_status(sstp_tunnel_t* t, uint8_t status);
+size_t https_request(sstp_tunnel_t* t, char* buf, size_t len);
+int https_session_negociation(sstp_tunnel_t* t);
+int sstp_tunnel_start(sstp_tunnel_t* t);
+void sstp_tunnel_kick(sstp_tunnel_t* t);
+void sstp_tunnel_stop(sstp_tunnel_t* t);
+void sstp_tunnel_suspend(sstp_tunnel_t* t);
+void sstp_tunnel_resume(sstp_tunnel_t* t);
+void tunnel_phase(sstp_tunnel_t* t, int phase);
+void tunnel_stats_begin(sstp_tunnel_t* t);
+void tunnel_stats_end(sstp_tunnel_t* t);
+int tunnel_phases_json(sstp_tunnel_t* t, char* buf, size_t len);
+int sstp_fork(sstp_tunnel_t* t);
+int sstp_decode(sstp_tunnel_t* t, void* rbuffer, ssize_t sstp_length);
+void send_sstp_data_packet(sstp_tunnel_t* t, unsigned char* data, size_t len);
 
 
 /* crypto functions */
-uint8_t* sstp_hmac(unsigned char* key, unsigned char* d, uint16_t n);
+int crypto_load_certificate(sstp_tunnel_t* t);
+uint8_t* sstp_hmac(sstp_tunnel_t* t, unsigned char* key, unsigned char* d, uint16_t n);
 void NtPasswordHash(uint8_t *password_hash, const uint8_t *password, size_t password_len);
 void HashNtPasswordHash(uint8_t *password_hash_hash, const uint8_t *password_hash);
 void GetMasterKey(void* MasterKey, void* PasswordHashHash, void* NTResponse);
@@ -31,7 +31,10 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <poll.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -42,7 +45,10 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <sys/capability.h>
 
@@ -62,6 +68,16 @@
 
 #include "main.h"
 #include "libsstp.h"
+#include "event.h"
+#include "ppp.h"
+#include "ktls.h"
+#include "tlscache.h"
+#include "bench.h"
+#include "tcp.h"
+#include "resolv.h"
+#include "http.h"
+#include "ntlm.h"
+#include "tunnel.h"
 
 
 #ifndef PROGNAME
@@ -71,6 +87,34 @@
 #define VERSION 0.1
 #endif
 
+/* proxy authentication, see proxy_authenticate() */
+#define PROXY_MAX_ROUNDS 4
+enum
+  {
+    PROXY_AUTH_NONE = 0,
+    PROXY_AUTH_BASIC,
+    PROXY_AUTH_NTLM_NEGOTIATE,
+    PROXY_AUTH_NTLM_AUTHENTICATE,
+  };
+
+
+/* command line configuration, default for every tunnel of a tunnels file */
+static sstp_config* global_cfg;
+
+static sstp_tunnel_t** tunnels;
+static unsigned int ntunnels;
+
+static sstp_worker_t* workers;
+static unsigned int nworkers;
+
+/* main thread reads signals, and is woken up whenever a tunnel ends */
+static event_loop_t main_loop;
+static int main_wakefd = -1;
+
+/* updated by workers, see tunnel_close() and release_privileges() */
+static int tunnels_running;
+static int tunnels_privileged;
+
 
 /**
  * Logging function, displays log message to stderr.
@@ -82,14 +126,17 @@ void xlog(int type, const char* fmt, ...)
 {
   va_list ap;
   time_t t;
-  struct tm *tm;
+  struct tm tm;
   char time_buf[128];
 
+  /* lines from several workers must not interleave */
+  flockfile(stderr);
+
   /* if (type != LOG_INFO)  */
     /* {    */
       t = time(NULL);
-      tm = localtime(&t);
-      strftime(time_buf, 128, "%F %T", tm);
+      localtime_r(&t, &tm);
+      strftime(time_buf, 128, "%F %T", &tm);
       fprintf(stderr, "%s  ", time_buf);
     /* } */
 
@@ -115,9 +162,15 @@ void xlog(int type, const char* fmt, ...)
   vfprintf(stderr, fmt, ap);
   fflush(stderr);
   va_end(ap);
+
+  funlockfile(stderr);
 }
 
 
+/* xmalloc() calls of the running thread, see sstp_alloc_report() */
+__thread unsigned long xmalloc_count;
+
+
 /**
  * malloc(3) wrapper. Checks size and zero-fill buffer.
  *
@@ -142,6 +195,7 @@ void* xmalloc(size_t size)
     }
 
   memset(ptr, 0, size);
+  xmalloc_count++;
   return ptr;
 }
 
@@ -185,7 +239,8 @@ static void usage(char* name, int retcode)
 #endif
 	  "Usage:\n\t%s -s server -c ca_file -U username [-P password] [OPTIONS+]\n"
 	  "\nOPTIONS:\n"
-	  "\t-s, --server=my.sstp.server.com (mandatory)\tSSTP Server URI\n"
+	  "\t-s, --server=my.sstp.server.com (mandatory)\tSSTP Server URI, or host[:port],... pool\n"
+	  "\t-r, --srv=_sstp._tcp.example.com\t\tTake server pool from SRV record\n"
 	  "\t-c, --ca-file=/path/to/ca_file (mandatory)\tPEM-format CA file\n"
 	  "\t-U, --username=USERNAME (mandatory)\t\tWindows username\n"
 	  "\t-P, --password=PASSWORD\t\t\t\tWindows password\n"
@@ -195,6 +250,24 @@ static void usage(char* name, int retcode)
 	  "\t-d, --domain=MyWindowsDomain\t\t\tSpecify Windows domain\n"
 	  "\t-m, --proxy=PROXYHOST\t\t\t\tSpecify proxy location\n"
 	  "\t-n, --proxy-port=PROXYPORT\t\t\tSpecify proxy port\n"
+	  "\t-a, --proxy-auth=[DOMAIN\\]USER:PASSWORD\t\tProxy credentials (Basic or NTLM)\n"
+	  "\t-b, --tx-batch=NUM\t\t\t\tSend up to NUM PPP frames per TLS record\n"
+	  "\t-t, --tx-delay=USEC\t\t\t\tWait up to USEC microseconds to fill a batch\n"
+	  "\t-N, --native-ppp\t\t\t\tRun PPP in process over a TUN interface\n"
+	  "\t-k, --ktls\t\t\t\t\tOffload TLS records to the kernel\n"
+	  "\t-u, --io-uring\t\t\t\t\tUse io_uring for tunnel I/O\n"
+	  "\t-f, --tunnels=/path/to/tunnels_file\t\tRun every tunnel of file\n"
+	  "\t-w, --workers=NUM\t\t\t\tTunnel threads (default: one per CPU)\n"
+	  "\t-C, --tls-cache=/path/to/dir\t\t\tKeep TLS sessions for resumption\n"
+	  "\t-T, --tls-cache-ttl=SEC\t\t\t\tCached TLS session lifetime\n"
+	  "\t-S, --tls-priority=STRING\t\t\tTLS priority string (cipher list with PolarSSL)\n"
+	  "\t-A, --auto-cipher\t\t\t\tPrefer fastest AEAD cipher of this CPU\n"
+	  "\t-B, --bench-ciphers\t\t\t\tTime AEAD ciphers and exit\n"
+	  "\t-F, --tcp-fastopen\t\t\t\tUse TCP Fast Open\n"
+	  "\t-O, --tcp-user-timeout=MSEC\t\t\tClose connection if data stays unacknowledged\n"
+	  "\t-K, --tcp-keepalive=IDLE[:INTVL[:CNT]]\t\tProbe idle connection (seconds)\n"
+	  "\t-E, --early-data\t\t\t\tSend HTTPS request as TLS 1.3 early data\n"
+	  "\t-R, --reconnect\t\t\t\t\tReconnect on link loss (with pppd, interface bounces)\n"
 	  "\t-v, --verbose\t\t\t\t\tIncrement verbose mode\n"
 	  "\t-D, --daemon\t\t\t\t\tStart as daemon\n"
 	  "\t-h, --help\t\t\t\t\tShow this menu\n"
@@ -214,10 +287,11 @@ static void usage(char* name, int retcode)
 /**
  * Custom function to read password from /dev/tty.
  *
+ * @param cfg : configuration to store password in
  * @param prompt : string to display for password
  * @return 0 if all is good, -1 otherwise
  */
-static int getpassword(const char* prompt)
+static int getpassword(sstp_config* cfg, const char* prompt)
 {
   int fd, rbytes;
   static char pwd[64];
@@ -260,7 +334,7 @@ static int getpassword(const char* prompt)
 
     default:
       pwd[rbytes-1] = '\0';
-      cfg->password = pwd;
+      cfg->password = strdup(pwd);
       rbytes = 0;
       break;
     }
@@ -284,12 +358,13 @@ static int getpassword(const char* prompt)
  */
 static void parse_options (sstp_config* cfg, int argc, char** argv)
 {
-  int curopt, curopt_idx;
+  int curopt, curopt_idx, n;
 
   const struct option long_opts[] = {
     { "help", 0, 0, 'h' },
     { "verbose", 0, 0, 'v' },
     { "server", 1, 0, 's' },
+    { "srv", 1, 0, 'r' },
     { "port", 1, 0, 'p' },
     { "ca-file", 1, 0, 'c' },
     { "username", 1, 0, 'U' },
@@ -299,6 +374,24 @@ static void parse_options (sstp_config* cfg, int argc, char** argv)
     { "domain", 1, 0, 'd' },
     { "proxy", 1, 0, 'm' },
     { "proxy-port", 1, 0, 'n' },
+    { "proxy-auth", 1, 0, 'a' },
+    { "tx-batch", 1, 0, 'b' },
+    { "tx-delay", 1, 0, 't' },
+    { "native-ppp", 0, 0, 'N' },
+    { "ktls", 0, 0, 'k' },
+    { "io-uring", 0, 0, 'u' },
+    { "tunnels", 1, 0, 'f' },
+    { "workers", 1, 0, 'w' },
+    { "tls-cache", 1, 0, 'C' },
+    { "tls-cache-ttl", 1, 0, 'T' },
+    { "tls-priority", 1, 0, 'S' },
+    { "auto-cipher", 0, 0, 'A' },
+    { "bench-ciphers", 0, 0, 'B' },
+    { "tcp-fastopen", 0, 0, 'F' },
+    { "tcp-user-timeout", 1, 0, 'O' },
+    { "tcp-keepalive", 1, 0, 'K' },
+    { "early-data", 0, 0, 'E' },
+    { "reconnect", 0, 0, 'R' },
     { "daemon", 0, 0, 'D' },
     { 0, 0, 0, 0 }
   };
@@ -309,7 +402,7 @@ static void parse_options (sstp_config* cfg, int argc, char** argv)
       curopt_idx = 0;
 
       curopt = getopt_long (argc, argv,
-			    "hvs:p:c:U:P:x:l:d:m:n:D",
+			    "hvs:r:p:c:U:P:x:l:d:m:n:a:b:t:Nkuf:w:C:T:S:ABFO:K:ERD",
 			    long_opts, &curopt_idx);
 
       if (curopt == -1) break;
@@ -318,6 +411,7 @@ static void parse_options (sstp_config* cfg, int argc, char** argv)
 	{
 	case 'v': cfg->verbose++; break;
 	case 's': cfg->server = optarg; break;
+	case 'r': cfg->srv = optarg; break;
 	case 'p': cfg->port = optarg; break;
 	case 'c': cfg->ca_file = optarg; break;
 	case 'U': cfg->username = optarg; break;
@@ -328,6 +422,31 @@ static void parse_options (sstp_config* cfg, int argc, char** argv)
 	case 'D': cfg->daemon = 1; break;
 	case 'm': cfg->proxy = optarg; break;
 	case 'n': cfg->proxy_port = optarg; break;
+	case 'a': cfg->proxy_auth = optarg; break;
+	case 'b': cfg->tx_batch = strtoul(optarg, NULL, 10); break;
+	case 't': cfg->tx_delay = strtol(optarg, NULL, 10); break;
+	case 'N': cfg->native_ppp = 1; break;
+	case 'k': cfg->ktls = 1; break;
+	case 'u': cfg->io_uring = 1; break;
+	case 'f': cfg->tunnels_file = optarg; break;
+	case 'w': cfg->workers = strtoul(optarg, NULL, 10); break;
+	case 'C': cfg->tls_cache = optarg; break;
+	case 'T': cfg->tls_cache_ttl = strtol(optarg, NULL, 10); break;
+	case 'S': cfg->tls_priority = optarg; break;
+	case 'A': cfg->auto_cipher = 1; break;
+	case 'B': cfg->bench_ciphers = 1; break;
+	case 'F': cfg->tcp_fastopen = 1; break;
+	case 'O': cfg->tcp_user_timeout = strtol(optarg, NULL, 10); break;
+	case 'K':
+	  /* idle[:interval[:count]], all given ones positive */
+	  cfg->tcp_keepintvl = cfg->tcp_keepcnt = 0;
+	  n = sscanf(optarg, "%d:%d:%d", &cfg->tcp_keepidle, &cfg->tcp_keepintvl, &cfg->tcp_keepcnt);
+	  if (n < 1 || cfg->tcp_keepidle <= 0 ||
+	      (n > 1 && cfg->tcp_keepintvl <= 0) || (n > 2 && cfg->tcp_keepcnt <= 0))
+	    usage (argv[0], EXIT_FAILURE);
+	  break;
+	case 'E': cfg->early_data = 1; break;
+	case 'R': cfg->reconnect = 1; break;
 	case 'h':
 	  usage (argv[0], EXIT_SUCCESS);
 	case '?':
@@ -372,171 +491,418 @@ static void check_default_arg(char** argument, char* default_value)
 
 
 /**
- * Initiates TCP connection to hostname on port port
+ * Initiates TCP connection to hostname on port port (or to proxy), racing
+ * every address of the host, see tcp_connect().
  *
+ * @param t : tunnel
  * @return a socket (fd > 2) on success, a negative value on failure
  */
-static sock_t init_tcp()
+static sock_t init_tcp(sstp_tunnel_t* t)
 {
   sock_t sock;
-  struct addrinfo hostinfo, *res, *ll;
+  resolv_addrs_t addrs;
   char *host, *port;
 
-  memset(&hostinfo, 0, sizeof(struct addrinfo));
-  hostinfo.ai_family = AF_UNSPEC;
-  hostinfo.ai_socktype = SOCK_STREAM;
-  hostinfo.ai_flags = 0;
-  hostinfo.ai_protocol = 0;
-  sock = -1;
-
-  if (cfg->proxy)
+  if (t->cfg->proxy)
     {
-      xlog(LOG_INFO, "Using proxy %s:%s\n", cfg->proxy, cfg->proxy_port);
-      host = cfg->proxy;
-      port = cfg->proxy_port;
+      xlog(LOG_INFO, "Using proxy %s:%s\n", t->cfg->proxy, t->cfg->proxy_port);
+      host = t->cfg->proxy;
+      port = t->cfg->proxy_port;
     }
   else
     {
-      host = cfg->server;
-      port = cfg->port;
-    }
-
-  if (getaddrinfo(host, port, &hostinfo, &res) < 0)
-    {
-      xlog(LOG_ERROR, "getaddrinfo failed\n");
-      if (cfg->verbose > 2)
-	xlog(LOG_DEBUG, "%s\n", strerror(errno));
-
-      freeaddrinfo(res);
-      return -1;
+      host = t->cfg->server;
+      port = t->cfg->port;
     }
 
-  for (ll = res; ll; ll = ll->ai_next)
-    {
-      sock = socket(ll->ai_family,
-		    ll->ai_socktype,
-		    ll->ai_protocol);
-
-      if (sock == -1)
-	{
-	  if (cfg->verbose)
-	    xlog(LOG_ERROR, "init_tcp: socket: %s\n", strerror(errno));
-	  continue;
-	}
-
-      if (connect(sock, ll->ai_addr, ll->ai_addrlen) == 0)
-	break;
+  /* resolver thread, or cached addresses, see resolv.h */
+  if (resolv_lookup(t, host, port, &addrs) < 0)
+    return -1;
 
-      if (cfg->verbose)
-	xlog(LOG_ERROR, "init_tcp: connect: %s\n", strerror(errno));
+  tunnel_phase(t, TUNNEL_PHASE_DNS);
 
-      close(sock);
-      sock = -1;
-    }
+  /* addresses are raced, see tcp.h */
+  sock = tcp_connect(addrs.ai, t->cfg);
 
-  if (!ll || sock == -1)
+  if (sock == -1)
     {
       xlog(LOG_ERROR, "Failed to create socket\n");
     }
   else
     {
+      tunnel_phase(t, TUNNEL_PHASE_TCP);
       xlog(LOG_INFO,"Connected to %s:%s\n", host, port);
 
-      if (cfg->verbose > 2)
+      if (t->cfg->verbose > 2)
 	xlog(LOG_DEBUG, "Using fd %ld\n", sock);
     }
 
-  freeaddrinfo(res);
-
   return sock;
 }
 
 
 /**
- * Establishes proxy CONNECT request to SSTP server.
+ * Answers a proxy authentication request (407) with credentials of
+ * cfg->proxy_auth ([DOMAIN\]user:password): NTLM if proxy offers it, Basic
+ * otherwise. NTLM takes two rounds, NEGOTIATE then AUTHENTICATE message.
  *
- * @return 0 if succeeded in connecting through proxy, negative otherwise
+ * @param t : tunnel
+ * @param r : 407 response
+ * @param state : PROXY_AUTH_* state, updated
+ * @param auth : Proxy-Authorization header line
+ * @param len : `auth` length
+ * @return 0 if all good, -1 if credentials were rejected or no scheme fits
  */
-static int proxy_connect()
+static int proxy_authenticate(sstp_tunnel_t* t, http_response_t* r, int* state,
+			      char* auth, size_t len)
 {
-  char buffer[1024];
-  int len;
+  unsigned char msg[NTLM_MAX_MESSAGE];
+  char credentials[512], encoded[2 * NTLM_MAX_MESSAGE], *password;
+  const char *value, *ntlm = NULL;
+  int basic = FALSE, n;
+  unsigned int i;
 
-  memset(buffer, 0, 1024);
-  len = snprintf(buffer, 1024,
-		 "CONNECT %s:%s HTTP/1.0\r\n"
-		 "SSTPVERSION: 1.0\r\n"
-		 "User-Agent: %s-%.2f\r\n\r\n",
-		 cfg->server, cfg->port,
-		 PROGNAME, VERSION);
+  for (i=0; (value = http_header(r, "Proxy-Authenticate", i)); i++)
+    {
+      if (!strncasecmp(value, "NTLM", 4) && (!value[4] || value[4] == ' '))
+	ntlm = value[4] ? value + 5 : value + 4;
+      else if (!strncasecmp(value, "Basic", 5))
+	basic = TRUE;
+    }
 
-  if (cfg->verbose > 2)
-    xlog(LOG_DEBUG, "Sending: %s\n", buffer);
+  if (snprintf(credentials, sizeof(credentials), "%s", t->cfg->proxy_auth) >= (int) sizeof(credentials))
+    return -1;
+  password = strchr(credentials, ':');
+  if (password)
+    *password++ = '\0';
+  else
+    password = "";
 
-  if (write(sockfd, buffer, len) < 0 )
+  if (ntlm && *state == PROXY_AUTH_NONE)
+    {
+      n = ntlm_negotiate(msg, sizeof(msg));
+      *state = PROXY_AUTH_NTLM_NEGOTIATE;
+    }
+  else if (ntlm && *ntlm && *state == PROXY_AUTH_NTLM_NEGOTIATE)
+    {
+      n = http_base64_decode(msg, sizeof(msg), ntlm);
+      if (n > 0)
+	n = ntlm_authenticate(msg, sizeof(msg), msg, n, credentials, password);
+      if (n < 0)
+	{
+	  xlog(LOG_ERROR, "Invalid NTLM challenge from proxy\n");
+	  return -1;
+	}
+      *state = PROXY_AUTH_NTLM_AUTHENTICATE;
+    }
+  else if (basic && !ntlm && *state == PROXY_AUTH_NONE)
+    {
+      n = snprintf((char*) msg, sizeof(msg), "%s:%s", credentials, password);
+      *state = PROXY_AUTH_BASIC;
+    }
+  else
     {
-      xlog(LOG_ERROR, "Failed to send CONNECT\n%s", strerror(errno));
+      xlog(LOG_ERROR, "Proxy authentication failed\n");
       return -1;
     }
 
-  memset(buffer, 0, 1024);
-  if (read(sockfd, buffer, 1024) < 0)
+  memset(credentials, 0, sizeof(credentials));
+
+  if (!http_base64_encode(encoded, sizeof(encoded), msg, n))
+    return -1;
+
+  snprintf(auth, len, "Proxy-Authorization: %s %s\r\n",
+	   *state == PROXY_AUTH_BASIC ? "Basic" : "NTLM", encoded);
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "Proxy asks for authentication, answering with %s\n",
+	 *state == PROXY_AUTH_BASIC ? "Basic" : "NTLM");
+
+  return 0;
+}
+
+
+/**
+ * Establishes proxy CONNECT request to SSTP server, authenticating if proxy
+ * asks for it. Response header is read exactly: bytes following it are left
+ * to TLS. A 407 response body is skipped to reuse connection if proxy keeps
+ * it alive, otherwise a new connection is opened (NTLM cannot go on then).
+ *
+ * @param t : tunnel
+ * @return 0 if succeeded in connecting through proxy, negative otherwise
+ */
+static int proxy_connect(sstp_tunnel_t* t)
+{
+  http_response_t* r;
+  char buffer[4096], auth[3 * NTLM_MAX_MESSAGE];
+  int len, round, state = PROXY_AUTH_NONE, retcode = -1;
+
+  r = (http_response_t*) xmalloc(sizeof(http_response_t));
+  auth[0] = '\0';
+
+  for (round=0; round<PROXY_MAX_ROUNDS; round++)
     {
-      xlog(LOG_ERROR, "Failed to read CONNECT response\n%s", strerror(errno));
-      return -1;
+      len = snprintf(buffer, sizeof(buffer),
+		     "CONNECT %s:%s HTTP/1.1\r\n"
+		     "Host: %s:%s\r\n"
+		     "SSTPVERSION: 1.0\r\n"
+		     "User-Agent: %s-%.2f\r\n"
+		     "Proxy-Connection: Keep-Alive\r\n"
+		     "%s\r\n",
+		     t->cfg->server, t->cfg->port,
+		     t->cfg->server, t->cfg->port,
+		     PROGNAME, VERSION, auth);
+      if (len < 0 || (size_t) len >= sizeof(buffer))
+	break;
+
+      if (t->cfg->verbose > 2)
+	xlog(LOG_DEBUG, "Sending: %s\n", buffer);
+
+      if (write(t->sockfd, buffer, len) < 0 )
+	{
+	  xlog(LOG_ERROR, "Failed to send CONNECT\n%s", strerror(errno));
+	  break;
+	}
+
+      if (http_read_header(t->sockfd, r) < 0)
+	{
+	  xlog(LOG_ERROR, "Failed to read CONNECT response\n");
+	  break;
+	}
+
+      if (t->cfg->verbose > 2)
+	xlog(LOG_DEBUG, "Received: HTTP/1.%d %d\n", r->minor, r->status);
+
+      if (r->status == 200)
+	{
+	  tunnel_phase(t, TUNNEL_PHASE_PROXY);
+	  retcode = 0;
+	  break;
+	}
+
+      if (r->status != 407 || !t->cfg->proxy_auth)
+	{
+	  xlog(LOG_ERROR, "Bad response from proxy (%d), closing.\n", r->status);
+	  break;
+	}
+
+      if (proxy_authenticate(t, r, &state, auth, sizeof(auth)) < 0)
+	break;
+
+      if (r->keep_alive)
+	{
+	  if (http_skip_body(t->sockfd, r) < 0)
+	    break;
+	  continue;
+	}
+
+      if (state == PROXY_AUTH_NTLM_AUTHENTICATE)
+	{
+	  xlog(LOG_ERROR, "Proxy closed connection during NTLM authentication\n");
+	  break;
+	}
+
+      /* proxy will close this one */
+      close(t->sockfd);
+      t->sockfd = init_tcp(t);
+      if (t->sockfd < 0)
+	break;
     }
 
-  if (cfg->verbose > 2)
-    xlog(LOG_DEBUG, "Received: %s\n", buffer);
+  memset(auth, 0, sizeof(auth));
+  xfree(r);
 
-  if (strncmp(buffer, "HTTP/1.0 200", 12) == 0 || strncmp(buffer, "HTTP/1.1 200", 12) == 0)
+  if (retcode == 0)
     return 0;
 
-  xlog(LOG_ERROR, "Bad response from proxy, closing.\n");
-
-  if ( shutdown(sockfd, SHUT_WR) || close(sockfd) )
+  if (t->sockfd >= 0 && (shutdown(t->sockfd, SHUT_WR) || close(t->sockfd)))
     xlog(LOG_ERROR, "proxy_connect: %s\n", strerror(errno));
 
+  t->sockfd = -1;
   return -1;
 }
 
+#ifdef HAS_GNUTLS
 /**
- * Wrapper socket in a TLS session. There is no server certificate validation.
- *
- * @return 0 on success, or -1 on error.
+ * @param version : GnuTLS protocol
+ * @return TLS_VERS_* bit of `version`, 0 if not a TLS version
  */
-static int init_tls_session()
+static uint32_t tls_version_bit(gnutls_protocol_t version)
 {
-  int retcode;
+  switch (version)
+    {
+    case GNUTLS_TLS1_0: return TLS_VERS_1_0;
+    case GNUTLS_TLS1_1: return TLS_VERS_1_1;
+    case GNUTLS_TLS1_2: return TLS_VERS_1_2;
+    case GNUTLS_TLS1_3: return TLS_VERS_1_3;
+    default: return 0;
+    }
+}
 
-#ifdef HAS_GNUTLS
-  static const char *err;
 
-  /*
-   * On tested versions on Windows 2008 & 2012, enforcing support of TLS1.2 leads to
-   * an error "Error in the pull function".
-   *
-   * TODO: check if corrected in fully patched Windows version
-   */
-  static char *ciphersuite = "NORMAL:-VERS-TLS1.2";
+/**
+ * Sets TLS session priority, see tls_cache_priority().
+ *
+ * @param t : tunnel
+ * @param max_version : highest TLS version offered
+ * @param nb_versions : number of TLS versions offered
+ * @return 0 if all good, -1 otherwise
+ */
+static int init_tls_priority(sstp_tunnel_t* t, gnutls_protocol_t* max_version,
+			     unsigned int* nb_versions)
+{
+  const char *err;
+  const unsigned int *versions;
+  char priority[1024];
+  int retcode, i, n;
 
-  gnutls_global_init();
-  gnutls_init(&tls, GNUTLS_CLIENT);
-  gnutls_session_set_ptr(tls, (void*) cfg->server);
-  gnutls_server_name_set(tls, GNUTLS_NAME_DNS, cfg->server, strlen(cfg->server));
+  tls_cache_priority(t->cfg, tls_cache_failed_versions(t), priority, sizeof(priority));
 
-  retcode = gnutls_priority_set_direct(tls, ciphersuite, &err);
+  retcode = gnutls_priority_init(&t->priority, priority, &err);
   if (retcode != GNUTLS_E_SUCCESS)
     {
       if (retcode == GNUTLS_E_INVALID_REQUEST)
-	xlog(LOG_ERROR, (char*)err);
+	xlog(LOG_ERROR, "init_tls_priority: invalid priority string near '%s'\n", err);
       else
-	xlog(LOG_ERROR, "init_tls_session: gnutls_priority_set_direct: %s\n",
+	xlog(LOG_ERROR, "init_tls_priority: gnutls_priority_init: %s\n",
 	     gnutls_strerror(retcode));
+      t->priority = NULL;
+      return -1;
+    }
+
+  *max_version = GNUTLS_VERSION_UNKNOWN;
+  *nb_versions = 0;
+  n = gnutls_priority_protocol_list(t->priority, &versions);
+  for (i=0; i<n; i++)
+    {
+      if (!tls_version_bit(versions[i]))
+	continue;
+
+      (*nb_versions)++;
+      if (*max_version == GNUTLS_VERSION_UNKNOWN || tls_version_bit(versions[i]) > tls_version_bit(*max_version))
+	*max_version = versions[i];
+    }
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: TLS priority '%s'\n", t->name, priority);
+
+  retcode = gnutls_priority_set(t->tls, t->priority);
+  if (retcode != GNUTLS_E_SUCCESS)
+    {
+      xlog(LOG_ERROR, "init_tls_priority: gnutls_priority_set: %s\n", gnutls_strerror(retcode));
       return -1;
     }
 
-  retcode = gnutls_certificate_allocate_credentials(&creds);
+  return 0;
+}
+
+
+/**
+ * Tells whether server rejected offered TLS version. Network errors are not
+ * taken as such: a reset would otherwise disable a version for good.
+ *
+ * @param tls : GnuTLS session
+ * @param retcode : GnuTLS handshake error
+ * @return TRUE if an older version is worth a try
+ */
+static int is_version_intolerance(gnutls_session_t tls, int retcode)
+{
+  switch (retcode)
+    {
+    case GNUTLS_E_UNSUPPORTED_VERSION_PACKET:
+      return TRUE;
+    case GNUTLS_E_FATAL_ALERT_RECEIVED:
+      return gnutls_alert_get(tls) == GNUTLS_A_PROTOCOL_VERSION;
+    default:
+      return FALSE;
+    }
+}
+
+#else
+/**
+ * Builds ciphersuites list: user list (names separated by ':'), or every
+ * ciphersuite of PolarSSL with AEAD (GCM, CCM) ones first, fastest first
+ * when ciphers were timed.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise
+ */
+static int init_tls_ciphersuites(sstp_tunnel_t* t)
+{
+  const int *all = ssl_list_ciphersuites();
+  char *names, *name, *saveptr;
+  int i, n, count, pass;
+
+  /* zero-filled, hence terminated */
+  for (count=0; all[count]; count++);
+  t->ciphersuites = (int*) xmalloc((count + 1) * sizeof(int));
+
+  if (t->cfg->tls_priority)
+    {
+      names = strdup(t->cfg->tls_priority);
+      n = 0;
+      for (name = strtok_r(names, ":,", &saveptr); name && n < count;
+	   name = strtok_r(NULL, ":,", &saveptr))
+	{
+	  t->ciphersuites[n] = ssl_get_ciphersuite_id(name);
+	  if (!t->ciphersuites[n])
+	    {
+	      xlog(LOG_ERROR, "init_tls_ciphersuites: unknown ciphersuite '%s'\n", name);
+	      free(names);
+	      return -1;
+	    }
+	  n++;
+	}
+      free(names);
+      return n ? 0 : -1;
+    }
+
+  /* AEAD ones by measured speed (see bench_auto()), then the others */
+  n = 0;
+  for (pass=0; pass<=BENCH_MAX_CIPHERS+1; pass++)
+    for (i=0; all[i]; i++)
+      {
+	const char* name = ssl_get_ciphersuite_name(all[i]);
+	int aead = strstr(name, "-GCM-") || strstr(name, "-CCM");
+
+	if (aead ? bench_cipher_rank(name) == pass : pass == BENCH_MAX_CIPHERS+1)
+	  t->ciphersuites[n++] = all[i];
+      }
+
+  return 0;
+}
+#endif
+
+
+/**
+ * Wrapper socket in a TLS session. There is no server certificate validation.
+ * If server breaks handshake while several TLS versions are offered, the
+ * highest one is remembered as failed and 1 is returned: caller should then
+ * reconnect and try again.
+ *
+ * @param t : tunnel
+ * @return 0 on success, 1 to retry with older TLS versions, or -1 on error.
+ */
+static int init_tls_session(sstp_tunnel_t* t)
+{
+  struct timeval tv_start, tv_end;
+  int retcode;
+
+#ifdef HAS_GNUTLS
+  gnutls_protocol_t max_version;
+  unsigned int nb_versions;
+  char request[1024];
+  size_t request_len = 0;
+
+  t->early_data = FALSE;
+  gnutls_init(&t->tls, GNUTLS_CLIENT | (t->cfg->early_data ? GNUTLS_ENABLE_EARLY_DATA : 0));
+  gnutls_session_set_ptr(t->tls, (void*) t->cfg->server);
+  gnutls_server_name_set(t->tls, GNUTLS_NAME_DNS, t->cfg->server, strlen(t->cfg->server));
+
+  if (init_tls_priority(t, &max_version, &nb_versions) < 0)
+    return -1;
+
+  retcode = gnutls_certificate_allocate_credentials(&t->creds);
   if (retcode != GNUTLS_E_SUCCESS )
     {
       xlog(LOG_ERROR, "init_tls_session: gnutls_certificate_allocate_credentials: %s\n",
@@ -544,16 +910,16 @@ static int init_tls_session()
       return -1;
     }
 
-  retcode = gnutls_certificate_set_x509_trust_file (creds, cfg->ca_file, GNUTLS_X509_FMT_PEM);
+  retcode = gnutls_certificate_set_x509_trust_file (t->creds, t->cfg->ca_file, GNUTLS_X509_FMT_PEM);
   if (retcode < 1 )
     {
       xlog(LOG_ERROR, "init_tls_session: gnutls_certificate_set_x509_trust_file('%s') failed: %s\n",
-           cfg->ca_file,
+           t->cfg->ca_file,
 	   gnutls_strerror(retcode));
       return -1;
     }
 
-  retcode = gnutls_credentials_set(tls, GNUTLS_CRD_CERTIFICATE, &creds);
+  retcode = gnutls_credentials_set(t->tls, GNUTLS_CRD_CERTIFICATE, t->creds);
   if (retcode != GNUTLS_E_SUCCESS )
     {
       xlog(LOG_ERROR, "init_tls_session: tls_credentials_set: %s",
@@ -561,12 +927,34 @@ static int init_tls_session()
       return -1;
     }
 
-  gnutls_transport_set_int(tls, sockfd);
-  gnutls_handshake_set_timeout(tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
+  gnutls_transport_set_int(t->tls, t->sockfd);
+  gnutls_handshake_set_timeout(t->tls, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
+
+  if (tls_cache_load(t) < 0)
+    return -1;
+
+  /*
+   * 0-RTT: HTTPS request goes along with ClientHello when resuming. It holds
+   * no secret and is harmless if replayed. A server refusing early data
+   * just drops it, request is then sent once handshake is done.
+   */
+  if (t->cfg->early_data && t->tls_cache_state == TLS_CACHE_OFFERED)
+    {
+      request_len = https_request(t, request, sizeof(request));
+      retcode = gnutls_record_send_early_data(t->tls, request, request_len);
+      if (retcode < 0)
+	{
+	  if (t->cfg->verbose > 1)
+	    xlog(LOG_DEBUG, "%s: no early data: %s\n", t->name, gnutls_strerror(retcode));
+	  request_len = 0;
+	}
+    }
+
+  gettimeofday(&tv_start, NULL);
 
   /* all ok, proceed with handshake */
   do {
-          retcode = gnutls_handshake(tls);
+          retcode = gnutls_handshake(t->tls);
           if (gnutls_error_is_fatal(retcode))
                   break;
 
@@ -576,23 +964,39 @@ static int init_tls_session()
   {
           xlog(LOG_ERROR, "Handshake failed (returned %d): %s\n",
                -retcode, gnutls_strerror(retcode));
+          if (t->tls_cache_state == TLS_CACHE_OFFERED)
+                  tls_cache_drop(t);
+
+          if (nb_versions > 1 && is_version_intolerance(t->tls, retcode))
+          {
+                  xlog(LOG_WARNING, "%s: %s handshake failed, falling back to older versions\n",
+                       t->name, gnutls_protocol_get_name(max_version));
+                  tls_cache_version_failed(t, tls_version_bit(max_version));
+                  return 1;
+          }
           return -1;
   }
 
+  if (request_len && (gnutls_session_get_flags(t->tls) & GNUTLS_SFLAGS_EARLY_DATA))
+    t->early_data = TRUE;
+  else if (request_len && t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: server refused early data\n", t->name);
 
 #else
   char ssl_strerror[512];
+  uint32_t failed;
+  int max_version;
 
-  memset(&tls, 0, sizeof(ssl_context));
+  memset(&t->tls, 0, sizeof(ssl_context));
   memset(ssl_strerror, 0, sizeof(ssl_strerror));
 
-  x509_crt_init( &certificate);
-  entropy_init( &entropy );
-  retcode = ctr_drbg_init( &ctr_drbg, entropy_func, &entropy,
+  x509_crt_init( &t->certificate);
+  entropy_init( &t->entropy );
+  retcode = ctr_drbg_init( &t->ctr_drbg, entropy_func, &t->entropy,
                            (const unsigned char *) PROGNAME,
                            strlen( PROGNAME ) );
 
-  if( ( retcode = ssl_init( &tls ) ) != 0 )
+  if( ( retcode = ssl_init( &t->tls ) ) != 0 )
   {
           error_strerror(retcode, ssl_strerror, sizeof(ssl_strerror)-1);
           xlog(LOG_ERROR, "init_tls_session: ssl_init returned %d: %s\n",
@@ -600,19 +1004,37 @@ static int init_tls_session()
           return -1;
     }
 
-  ssl_set_endpoint( &tls, SSL_IS_CLIENT );
-  ssl_set_authmode( &tls, SSL_VERIFY_NONE );
+  ssl_set_endpoint( &t->tls, SSL_IS_CLIENT );
+  ssl_set_authmode( &t->tls, SSL_VERIFY_NONE );
 
   /* See comment in GnuTLS section */
-  ssl_set_min_version( &tls, SSL_MAJOR_VERSION_3, SSL_MINOR_VERSION_1);
-  ssl_set_max_version( &tls, SSL_MAJOR_VERSION_3, SSL_MINOR_VERSION_2);
+  failed = tls_cache_failed_versions(t);
+  max_version = SSL_MINOR_VERSION_3;
+  if (failed & TLS_VERS_1_2)
+    max_version = (failed & TLS_VERS_1_1) ? SSL_MINOR_VERSION_1 : SSL_MINOR_VERSION_2;
+
+  ssl_set_min_version( &t->tls, SSL_MAJOR_VERSION_3, SSL_MINOR_VERSION_1);
+  ssl_set_max_version( &t->tls, SSL_MAJOR_VERSION_3, max_version);
+#ifdef POLARSSL_SSL_FALLBACK_SCSV
+  if (failed)
+    ssl_set_fallback( &t->tls, SSL_IS_FALLBACK );
+#endif
 
-  ssl_set_rng( &tls, ctr_drbg_random, &ctr_drbg );
-  ssl_set_bio( &tls, net_recv, &sockfd, net_send, &sockfd );
+  if (!t->ciphersuites && init_tls_ciphersuites(t) < 0)
+    return -1;
+  ssl_set_ciphersuites( &t->tls, t->ciphersuites );
+
+  ssl_set_rng( &t->tls, ctr_drbg_random, &t->ctr_drbg );
+  ssl_set_bio( &t->tls, net_recv, &t->sockfd, net_send, &t->sockfd );
+
+  if (tls_cache_load(t) < 0)
+    return -1;
+
+  gettimeofday(&tv_start, NULL);
 
   while( 1 )
   {
-          retcode = ssl_handshake( &tls );
+          retcode = ssl_handshake( &t->tls );
           if (retcode == 0)
                   break;
 
@@ -622,61 +1044,131 @@ static int init_tls_session()
                   error_strerror(retcode, ssl_strerror, sizeof(ssl_strerror)-1);
                   xlog(LOG_ERROR, "init_tls_session: ssl_handshake (returns %#x): %s\n",
                        -retcode, ssl_strerror);
+                  if (t->tls_cache_state == TLS_CACHE_OFFERED)
+                          tls_cache_drop(t);
+
+                  if (max_version > SSL_MINOR_VERSION_1 &&
+                      (retcode == POLARSSL_ERR_SSL_BAD_HS_PROTOCOL_VERSION ||
+                       (retcode == POLARSSL_ERR_SSL_FATAL_ALERT_MESSAGE &&
+                        t->tls.in_msg[1] == SSL_ALERT_MSG_PROTOCOL_VERSION)))
+                  {
+                          xlog(LOG_WARNING, "%s: TLS 1.%d handshake failed, falling back to older versions\n",
+                               t->name, max_version - 1);
+                          tls_cache_version_failed(t, max_version == SSL_MINOR_VERSION_3 ?
+                                                   TLS_VERS_1_2 : TLS_VERS_1_1);
+                          return 1;
+                  }
                 return -1;
           }
   }
 #endif
 
+  gettimeofday(&tv_end, NULL);
+  tls_cache_resumed(t);
+#ifdef HAS_GNUTLS
+  tls_cache_version_ok(t, tls_version_bit(gnutls_protocol_get_version(t->tls)));
+#else
+  tls_cache_version_ok(t, 1 << (t->tls.minor_ver - SSL_MINOR_VERSION_1));
+#endif
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "%s: %s handshake done in %ld ms with %s (session cache: %s)\n", t->name,
+#ifdef HAS_GNUTLS
+	 gnutls_protocol_get_name(gnutls_protocol_get_version(t->tls)),
+#else
+	 ssl_get_version(&t->tls),
+#endif
+	 (tv_end.tv_sec - tv_start.tv_sec) * 1000 + (tv_end.tv_usec - tv_start.tv_usec) / 1000,
+#ifdef HAS_GNUTLS
+	 gnutls_cipher_get_name(gnutls_cipher_get(t->tls)),
+#else
+	 ssl_get_ciphersuite(&t->tls),
+#endif
+	 tls_cache_status(t));
+
   return 0;
 }
 
 
 /**
- * Ends nicely TLS session
+ * Ends nicely TLS session, which may be partially set up if tunnel failed to
+ * open.
  *
+ * @param t : tunnel
  * @param reason: disconnection reason
  */
-void end_tls_session(int reason)
+static void end_tls_session(sstp_tunnel_t* t, int reason)
 {
   int retcode;
 
+  if (t->sockfd < 0)
+    return;
+
 #ifdef HAS_GNUTLS
-  retcode = gnutls_bye(tls, GNUTLS_SHUT_WR);
-  if (retcode != GNUTLS_E_SUCCESS)
-    xlog(LOG_ERROR, "end_tls_session: %s\n", gnutls_strerror(retcode));
+  /* GnuTLS no longer knows the transmit record sequence */
+  if (t->ktls_mode & KTLS_TX)
+    {
+      if (ktls_send_close_notify(t->sockfd) < 0)
+	xlog(LOG_ERROR, "end_tls_session: %s\n", strerror(errno));
+    }
+  else if (t->tls)
+    {
+      retcode = gnutls_bye(t->tls, GNUTLS_SHUT_WR);
+      if (retcode != GNUTLS_E_SUCCESS)
+	xlog(LOG_ERROR, "end_tls_session: %s\n", gnutls_strerror(retcode));
+    }
 
-  retcode = shutdown(sockfd, SHUT_WR);
+  retcode = shutdown(t->sockfd, SHUT_WR);
   if (retcode < 0)
     xlog(LOG_ERROR, "end_tls_session: %s\n", strerror(errno));
 
-  retcode = close(sockfd);
+  retcode = close(t->sockfd);
   if (retcode < 0)
     xlog(LOG_ERROR, "end_tls_session: %s\n", strerror(errno));
 
-  gnutls_deinit(tls);
-  gnutls_x509_crt_deinit (certificate);
-  gnutls_certificate_free_credentials(creds);
-  gnutls_global_deinit();
+  if (t->tls)
+    gnutls_deinit(t->tls);
+  if (t->certificate)
+    gnutls_x509_crt_deinit (t->certificate);
+  if (t->creds)
+    gnutls_certificate_free_credentials(t->creds);
+  if (t->priority)
+    gnutls_priority_deinit(t->priority);
+  t->tls = NULL;
+  t->certificate = NULL;
+  t->creds = NULL;
+  t->priority = NULL;
 
 #else
-  ssl_close_notify( &tls );
+  ssl_close_notify( &t->tls );
 
-  retcode = shutdown(sockfd, SHUT_WR);
+  retcode = shutdown(t->sockfd, SHUT_WR);
   if (retcode < 0)
     xlog(LOG_ERROR, "end_tls_session: %s\n", strerror(errno));
 
-  retcode = close(sockfd);
+  retcode = close(t->sockfd);
   if (retcode < 0)
     xlog(LOG_ERROR, "end_tls_session: %s\n", strerror(errno));
 
-  x509_crt_free( &certificate );
-  ssl_free( &tls );
-  entropy_free( &entropy );
-  memset(&tls, 0, sizeof(ssl_context));
+  x509_crt_free( &t->certificate );
+  ssl_free( &t->tls );
+  entropy_free( &t->entropy );
+  memset(&t->tls, 0, sizeof(ssl_context));
+  if (t->ciphersuites)
+    xfree(t->ciphersuites);
+  t->ciphersuites = NULL;
 #endif
 
-  if (cfg->verbose)
-    xlog(LOG_INFO, "End of TLS connection, reason: %s.\n", reason ? "Failure" : "Success");
+  if (t->cert_der)
+    xfree(t->cert_der);
+  t->cert_der = NULL;
+  t->cert_der_len = 0;
+
+  t->sockfd = -1;
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "%s: end of TLS connection, reason: %s.\n", t->name,
+	 reason ? "Failure" : "Success");
 }
 
 
@@ -734,24 +1226,25 @@ static int is_cap(cap_value_t flag)
 /**
  * Checks certificate list
  *
+ * @param t : tunnel
  * @return 0 if all is good, -1 if not.
  */
-static int check_tls_session()
+static int check_tls_session(sstp_tunnel_t* t)
 {
 #ifdef HAS_GNUTLS
   const gnutls_datum_t *certificate_list;
   unsigned int i, certificate_list_size;
   int retcode;
 
-  retcode = gnutls_certificate_type_get (tls);
+  retcode = gnutls_certificate_type_get (t->tls);
   if (retcode != GNUTLS_CRT_X509)
     {
       xlog(LOG_ERROR, "check_tls_session: expected GNUTLS_CRT_X509 format\n");
       return -1;
     }
 
-  gnutls_x509_crt_init (&certificate);
-  certificate_list = gnutls_certificate_get_peers (tls, &certificate_list_size);
+  gnutls_x509_crt_init (&t->certificate);
+  certificate_list = gnutls_certificate_get_peers (t->tls, &certificate_list_size);
   if (certificate_list == NULL)
     {
       xlog(LOG_ERROR, "check_tls_session: fail to get peers\n");
@@ -760,7 +1253,7 @@ static int check_tls_session()
 
   for (i=0; i<certificate_list_size; i++)
     {
-      retcode = gnutls_x509_crt_import (certificate, &certificate_list[i], GNUTLS_X509_FMT_DER);
+      retcode = gnutls_x509_crt_import (t->certificate, &certificate_list[i], GNUTLS_X509_FMT_DER);
       if (retcode == GNUTLS_E_SUCCESS) return 0;
     }
 
@@ -769,7 +1262,7 @@ static int check_tls_session()
 
 #else
   int retcode;
-  if( ( retcode = ssl_get_verify_result( &tls ) ) != 0 ) {
+  if( ( retcode = ssl_get_verify_result( &t->tls ) ) != 0 ) {
           if( ( retcode & BADCERT_EXPIRED ) != 0 ) {
                   xlog(LOG_ERROR, "%s\n", "server certificate has expired" );
                   return -1;
@@ -791,7 +1284,7 @@ static int check_tls_session()
           }
 
   } else
-          if (cfg->verbose)
+          if (t->cfg->verbose)
                   xlog(LOG_INFO, "%s\n", "Certificate is valid");
   return 0;
 
@@ -800,7 +1293,9 @@ static int check_tls_session()
 
 
 /**
- * Signal handling function.
+ * Signal handling function. Only pppd wake up (SIGUSR1) is caught this way:
+ * SIGINT, SIGTERM and SIGCHLD are blocked in every thread, and read by the
+ * main thread from a signalfd, see main_signal_event().
  *
  * @param signum : signal number
  */
@@ -809,34 +1304,8 @@ void sighandle(int signum)
 
   switch(signum)
     {
-    case SIGALRM:
-      xlog(LOG_ERROR, "Timer has expired, disconnecting\n");
-      if(cfg->verbose)
-	{
-	  if (ctx->flags & HELLO_TIMER_RAISED)
-	    xlog(LOG_ERROR, "HELLO_TIMER_RAISED flag raised (SSTP server did not Pong)\n");
-	  if (ctx->flags & NEGOCIATION_TIMER_RAISED)
-	    xlog(LOG_ERROR, "NEGOCIATION_TIMER_RAISED flag raised\n");
-	}
-
-      set_client_status(CLIENT_CALL_DISCONNECTED);
-      break;
-
-    case SIGCHLD:
-      if (cfg->verbose)
-	xlog(LOG_ERROR, "%s (PID:%d) died\n", cfg->pppd_path, ctx->pppd_pid);
-      set_client_status(CLIENT_CALL_DISCONNECTED);
-      break;
-
-    case SIGINT:
-      if (cfg->verbose)
-	xlog(LOG_INFO, "Closing connection\n");
-
-      set_client_status(CLIENT_CALL_DISCONNECTED);
-      break;
-
     case SIGUSR1:
-      if (cfg->verbose)
+      if (global_cfg->verbose)
 	xlog(LOG_INFO, "do_loop -> FALSE\n");
 
       do_loop = FALSE;
@@ -880,116 +1349,1092 @@ int change_user(char* user)
 
 
 /**
- * Main function performs the following steps:
- * - set up signal handler
- * - parse & set upconfiguration
- * - initialize tcp connection
- * - initialize tls socket
- * - triggers https negocation
+ * Called once a tunnel no longer needs root: pppd is awake, or TUN interface
+ * is configured. As user ID is shared by all threads, privileges are dropped
+ * only when every tunnel is done with them.
  *
- * @param argc: number of command-line argument
- * @param argv: array of command-line argument
- *
- * @return EXIT_SUCCESS in a perfect world, EXIT_FAILURE otherwise
+ * @param t : tunnel
+ * @return 0 if all good, -1 if privileges could not be dropped
  */
-int main (int argc, char** argv)
+int release_privileges(sstp_tunnel_t* t)
 {
-  struct sigaction saction;
-  int retcode;
-  pid_t pid = -1;
-  char *tempdir = NULL;
+  if (!t->privileged)
+    return 0;
 
+  t->privileged = FALSE;
 
-#if !defined  __linux__
-  xlog (LOG_ERROR, "Operating system not supported\n");
-  return EXIT_FAILURE;
-#endif
+  if (__sync_sub_and_fetch(&tunnels_privileged, 1) || getuid() != 0)
+    return 0;
 
-  cfg = (sstp_config*) xmalloc(sizeof(sstp_config));
+  if (change_user(NO_PRIV_USER) < 0)
+    return -1;
 
-  parse_options(cfg, argc, argv);
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "Switch user to '%s'\n", NO_PRIV_USER);
 
+  return 0;
+}
 
-  if (getuid() != 0 || geteuid() != 0)
-    {
-      /* got root ? */
-      xlog (LOG_DEBUG, "%s is not running as root. Using capabilities\n",
-	    argv[0]);
 
-      /* or is capable ? *MUST* have KILL and SETEUID */
-      retcode = is_cap(CAP_KILL);
-      if (retcode != TRUE)
-	{
-	  xlog(LOG_ERROR, "Process not KILL capable. Check your privileges.\n");
-	  goto end;
-	}
-      retcode = is_cap(CAP_SETUID);
-      if (retcode != TRUE)
-	{
-	  xlog(LOG_ERROR, "Process is not SETEUID capable. Check your privileges.\n");
-	  goto end;
-	}
+/**
+ * Validates a tunnel configuration and fills default values. Missing
+ * mandatory arguments exit on error.
+ *
+ * @param cfg : tunnel configuration
+ * @return 0 if all good, -1 otherwise
+ */
+static int check_config(sstp_config* cfg)
+{
+  int retcode;
 
-    }
-  else
+  if (!cfg->srv)
+    check_required_arg(cfg->server);
+  check_required_arg(cfg->username);
+  check_required_arg(cfg->ca_file);
+
+  retcode = access (cfg->ca_file, R_OK);
+  if (retcode < 0)
+    {
+      xlog(LOG_ERROR, "%s is not readable.\n", cfg->ca_file);
+      return -1;
+    }
+
+  cfg->ca_file = realpath(cfg->ca_file, NULL);
+
+  if (!cfg->password)
+    {
+      if (cfg->verbose)
+	xlog(LOG_INFO, "No password specified for %s, prompting for one.\n",
+	     cfg->srv ? cfg->srv : cfg->server);
+
+      retcode = getpassword(cfg, "Password: ");
+
+      if (!cfg->password || retcode < 0)
+	{
+	  xlog(LOG_ERROR, "Failed to read password\n");
+	  if (errno && cfg->verbose > 2)
+	    xlog(LOG_ERROR, "errno: %s\n", strerror(errno));
+
+	  return -1;
+	}
+    }
+
+  check_default_arg(&cfg->port, "443");
+  check_default_arg(&cfg->pppd_path, "/usr/sbin/pppd");
+
+  if (cfg->proxy)
+    check_default_arg(&cfg->proxy_port, "8080");
+
+  if (!cfg->tx_batch)
+    cfg->tx_batch = 1;
+
+  if (cfg->tx_delay > 0 && cfg->tx_batch == 1)
+    {
+      xlog(LOG_WARNING, "TX delay is useless without TX batching. Dropping.\n");
+      cfg->tx_delay = 0;
+    }
+
+  if (cfg->proxy_port && !cfg->proxy)
+    xlog(LOG_ERROR, "No PROXYHOST specified for PROXYPORT '%s'. Dropping.\n",
+	 cfg->proxy_port);
+
+  if (cfg->tls_cache_ttl <= 0)
+    cfg->tls_cache_ttl = TLS_CACHE_DEFAULT_TTL;
+
+  if (cfg->tcp_keepidle > 0)
+    {
+      if (cfg->tcp_keepintvl <= 0)
+	cfg->tcp_keepintvl = TCP_KEEPALIVE_INTVL;
+      if (cfg->tcp_keepcnt <= 0)
+	cfg->tcp_keepcnt = TCP_KEEPALIVE_CNT;
+    }
+
+#ifndef HAS_GNUTLS
+  if (cfg->early_data)
+    {
+      xlog(LOG_WARNING, "TLS early data needs GnuTLS. Dropping.\n");
+      cfg->early_data = 0;
+    }
+#endif
+
+  if (cfg->early_data && !cfg->tls_cache)
+    xlog(LOG_WARNING, "TLS early data is only sent along with a cached session (-C).\n");
+
+  if (!cfg->native_ppp)
+    {
+      retcode = access (cfg->pppd_path, X_OK);
+      if (retcode < 0)
+	{
+	  xlog(LOG_ERROR, "Failed to access ppp binary.\n");
+	  return -1;
+	}
+
+      cfg->pppd_path = realpath(cfg->pppd_path, NULL);
+    }
+  else
+    cfg->pppd_path = NULL;
+
+  return 0;
+}
+
+
+/**
+ * Allocates a tunnel. Its configuration starts as a copy of command line
+ * configuration, then options of `line` (if any) are applied.
+ *
+ * @param name : tunnel name, used in logs
+ * @param line : tunnels file line, "name [OPTIONS+]", or NULL
+ * @return new tunnel
+ */
+static sstp_tunnel_t* tunnel_new(const char* name, const char* line)
+{
+  sstp_tunnel_t* t;
+  char *argv[TUNNEL_MAX_ARGS + 1], *saveptr, *token;
+  int argc;
+
+  t = (sstp_tunnel_t*) xmalloc(sizeof(sstp_tunnel_t));
+  t->cfg = (sstp_config*) xmalloc(sizeof(sstp_config));
+  memcpy(t->cfg, global_cfg, sizeof(sstp_config));
+  t->sockfd = -1;
+  t->ppp_fd = -1;
+  t->pppd_ready_fd = -1;
+  t->tls_cache_fd = -1;
+  t->resolv_cache_fd = -1;
+  t->servers.cache_fd = -1;
+
+  if (line)
+    {
+      /* option values point into the line, which lives as long as tunnel */
+      t->line = strdup(line);
+      argc = 0;
+      for (token = strtok_r(t->line, " \t", &saveptr); token && argc < TUNNEL_MAX_ARGS;
+	   token = strtok_r(NULL, " \t", &saveptr))
+	argv[argc++] = token;
+      argv[argc] = NULL;
+
+      t->name = argv[0];
+      optind = 0;
+      parse_options(t->cfg, argc, argv);
+    }
+  else
+    t->name = (char*) name;
+
+  return t;
+}
+
+
+/**
+ * Reads tunnels file: one tunnel per line, as a name followed by command
+ * line options (without quoting). Empty lines and lines starting with '#'
+ * are skipped.
+ *
+ * @param path : tunnels file
+ * @return number of tunnels read, -1 on error
+ */
+static int load_tunnels(const char* path)
+{
+  FILE* fd;
+  char buffer[1024], *line;
+  size_t len;
+
+  fd = fopen(path, "r");
+  if (!fd)
+    {
+      xlog(LOG_ERROR, "Failed to open '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  while (fgets(buffer, sizeof(buffer), fd))
+    {
+      len = strlen(buffer);
+      while (len && (buffer[len-1] == '\n' || buffer[len-1] == '\r' ||
+		     buffer[len-1] == ' ' || buffer[len-1] == '\t'))
+	buffer[--len] = '\0';
+
+      line = buffer + strspn(buffer, " \t");
+      if (*line == '\0' || *line == '#')
+	continue;
+
+      tunnels = realloc(tunnels, (ntunnels + 1) * sizeof(sstp_tunnel_t*));
+      if (!tunnels)
+	{
+	  perror("load_tunnels");
+	  abort();
+	}
+
+      tunnels[ntunnels++] = tunnel_new(NULL, line);
+    }
+
+  fclose(fd);
+  return ntunnels;
+}
+
+
+/**
+ * Releases everything a tunnel holds: SSTP session, PPP side and TLS session.
+ * Safe on a tunnel which failed to open, whatever the step.
+ *
+ * @param t : tunnel
+ */
+static void tunnel_close(sstp_tunnel_t* t)
+{
+  if (t->ctx)
+    sstp_tunnel_stop(t);
+
+  if (t->worker)
+    event_timer_cancel(&t->worker->loop, &t->reconnect_timer);
+  t->reconnecting = FALSE;
+
+  if (t->park)
+    xfree(t->park);
+  t->park = NULL;
+
+  if (t->ppp)
+    {
+      ppp_close(t->ppp);
+      xfree(t->ppp);
+      t->ppp = NULL;
+    }
+  else if (t->ppp_fd >= 0)
+    close(t->ppp_fd);
+  t->ppp_fd = -1;
+
+  /* pppd was never woken up */
+  if (t->pppd_pid > 0)
+    kill(t->pppd_pid, SIGTERM);
+  t->pppd_pid = 0;
+
+  if (t->pppd_ready_fd >= 0)
+    close(t->pppd_ready_fd);
+  t->pppd_ready_fd = -1;
+
+  end_tls_session(t, t->retcode);
+
+  if (t->sess)
+    xfree(t->sess);
+  t->sess = NULL;
+
+  release_privileges(t);
+}
+
+
+/**
+ * Waits for pppd to be running: its readiness pipe is closed by execv(), or
+ * gets execv() errno if it failed.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise
+ */
+static int pppd_wait_ready(sstp_tunnel_t* t)
+{
+  struct pollfd pfd = { t->pppd_ready_fd, POLLIN, 0 };
+  int retcode, err = 0;
+
+  do
+    retcode = poll(&pfd, 1, PPPD_READY_TIMEOUT);
+  while (retcode < 0 && errno == EINTR);
+
+  if (retcode == 0)
+    {
+      xlog(LOG_ERROR, "pppd_wait_ready: %s did not start within %d ms\n",
+	   t->cfg->pppd_path, PPPD_READY_TIMEOUT);
+      return -1;
+    }
+
+  if (retcode > 0)
+    retcode = read(t->pppd_ready_fd, &err, sizeof(int));
+
+  close(t->pppd_ready_fd);
+  t->pppd_ready_fd = -1;
+
+  if (retcode < 0)
+    {
+      xlog(LOG_ERROR, "pppd_wait_ready: %s\n", strerror(errno));
+      return -1;
+    }
+
+  if (retcode > 0)
+    {
+      xlog(LOG_ERROR, "Failed to execute %s: %s\n", t->cfg->pppd_path, strerror(err));
+      return -1;
+    }
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: pppd (PID:%d) is running\n", t->name, t->pppd_pid);
+
+  return 0;
+}
+
+
+/**
+ * Connects a tunnel to its current server: TCP connection (through proxy if
+ * any), TLS and HTTPS negociation.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise
+ */
+static int tunnel_connect(sstp_tunnel_t* t)
+{
+  int retcode;
+
+  /* create socket  */
+  t->sockfd = init_tcp(t);
+  if (t->sockfd < 0)
+    {
+      xlog(LOG_ERROR, "TCP socket has failed, leaving...\n");
+      return -1;
+    }
+
+  if (t->cfg->proxy != NULL && proxy_connect(t) < 0)
+    return -1;
+
+  /* wrap socket with tls socket, reconnecting as long as TLS versions fall back */
+  while ((retcode = init_tls_session(t)) != 0)
+    {
+#ifdef HAS_GNUTLS
+      /* no close notify for a broken handshake */
+      if (t->tls)
+	gnutls_deinit(t->tls);
+      t->tls = NULL;
+#endif
+      if (retcode < 0 || t->kill)
+	break;
+
+      end_tls_session(t, 1);
+
+      t->sockfd = init_tcp(t);
+      if (t->sockfd < 0)
+	{
+	  xlog(LOG_ERROR, "TCP socket has failed, leaving...\n");
+	  return -1;
+	}
+
+      if (t->cfg->proxy != NULL && proxy_connect(t) < 0)
+	return -1;
+    }
+
+  if (retcode != 0)
+    {
+      xlog(LOG_ERROR, "TLS session initialization has failed, leaving.\n");
+      return -1;
+    }
+
+  tunnel_phase(t, TUNNEL_PHASE_TLS);
+
+  if (check_tls_session(t) < 0)
+    {
+      xlog(LOG_ERROR, "TLS session check failed, leaving.\n");
+      return -1;
+    }
+
+  /* crypto binding then only copies certificate hash */
+  if (crypto_load_certificate(t) < 0)
+    return -1;
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "TLS session ready\n");
+
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "Initiating HTTPS negociation\n");
+
+  if (https_session_negociation(t) < 0)
+    {
+      xlog(LOG_ERROR, "An error occured in HTTPS negociation, leaving.\n");
+      return -1;
+    }
+
+  tunnel_phase(t, TUNNEL_PHASE_HTTP);
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "HTTPS session ready\n");
+
+  /* TLS 1.3 tickets have been received along with HTTPS response */
+  tls_cache_store(t);
+
+  /* from now on, only SSTP records are exchanged */
+  if (t->cfg->ktls && ktls_enable(t) < 0)
+    return -1;
+
+  return 0;
+}
+
+
+/**
+ * Runs every client step of a tunnel up to SSTP negociation: wakes up pppd,
+ * so that it starts during TCP connection (through proxy if any), TLS and
+ * HTTPS negociation, then waits for it to be running. With a server pool,
+ * servers are tried in turn until one connects, see servers.h.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise
+ */
+static int tunnel_open(sstp_tunnel_t* t)
+{
+  /* before first connection only, and not part of it */
+  servers_select(t);
+
+  /* time to link is counted from here, see sstp_decode() */
+  tunnel_phase(t, TUNNEL_PHASE_OPEN);
+
+  /* pppd starts along with handshakes, its first frames wait in pty */
+  if (t->pppd_pid > 0 && !t->reconnecting)
+    {
+      if (kill(t->pppd_pid, SIGUSR1) < 0)
+	{
+	  xlog(LOG_ERROR, "[FATAL] Failed to send signal %d to PID:%d\n", SIGUSR1, t->pppd_pid);
+	  if (t->cfg->verbose > 1)
+	    xlog(LOG_ERROR, "Reason: %s\n", strerror(errno));
+
+	  return -1;
+	}
+    }
+
+  while (tunnel_connect(t) < 0)
+    {
+      if (t->kill || servers_next(t) < 0)
+	return -1;
+
+      end_tls_session(t, 1);
+      t->ktls_mode = 0;
+
+      /* allocated again by https_session_negociation() */
+      if (t->sess)
+	xfree(t->sess);
+      t->sess = NULL;
+    }
+
+  t->servers.failed = 0;
+
+  /* pppd had every handshake long to start */
+  if (t->pppd_pid > 0 && t->pppd_ready_fd >= 0 && pppd_wait_ready(t) < 0)
+    return -1;
+
+  /* if sstoper was launched as root, we can drop privs here */
+  /* in native mode, this is done once TUN interface is configured */
+  if (!t->cfg->native_ppp && release_privileges(t) < 0)
+    return -1;
+
+  /* start sstp session */
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "Initiating SSTP negociation\n");
+
+  return 0;
+}
+
+
+/**
+ * Called when a tunnel ends: main thread tracks how many are left.
+ *
+ * @param t : tunnel
+ */
+static void tunnel_done(sstp_tunnel_t* t)
+{
+  uint64_t one = 1;
+
+  tunnel_close(t);
+  t->running = FALSE;
+  t->worker->running--;
+
+  __sync_sub_and_fetch(&tunnels_running, 1);
+  if (write(main_wakefd, &one, sizeof(uint64_t)) < 0)
+    xlog(LOG_ERROR, "tunnel_done: %s\n", strerror(errno));
+}
+
+
+static int tunnel_reconnect_event(void* data);
+
+
+/**
+ * Link to the server was lost by a running tunnel, or a reconnection attempt
+ * failed: SSTP session and TLS connection are released, but pppd (or TUN
+ * interface) is kept, along with its addresses and routes, and a new
+ * connection is attempted once the reconnection delay has elapsed. The delay
+ * doubles on each failure, from TUNNEL_RECONNECT_DELAY_MIN up to
+ * TUNNEL_RECONNECT_DELAY_MAX.
+ *
+ * @param t : tunnel
+ */
+static void tunnel_suspend(sstp_tunnel_t* t)
+{
+  if (!t->reconnecting)
+    {
+      if (t->ppp)
+	xlog(LOG_WARNING, "%s: link lost, keeping %s up while reconnecting\n", t->name,
+	     t->ppp->ifname);
+      else
+	xlog(LOG_WARNING, "%s: link lost, keeping %s running while reconnecting, "
+	     "its interface goes down until PPP is negociated again\n", t->name,
+	     t->cfg->pppd_path);
+
+      t->reconnecting = TRUE;
+      t->reconnects = 0;
+      t->reconnect_delay = TUNNEL_RECONNECT_DELAY_MIN;
+    }
+  else
+    {
+      t->reconnect_delay *= 2;
+      if (t->reconnect_delay > TUNNEL_RECONNECT_DELAY_MAX)
+	t->reconnect_delay = TUNNEL_RECONNECT_DELAY_MAX;
+    }
+
+  sstp_tunnel_suspend(t);
+
+  end_tls_session(t, 1);
+  t->ktls_mode = 0;
+
+  /* allocated again by https_session_negociation() */
+  if (t->sess)
+    xfree(t->sess);
+  t->sess = NULL;
+
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "%s: reconnecting in %ld ms\n", t->name, t->reconnect_delay);
+
+  event_timer_init(&t->reconnect_timer, tunnel_reconnect_event, t);
+  if (event_timer_arm(&t->worker->loop, &t->reconnect_timer, t->reconnect_delay * 1000) < 0)
+    {
+      xlog(LOG_ERROR, "tunnel_suspend: %s\n", strerror(errno));
+      t->retcode = -1;
+      tunnel_done(t);
+    }
+}
+
+
+/**
+ * Connector thread: runs every client step of a connection (first one or a
+ * reconnection) up to SSTP negociation. They block (name resolution, TCP
+ * connection, TLS and HTTPS negociation), and other tunnels of the worker
+ * must still be served meanwhile. Worker is woken up once done, see
+ * tunnel_connected().
+ *
+ * @param data : tunnel
+ * @return NULL
+ */
+static void* tunnel_connect_thread(void* data)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) data;
+  uint64_t one = 1;
+
+  t->connect_retcode = tunnel_open(t);
+
+  __sync_synchronize();
+  t->connect_state = TUNNEL_CONNECT_DONE;
+
+  if (write(t->worker->wakefd, &one, sizeof(uint64_t)) < 0)
+    xlog(LOG_ERROR, "tunnel_connect_thread: %s\n", strerror(errno));
+
+  return NULL;
+}
+
+
+/**
+ * Hands client steps of a tunnel to a connector thread. The tunnel belongs to
+ * it until it is done.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise
+ */
+static int tunnel_connect_start(sstp_tunnel_t* t)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int retcode;
+
+  t->connect_state = TUNNEL_CONNECT_RUNNING;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  retcode = pthread_create(&thread, &attr, tunnel_connect_thread, t);
+  pthread_attr_destroy(&attr);
+
+  if (retcode != 0)
+    {
+      xlog(LOG_ERROR, "tunnel_connect_start: pthread_create: %s\n", strerror(retcode));
+      t->connect_state = TUNNEL_CONNECT_IDLE;
+      return -1;
+    }
+
+  return 0;
+}
+
+
+/**
+ * Reconnection delay expiration: client steps are run again by a connector
+ * thread. Meanwhile, the worker only parks PPP side frames of this tunnel.
+ *
+ * @param data : tunnel
+ * @return 0
+ */
+static int tunnel_reconnect_event(void* data)
+{
+  sstp_tunnel_t* t = (sstp_tunnel_t*) data;
+
+  if (t->kill)
+    {
+      tunnel_done(t);
+      return 0;
+    }
+
+  t->reconnects++;
+  if (t->cfg->verbose)
+    xlog(LOG_INFO, "%s: reconnection attempt %u\n", t->name, t->reconnects);
+
+  if (tunnel_connect_start(t) < 0)
+    tunnel_suspend(t);
+
+  return 0;
+}
+
+
+/**
+ * Connector thread is done, back in the worker: SSTP negociation starts on
+ * the new connection. A reconnected tunnel is resumed once PPP is up, see
+ * sstp_tunnel_resume(), or suspended again if it failed. A first connection
+ * failing, or a disconnection asked meanwhile, ends the tunnel.
+ *
+ * @param t : tunnel
+ */
+static void tunnel_connected(sstp_tunnel_t* t)
+{
+  t->connect_state = TUNNEL_CONNECT_IDLE;
+
+  if (t->kill)
+    tunnel_done(t);
+  else if (t->connect_retcode < 0 || sstp_tunnel_start(t) < 0)
+    {
+      if (t->reconnecting)
+	tunnel_suspend(t);
+      else
+	{
+	  t->retcode = -1;
+	  tunnel_done(t);
+	}
+    }
+}
+
+
+/**
+ * Decides what becomes of a disconnected tunnel: with cfg->reconnect, a link
+ * lost (or not resumed yet) while nobody asked for disconnection is
+ * suspended, any other disconnection ends the tunnel.
+ *
+ * @param t : tunnel
+ */
+static void tunnel_disconnected(sstp_tunnel_t* t)
+{
+  if (t->cfg->reconnect && !t->kill &&
+      (t->ppp || t->pppd_pid > 0) &&
+      !(t->ctx->flags & REMOTE_DISCONNECTION) &&
+      (t->reconnecting || (t->ctx->flags & LINK_FAILURE)))
+    tunnel_suspend(t);
+  else
+    tunnel_done(t);
+}
+
+
+/**
+ * Worker wake up handler: disconnects tunnels for which main thread asked
+ * so (signal received, or pppd died), and starts connected ones.
+ *
+ * @return 0
+ */
+static int worker_wake_event(int fd, uint32_t events UNUSED, void* data)
+{
+  sstp_worker_t* w = (sstp_worker_t*) data;
+  uint64_t value;
+  unsigned int i;
+
+  if (read(fd, &value, sizeof(uint64_t)) != sizeof(uint64_t))
+    return 0;
+
+  for (i=0; i<w->ntunnels; i++)
     {
-      xlog (LOG_WARNING,
-	    "%s is running as root. This could be potentially dangerous. "
-	    "Consider using capabilities.\n",
-	    argv[0]);
+      sstp_tunnel_t* t = w->tunnels[i];
+
+      if (!t->running)
+	continue;
+
+      /* tunnel belongs to its connector thread until it is done */
+      if (t->connect_state == TUNNEL_CONNECT_DONE)
+	{
+	  __sync_synchronize();
+	  tunnel_connected(t);
+	}
+      else if (t->connect_state == TUNNEL_CONNECT_RUNNING)
+	continue;
+
+      else if (t->kill && t->ctx)
+	set_client_status(t, CLIENT_CALL_DISCONNECTED);
+
+      /* waiting for reconnection */
+      else if (t->kill)
+	tunnel_done(t);
     }
 
-  check_required_arg(cfg->server);
-  check_required_arg(cfg->username);
-  check_required_arg(cfg->ca_file);
+  return 0;
+}
 
-  retcode = access (cfg->ca_file, R_OK);
-  if (retcode < 0)
+
+/**
+ * Worker thread: opens its tunnels at once, each one on a connector thread,
+ * then runs their event loop until all of them are disconnected. A tunnel
+ * slow to connect does not hold back the others.
+ *
+ * @param data : worker
+ * @return NULL
+ */
+static void* worker_run(void* data)
+{
+  sstp_worker_t* w = (sstp_worker_t*) data;
+  sstp_tunnel_t* t;
+  unsigned int i;
+
+  for (i=0; i<w->ntunnels; i++)
     {
-      xlog(LOG_ERROR, "%s is not readable.\n", cfg->ca_file);
-      goto end;
+      t = w->tunnels[i];
+      t->running = TRUE;
+      w->running++;
+
+      if (t->kill || tunnel_connect_start(t) < 0)
+	{
+	  t->retcode = -1;
+	  tunnel_done(t);
+	}
     }
 
-  cfg->ca_file = realpath(cfg->ca_file, NULL);
+  while (w->running)
+    {
+      for (i=0; i<w->ntunnels; i++)
+	if (w->tunnels[i]->running)
+	  sstp_tunnel_kick(w->tunnels[i]);
 
-  if (!cfg->password)
+      if (event_dispatch(&w->loop, -1) < 0)
+	{
+	  xlog(LOG_ERROR, "worker %u: leaving event loop on error: %s\n", w->id, strerror(errno));
+	  for (i=0; i<w->ntunnels; i++)
+	    if (w->tunnels[i]->running && w->tunnels[i]->ctx)
+	      {
+		w->tunnels[i]->kill = TRUE;
+		set_client_status(w->tunnels[i], CLIENT_CALL_DISCONNECTED);
+	      }
+	    else if (w->tunnels[i]->running &&
+		     w->tunnels[i]->connect_state == TUNNEL_CONNECT_IDLE)
+	      tunnel_done(w->tunnels[i]);
+	}
+
+      /* handlers of a tunnel may be called up to the end of a dispatch */
+      for (i=0; i<w->ntunnels; i++)
+	{
+	  t = w->tunnels[i];
+	  if (t->running && t->ctx && t->ctx->state == CLIENT_CALL_DISCONNECTED)
+	    tunnel_disconnected(t);
+	}
+    }
+
+  return NULL;
+}
+
+
+/**
+ * Main thread signal handler: SIGINT and SIGTERM close every tunnel, SIGCHLD
+ * closes tunnels whose pppd died, SIGUSR2 logs connection milestones.
+ *
+ * @return 0
+ */
+static int main_signal_event(int fd, uint32_t events UNUSED, void* data UNUSED)
+{
+  struct signalfd_siginfo si;
+  uint64_t one = 1;
+  unsigned int i;
+  char buf[1024];
+
+  while (read(fd, &si, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo))
     {
-      if (cfg->verbose)
-	xlog(LOG_INFO, "No password specified, prompting for one.\n");
+      /* connection milestones of every tunnel, see tunnel_phase() */
+      if (si.ssi_signo == SIGUSR2)
+	{
+	  for (i=0; i<ntunnels; i++)
+	    if (tunnel_phases_json(tunnels[i], buf, sizeof(buf)) > 0)
+	      xlog(LOG_INFO, "%s\n", buf);
+	  continue;
+	}
+
+      for (i=0; i<ntunnels; i++)
+	{
+	  sstp_tunnel_t* t = tunnels[i];
+
+	  switch (si.ssi_signo)
+	    {
+	    case SIGCHLD:
+	      if (t->pppd_pid <= 0 || kill(t->pppd_pid, 0) == 0 || errno != ESRCH)
+		continue;
+
+	      if (t->cfg->verbose)
+		xlog(LOG_ERROR, "%s (PID:%d) died\n", t->cfg->pppd_path, t->pppd_pid);
+	      break;
+
+	    case SIGINT:
+	    case SIGTERM:
+	      if (t->cfg->verbose)
+		xlog(LOG_INFO, "%s: closing connection\n", t->name);
+	      break;
+	    }
+
+	  t->kill = TRUE;
+	}
+    }
 
-      retcode = getpassword("Password: ");
+  /* worker reads flags once woken up */
+  for (i=0; i<nworkers; i++)
+    if (write(workers[i].wakefd, &one, sizeof(uint64_t)) < 0)
+      xlog(LOG_ERROR, "main_signal_event: %s\n", strerror(errno));
 
-      if (!cfg->password || retcode < 0)
+  return 0;
+}
+
+
+/**
+ * Main thread wake up handler, a tunnel has ended.
+ *
+ * @return 0
+ */
+static int main_wake_event(int fd, uint32_t events UNUSED, void* data UNUSED)
+{
+  uint64_t value;
+
+  if (read(fd, &value, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+    xlog(LOG_ERROR, "main_wake_event: %s\n", strerror(errno));
+
+  return 0;
+}
+
+
+/**
+ * Pins a worker thread to one of the CPUs the process may run on.
+ *
+ * @param w : worker
+ */
+static void worker_set_affinity(sstp_worker_t* w)
+{
+  cpu_set_t allowed, cpuset;
+  int cpu, n, ncpus;
+
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) < 0)
+    return;
+
+  ncpus = CPU_COUNT(&allowed);
+  if (ncpus < 2)
+    return;
+
+  n = w->id % ncpus;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+      break;
+
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  if (pthread_setaffinity_np(w->thread, sizeof(cpu_set_t), &cpuset) != 0)
+    xlog(LOG_WARNING, "Failed to pin worker %u to CPU %d\n", w->id, cpu);
+  else if (global_cfg->verbose > 1)
+    xlog(LOG_DEBUG, "Worker %u pinned to CPU %d\n", w->id, cpu);
+}
+
+
+/**
+ * Spreads tunnels over workers (one per CPU by default), and starts them.
+ *
+ * @return 0 if all good, -1 otherwise
+ */
+static int start_workers()
+{
+  long ncpus;
+  unsigned int i;
+  sstp_worker_t* w;
+
+  nworkers = global_cfg->workers;
+  if (!nworkers)
+    {
+      ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      nworkers = (ncpus > 0) ? ncpus : 1;
+    }
+  if (nworkers > ntunnels)
+    nworkers = ntunnels;
+
+  workers = (sstp_worker_t*) xmalloc(nworkers * sizeof(sstp_worker_t));
+
+  for (i=0; i<nworkers; i++)
+    {
+      w = &workers[i];
+      w->id = i;
+      w->tunnels = (sstp_tunnel_t**) xmalloc(ntunnels * sizeof(sstp_tunnel_t*));
+      w->wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+      if (w->wakefd < 0 || event_loop_init(&w->loop) < 0)
 	{
-	  xlog(LOG_ERROR, "Failed to read password\n");
-	  if (errno && cfg->verbose > 2)
-	    xlog(LOG_ERROR, "errno: %s\n", strerror(errno));
+	  xlog(LOG_ERROR, "start_workers: %s\n", strerror(errno));
+	  return -1;
+	}
+
+      w->wake_handler.fd = w->wakefd;
+      w->wake_handler.cb = worker_wake_event;
+      w->wake_handler.data = w;
+      if (event_add(&w->loop, &w->wake_handler, EPOLLIN) < 0)
+	{
+	  xlog(LOG_ERROR, "start_workers: %s\n", strerror(errno));
+	  return -1;
+	}
+    }
+
+  for (i=0; i<ntunnels; i++)
+    {
+      w = &workers[i % nworkers];
+      tunnels[i]->worker = w;
+      w->tunnels[w->ntunnels++] = tunnels[i];
+    }
+
+  if (global_cfg->verbose)
+    xlog(LOG_INFO, "Running %u tunnel(s) on %u worker(s)\n", ntunnels, nworkers);
+
+  for (i=0; i<nworkers; i++)
+    {
+      w = &workers[i];
+      if (pthread_create(&w->thread, NULL, worker_run, w) != 0)
+	{
+	  xlog(LOG_ERROR, "Failed to start worker %u\n", i);
+	  nworkers = i;
+	  return -1;
+	}
+
+      if (nworkers > 1)
+	worker_set_affinity(w);
+    }
+
+  return 0;
+}
+
+
+/**
+ * Main function performs the following steps:
+ * - set up signal handler
+ * - parse & set upconfiguration (one tunnel, or a tunnels file)
+ * - create TUN interfaces or suspended pppd processes while still privileged
+ * - start workers, each one running its tunnels:
+ *   - initialize tcp connection
+ *   - initialize tls socket
+ *   - triggers https negocation
+ * - wait for signals, and for every tunnel to end
+ *
+ * @param argc: number of command-line argument
+ * @param argv: array of command-line argument
+ *
+ * @return EXIT_SUCCESS in a perfect world, EXIT_FAILURE otherwise
+ */
+int main (int argc, char** argv)
+{
+  struct sigaction saction;
+  sigset_t mask;
+  int retcode, sigfd = -1;
+  unsigned int i, nchecked = 0;
+  char *tempdir = NULL;
+  event_handler_t signal_handler, wake_handler;
+  sstp_tunnel_t* t;
+
+
+#if !defined  __linux__
+  xlog (LOG_ERROR, "Operating system not supported\n");
+  return EXIT_FAILURE;
+#endif
+
+  global_cfg = (sstp_config*) xmalloc(sizeof(sstp_config));
+  main_loop.epfd = -1;
+
+  parse_options(global_cfg, argc, argv);
 
+  if (global_cfg->bench_ciphers)
+    {
+      retcode = bench_print();
+      xfree(global_cfg);
+      return (retcode < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+  if (global_cfg->tunnels_file)
+    {
+      if (load_tunnels(global_cfg->tunnels_file) <= 0)
+	{
+	  xlog(LOG_ERROR, "No tunnel found in '%s'.\n", global_cfg->tunnels_file);
+	  retcode = -1;
 	  goto end;
 	}
     }
+  else
+    {
+      check_required_arg(global_cfg->srv ? global_cfg->srv : global_cfg->server);
+      tunnels = (sstp_tunnel_t**) xmalloc(sizeof(sstp_tunnel_t*));
+      tunnels[ntunnels++] = tunnel_new(global_cfg->srv ? global_cfg->srv : global_cfg->server, NULL);
+    }
 
-  check_default_arg(&cfg->port, "443");
-  check_default_arg(&cfg->pppd_path, "/usr/sbin/pppd");
 
-  if (cfg->proxy)
-    check_default_arg(&cfg->proxy_port, "8080");
+  if (getuid() != 0 || geteuid() != 0)
+    {
+      /* got root ? */
+      xlog (LOG_DEBUG, "%s is not running as root. Using capabilities\n",
+	    argv[0]);
 
-  if (cfg->proxy_port && !cfg->proxy)
-    xlog(LOG_ERROR, "No PROXYHOST specified for PROXYPORT '%s'. Dropping.\n",
-	 cfg->proxy_port);
+      /* or is capable ? *MUST* have KILL (or NET_ADMIN in native mode) and SETEUID */
+      for (i=0; i<ntunnels; i++)
+	{
+	  if (tunnels[i]->cfg->native_ppp)
+	    {
+	      retcode = is_cap(CAP_NET_ADMIN);
+	      if (retcode != TRUE)
+		{
+		  xlog(LOG_ERROR, "Process not NET_ADMIN capable. Check your privileges.\n");
+		  goto end;
+		}
+	    }
+	  else
+	    {
+	      retcode = is_cap(CAP_KILL);
+	      if (retcode != TRUE)
+		{
+		  xlog(LOG_ERROR, "Process not KILL capable. Check your privileges.\n");
+		  goto end;
+		}
+	    }
+	}
+      retcode = is_cap(CAP_SETUID);
+      if (retcode != TRUE)
+	{
+	  xlog(LOG_ERROR, "Process is not SETEUID capable. Check your privileges.\n");
+	  goto end;
+	}
 
-  retcode = access (cfg->pppd_path, X_OK);
-  if (retcode < 0)
+    }
+  else
+    {
+      xlog (LOG_WARNING,
+	    "%s is running as root. This could be potentially dangerous. "
+	    "Consider using capabilities.\n",
+	    argv[0]);
+    }
+
+  for (nchecked=0; nchecked<ntunnels; nchecked++)
     {
-      xlog(LOG_ERROR, "Failed to access ppp binary.\n");
-      goto end;
+      retcode = check_config(tunnels[nchecked]->cfg);
+      if (retcode < 0)
+	goto end;
     }
 
-  cfg->pppd_path = realpath(cfg->pppd_path, NULL);
+  for (i=0; i<ntunnels; i++)
+    {
+      retcode = servers_init(tunnels[i]);
+      if (retcode < 0)
+	goto end;
+    }
 
-  if (cfg->verbose)
-    xlog(LOG_INFO, "Verbose level: %d\n", cfg->verbose);
+  if (global_cfg->verbose)
+    xlog(LOG_INFO, "Verbose level: %d\n", global_cfg->verbose);
 
 
   /* catch signal */
@@ -998,17 +2443,26 @@ int main (int argc, char** argv)
   saction.sa_flags = SA_NOCLDSTOP|SA_NOCLDWAIT;
   sigemptyset(&saction.sa_mask);
 
-  sigaction(SIGINT, &saction, NULL);
-  sigaction(SIGALRM, &saction, NULL);
   sigaction(SIGCHLD, &saction, NULL);
   sigaction(SIGUSR1, &saction, NULL);
 
+  /* read from a signalfd by main thread; blocked mask is inherited by workers */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+
+  /* a tunnel writing to a dead socket fails on its own */
+  signal(SIGPIPE, SIG_IGN);
+
 
   /* main starts here */
-  if (cfg->daemon)
+  if (global_cfg->daemon)
     {
-      if (cfg->verbose > 1)
-	xlog(LOG_DEBUG, "Starting daemon (send SIGINT to close properly)\n");
+      if (global_cfg->verbose > 1)
+	xlog(LOG_DEBUG, "Starting daemon (send SIGINT or SIGTERM to close properly)\n");
 
       if (daemon(0, 0) < 0)
 	{
@@ -1017,27 +2471,51 @@ int main (int argc, char** argv)
 	}
     }
 
-  if (cfg->verbose > 1)
+  if (global_cfg->verbose > 1)
     xlog (LOG_DEBUG, "Starting %s as %d\n", argv[0], getpid());
 
-  /* create socket  */
-  sockfd = init_tcp();
-  if (sockfd < 0)
+#ifdef HAS_GNUTLS
+  gnutls_global_init();
+#endif
+
+  /* every tunnel holds privileges until it is set up, see release_privileges() */
+  for (i=0; i<ntunnels; i++)
+    tunnels[i]->privileged = (getuid() == 0);
+  tunnels_privileged = (getuid() == 0) ? ntunnels : 0;
+
+
+  /* cache files may not be writable once privileges are dropped */
+  for (i=0; i<ntunnels; i++)
     {
-      xlog(LOG_ERROR, "TCP socket has failed, leaving...\n");
-      goto end;
+      retcode = servers_open(tunnels[i]);
+      if (retcode < 0)
+	goto disco;
     }
 
-  if (cfg->proxy != NULL)
+  /* a few ms spent timing ciphers, unless already done on this host */
+  if (global_cfg->auto_cipher)
+    bench_auto(global_cfg->tls_cache, global_cfg->verbose);
+
+  /* TUN interfaces must be created while still privileged */
+  for (i=0; i<ntunnels; i++)
     {
-      retcode = proxy_connect();
+      t = tunnels[i];
+      if (!t->cfg->native_ppp)
+	continue;
+
+      t->ppp = (ppp_context_t*) xmalloc(sizeof(ppp_context_t));
+      retcode = ppp_init(t->ppp, t);
       if (retcode < 0)
-	goto end;
+	{
+	  xfree(t->ppp);
+	  t->ppp = NULL;
+	  goto disco;
+	}
+      t->ppp_fd = t->ppp->tun_fd;
     }
 
-
   /* drop privileges and change user */
-  if (cfg->verbose)
+  if (global_cfg->verbose)
     xlog(LOG_INFO, "Dropping privileges\n");
 
   tempdir = strdup(NO_PRIV_DIR) ;
@@ -1055,7 +2533,7 @@ int main (int argc, char** argv)
       retcode = -1;
       goto disco;
     }
-  if (cfg->verbose > 1)
+  if (global_cfg->verbose > 1)
     xlog(LOG_DEBUG, "chdir-ed to'%s'\n", tempdir);
 
   /* if user is not root, all privileges can be dropped right now */
@@ -1065,99 +2543,140 @@ int main (int argc, char** argv)
       retcode = change_user(NO_PRIV_USER);
       if (retcode < 0)
 	goto disco;
-      if (cfg->verbose > 1)
+      if (global_cfg->verbose > 1)
 	xlog(LOG_DEBUG, "Switch user to '%s'\n", NO_PRIV_USER);
       }
 
-  /* create forked pppd process as suspended */
-  pid = sstp_fork();
-  if (pid <= 0)
+  /* create forked pppd processes as suspended */
+  for (i=0; i<ntunnels; i++)
     {
-      xlog(LOG_ERROR, "Cannot create pppd process, leaving.\n");
-      retcode = -1 ;
-      goto disco;
-    }
-
-  if (cfg->verbose)
-    xlog (LOG_INFO, "'%s' forked with PID %d\n", cfg->pppd_path, pid);
+      t = tunnels[i];
+      if (t->cfg->native_ppp)
+	continue;
 
+      t->pppd_pid = sstp_fork(t);
+      if (t->pppd_pid <= 0)
+	{
+	  xlog(LOG_ERROR, "Cannot create pppd process, leaving.\n");
+	  t->pppd_pid = 0;
+	  retcode = -1 ;
+	  goto disco;
+	}
 
-  /* wrap socket with tls socket */
-  retcode = init_tls_session();
-  if (retcode < 0)
-    {
-      xlog(LOG_ERROR, "TLS session initialization has failed, leaving.\n");
-      goto disco;
+      if (t->cfg->verbose)
+	xlog (LOG_INFO, "'%s' forked with PID %d\n", t->cfg->pppd_path, t->pppd_pid);
     }
 
-  retcode = check_tls_session();
-  if (retcode < 0)
+
+  /* main thread only waits for signals and tunnels end */
+  sigfd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+  main_wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (sigfd < 0 || main_wakefd < 0 || event_loop_init(&main_loop) < 0)
     {
-      xlog(LOG_ERROR, "TLS session check failed, leaving.\n");
+      xlog(LOG_ERROR, "main: %s\n", strerror(errno));
+      retcode = -1;
       goto disco;
     }
 
-  if (cfg->verbose)
-    xlog(LOG_INFO, "TLS session ready\n");
-
-
-  if (cfg->verbose)
-    xlog(LOG_INFO, "Initiating HTTPS negociation\n");
+  signal_handler.fd = sigfd;
+  signal_handler.cb = main_signal_event;
+  signal_handler.data = NULL;
+  wake_handler.fd = main_wakefd;
+  wake_handler.cb = main_wake_event;
+  wake_handler.data = NULL;
 
-  retcode = https_session_negociation();
-  if (retcode < 0)
+  if (event_add(&main_loop, &signal_handler, EPOLLIN) < 0 ||
+      event_add(&main_loop, &wake_handler, EPOLLIN) < 0)
     {
-      xlog(LOG_ERROR, "An error occured in HTTPS negociation, leaving.\n");
+      xlog(LOG_ERROR, "main: %s\n", strerror(errno));
+      retcode = -1;
       goto disco;
     }
 
-  if (cfg->verbose)
-    xlog(LOG_INFO, "HTTPS session ready\n");
-
-  /* wake up pppd */
-  retcode = kill(pid, SIGUSR1);
+  tunnels_running = ntunnels;
+  retcode = start_workers();
   if (retcode < 0)
     {
-      xlog(LOG_ERROR, "[FATAL] Failed to send signal %d to PID:%d\n", SIGUSR1, pid);
-      if (cfg->verbose > 1)
-	xlog(LOG_ERROR, "Reason: %s\n", strerror(errno));
-
-      retcode = -1;
-      goto disco;
+      /* started workers see their tunnels killed */
+      for (i=0; i<ntunnels; i++)
+	tunnels[i]->kill = TRUE;
+      main_signal_event(-1, 0, NULL);
     }
 
-
-  /* if sstoper was launched as root, we can drop privs here */
-  if (getuid() == 0)
+  while (__sync_fetch_and_add(&tunnels_running, 0) > 0 && nworkers)
     {
-      retcode = change_user(NO_PRIV_USER);
+      if (event_dispatch(&main_loop, -1) < 0)
+	{
+	  xlog(LOG_ERROR, "main: %s\n", strerror(errno));
+	  break;
+	}
+
+      /* some workers never started */
       if (retcode < 0)
-	goto disco;
-      if (cfg->verbose > 1)
-	xlog(LOG_DEBUG, "Switch user to '%s'\n", NO_PRIV_USER);
+	break;
     }
 
-  /* start sstp session */
-  if (cfg->verbose)
-    xlog(LOG_INFO, "Initiating SSTP negociation\n");
+  for (i=0; i<nworkers; i++)
+    pthread_join(workers[i].thread, NULL);
 
-  sleep(1);
-
-  sstp_loop(pid);
+  for (i=0; i<ntunnels; i++)
+    if (tunnels[i]->retcode)
+      retcode = -1;
 
  disco:
-  unlink(tempdir);
+  if (tempdir)
+    unlink(tempdir);
+
+  /* tunnels which did not go through a worker */
+  for (i=0; i<ntunnels; i++)
+    if (!tunnels[i]->worker || nworkers <= tunnels[i]->worker->id)
+      {
+	tunnels[i]->retcode = retcode;
+	tunnel_close(tunnels[i]);
+      }
+
+  for (i=0; i<nworkers; i++)
+    {
+      event_loop_close(&workers[i].loop);
+      close(workers[i].wakefd);
+      xfree(workers[i].tunnels);
+    }
 
-  if (pid > 0)
-    kill(pid, SIGTERM);
+  event_loop_close(&main_loop);
+  if (sigfd >= 0)
+    close(sigfd);
+  if (main_wakefd >= 0)
+    close(main_wakefd);
+
+#ifdef HAS_GNUTLS
+  gnutls_global_deinit();
+#endif
 
   retcode = !retcode ? EXIT_SUCCESS : EXIT_FAILURE;
-  end_tls_session(retcode);
 
  end :
-  xfree(tempdir);
-  xfree(cfg->pppd_path);
-  xfree(cfg->ca_file);
-  xfree(cfg);
+  if (tempdir)
+    xfree(tempdir);
+  for (i=0; i<ntunnels; i++)
+    {
+      t = tunnels[i];
+      /* realpath()-ed by check_config() */
+      if (i < nchecked)
+	{
+	  if (t->cfg->pppd_path)
+	    xfree(t->cfg->pppd_path);
+	  xfree(t->cfg->ca_file);
+	}
+      servers_close(t);
+      xfree(t->cfg);
+      if (t->line)
+	xfree(t->line);
+      xfree(t);
+    }
+  if (tunnels)
+    xfree(tunnels);
+  if (workers)
+    xfree(workers);
+  xfree(global_cfg);
   return retcode;
 }
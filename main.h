@@ -61,6 +61,7 @@ typedef struct
   int verbose;
   int daemon;
   char* server;
+  char* srv;
   char* port;
   char* ca_file;
   char* username;
@@ -70,26 +71,38 @@ typedef struct
   char* domain;
   char* proxy;
   char* proxy_port;
+  char* proxy_auth;
+  unsigned int tx_batch;
+  long tx_delay;
+  int native_ppp;
+  int ktls;
+  int io_uring;
+  char* tunnels_file;
+  unsigned int workers;
+  char* tls_cache;
+  long tls_cache_ttl;
+  char* tls_priority;
+  int auto_cipher;
+  int bench_ciphers;
+  int tcp_fastopen;
+  long tcp_user_timeout;
+  int tcp_keepidle;
+  int tcp_keepintvl;
+  int tcp_keepcnt;
+  int early_data;
+  int reconnect;
 } sstp_config;
 
-#ifdef HAS_GNUTLS
-gnutls_session_t tls;
-gnutls_x509_crt_t certificate;
-gnutls_certificate_credentials_t creds;
-#else
-entropy_context entropy;
-ctr_drbg_context ctr_drbg;
-ssl_context tls;
-x509_crt certificate;
-#endif
-
-sock_t sockfd;
-sstp_config *cfg;
 int do_loop;
 
+struct __sstp_tunnel;
+
 
 extern int snprintf (char *__restrict __s, size_t __maxlen, __const char *__restrict __format, ...);
 
 void xlog(int type, const char* fmt, ...);
+extern __thread unsigned long xmalloc_count;
 void* xmalloc(size_t size);
 void xfree(void*);
+int change_user(char* user);
+int release_privileges(struct __sstp_tunnel* t);
@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+# kTLS loopback check: runs sstoper with --ktls against 'openssl s_server -ktls'
+# on 127.0.0.1, which answers HTTPS negociation and SSTP Call Connect Request.
+# Call Connect Request then goes through kernel TLS transmit path, and Call
+# Connect Ack through kernel TLS receive path.
+#
+# Requires root (TUN device), kernel 'tls' module, and an OpenSSL built with
+# kTLS support.
+#
+# Syntax: misc/ktls_loopback.sh [sstoper [port]]
+#
+
+SSTOPER=${1:-./sstoper}
+PORT=${2:-14433}
+TMP=$(mktemp -d /tmp/sstoper-ktls.XXXXXX)
+
+cleanup()
+{
+    [ -n "$CLIENT" ] && kill $CLIENT 2>/dev/null
+    [ -n "$SERVER" ] && kill $SERVER 2>/dev/null
+    rm -fr -- "$TMP"
+}
+trap cleanup EXIT
+
+if ! grep -qw tls /proc/sys/net/ipv4/tcp_available_ulp 2>/dev/null; then
+    modprobe tls 2>/dev/null
+    if ! grep -qw tls /proc/sys/net/ipv4/tcp_available_ulp 2>/dev/null; then
+        echo "[-] Kernel 'tls' module is not available"
+        exit 1
+    fi
+fi
+
+if ! openssl s_server -help 2>&1 | grep -q -- "-ktls"; then
+    echo "[-] openssl s_server has no -ktls option"
+    exit 1
+fi
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" \
+    -addext "subjectAltName=DNS:localhost" \
+    -keyout "$TMP/key.pem" -out "$TMP/cert.pem" >/dev/null 2>&1 || exit 1
+
+# HTTPS response, then Call Connect Ack once client offloaded TLS to kernel
+(
+    printf 'HTTP/1.1 200 OK\r\nContent-Length: 18446744073709551615\r\n\r\n'
+    sleep 2
+    printf '\x10\x01\x00\x30\x00\x02\x00\x01\x00\x04\x00\x28\x00\x00\x00\x02'
+    head -c 32 /dev/urandom
+    sleep 3
+) | openssl s_server -accept 127.0.0.1:$PORT -cert "$TMP/cert.pem" -key "$TMP/key.pem" \
+    -ktls -quiet -naccept 1 > "$TMP/server.out" 2> "$TMP/server.log" &
+SERVER=$!
+sleep 1
+
+$SSTOPER -s localhost -p $PORT -c "$TMP/cert.pem" -U user -P pass -N -k -v \
+    > "$TMP/client.log" 2>&1 &
+CLIENT=$!
+sleep 4
+
+retcode=0
+if grep -q "kTLS: TX and RX in kernel" "$TMP/client.log"; then
+    echo "[+] Session offloaded to kernel"
+else
+    echo "[-] Session not offloaded:"
+    grep "kTLS" "$TMP/client.log"
+    retcode=1
+fi
+
+# SSTP Call Connect Request: control packet of 14 bytes, message type 1
+if od -An -tx1 "$TMP/server.out" | tr -d ' \n' | grep -q "1001000e0001"; then
+    echo "[+] Call Connect Request received by server (kernel TX)"
+else
+    echo "[-] Call Connect Request not received by server"
+    retcode=1
+fi
+
+if grep -q "CLIENT_CONNECT_ACK_RECEIVED" "$TMP/client.log"; then
+    echo "[+] Call Connect Ack received by client (kernel RX)"
+else
+    echo "[-] Call Connect Ack not received by client"
+    retcode=1
+fi
+
+exit $retcode
@@ -0,0 +1,244 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "main.h"
+#include "libsstp.h"
+#include "ntlm.h"
+
+#define NTLM_SIGNATURE "NTLMSSP"
+#define NTLM_EPOCH_OFFSET 11644473600ULL	/* sec from 1601 to 1970 */
+
+
+static void ntlm_put16(unsigned char* p, uint16_t v)
+{
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static void ntlm_put32(unsigned char* p, uint32_t v)
+{
+  ntlm_put16(p, v & 0xffff);
+  ntlm_put16(p + 2, v >> 16);
+}
+
+static uint16_t ntlm_get16(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t ntlm_get32(const unsigned char* p)
+{
+  return ntlm_get16(p) | ((uint32_t) ntlm_get16(p + 2) << 16);
+}
+
+
+/**
+ * Appends a field to message payload, and sets its security buffer.
+ *
+ * @param msg : message
+ * @param secbuf : security buffer offset in message
+ * @param offset : payload end, updated
+ * @param data : field
+ * @param len : `data` length
+ */
+static void ntlm_field(unsigned char* msg, size_t secbuf, size_t* offset,
+		       const unsigned char* data, size_t len)
+{
+  ntlm_put16(msg + secbuf, len);
+  ntlm_put16(msg + secbuf + 2, len);
+  ntlm_put32(msg + secbuf + 4, *offset);
+  if (len)
+    memcpy(msg + *offset, data, len);
+  *offset += len;
+}
+
+
+/**
+ * ASCII to UTF-16LE, like NtPasswordHash() does.
+ *
+ * @param out : UTF-16LE string, 2 * strlen(in) bytes
+ * @param in : string
+ * @param upper : TRUE to uppercase
+ * @return `out` length
+ */
+static size_t ntlm_unicode(unsigned char* out, const char* in, int upper)
+{
+  size_t i;
+
+  for (i=0; in[i]; i++)
+    {
+      out[2*i] = upper ? toupper((unsigned char) in[i]) : in[i];
+      out[2*i+1] = 0;
+    }
+
+  return 2 * i;
+}
+
+
+/**
+ * Builds NEGOTIATE message.
+ *
+ * @param msg : message buffer
+ * @param len : `msg` length
+ * @return message length
+ */
+size_t ntlm_negotiate(unsigned char* msg, size_t len)
+{
+  if (len < 32)
+    return 0;
+
+  /* no domain nor workstation supplied */
+  memset(msg, 0, 32);
+  memcpy(msg, NTLM_SIGNATURE, sizeof(NTLM_SIGNATURE));
+  ntlm_put32(msg + 8, 1);
+  ntlm_put32(msg + 12, NTLM_FLAGS | NTLM_FLAG_OEM);
+
+  return 32;
+}
+
+
+/**
+ * Builds AUTHENTICATE message, with NTLMv2 and LMv2 responses:
+ *   NTOWFv2 = HMAC-MD5(MD4(password), UPPER(user) | domain)
+ *   blob = 0x0101 | 0 | timestamp | client challenge | 0 | target info | 0
+ *   NT response = HMAC-MD5(NTOWFv2, server challenge | blob) | blob
+ *   LM response = HMAC-MD5(NTOWFv2, server challenge | client challenge) | client challenge
+ *
+ * @param msg : message buffer
+ * @param len : `msg` length
+ * @param challenge : CHALLENGE message from server
+ * @param challenge_len : `challenge` length
+ * @param user : [DOMAIN\]user
+ * @param password : password
+ * @return message length, -1 if challenge is invalid or too large
+ */
+int ntlm_authenticate(unsigned char* msg, size_t len, const unsigned char* challenge,
+		      size_t challenge_len, const char* user, const char* password)
+{
+  unsigned char nt_hash[16], ntowf[16], proof[16], lm[24], client_challenge[8];
+  unsigned char blob[NTLM_MAX_MESSAGE], identity[512], domain_u[256], user_u[256];
+  const unsigned char *server_challenge, *target_info;
+  size_t target_info_len, blob_len, identity_len, domain_len, user_len, offset;
+  unsigned int hmac_len;
+  const char* name;
+  char domain[128];
+  uint64_t timestamp;
+  HMAC_CTX* hmac;
+
+  if (challenge_len < 48 || memcmp(challenge, NTLM_SIGNATURE, sizeof(NTLM_SIGNATURE)) ||
+      ntlm_get32(challenge + 8) != 2)
+    return -1;
+
+  server_challenge = challenge + 24;
+  target_info_len = ntlm_get16(challenge + 40);
+  if (ntlm_get32(challenge + 44) + target_info_len > challenge_len)
+    return -1;
+  target_info = challenge + ntlm_get32(challenge + 44);
+
+  /* DOMAIN\user */
+  domain[0] = '\0';
+  name = strchr(user, '\\');
+  if (name && (size_t) (name - user) < sizeof(domain))
+    {
+      memcpy(domain, user, name - user);
+      domain[name - user] = '\0';
+      name++;
+    }
+  else
+    name = user;
+
+  if (strlen(name) > sizeof(user_u) / 2 || strlen(password) > 256 ||
+      28 + target_info_len + 4 > sizeof(blob))
+    return -1;
+
+  user_len = ntlm_unicode(user_u, name, FALSE);
+  domain_len = ntlm_unicode(domain_u, domain, FALSE);
+
+  NtPasswordHash(nt_hash, (const uint8_t*) password, strlen(password));
+
+  identity_len = ntlm_unicode(identity, name, TRUE);
+  memcpy(identity + identity_len, domain_u, domain_len);
+  identity_len += domain_len;
+  HMAC(EVP_md5(), nt_hash, 16, identity, identity_len, ntowf, &hmac_len);
+
+  if (RAND_bytes(client_challenge, sizeof(client_challenge)) != 1)
+    return -1;
+
+  timestamp = ((uint64_t) time(NULL) + NTLM_EPOCH_OFFSET) * 10000000ULL;
+
+  memset(blob, 0, 28);
+  blob[0] = blob[1] = 0x01;
+  ntlm_put32(blob + 8, timestamp & 0xffffffff);
+  ntlm_put32(blob + 12, timestamp >> 32);
+  memcpy(blob + 16, client_challenge, 8);
+  memcpy(blob + 28, target_info, target_info_len);
+  memset(blob + 28 + target_info_len, 0, 4);
+  blob_len = 28 + target_info_len + 4;
+
+  hmac = HMAC_CTX_new();
+  HMAC_Init_ex(hmac, ntowf, 16, EVP_md5(), NULL);
+  HMAC_Update(hmac, server_challenge, 8);
+  HMAC_Update(hmac, blob, blob_len);
+  HMAC_Final(hmac, proof, &hmac_len);
+
+  HMAC_Init_ex(hmac, ntowf, 16, EVP_md5(), NULL);
+  HMAC_Update(hmac, server_challenge, 8);
+  HMAC_Update(hmac, client_challenge, 8);
+  HMAC_Final(hmac, lm, &hmac_len);
+  HMAC_CTX_free(hmac);
+  memcpy(lm + 16, client_challenge, 8);
+
+  offset = 64;
+  if (offset + sizeof(lm) + sizeof(proof) + blob_len + domain_len + user_len > len)
+    return -1;
+
+  memset(msg, 0, offset);
+  memcpy(msg, NTLM_SIGNATURE, sizeof(NTLM_SIGNATURE));
+  ntlm_put32(msg + 8, 3);
+  ntlm_field(msg, 12, &offset, lm, sizeof(lm));
+  ntlm_put16(msg + 20, sizeof(proof) + blob_len);
+  ntlm_put16(msg + 22, sizeof(proof) + blob_len);
+  ntlm_put32(msg + 24, offset);
+  memcpy(msg + offset, proof, sizeof(proof));
+  memcpy(msg + offset + sizeof(proof), blob, blob_len);
+  offset += sizeof(proof) + blob_len;
+  ntlm_field(msg, 28, &offset, domain_u, domain_len);
+  ntlm_field(msg, 36, &offset, user_u, user_len);
+  ntlm_field(msg, 44, &offset, NULL, 0);
+  ntlm_field(msg, 52, &offset, NULL, 0);
+  ntlm_put32(msg + 60, NTLM_FLAGS);
+
+  memset(nt_hash, 0, sizeof(nt_hash));
+  memset(ntowf, 0, sizeof(ntowf));
+
+  return offset;
+}
@@ -0,0 +1,41 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NTLM_MAX_MESSAGE 2048
+
+/* NEGOTIATE_UNICODE | REQUEST_TARGET | NEGOTIATE_NTLM | ALWAYS_SIGN | EXTENDED_SESSIONSECURITY */
+#define NTLM_FLAGS 0x00088205
+#define NTLM_FLAG_OEM 0x00000002
+
+/*
+ * NTLM (MS-NLMP) client messages for HTTP proxy authentication: NEGOTIATE
+ * message, then AUTHENTICATE message answering server CHALLENGE with an
+ * NTLMv2 response. User may be given as DOMAIN\user.
+ */
+size_t ntlm_negotiate(unsigned char* msg, size_t len);
+int ntlm_authenticate(unsigned char* msg, size_t len, const unsigned char* challenge,
+		      size_t challenge_len, const char* user, const char* password);
@@ -0,0 +1,120 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+
+/**
+ * Initializes an empty pool of `size` bytes blocks.
+ *
+ * @param pool : pool to initialize
+ * @param size : block size
+ */
+void pool_init(pool_t* pool, size_t size)
+{
+  memset(pool, 0, sizeof(pool_t));
+  pool->size = (size < sizeof(pool_block_t)) ? sizeof(pool_block_t) : size;
+}
+
+
+/**
+ * Takes a block from the pool freelist, or from the heap if it is empty.
+ *
+ * @param pool : pool
+ * @return a block of pool->size bytes, not zero-filled
+ */
+void* pool_get(pool_t* pool)
+{
+  pool_block_t* block;
+
+  pool->requests++;
+  pool->used++;
+
+  block = pool->free;
+  if (block)
+    pool->free = block->next;
+  else
+    {
+      block = malloc(pool->size);
+      if (!block)
+	{
+	  perror("pool_get: fail to allocate space");
+	  abort();
+	}
+      pool->heap_allocs++;
+    }
+
+#ifdef DEBUG
+  memset(block, POOL_POISON_ALLOC, pool->size);
+#endif
+
+  return block;
+}
+
+
+/**
+ * Gives a block back to the pool freelist.
+ *
+ * @param pool : pool the block was taken from
+ * @param block : block to release, may be NULL
+ */
+void pool_put(pool_t* pool, void* block)
+{
+  pool_block_t* b = (pool_block_t*) block;
+
+  if (!b)
+    return;
+
+#ifdef DEBUG
+  memset(b, POOL_POISON_FREE, pool->size);
+#endif
+
+  b->next = pool->free;
+  pool->free = b;
+  pool->used--;
+}
+
+
+/**
+ * Returns every free block to the heap. Counters are kept.
+ *
+ * @param pool : pool
+ * @return number of blocks still in use (leaked by caller)
+ */
+unsigned int pool_destroy(pool_t* pool)
+{
+  pool_block_t* block;
+
+  while ((block = pool->free))
+    {
+      pool->free = block->next;
+      free(block);
+    }
+
+  return pool->used;
+}
@@ -0,0 +1,58 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stddef.h>
+
+#define POOL_SMALL_SIZE 128
+
+#ifdef DEBUG
+#define POOL_POISON_ALLOC 0xa5
+#define POOL_POISON_FREE 0x6b
+#endif
+
+/*
+ * Fixed-size buffer pool. Released blocks are kept on a freelist and handed
+ * out again by pool_get(), so that after warm-up a session allocates nothing
+ * from the heap. Blocks are not zero-filled; in DEBUG builds, they are
+ * poisoned on pool_get() and pool_put() to catch reads of stale data.
+ */
+typedef struct __pool_block
+{
+  struct __pool_block* next;
+} pool_block_t;
+
+typedef struct __pool
+{
+  size_t size;
+  pool_block_t* free;
+  unsigned int used;		/* blocks handed out and not put back */
+  unsigned long requests;	/* pool_get() calls */
+  unsigned long heap_allocs;	/* blocks taken from the heap */
+} pool_t;
+
+
+void pool_init(pool_t* pool, size_t size);
+void* pool_get(pool_t* pool);
+void pool_put(pool_t* pool, void* block);
+unsigned int pool_destroy(pool_t* pool);
@@ -0,0 +1,1356 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Native PPP client: LCP, MS-CHAPv2, IPCP and IPV6CP are negotiated in
+ * process, and IP packets are exchanged with a TUN device instead of a pppd
+ * pty. See also:
+ * - http://tools.ietf.org/search/rfc1661 (PPP, LCP)
+ * - http://tools.ietf.org/search/rfc2759 (MS-CHAPv2)
+ * - http://tools.ietf.org/search/rfc1332 (IPCP), rfc1877 (DNS options)
+ * - http://tools.ietf.org/search/rfc5072 (IPV6CP)
+ */
+
+#define _GNU_SOURCE 1
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/if_tun.h>
+#include <openssl/des.h>
+#include <openssl/md4.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#ifdef HAS_GNUTLS
+#include <gnutls/x509.h>
+#include <gnutls/gnutls.h>
+#else
+#include <polarssl/net.h>
+#include <polarssl/ssl.h>
+#include <polarssl/entropy.h>
+#include <polarssl/ctr_drbg.h>
+#endif
+
+#include "libsstp.h"
+#include "main.h"
+#include "event.h"
+#include "ppp.h"
+#include "tunnel.h"
+
+
+/* IPCP options */
+enum ipcp_options
+  {
+    IPCP_OPT_ADDRESS = 3,
+    IPCP_OPT_PRIMARY_DNS = 129,
+    IPCP_OPT_SECONDARY_DNS = 131
+  };
+
+/* LCP options */
+enum lcp_options
+  {
+    LCP_OPT_MRU = 1,
+    LCP_OPT_AUTH = 3,
+    LCP_OPT_MAGIC = 5,
+    LCP_OPT_PFC = 7,
+    LCP_OPT_ACFC = 8
+  };
+
+/* IPV6CP options */
+enum ipv6cp_options
+  {
+    IPV6CP_OPT_IFID = 1
+  };
+
+/* in6_ifreq from linux/ipv6.h, which conflicts with netinet/in.h */
+struct ppp_in6_ifreq
+{
+  struct in6_addr ifr6_addr;
+  uint32_t ifr6_prefixlen;
+  int ifr6_ifindex;
+};
+
+
+/**
+ * Returns the protocol of a PPP frame, whether Address/Control fields and
+ * Protocol field are compressed or not.
+ *
+ * @param frame : PPP frame
+ * @param len : `frame` length
+ * @param offset : if not NULL, receives the offset of the information field
+ * @return protocol, or 0 if frame is too short
+ */
+uint16_t ppp_frame_protocol(unsigned char* frame, size_t len, size_t* offset)
+{
+  size_t i = 0;
+  uint16_t protocol;
+
+  if (len >= 2 && frame[0] == PPP_ADDRESS && frame[1] == PPP_CONTROL)
+    i = 2;
+
+  if (i >= len)
+    return 0;
+
+  /* compressed protocol field has its lowest bit set */
+  if (frame[i] & 0x01)
+    protocol = frame[i++];
+  else
+    {
+      if (i + 2 > len)
+	return 0;
+      protocol = (frame[i] << 8) | frame[i+1];
+      i += 2;
+    }
+
+  if (offset)
+    *offset = i;
+
+  return protocol;
+}
+
+
+/**
+ * Sends a PPP frame with Address/Control fields through SSTP.
+ *
+ * @param ppp : PPP context
+ * @param protocol : PPP protocol
+ * @param info : information field
+ * @param len : `info` length
+ */
+static void ppp_output(ppp_context_t* ppp, uint16_t protocol, unsigned char* info, size_t len)
+{
+  unsigned char buffer[SSTP_HEADROOM + PPP_HEADROOM + PPP_MAX_MRU];
+  unsigned char* frame;
+
+  if (len > PPP_MAX_MRU)
+    return;
+
+  frame = buffer + SSTP_HEADROOM;
+  frame[0] = PPP_ADDRESS;
+  frame[1] = PPP_CONTROL;
+  frame[2] = protocol >> 8;
+  frame[3] = protocol & 0xff;
+  memcpy(frame + PPP_HEADROOM, info, len);
+
+  send_sstp_data_packet(ppp->tunnel, frame, PPP_HEADROOM + len);
+}
+
+
+/**
+ * Sends a control protocol packet.
+ *
+ * @param ppp : PPP context
+ * @param cp : control protocol
+ * @param code : packet code
+ * @param identifier : packet identifier
+ * @param data : packet data
+ * @param len : `data` length
+ */
+static void ppp_cp_send(ppp_context_t* ppp, ppp_cp_t* cp, uint8_t code, uint8_t identifier,
+			unsigned char* data, size_t len)
+{
+  unsigned char packet[PPP_MAX_MRU];
+  ppp_cp_header_t* header;
+
+  if (sizeof(ppp_cp_header_t) + len > PPP_MAX_MRU)
+    return;
+
+  header = (ppp_cp_header_t*) packet;
+  header->code = code;
+  header->identifier = identifier;
+  header->length = htons(sizeof(ppp_cp_header_t) + len);
+  if (len)
+    memcpy(packet + sizeof(ppp_cp_header_t), data, len);
+
+  if (ppp->tunnel->cfg->verbose > 2)
+    xlog(LOG_DEBUG, "\t-> %s code %d id %d length %lu\n",
+	 cp->name, code, identifier, sizeof(ppp_cp_header_t) + len);
+
+  ppp_output(ppp, cp->protocol, packet, sizeof(ppp_cp_header_t) + len);
+}
+
+
+/**
+ * Sends a new Configure-Request for a control protocol.
+ *
+ * @param ppp : PPP context
+ * @param cp : control protocol
+ */
+static void ppp_cp_send_request(ppp_context_t* ppp, ppp_cp_t* cp)
+{
+  unsigned char options[PPP_MAX_MRU];
+  size_t len;
+
+  len = cp->ops->add_options(ppp, options);
+  cp->identifier++;
+  ppp_cp_send(ppp, cp, PPP_CONF_REQ, cp->identifier, options, len);
+}
+
+
+/**
+ * Starts negociation of a control protocol.
+ *
+ * @param ppp : PPP context
+ * @param cp : control protocol
+ */
+static void ppp_cp_open(ppp_context_t* ppp, ppp_cp_t* cp)
+{
+  if (cp->state != PPP_CP_INITIAL && cp->state != PPP_CP_CLOSED)
+    return;
+
+  cp->restart = PPP_MAX_CONFIGURE;
+  cp->state = PPP_CP_REQSENT;
+  ppp_cp_send_request(ppp, cp);
+}
+
+
+/**
+ * Moves a control protocol to a new state, calling this-layer-up and
+ * this-layer-down actions when leaving or entering Opened state.
+ *
+ * @param ppp : PPP context
+ * @param cp : control protocol
+ * @param state : new state
+ */
+static void ppp_cp_set_state(ppp_context_t* ppp, ppp_cp_t* cp, uint8_t state)
+{
+  uint8_t old_state = cp->state;
+
+  if (old_state == state)
+    return;
+
+  cp->state = state;
+
+  if (ppp->tunnel->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: state %d -> %d\n", cp->name, old_state, state);
+
+  if (state == PPP_CP_OPENED)
+    {
+      if (ppp->tunnel->cfg->verbose)
+	xlog(LOG_INFO, "%s is up\n", cp->name);
+      cp->ops->up(ppp);
+    }
+  else if (old_state == PPP_CP_OPENED)
+    {
+      if (ppp->tunnel->cfg->verbose)
+	xlog(LOG_INFO, "%s is down\n", cp->name);
+      cp->ops->down(ppp);
+    }
+}
+
+
+/**
+ * Handles a Configure-Request from peer: every option is checked, and the
+ * request is acknowledged, nak-ed or rejected as a whole.
+ *
+ * @param ppp : PPP context
+ * @param cp : control protocol
+ * @param identifier : request identifier
+ * @param options : request options
+ * @param len : `options` length
+ */
+static void ppp_cp_recv_request(ppp_context_t* ppp, ppp_cp_t* cp, uint8_t identifier,
+				unsigned char* options, size_t len)
+{
+  unsigned char naks[PPP_MAX_MRU], rejs[PPP_MAX_MRU], suggested[UINT8_MAX];
+  ppp_option_header_t* nak = (ppp_option_header_t*) suggested;
+  size_t nak_len, rej_len, i;
+  uint8_t verdict;
+
+  nak_len = rej_len = 0;
+
+  for (i = 0; i + sizeof(ppp_option_header_t) <= len; )
+    {
+      ppp_option_header_t* option = (ppp_option_header_t*) (options + i);
+
+      if (option->length < sizeof(ppp_option_header_t) || i + option->length > len)
+	{
+	  xlog(LOG_WARNING, "%s: malformed option in Configure-Request\n", cp->name);
+	  return;
+	}
+
+      /* a suggested option may be longer than the one peer sent */
+      verdict = cp->ops->peer_option(ppp, option, nak);
+      if (verdict == PPP_CONF_NAK && nak_len + nak->length <= sizeof(naks))
+	{
+	  memcpy(naks + nak_len, nak, nak->length);
+	  nak_len += nak->length;
+	}
+      else if (verdict == PPP_CONF_REJ)
+	{
+	  memcpy(rejs + rej_len, option, option->length);
+	  rej_len += option->length;
+	}
+
+      i += option->length;
+    }
+
+  /* peer renegociates an opened link */
+  if (cp->state == PPP_CP_OPENED)
+    {
+      ppp_cp_set_state(ppp, cp, PPP_CP_REQSENT);
+      ppp_cp_send_request(ppp, cp);
+    }
+  else if (cp->state == PPP_CP_INITIAL || cp->state == PPP_CP_CLOSED)
+    {
+      cp->restart = PPP_MAX_CONFIGURE;
+      cp->state = PPP_CP_REQSENT;
+      ppp_cp_send_request(ppp, cp);
+    }
+
+  if (rej_len)
+    ppp_cp_send(ppp, cp, PPP_CONF_REJ, identifier, rejs, rej_len);
+  else if (nak_len)
+    ppp_cp_send(ppp, cp, PPP_CONF_NAK, identifier, naks, nak_len);
+  else
+    {
+      ppp_cp_send(ppp, cp, PPP_CONF_ACK, identifier, options, len);
+
+      if (cp->state == PPP_CP_ACKRCVD)
+	ppp_cp_set_state(ppp, cp, PPP_CP_OPENED);
+      else
+	ppp_cp_set_state(ppp, cp, PPP_CP_ACKSENT);
+      return;
+    }
+
+  if (cp->state == PPP_CP_ACKSENT)
+    ppp_cp_set_state(ppp, cp, PPP_CP_REQSENT);
+}
+
+
+/**
+ * Handles Configure-Ack, Configure-Nak and Configure-Reject answers to our
+ * own Configure-Request.
+ *
+ * @param ppp : PPP context
+ * @param cp : control protocol
+ * @param code : answer code
+ * @param identifier : answer identifier
+ * @param options : answer options
+ * @param len : `options` length
+ */
+static void ppp_cp_recv_answer(ppp_context_t* ppp, ppp_cp_t* cp, uint8_t code,
+			       uint8_t identifier, unsigned char* options, size_t len)
+{
+  size_t i;
+
+  if (identifier != cp->identifier)
+    {
+      if (ppp->tunnel->cfg->verbose > 1)
+	xlog(LOG_DEBUG, "%s: dropping answer with bad identifier\n", cp->name);
+      return;
+    }
+
+  if (code == PPP_CONF_ACK)
+    {
+      cp->restart = PPP_MAX_CONFIGURE;
+
+      if (cp->state == PPP_CP_ACKSENT)
+	ppp_cp_set_state(ppp, cp, PPP_CP_OPENED);
+      else if (cp->state == PPP_CP_REQSENT)
+	ppp_cp_set_state(ppp, cp, PPP_CP_ACKRCVD);
+      else if (cp->state == PPP_CP_OPENED)
+	{
+	  ppp_cp_set_state(ppp, cp, PPP_CP_REQSENT);
+	  ppp_cp_send_request(ppp, cp);
+	}
+      return;
+    }
+
+  for (i = 0; i + sizeof(ppp_option_header_t) <= len; )
+    {
+      ppp_option_header_t* option = (ppp_option_header_t*) (options + i);
+
+      if (option->length < sizeof(ppp_option_header_t) || i + option->length > len)
+	break;
+
+      if (code == PPP_CONF_NAK)
+	cp->ops->nak_option(ppp, option);
+      else
+	cp->ops->rej_option(ppp, option);
+
+      i += option->length;
+    }
+
+  if (cp->state == PPP_CP_ACKRCVD || cp->state == PPP_CP_OPENED)
+    ppp_cp_set_state(ppp, cp, PPP_CP_REQSENT);
+
+  ppp_cp_send_request(ppp, cp);
+}
+
+
+/**
+ * Control protocol input.
+ *
+ * @param ppp : PPP context
+ * @param cp : control protocol
+ * @param packet : control protocol packet
+ * @param len : `packet` length
+ */
+static void ppp_cp_input(ppp_context_t* ppp, ppp_cp_t* cp, unsigned char* packet, size_t len)
+{
+  ppp_cp_header_t* header;
+  unsigned char* data;
+  size_t data_len;
+
+  if (len < sizeof(ppp_cp_header_t))
+    return;
+
+  header = (ppp_cp_header_t*) packet;
+  data_len = ntohs(header->length);
+  if (data_len < sizeof(ppp_cp_header_t) || data_len > len)
+    {
+      xlog(LOG_WARNING, "%s: invalid packet length\n", cp->name);
+      return;
+    }
+
+  data = packet + sizeof(ppp_cp_header_t);
+  data_len -= sizeof(ppp_cp_header_t);
+
+  if (ppp->tunnel->cfg->verbose > 2)
+    xlog(LOG_DEBUG, "\t<- %s code %d id %d length %lu\n",
+	 cp->name, header->code, header->identifier, data_len + sizeof(ppp_cp_header_t));
+
+  switch (header->code)
+    {
+    case PPP_CONF_REQ:
+      ppp_cp_recv_request(ppp, cp, header->identifier, data, data_len);
+      break;
+
+    case PPP_CONF_ACK:
+    case PPP_CONF_NAK:
+    case PPP_CONF_REJ:
+      ppp_cp_recv_answer(ppp, cp, header->code, header->identifier, data, data_len);
+      break;
+
+    case PPP_TERM_REQ:
+      ppp_cp_send(ppp, cp, PPP_TERM_ACK, header->identifier, NULL, 0);
+      ppp_cp_set_state(ppp, cp, PPP_CP_CLOSED);
+      break;
+
+    case PPP_TERM_ACK:
+      ppp_cp_set_state(ppp, cp, PPP_CP_CLOSED);
+      break;
+
+    case PPP_ECHO_REQ:
+      if (cp->protocol == PPP_LCP && cp->state == PPP_CP_OPENED && data_len >= 4)
+	{
+	  uint32_t magic = htonl(ppp->magic);
+	  memcpy(data, &magic, sizeof(uint32_t));
+	  ppp_cp_send(ppp, cp, PPP_ECHO_REP, header->identifier, data, data_len);
+	}
+      break;
+
+    case PPP_ECHO_REP:
+    case PPP_DISCARD_REQ:
+      break;
+
+    case PPP_PROTO_REJ:
+      if (cp->protocol == PPP_LCP && data_len >= 2)
+	{
+	  uint16_t protocol = (data[0] << 8) | data[1];
+
+	  if (protocol == PPP_IPV6CP)
+	    {
+	      if (ppp->tunnel->cfg->verbose)
+		xlog(LOG_INFO, "Peer does not support IPv6\n");
+	      ppp->ipv6cp.state = PPP_CP_CLOSED;
+	    }
+	  else if (protocol == PPP_IPCP)
+	    ppp->ipcp.state = PPP_CP_CLOSED;
+	}
+      break;
+
+    case PPP_CODE_REJ:
+      if (ppp->tunnel->cfg->verbose)
+	xlog(LOG_WARNING, "%s: peer rejected code\n", cp->name);
+      break;
+
+    default:
+      ppp_cp_send(ppp, cp, PPP_CODE_REJ, ++cp->identifier, packet,
+		  data_len + sizeof(ppp_cp_header_t));
+      break;
+    }
+}
+
+
+/*
+ * LCP
+ */
+
+static size_t lcp_add_options(ppp_context_t* ppp, unsigned char* options)
+{
+  uint32_t magic = htonl(ppp->magic);
+
+  options[0] = LCP_OPT_MAGIC;
+  options[1] = 6;
+  memcpy(options + 2, &magic, sizeof(uint32_t));
+
+  return 6;
+}
+
+static uint8_t lcp_peer_option(ppp_context_t* ppp, ppp_option_header_t* option,
+			       ppp_option_header_t* nak)
+{
+  unsigned char* value = (unsigned char*) option + sizeof(ppp_option_header_t);
+
+  switch (option->type)
+    {
+    case LCP_OPT_MRU:
+      if (option->length != 4)
+	return PPP_CONF_REJ;
+      ppp->peer_mru = (value[0] << 8) | value[1];
+      return PPP_CONF_ACK;
+
+    case LCP_OPT_AUTH:
+      /* only MS-CHAPv2 is supported, suggest it otherwise */
+      if (option->length == 5 && value[0] == (PPP_CHAP >> 8) &&
+	  value[1] == (PPP_CHAP & 0xff) && value[2] == MSCHAPV2_ALGORITHM)
+	return PPP_CONF_ACK;
+
+      value = (unsigned char*) nak + sizeof(ppp_option_header_t);
+      nak->type = LCP_OPT_AUTH;
+      nak->length = 5;
+      value[0] = PPP_CHAP >> 8;
+      value[1] = PPP_CHAP & 0xff;
+      value[2] = MSCHAPV2_ALGORITHM;
+      return PPP_CONF_NAK;
+
+    case LCP_OPT_MAGIC:
+    case LCP_OPT_PFC:
+    case LCP_OPT_ACFC:
+      return PPP_CONF_ACK;
+
+    default:
+      return PPP_CONF_REJ;
+    }
+}
+
+static void lcp_nak_option(ppp_context_t* ppp, ppp_option_header_t* option)
+{
+  if (option->type == LCP_OPT_MAGIC)
+    RAND_bytes((unsigned char*) &ppp->magic, sizeof(uint32_t));
+}
+
+static void lcp_rej_option(ppp_context_t* ppp UNUSED, ppp_option_header_t* option UNUSED)
+{
+}
+
+static void lcp_up(ppp_context_t* ppp UNUSED)
+{
+  /* authentication is driven by the server Challenge */
+}
+
+static void lcp_down(ppp_context_t* ppp)
+{
+  ppp->authenticated = FALSE;
+  ppp_cp_set_state(ppp, &ppp->ipcp, PPP_CP_CLOSED);
+  ppp_cp_set_state(ppp, &ppp->ipv6cp, PPP_CP_CLOSED);
+
+  xlog(LOG_ERROR, "PPP link terminated\n");
+  set_client_status(ppp->tunnel, CLIENT_CALL_DISCONNECTED);
+}
+
+static const ppp_cp_ops_t lcp_ops =
+  {
+    lcp_add_options, lcp_peer_option, lcp_nak_option, lcp_rej_option, lcp_up, lcp_down
+  };
+
+
+/*
+ * TUN interface
+ */
+
+/**
+ * Sets up TUN interface address and brings it up.
+ *
+ * @param ppp : PPP context
+ * @return 0 if all good, -1 otherwise
+ */
+static int ppp_tun_configure(ppp_context_t* ppp)
+{
+  struct ifreq ifr;
+  struct sockaddr_in* sin;
+  int sock, retcode = -1;
+
+  sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    {
+      xlog(LOG_ERROR, "ppp_tun_configure: %s\n", strerror(errno));
+      return -1;
+    }
+
+  memset(&ifr, 0, sizeof(struct ifreq));
+  snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ppp->ifname);
+  sin = (struct sockaddr_in*) &ifr.ifr_addr;
+  sin->sin_family = AF_INET;
+
+  sin->sin_addr = ppp->local_addr;
+  if (ioctl(sock, SIOCSIFADDR, &ifr) < 0)
+    goto end;
+
+  sin->sin_addr = ppp->peer_addr;
+  if (ioctl(sock, SIOCSIFDSTADDR, &ifr) < 0)
+    goto end;
+
+  sin->sin_addr.s_addr = INADDR_BROADCAST;
+  if (ioctl(sock, SIOCSIFNETMASK, &ifr) < 0)
+    goto end;
+
+  ifr.ifr_mtu = ppp->peer_mru;
+  if (ioctl(sock, SIOCSIFMTU, &ifr) < 0)
+    goto end;
+
+  if (ioctl(sock, SIOCGIFFLAGS, &ifr) < 0)
+    goto end;
+
+  ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+  if (ioctl(sock, SIOCSIFFLAGS, &ifr) < 0)
+    goto end;
+
+  retcode = 0;
+
+ end:
+  if (retcode < 0)
+    xlog(LOG_ERROR, "Failed to configure %s: %s\n", ppp->ifname, strerror(errno));
+
+  close(sock);
+  return retcode;
+}
+
+
+/**
+ * Adds IPv6 link-local address built from negociated interface identifier.
+ *
+ * @param ppp : PPP context
+ * @return 0 if all good, -1 otherwise
+ */
+static int ppp_tun_configure6(ppp_context_t* ppp)
+{
+  struct ppp_in6_ifreq ifr6;
+  int sock, retcode;
+
+  sock = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    {
+      xlog(LOG_ERROR, "ppp_tun_configure6: %s\n", strerror(errno));
+      return -1;
+    }
+
+  memset(&ifr6, 0, sizeof(struct ppp_in6_ifreq));
+  ifr6.ifr6_addr.s6_addr[0] = 0xfe;
+  ifr6.ifr6_addr.s6_addr[1] = 0x80;
+  memcpy(ifr6.ifr6_addr.s6_addr + 8, ppp->local_ifid, 8);
+  ifr6.ifr6_prefixlen = 64;
+  ifr6.ifr6_ifindex = if_nametoindex(ppp->ifname);
+
+  retcode = ioctl(sock, SIOCSIFADDR, &ifr6);
+  if (retcode < 0)
+    xlog(LOG_ERROR, "Failed to set IPv6 address on %s: %s\n", ppp->ifname, strerror(errno));
+  else
+    memcpy(ppp->tun_ifid, ppp->local_ifid, 8);
+
+  close(sock);
+  return retcode;
+}
+
+
+/*
+ * IPCP
+ */
+
+static size_t ipcp_add_options(ppp_context_t* ppp, unsigned char* options)
+{
+  size_t len = 0;
+  int i;
+  struct
+  {
+    uint8_t type;
+    struct in_addr* addr;
+  } wanted[] =
+      {
+	{ IPCP_OPT_ADDRESS, &ppp->local_addr },
+	{ IPCP_OPT_PRIMARY_DNS, &ppp->dns[0] },
+	{ IPCP_OPT_SECONDARY_DNS, &ppp->dns[1] },
+      };
+
+  for (i = 0; i < 3; i++)
+    {
+      if (ppp->ipcp_rejected & (1 << i))
+	continue;
+
+      options[len] = wanted[i].type;
+      options[len+1] = 6;
+      memcpy(options + len + 2, wanted[i].addr, sizeof(struct in_addr));
+      len += 6;
+    }
+
+  return len;
+}
+
+static uint8_t ipcp_peer_option(ppp_context_t* ppp, ppp_option_header_t* option,
+				ppp_option_header_t* nak UNUSED)
+{
+  if (option->type == IPCP_OPT_ADDRESS && option->length == 6)
+    {
+      memcpy(&ppp->peer_addr, (unsigned char*) option + 2, sizeof(struct in_addr));
+      return PPP_CONF_ACK;
+    }
+
+  return PPP_CONF_REJ;
+}
+
+static struct in_addr* ipcp_option_addr(ppp_context_t* ppp, uint8_t type, int* index)
+{
+  switch (type)
+    {
+    case IPCP_OPT_ADDRESS: *index = 0; return &ppp->local_addr;
+    case IPCP_OPT_PRIMARY_DNS: *index = 1; return &ppp->dns[0];
+    case IPCP_OPT_SECONDARY_DNS: *index = 2; return &ppp->dns[1];
+    default: return NULL;
+    }
+}
+
+static void ipcp_nak_option(ppp_context_t* ppp, ppp_option_header_t* option)
+{
+  struct in_addr* addr;
+  int index;
+
+  addr = ipcp_option_addr(ppp, option->type, &index);
+  if (addr && option->length == 6)
+    memcpy(addr, (unsigned char*) option + 2, sizeof(struct in_addr));
+}
+
+static void ipcp_rej_option(ppp_context_t* ppp, ppp_option_header_t* option)
+{
+  int index;
+
+  if (ipcp_option_addr(ppp, option->type, &index))
+    ppp->ipcp_rejected |= (1 << index);
+}
+
+static void ipcp_up(ppp_context_t* ppp)
+{
+  char local[INET_ADDRSTRLEN], peer[INET_ADDRSTRLEN];
+
+  inet_ntop(AF_INET, &ppp->local_addr, local, sizeof(local));
+  inet_ntop(AF_INET, &ppp->peer_addr, peer, sizeof(peer));
+  xlog(LOG_INFO, "%s: local address %s, remote address %s\n", ppp->ifname, local, peer);
+
+  if (ppp->dns[0].s_addr && ppp->tunnel->cfg->verbose)
+    {
+      inet_ntop(AF_INET, &ppp->dns[0], local, sizeof(local));
+      inet_ntop(AF_INET, &ppp->dns[1], peer, sizeof(peer));
+      xlog(LOG_INFO, "%s: DNS servers %s %s\n", ppp->ifname, local, peer);
+    }
+
+  /* on renegociation, privileges may be gone: interface is kept as is */
+  if (ppp->tun_local.s_addr)
+    {
+      if (ppp->tun_local.s_addr != ppp->local_addr.s_addr ||
+	  ppp->tun_peer.s_addr != ppp->peer_addr.s_addr)
+	{
+	  xlog(LOG_ERROR, "%s: addresses changed on renegociation\n", ppp->ifname);
+	  set_client_status(ppp->tunnel, CLIENT_CALL_DISCONNECTED);
+	  return;
+	}
+
+      /* same interface over a new SSTP session, see tunnel_suspend() */
+      sstp_tunnel_resume(ppp->tunnel);
+      return;
+    }
+
+  if (ppp_tun_configure(ppp) < 0)
+    {
+      set_client_status(ppp->tunnel, CLIENT_CALL_DISCONNECTED);
+      return;
+    }
+
+  ppp->tun_local = ppp->local_addr;
+  ppp->tun_peer = ppp->peer_addr;
+
+  if (ppp->ipv6cp.state == PPP_CP_OPENED)
+    ppp_tun_configure6(ppp);
+
+  /* interface is set up, privileges are no longer needed by this tunnel */
+  if (release_privileges(ppp->tunnel) < 0)
+    set_client_status(ppp->tunnel, CLIENT_CALL_DISCONNECTED);
+}
+
+static void ipcp_down(ppp_context_t* ppp UNUSED)
+{
+}
+
+static const ppp_cp_ops_t ipcp_ops =
+  {
+    ipcp_add_options, ipcp_peer_option, ipcp_nak_option, ipcp_rej_option, ipcp_up, ipcp_down
+  };
+
+
+/*
+ * IPV6CP
+ */
+
+static size_t ipv6cp_add_options(ppp_context_t* ppp, unsigned char* options)
+{
+  options[0] = IPV6CP_OPT_IFID;
+  options[1] = 10;
+  memcpy(options + 2, ppp->local_ifid, 8);
+
+  return 10;
+}
+
+static uint8_t ipv6cp_peer_option(ppp_context_t* ppp, ppp_option_header_t* option,
+				  ppp_option_header_t* nak UNUSED)
+{
+  if (option->type == IPV6CP_OPT_IFID && option->length == 10)
+    {
+      memcpy(ppp->peer_ifid, (unsigned char*) option + 2, 8);
+      return PPP_CONF_ACK;
+    }
+
+  return PPP_CONF_REJ;
+}
+
+static void ipv6cp_nak_option(ppp_context_t* ppp, ppp_option_header_t* option)
+{
+  if (option->type == IPV6CP_OPT_IFID && option->length == 10)
+    memcpy(ppp->local_ifid, (unsigned char*) option + 2, 8);
+}
+
+static void ipv6cp_rej_option(ppp_context_t* ppp UNUSED, ppp_option_header_t* option UNUSED)
+{
+}
+
+static void ipv6cp_up(ppp_context_t* ppp)
+{
+  /* on renegociation, interface is kept as is */
+  if (!memcmp(ppp->tun_ifid, ppp->local_ifid, 8))
+    return;
+
+  /* if IPCP is not up yet, address is set along with IPv4 configuration */
+  if (ppp->ipcp.state == PPP_CP_OPENED)
+    ppp_tun_configure6(ppp);
+}
+
+static void ipv6cp_down(ppp_context_t* ppp UNUSED)
+{
+}
+
+static const ppp_cp_ops_t ipv6cp_ops =
+  {
+    ipv6cp_add_options, ipv6cp_peer_option, ipv6cp_nak_option, ipv6cp_rej_option,
+    ipv6cp_up, ipv6cp_down
+  };
+
+
+/*
+ * MS-CHAPv2
+ */
+
+/**
+ * Expands a 7-byte key into a 8-byte DES key, and encrypts `clear` with it.
+ */
+static void DesEncrypt(const uint8_t* clear, const uint8_t* key7, uint8_t* cypher)
+{
+  DES_cblock key;
+  DES_key_schedule schedule;
+
+  key[0] = key7[0];
+  key[1] = (key7[0] << 7) | (key7[1] >> 1);
+  key[2] = (key7[1] << 6) | (key7[2] >> 2);
+  key[3] = (key7[2] << 5) | (key7[3] >> 3);
+  key[4] = (key7[3] << 4) | (key7[4] >> 4);
+  key[5] = (key7[4] << 3) | (key7[5] >> 5);
+  key[6] = (key7[5] << 2) | (key7[6] >> 6);
+  key[7] = key7[6] << 1;
+  DES_set_odd_parity(&key);
+  DES_set_key_unchecked(&key, &schedule);
+
+  DES_ecb_encrypt((const_DES_cblock*) clear, (DES_cblock*) cypher, &schedule, DES_ENCRYPT);
+}
+
+
+/**
+ * Strips the "DOMAIN\" prefix of a username, as done by Windows.
+ */
+static const char* ppp_chap_user(const char* username)
+{
+  const char* user = strrchr(username, '\\');
+
+  return user ? user + 1 : username;
+}
+
+
+static void ChallengeHash(const uint8_t* PeerChallenge, const uint8_t* AuthenticatorChallenge,
+			  const char* UserName, uint8_t* Challenge)
+{
+  SHA_CTX c;
+  uint8_t Digest[SHA_DIGEST_LENGTH];
+
+  SHA1_Init(&c);
+  SHA1_Update(&c, PeerChallenge, 16);
+  SHA1_Update(&c, AuthenticatorChallenge, 16);
+  SHA1_Update(&c, UserName, strlen(UserName));
+  SHA1_Final(Digest, &c);
+
+  memcpy(Challenge, Digest, 8);
+}
+
+
+static void ChallengeResponse(const uint8_t* Challenge, const uint8_t* PasswordHash,
+			      uint8_t* Response)
+{
+  uint8_t ZPasswordHash[21];
+
+  memset(ZPasswordHash, 0, sizeof(ZPasswordHash));
+  memcpy(ZPasswordHash, PasswordHash, MD4_DIGEST_LENGTH);
+
+  DesEncrypt(Challenge, ZPasswordHash, Response);
+  DesEncrypt(Challenge, ZPasswordHash + 7, Response + 8);
+  DesEncrypt(Challenge, ZPasswordHash + 14, Response + 16);
+}
+
+
+static void GenerateAuthenticatorResponse(ppp_context_t* ppp, char* AuthenticatorResponse)
+{
+  SHA_CTX c;
+  uint8_t PasswordHash[MD4_DIGEST_LENGTH];
+  uint8_t PasswordHashHash[MD4_DIGEST_LENGTH];
+  uint8_t Digest[SHA_DIGEST_LENGTH];
+  uint8_t Challenge[8];
+  int i;
+
+  static const char Magic1[] = "Magic server to client signing constant";
+  static const char Magic2[] = "Pad to make it do more than one iteration";
+
+  NtPasswordHash(PasswordHash, (const uint8_t*) ppp->password, strlen(ppp->password));
+  HashNtPasswordHash(PasswordHashHash, PasswordHash);
+
+  SHA1_Init(&c);
+  SHA1_Update(&c, PasswordHashHash, MD4_DIGEST_LENGTH);
+  SHA1_Update(&c, ppp->nt_response, 24);
+  SHA1_Update(&c, Magic1, sizeof(Magic1) - 1);
+  SHA1_Final(Digest, &c);
+
+  ChallengeHash(ppp->peer_challenge, ppp->auth_challenge,
+		ppp_chap_user(ppp->username), Challenge);
+
+  SHA1_Init(&c);
+  SHA1_Update(&c, Digest, SHA_DIGEST_LENGTH);
+  SHA1_Update(&c, Challenge, 8);
+  SHA1_Update(&c, Magic2, sizeof(Magic2) - 1);
+  SHA1_Final(Digest, &c);
+
+  AuthenticatorResponse[0] = 'S';
+  AuthenticatorResponse[1] = '=';
+  for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+    sprintf(AuthenticatorResponse + 2 + i*2, "%02X", Digest[i]);
+}
+
+
+/**
+ * Answers a MS-CHAPv2 Challenge. As with pppd, response value is picked up by
+ * send_sstp_data_packet() for SSTP crypto binding.
+ *
+ * @param ppp : PPP context
+ * @param identifier : challenge identifier
+ * @param data : challenge data
+ * @param len : `data` length
+ */
+static void ppp_chap_challenge(ppp_context_t* ppp, uint8_t identifier,
+			       unsigned char* data, size_t len)
+{
+  unsigned char packet[PPP_MAX_MRU];
+  unsigned char *value;
+  uint8_t PasswordHash[MD4_DIGEST_LENGTH];
+  uint8_t Challenge[8];
+  size_t name_len, packet_len;
+
+  if (len < 17 || data[0] != 16)
+    {
+      xlog(LOG_ERROR, "Invalid MS-CHAPv2 challenge\n");
+      return;
+    }
+
+  memcpy(ppp->auth_challenge, data + 1, 16);
+  RAND_bytes(ppp->peer_challenge, 16);
+
+  NtPasswordHash(PasswordHash, (const uint8_t*) ppp->password, strlen(ppp->password));
+  ChallengeHash(ppp->peer_challenge, ppp->auth_challenge,
+		ppp_chap_user(ppp->username), Challenge);
+  ChallengeResponse(Challenge, PasswordHash, ppp->nt_response);
+
+  name_len = strlen(ppp->username);
+  packet_len = sizeof(ppp_cp_header_t) + 1 + MSCHAPV2_RESPONSE_LEN + name_len;
+  if (packet_len > PPP_MAX_MRU)
+    return;
+
+  packet[0] = PPP_CHAP_RESPONSE;
+  packet[1] = identifier;
+  packet[2] = packet_len >> 8;
+  packet[3] = packet_len & 0xff;
+  packet[4] = MSCHAPV2_RESPONSE_LEN;
+
+  value = packet + 5;
+  memcpy(value, ppp->peer_challenge, 16);
+  memset(value + 16, 0, 8);
+  memcpy(value + 24, ppp->nt_response, 24);
+  value[48] = 0;
+  memcpy(value + MSCHAPV2_RESPONSE_LEN, ppp->username, name_len);
+
+  if (ppp->tunnel->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "Sending MS-CHAPv2 response as '%s'\n", ppp->username);
+
+  ppp_output(ppp, PPP_CHAP, packet, packet_len);
+}
+
+
+/**
+ * CHAP input: answers challenges, checks server authenticator on success and
+ * then starts network control protocols.
+ *
+ * @param ppp : PPP context
+ * @param packet : CHAP packet
+ * @param len : `packet` length
+ */
+static void ppp_chap_input(ppp_context_t* ppp, unsigned char* packet, size_t len)
+{
+  ppp_cp_header_t* header;
+  char expected[2 + SHA_DIGEST_LENGTH*2 + 1];
+  size_t data_len;
+
+  if (len < sizeof(ppp_cp_header_t))
+    return;
+
+  header = (ppp_cp_header_t*) packet;
+  data_len = ntohs(header->length);
+  if (data_len < sizeof(ppp_cp_header_t) || data_len > len)
+    return;
+  data_len -= sizeof(ppp_cp_header_t);
+  packet += sizeof(ppp_cp_header_t);
+
+  switch (header->code)
+    {
+    case PPP_CHAP_CHALLENGE:
+      ppp_chap_challenge(ppp, header->identifier, packet, data_len);
+      break;
+
+    case PPP_CHAP_SUCCESS:
+      GenerateAuthenticatorResponse(ppp, expected);
+      if (data_len < 42 || strncasecmp((char*) packet, expected, 42))
+	{
+	  xlog(LOG_ERROR, "PPP Authentication failure: invalid server authenticator\n");
+	  set_client_status(ppp->tunnel, CLIENT_CALL_DISCONNECTED);
+	  break;
+	}
+
+      if (ppp->tunnel->cfg->verbose)
+	xlog(LOG_INFO, "PPP Authentication success\n");
+
+      ppp->authenticated = TRUE;
+      ppp_cp_open(ppp, &ppp->ipcp);
+      ppp_cp_open(ppp, &ppp->ipv6cp);
+      break;
+
+    case PPP_CHAP_FAILURE:
+      /* already reported by sstp_decode() */
+      set_client_status(ppp->tunnel, CLIENT_CALL_DISCONNECTED);
+      break;
+    }
+}
+
+
+/**
+ * Initializes native PPP: opens a TUN interface and a restart timer.
+ *
+ * @param ppp : PPP context
+ * @param tunnel : tunnel carrying PPP frames, gives MS-CHAPv2 credentials
+ * @return 0 if all good, -1 otherwise
+ */
+int ppp_init(ppp_context_t* ppp, struct __sstp_tunnel* tunnel)
+{
+  struct ifreq ifr;
+
+  memset(ppp, 0, sizeof(ppp_context_t));
+  event_timer_init(&ppp->restart_timer, ppp_timer_tick, ppp);
+  ppp->tunnel = tunnel;
+  ppp->username = tunnel->cfg->username;
+  ppp->password = tunnel->cfg->password;
+  ppp->peer_mru = PPP_DEFAULT_MRU;
+
+  ppp->lcp.name = "LCP";
+  ppp->lcp.protocol = PPP_LCP;
+  ppp->lcp.ops = &lcp_ops;
+  ppp->ipcp.name = "IPCP";
+  ppp->ipcp.protocol = PPP_IPCP;
+  ppp->ipcp.ops = &ipcp_ops;
+  ppp->ipv6cp.name = "IPV6CP";
+  ppp->ipv6cp.protocol = PPP_IPV6CP;
+  ppp->ipv6cp.ops = &ipv6cp_ops;
+
+  RAND_bytes((unsigned char*) &ppp->magic, sizeof(uint32_t));
+  RAND_bytes(ppp->local_ifid, 8);
+
+  ppp->tun_fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+  if (ppp->tun_fd < 0)
+    {
+      xlog(LOG_ERROR, "Failed to open /dev/net/tun: %s\n", strerror(errno));
+      return -1;
+    }
+
+  memset(&ifr, 0, sizeof(struct ifreq));
+  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+  strncpy(ifr.ifr_name, PPP_TUN_NAME, IFNAMSIZ - 1);
+
+  if (ioctl(ppp->tun_fd, TUNSETIFF, &ifr) < 0)
+    {
+      xlog(LOG_ERROR, "Failed to create TUN interface: %s\n", strerror(errno));
+      ppp_close(ppp);
+      return -1;
+    }
+
+  snprintf(ppp->ifname, IFNAMSIZ, "%s", ifr.ifr_name);
+
+  if (ppp->tunnel->cfg->verbose)
+    xlog(LOG_INFO, "Using TUN interface %s\n", ppp->ifname);
+
+  return 0;
+}
+
+
+/**
+ * Releases native PPP resources, TUN interface disappears.
+ *
+ * @param ppp : PPP context
+ */
+void ppp_close(ppp_context_t* ppp)
+{
+  if (ppp->tun_fd >= 0)
+    close(ppp->tun_fd);
+
+  ppp->tun_fd = -1;
+}
+
+
+/**
+ * Forgets negociation state once the link to the server is lost, for a new
+ * SSTP session to negociate from scratch. TUN interface and its addresses are
+ * kept: the same local address is requested again.
+ *
+ * @param ppp : PPP context
+ */
+void ppp_reset(ppp_context_t* ppp)
+{
+  ppp->lcp.state = ppp->ipcp.state = ppp->ipv6cp.state = PPP_CP_INITIAL;
+  ppp->authenticated = FALSE;
+  ppp->ipcp_rejected = 0;
+  ppp->ip_output = NULL;
+}
+
+
+/**
+ * Starts LCP negociation, along with restart timer, on the tunnel worker
+ * event loop.
+ *
+ * @param ppp : PPP context
+ */
+void ppp_open(ppp_context_t* ppp)
+{
+  if (event_timer_arm(&ppp->tunnel->worker->loop, &ppp->restart_timer,
+		      PPP_RESTART_TIMER * 1000000L) < 0)
+    xlog(LOG_ERROR, "ppp_open: %s\n", strerror(errno));
+
+  ppp_cp_open(ppp, &ppp->lcp);
+}
+
+
+/**
+ * Restart timer: Configure-Requests left unanswered are sent again, and
+ * negociation fails once PPP_MAX_CONFIGURE requests have been sent. Runs
+ * every PPP_RESTART_TIMER seconds.
+ *
+ * @param data : PPP context
+ * @return 0
+ */
+int ppp_timer_tick(void* data)
+{
+  ppp_context_t* ppp = (ppp_context_t*) data;
+  ppp_cp_t* cps[3];
+  int i;
+
+  cps[0] = &ppp->lcp;
+  cps[1] = &ppp->ipcp;
+  cps[2] = &ppp->ipv6cp;
+
+  for (i = 0; i < 3; i++)
+    {
+      ppp_cp_t* cp = cps[i];
+
+      if (cp->state != PPP_CP_REQSENT && cp->state != PPP_CP_ACKSENT)
+	continue;
+
+      if (!cp->restart--)
+	{
+	  xlog(LOG_ERROR, "%s negociation timed out\n", cp->name);
+	  cp->state = PPP_CP_CLOSED;
+
+	  if (cp->protocol != PPP_IPV6CP)
+	    set_client_status(ppp->tunnel, CLIENT_CALL_DISCONNECTED);
+	  continue;
+	}
+
+      ppp_cp_send_request(ppp, cp);
+    }
+
+  event_timer_arm(&ppp->tunnel->worker->loop, &ppp->restart_timer,
+		  PPP_RESTART_TIMER * 1000000L);
+  return 0;
+}
+
+
+/**
+ * Handles a PPP frame received from SSTP server: IP packets are written to
+ * TUN interface, and control protocols are processed.
+ *
+ * @param ppp : PPP context
+ * @param frame : PPP frame
+ * @param len : `frame` length
+ * @return 0 if all good, negative value otherwise
+ */
+int ppp_input(ppp_context_t* ppp, unsigned char* frame, size_t len)
+{
+  uint16_t protocol;
+  size_t offset;
+  unsigned char *info;
+
+  protocol = ppp_frame_protocol(frame, len, &offset);
+  info = frame + offset;
+  len -= offset;
+
+  switch (protocol)
+    {
+    case PPP_IP:
+    case PPP_IPV6:
+      if (ppp->ip_output)
+	return ppp->ip_output(ppp->tunnel, info, len);
+
+      if (write(ppp->tun_fd, info, len) < 0 && errno != EAGAIN)
+	{
+	  xlog(LOG_ERROR, "ppp_input: %s\n", strerror(errno));
+	  return -1;
+	}
+      break;
+
+    case PPP_LCP:
+      ppp_cp_input(ppp, &ppp->lcp, info, len);
+      break;
+
+    case PPP_CHAP:
+      if (ppp->lcp.state == PPP_CP_OPENED)
+	ppp_chap_input(ppp, info, len);
+      break;
+
+    case PPP_IPCP:
+      if (ppp->authenticated)
+	ppp_cp_input(ppp, &ppp->ipcp, info, len);
+      break;
+
+    case PPP_IPV6CP:
+      if (ppp->authenticated)
+	ppp_cp_input(ppp, &ppp->ipv6cp, info, len);
+      break;
+
+    case 0:
+      break;
+
+    default:
+      /* unsupported protocol (CCP, ...) */
+      if (ppp->lcp.state == PPP_CP_OPENED && len + 2 <= PPP_MAX_MRU - sizeof(ppp_cp_header_t))
+	{
+	  unsigned char rej[PPP_MAX_MRU];
+
+	  rej[0] = protocol >> 8;
+	  rej[1] = protocol & 0xff;
+	  memcpy(rej + 2, info, len);
+	  ppp_cp_send(ppp, &ppp->lcp, PPP_PROTO_REJ, ++ppp->lcp.identifier, rej, len + 2);
+	}
+      break;
+    }
+
+  return 0;
+}
+
+
+/**
+ * Turns an IP packet read from TUN interface into a PPP frame, by writing PPP
+ * header inside the PPP_HEADROOM bytes preceding it.
+ *
+ * @param ppp : PPP context
+ * @param packet : IP packet, preceded by PPP_HEADROOM writable bytes
+ * @param len : `packet` length
+ * @return PPP frame length, or 0 if packet must be dropped
+ */
+size_t ppp_encapsulate(ppp_context_t* ppp, unsigned char* packet, size_t len)
+{
+  unsigned char* frame = packet - PPP_HEADROOM;
+  uint16_t protocol;
+
+  if (!len)
+    return 0;
+
+  switch (packet[0] >> 4)
+    {
+    case 4:
+      if (ppp->ipcp.state != PPP_CP_OPENED)
+	return 0;
+      protocol = PPP_IP;
+      break;
+
+    case 6:
+      if (ppp->ipv6cp.state != PPP_CP_OPENED)
+	return 0;
+      protocol = PPP_IPV6;
+      break;
+
+    default:
+      return 0;
+    }
+
+  frame[0] = PPP_ADDRESS;
+  frame[1] = PPP_CONTROL;
+  frame[2] = protocol >> 8;
+  frame[3] = protocol & 0xff;
+
+  return len + PPP_HEADROOM;
+}
@@ -0,0 +1,188 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Must be included after event.h.
+ */
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <net/if.h>
+
+/* PPP properties */
+#define PPP_ADDRESS 0xff
+#define PPP_CONTROL 0x03
+#define PPP_HEADROOM 4
+#define PPP_DEFAULT_MRU 1500
+#define PPP_MAX_CONFIGURE 10
+#define PPP_RESTART_TIMER 3
+#define PPP_TUN_NAME "sstp%d"
+
+#define MSCHAPV2_ALGORITHM 0x81
+#define MSCHAPV2_RESPONSE_LEN 49
+
+
+/* PPP Protocol field values */
+enum ppp_protocols
+  {
+    PPP_IP = 0x0021,
+    PPP_IPV6 = 0x0057,
+    PPP_IPCP = 0x8021,
+    PPP_IPV6CP = 0x8057,
+    PPP_LCP = 0xc021,
+    PPP_PAP = 0xc023,
+    PPP_CHAP = 0xc223
+  };
+
+
+/* Control protocols codes (LCP, IPCP, IPV6CP) */
+enum ppp_cp_codes
+  {
+    PPP_CONF_REQ = 1,
+    PPP_CONF_ACK = 2,
+    PPP_CONF_NAK = 3,
+    PPP_CONF_REJ = 4,
+    PPP_TERM_REQ = 5,
+    PPP_TERM_ACK = 6,
+    PPP_CODE_REJ = 7,
+    PPP_PROTO_REJ = 8,
+    PPP_ECHO_REQ = 9,
+    PPP_ECHO_REP = 10,
+    PPP_DISCARD_REQ = 11
+  };
+
+
+/* CHAP codes */
+enum ppp_chap_codes
+  {
+    PPP_CHAP_CHALLENGE = 1,
+    PPP_CHAP_RESPONSE = 2,
+    PPP_CHAP_SUCCESS = 3,
+    PPP_CHAP_FAILURE = 4
+  };
+
+
+/* Control protocol automaton states (RFC 1661), reduced to the client side */
+enum ppp_cp_states
+  {
+    PPP_CP_INITIAL,
+    PPP_CP_REQSENT,
+    PPP_CP_ACKRCVD,
+    PPP_CP_ACKSENT,
+    PPP_CP_OPENED,
+    PPP_CP_CLOSED
+  };
+
+
+/* data structures */
+typedef struct __ppp_cp_header
+{
+  uint8_t code;
+  uint8_t identifier;
+  uint16_t length;
+} ppp_cp_header_t;
+
+typedef struct __ppp_option_header
+{
+  uint8_t type;
+  uint8_t length;
+} ppp_option_header_t;
+
+typedef struct __ppp_context ppp_context_t;
+
+/* Per-protocol option handling, see ppp.c */
+typedef struct __ppp_cp_ops
+{
+  size_t (*add_options)(ppp_context_t* ppp, unsigned char* options);
+  uint8_t (*peer_option)(ppp_context_t* ppp, ppp_option_header_t* option,
+			 ppp_option_header_t* nak);	/* suggested option, if nak-ed */
+  void (*nak_option)(ppp_context_t* ppp, ppp_option_header_t* option);
+  void (*rej_option)(ppp_context_t* ppp, ppp_option_header_t* option);
+  void (*up)(ppp_context_t* ppp);
+  void (*down)(ppp_context_t* ppp);
+} ppp_cp_ops_t;
+
+typedef struct __ppp_cp
+{
+  const char* name;
+  uint16_t protocol;
+  uint8_t state;
+  uint8_t identifier;
+  uint8_t restart;
+  const ppp_cp_ops_t* ops;
+} ppp_cp_t;
+
+struct __ppp_context
+{
+  int tun_fd;
+  event_timer_t restart_timer;	/* see ppp_open() */
+  char ifname[IFNAMSIZ];
+
+  ppp_cp_t lcp;
+  ppp_cp_t ipcp;
+  ppp_cp_t ipv6cp;
+
+  /* LCP */
+  uint32_t magic;
+  uint16_t peer_mru;
+
+  /* MS-CHAPv2 */
+  uint8_t auth_challenge[16];
+  uint8_t peer_challenge[16];
+  uint8_t nt_response[24];
+  uint8_t authenticated;
+
+  /* IPCP */
+  uint8_t ipcp_rejected;
+  struct in_addr local_addr;
+  struct in_addr peer_addr;
+  struct in_addr dns[2];
+  struct in_addr tun_local;
+  struct in_addr tun_peer;
+
+  /* IPV6CP */
+  uint8_t local_ifid[8];
+  uint8_t peer_ifid[8];
+  uint8_t tun_ifid[8];		/* zero until set on TUN interface */
+
+  const char* username;
+  const char* password;
+
+  /* tunnel carrying PPP frames */
+  struct __sstp_tunnel* tunnel;
+
+  /* IP packets output, write(2) on tun_fd if NULL */
+  int (*ip_output)(struct __sstp_tunnel* tunnel, unsigned char* packet, size_t len);
+};
+
+
+/* functions declarations */
+int ppp_init(ppp_context_t* ppp, struct __sstp_tunnel* tunnel);
+void ppp_close(ppp_context_t* ppp);
+void ppp_open(ppp_context_t* ppp);
+void ppp_reset(ppp_context_t* ppp);
+int ppp_timer_tick(void* data);
+int ppp_input(ppp_context_t* ppp, unsigned char* frame, size_t len);
+size_t ppp_encapsulate(ppp_context_t* ppp, unsigned char* packet, size_t len);
+uint16_t ppp_frame_protocol(unsigned char* frame, size_t len, size_t* offset);
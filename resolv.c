@@ -0,0 +1,436 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#ifdef HAS_GNUTLS
+#include <gnutls/x509.h>
+#include <gnutls/gnutls.h>
+#else
+#include <polarssl/net.h>
+#include <polarssl/ssl.h>
+#include <polarssl/entropy.h>
+#include <polarssl/ctr_drbg.h>
+#endif
+
+#include "main.h"
+#include "libsstp.h"
+#include "event.h"
+#include "resolv.h"
+#include "tunnel.h"
+
+
+/*
+ * One lookup, shared by resolver thread and the worker waiting for it (if
+ * any): last one to let it go frees it.
+ */
+typedef struct __resolv_query
+{
+  char* host;
+  char* port;
+  int cache_fd;			/* dup()-ed, -1 if no cache */
+  int verbose;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int done;
+  int error;			/* getaddrinfo() error */
+  unsigned int refs;
+
+  resolv_addrs_t addrs;
+} resolv_query_t;
+
+
+/**
+ * Opens (or creates) addresses cache file of tunnel server (or proxy), in
+ * cache directory. Host name characters other than alphanumerics, '.' and
+ * '-' are replaced by '_'.
+ *
+ * @param t : tunnel, with cfg->tls_cache set
+ * @return 0 if all good, -1 otherwise
+ */
+int resolv_open(sstp_tunnel_t* t)
+{
+  char path[PATH_MAX], *c;
+  int len;
+
+  t->resolv_cache_fd = -1;
+
+  if (!t->cfg->tls_cache)
+    return 0;
+
+  len = snprintf(path, sizeof(path), "%s/%s_%s.addr", t->cfg->tls_cache,
+		 t->cfg->proxy ? t->cfg->proxy : t->cfg->server,
+		 t->cfg->proxy ? t->cfg->proxy_port : t->cfg->port);
+  if (len < 0 || (size_t) len >= sizeof(path))
+    {
+      xlog(LOG_ERROR, "resolv_open: path too long\n");
+      return -1;
+    }
+
+  for (c = path + strlen(t->cfg->tls_cache) + 1; *c; c++)
+    if (!(isalnum(*c) || *c == '.' || *c == '-'))
+      *c = '_';
+
+  t->resolv_cache_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR);
+  if (t->resolv_cache_fd < 0)
+    {
+      xlog(LOG_ERROR, "resolv_open: '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: addresses cache '%s'\n", t->name, path);
+
+  return 0;
+}
+
+
+/**
+ * Closes cache file. A background lookup still running keeps its own fd.
+ *
+ * @param t : tunnel
+ */
+void resolv_close(sstp_tunnel_t* t)
+{
+  if (t->resolv_cache_fd >= 0)
+    close(t->resolv_cache_fd);
+
+  t->resolv_cache_fd = -1;
+}
+
+
+/**
+ * Chains addresses list, eg. after a copy.
+ *
+ * @param addrs : addresses
+ */
+void resolv_link(resolv_addrs_t* addrs)
+{
+  unsigned int i;
+
+  for (i=0; i<addrs->count; i++)
+    {
+      addrs->ai[i].ai_addr = (struct sockaddr*) &addrs->addr[i];
+      addrs->ai[i].ai_canonname = NULL;
+      addrs->ai[i].ai_next = (i + 1 < addrs->count) ? &addrs->ai[i+1] : NULL;
+    }
+}
+
+
+/**
+ * Reads cached addresses.
+ *
+ * @param fd : cache file
+ * @param addrs : addresses
+ * @return age of entry in seconds, -1 if none
+ */
+static long resolv_cache_read(int fd, resolv_addrs_t* addrs)
+{
+  resolv_entry_t entries[RESOLV_MAX_ADDRS];
+  resolv_header_t header;
+  ssize_t rbytes = -1;
+  unsigned int i;
+  time_t now;
+
+  addrs->count = 0;
+
+  flock(fd, LOCK_SH);
+  if (pread(fd, &header, sizeof(resolv_header_t), 0) == sizeof(resolv_header_t) &&
+      !memcmp(header.magic, RESOLV_MAGIC, sizeof(header.magic)) &&
+      header.count && header.count <= RESOLV_MAX_ADDRS)
+    rbytes = pread(fd, entries, header.count * sizeof(resolv_entry_t), sizeof(resolv_header_t));
+  flock(fd, LOCK_UN);
+
+  if (rbytes < 0 || (size_t) rbytes != header.count * sizeof(resolv_entry_t))
+    return -1;
+
+  for (i=0; i<header.count; i++)
+    {
+      if (entries[i].addrlen > sizeof(struct sockaddr_storage))
+	return -1;
+
+      memset(&addrs->ai[i], 0, sizeof(struct addrinfo));
+      addrs->ai[i].ai_family = entries[i].family;
+      addrs->ai[i].ai_socktype = entries[i].socktype;
+      addrs->ai[i].ai_protocol = entries[i].protocol;
+      addrs->ai[i].ai_addrlen = entries[i].addrlen;
+      memcpy(&addrs->addr[i], &entries[i].addr, sizeof(struct sockaddr_storage));
+    }
+  addrs->count = header.count;
+  resolv_link(addrs);
+
+  now = time(NULL);
+  return ((uint64_t) now > header.stored) ? (long) (now - header.stored) : 0;
+}
+
+
+/**
+ * Replaces cached addresses.
+ *
+ * @param fd : cache file
+ * @param addrs : addresses
+ */
+static void resolv_cache_write(int fd, resolv_addrs_t* addrs)
+{
+  resolv_entry_t entries[RESOLV_MAX_ADDRS];
+  resolv_header_t header;
+  unsigned int i;
+
+  memset(&header, 0, sizeof(resolv_header_t));
+  memcpy(header.magic, RESOLV_MAGIC, sizeof(header.magic));
+  header.stored = time(NULL);
+  header.count = addrs->count;
+
+  memset(entries, 0, sizeof(entries));
+  for (i=0; i<addrs->count; i++)
+    {
+      entries[i].family = addrs->ai[i].ai_family;
+      entries[i].socktype = addrs->ai[i].ai_socktype;
+      entries[i].protocol = addrs->ai[i].ai_protocol;
+      entries[i].addrlen = addrs->ai[i].ai_addrlen;
+      memcpy(&entries[i].addr, &addrs->addr[i], addrs->ai[i].ai_addrlen);
+    }
+
+  flock(fd, LOCK_EX);
+  if (ftruncate(fd, 0) < 0 ||
+      pwrite(fd, &header, sizeof(resolv_header_t), 0) != sizeof(resolv_header_t) ||
+      pwrite(fd, entries, addrs->count * sizeof(resolv_entry_t), sizeof(resolv_header_t)) !=
+      (ssize_t) (addrs->count * sizeof(resolv_entry_t)))
+    xlog(LOG_ERROR, "resolv_cache_write: %s\n", strerror(errno));
+  flock(fd, LOCK_UN);
+}
+
+
+/**
+ * Drops a reference to a query, freeing it if it was the last one.
+ *
+ * @param q : query, locked
+ */
+static void resolv_query_put(resolv_query_t* q)
+{
+  int last = (--q->refs == 0);
+
+  pthread_mutex_unlock(&q->lock);
+  if (!last)
+    return;
+
+  if (q->cache_fd >= 0)
+    close(q->cache_fd);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->cond);
+  xfree(q->host);
+  xfree(q->port);
+  xfree(q);
+}
+
+
+/**
+ * Resolver thread: runs getaddrinfo(), caches addresses found and wakes up
+ * waiting worker, if still any.
+ *
+ * @param data : query
+ * @return NULL
+ */
+static void* resolv_thread(void* data)
+{
+  resolv_query_t* q = (resolv_query_t*) data;
+  struct addrinfo hints, *res, *ll;
+  resolv_addrs_t addrs;
+  int error;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  addrs.count = 0;
+  error = getaddrinfo(q->host, q->port, &hints, &res);
+  if (!error)
+    {
+      for (ll = res; ll && addrs.count < RESOLV_MAX_ADDRS; ll = ll->ai_next)
+	{
+	  if (ll->ai_addrlen > sizeof(struct sockaddr_storage))
+	    continue;
+
+	  memset(&addrs.ai[addrs.count], 0, sizeof(struct addrinfo));
+	  addrs.ai[addrs.count].ai_family = ll->ai_family;
+	  addrs.ai[addrs.count].ai_socktype = ll->ai_socktype;
+	  addrs.ai[addrs.count].ai_protocol = ll->ai_protocol;
+	  addrs.ai[addrs.count].ai_addrlen = ll->ai_addrlen;
+	  memcpy(&addrs.addr[addrs.count], ll->ai_addr, ll->ai_addrlen);
+	  addrs.count++;
+	}
+      freeaddrinfo(res);
+
+      if (!addrs.count)
+	error = EAI_NONAME;
+    }
+
+  if (!error && q->cache_fd >= 0)
+    resolv_cache_write(q->cache_fd, &addrs);
+
+  if (q->verbose > 1)
+    xlog(LOG_DEBUG, "%s: %u address(es) resolved\n", q->host, addrs.count);
+
+  pthread_mutex_lock(&q->lock);
+  q->error = error;
+  memcpy(&q->addrs, &addrs, sizeof(resolv_addrs_t));
+  q->done = TRUE;
+  pthread_cond_signal(&q->cond);
+  resolv_query_put(q);
+
+  return NULL;
+}
+
+
+/**
+ * Starts a lookup in a resolver thread.
+ *
+ * @param t : tunnel
+ * @param host : host name
+ * @param port : port
+ * @param refs : 2 if caller waits for result, 1 otherwise
+ * @return query, NULL if thread could not be started
+ */
+static resolv_query_t* resolv_start(sstp_tunnel_t* t, const char* host, const char* port,
+				    unsigned int refs)
+{
+  resolv_query_t* q;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int retcode;
+
+  q = (resolv_query_t*) xmalloc(sizeof(resolv_query_t));
+  q->host = strdup(host);
+  q->port = strdup(port);
+  q->cache_fd = (t->resolv_cache_fd >= 0) ? dup(t->resolv_cache_fd) : -1;
+  q->verbose = t->cfg->verbose;
+  q->refs = refs;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  retcode = pthread_create(&thread, &attr, resolv_thread, q);
+  pthread_attr_destroy(&attr);
+
+  if (retcode != 0)
+    {
+      xlog(LOG_ERROR, "resolv_start: pthread_create: %s\n", strerror(retcode));
+      pthread_mutex_lock(&q->lock);
+      q->refs = 1;
+      resolv_query_put(q);
+      return NULL;
+    }
+
+  return q;
+}
+
+
+/**
+ * Resolves host: fresh cached addresses are used as is, older ones are used
+ * while a background lookup refreshes them. Otherwise, waits for a lookup up
+ * to RESOLV_TIMEOUT, falling back to addresses older than RESOLV_MAX_AGE if
+ * it fails.
+ *
+ * @param t : tunnel
+ * @param host : host name
+ * @param port : port
+ * @param addrs : addresses
+ * @return 0 if all good, -1 if host could not be resolved
+ */
+int resolv_lookup(sstp_tunnel_t* t, const char* host, const char* port, resolv_addrs_t* addrs)
+{
+  resolv_addrs_t cached;
+  resolv_query_t* q;
+  struct timespec deadline;
+  long age = -1;
+  int retcode = 0;
+
+  if (t->resolv_cache_fd >= 0)
+    age = resolv_cache_read(t->resolv_cache_fd, &cached);
+
+  if (age >= 0 && age < RESOLV_MAX_AGE)
+    {
+      memcpy(addrs, &cached, sizeof(resolv_addrs_t));
+      resolv_link(addrs);
+
+      if (t->cfg->verbose > 1)
+	xlog(LOG_DEBUG, "%s: using %u cached address(es), %ld sec old\n", host, addrs->count, age);
+
+      if (age >= RESOLV_TTL)
+	resolv_start(t, host, port, 1);
+      return 0;
+    }
+
+  q = resolv_start(t, host, port, 2);
+  if (!q)
+    return -1;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += RESOLV_TIMEOUT / 1000;
+  deadline.tv_nsec += (RESOLV_TIMEOUT % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+  pthread_mutex_lock(&q->lock);
+  while (!q->done && retcode == 0)
+    retcode = pthread_cond_timedwait(&q->cond, &q->lock, &deadline);
+
+  if (q->done && !q->error)
+    {
+      memcpy(addrs, &q->addrs, sizeof(resolv_addrs_t));
+      resolv_link(addrs);
+      resolv_query_put(q);
+      return 0;
+    }
+
+  if (q->done)
+    xlog(LOG_ERROR, "getaddrinfo failed: %s\n", gai_strerror(q->error));
+  else
+    xlog(LOG_ERROR, "%s: name resolution timed out\n", host);
+  resolv_query_put(q);
+
+  if (age < 0)
+    return -1;
+
+  xlog(LOG_WARNING, "%s: using cached addresses, %ld sec old\n", host, age);
+  memcpy(addrs, &cached, sizeof(resolv_addrs_t));
+  resolv_link(addrs);
+  return 0;
+}
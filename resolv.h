@@ -0,0 +1,77 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define RESOLV_TTL 300			/* sec, cached addresses are refreshed past it */
+#define RESOLV_MAX_AGE 86400		/* sec, older cached addresses are a last resort */
+#define RESOLV_TIMEOUT 5000		/* ms, lookup wait when nothing fresh is cached */
+#define RESOLV_MAX_ADDRS 16
+#define RESOLV_MAGIC "SSTPDNS1"
+
+/*
+ * Cache file header, followed by `count` entries.
+ */
+typedef struct __resolv_header
+{
+  char magic[8];
+  uint64_t stored;
+  uint32_t count;
+  uint32_t reserved;
+} resolv_header_t;
+
+typedef struct __resolv_entry
+{
+  uint32_t family;
+  uint32_t socktype;
+  uint32_t protocol;
+  uint32_t addrlen;
+  struct sockaddr_storage addr;
+} resolv_entry_t;
+
+/*
+ * Resolved addresses, as a getaddrinfo()-like list pointing into the
+ * structure itself: see resolv_link() after copying one.
+ */
+typedef struct __resolv_addrs
+{
+  unsigned int count;
+  struct addrinfo ai[RESOLV_MAX_ADDRS];
+  struct sockaddr_storage addr[RESOLV_MAX_ADDRS];
+} resolv_addrs_t;
+
+/*
+ * Name resolution runs in a resolver thread, so that a slow or dead DNS
+ * server does not stall a worker longer than RESOLV_TIMEOUT. Last good
+ * addresses of a server are kept in a file of the cache directory (-C): they
+ * are used right away on next connection, and refreshed in background once
+ * older than RESOLV_TTL (getaddrinfo() does not tell DNS TTL). Like TLS cache
+ * file, it is opened while still privileged.
+ */
+int resolv_open(sstp_tunnel_t* t);
+void resolv_close(sstp_tunnel_t* t);
+void resolv_link(resolv_addrs_t* addrs);
+int resolv_lookup(sstp_tunnel_t* t, const char* host, const char* port, resolv_addrs_t* addrs);
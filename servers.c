@@ -0,0 +1,823 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/nameser.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef HAS_GNUTLS
+#include <gnutls/x509.h>
+#include <gnutls/gnutls.h>
+#else
+#include <polarssl/net.h>
+#include <polarssl/ssl.h>
+#include <polarssl/entropy.h>
+#include <polarssl/ctr_drbg.h>
+#endif
+
+#include "main.h"
+#include "libsstp.h"
+#include "event.h"
+#include "tunnel.h"
+#include "tcp.h"
+#include "tlscache.h"
+#include "resolv.h"
+
+
+/*
+ * Probing of every server, shared by probe threads and the worker waiting
+ * for them: last one to let it go frees it. Threads may outlive the tunnel,
+ * so nothing in there points to its configuration.
+ */
+typedef struct __servers_probe servers_probe_t;
+
+typedef struct __servers_job
+{
+  servers_probe_t* probe;
+  unsigned int index;
+} servers_job_t;
+
+struct __servers_probe
+{
+  sstp_config cfg;		/* tcp_connect() settings, without any string */
+  char* host[SERVERS_MAX];
+  char* port[SERVERS_MAX];
+  char* priority[SERVERS_MAX];	/* TLS priority, as tunnel would use it */
+  long time[SERVERS_MAX];
+  servers_job_t jobs[SERVERS_MAX];
+  unsigned int count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned int pending;
+  unsigned int refs;
+};
+
+
+/**
+ * @return monotonic time, in milliseconds
+ */
+static int64_t servers_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * Appends a server to the pool.
+ *
+ * @param s : pool
+ * @param host : host name
+ * @param port : port
+ */
+static void servers_add(servers_t* s, const char* host, const char* port)
+{
+  server_t* server;
+
+  if (s->count == SERVERS_MAX)
+    {
+      xlog(LOG_WARNING, "Only %d servers are kept, '%s' is ignored\n", SERVERS_MAX, host);
+      return;
+    }
+
+  server = &s->list[s->count++];
+  server->host = strdup(host);
+  server->port = strdup(port);
+  server->time = -1;
+  server->tls_cache_fd = -1;
+  server->resolv_cache_fd = -1;
+}
+
+
+/**
+ * Fills the pool from a SRV record: targets are ordered by priority, then
+ * by decreasing weight. Probing orders them again.
+ *
+ * @param s : pool
+ * @param name : SRV record name, eg. _sstp._tcp.example.com
+ * @return 0 if all good, -1 otherwise
+ */
+static int servers_srv(servers_t* s, const char* name)
+{
+  unsigned char answer[NS_MAXMSG];
+  char target[NS_MAXDNAME], port[NI_MAXSERV];
+  uint16_t prio[SERVERS_MAX], weight[SERVERS_MAX], p, w;
+  const unsigned char* rdata;
+  server_t server;
+  unsigned int i, j;
+  ns_msg msg;
+  ns_rr rr;
+  int len;
+
+  len = res_query(name, ns_c_in, ns_t_srv, answer, sizeof(answer));
+  if (len < 0 || ns_initparse(answer, len, &msg) < 0)
+    {
+      xlog(LOG_ERROR, "%s: SRV lookup failed: %s\n", name, hstrerror(h_errno));
+      return -1;
+    }
+
+  for (i=0; i<ns_msg_count(msg, ns_s_an) && s->count < SERVERS_MAX; i++)
+    {
+      if (ns_parserr(&msg, ns_s_an, i, &rr) < 0 || ns_rr_type(rr) != ns_t_srv ||
+	  ns_rr_rdlen(rr) < 7)
+	continue;
+
+      rdata = ns_rr_rdata(rr);
+      if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + 6, target, sizeof(target)) < 0)
+	continue;
+
+      /* "." target: service not available */
+      if (!target[0] || !strcmp(target, "."))
+	continue;
+
+      snprintf(port, sizeof(port), "%u", ns_get16(rdata + 4));
+      servers_add(s, target, port);
+
+      /* insertion sort, by priority then weight */
+      server = s->list[s->count - 1];
+      p = ns_get16(rdata);
+      w = ns_get16(rdata + 2);
+      for (j = s->count - 1; j > 0 && (prio[j-1] > p || (prio[j-1] == p && weight[j-1] < w)); j--)
+	{
+	  s->list[j] = s->list[j-1];
+	  prio[j] = prio[j-1];
+	  weight[j] = weight[j-1];
+	}
+      s->list[j] = server;
+      prio[j] = p;
+      weight[j] = w;
+    }
+
+  if (!s->count)
+    {
+      xlog(LOG_ERROR, "%s: no server in SRV record\n", name);
+      return -1;
+    }
+
+  return 0;
+}
+
+
+/**
+ * Keeps what tunnel learnt about its current server, before another one is
+ * used or the pool is reordered.
+ *
+ * @param t : tunnel
+ */
+static void servers_save(sstp_tunnel_t* t)
+{
+  server_t* server = &t->servers.list[t->servers.current];
+
+  server->tls_failed_versions = t->tls_failed_versions;
+  server->tls_failed_expire = t->tls_failed_expire;
+}
+
+
+/**
+ * Makes a server of the pool the one tunnel connects to: configuration,
+ * cache files and failed TLS versions of the tunnel are switched to it.
+ *
+ * @param t : tunnel
+ * @param index : server index
+ */
+static void servers_use(sstp_tunnel_t* t, unsigned int index)
+{
+  server_t* server = &t->servers.list[index];
+
+  /* server name is read by tunnel_phases_json() on SIGUSR2 */
+  tunnel_stats_begin(t);
+  t->servers.current = index;
+  t->cfg->server = server->host;
+  t->cfg->port = server->port;
+  tunnel_stats_end(t);
+
+  t->tls_cache_fd = server->tls_cache_fd;
+  t->resolv_cache_fd = server->resolv_cache_fd;
+  t->tls_cache_state = (server->tls_cache_fd >= 0) ? TLS_CACHE_EMPTY : TLS_CACHE_DISABLED;
+  t->tls_failed_versions = server->tls_failed_versions;
+  t->tls_failed_expire = server->tls_failed_expire;
+}
+
+
+/**
+ * Fills the pool of a tunnel from cfg->srv, or cfg->server list of
+ * host[:port] (a port is only split from a name or an IPv4 address), and
+ * points tunnel to its first server.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise
+ */
+int servers_init(sstp_tunnel_t* t)
+{
+  servers_t* s = &t->servers;
+  char *list, *entry, *saveptr, *colon;
+
+  s->name = strdup(t->cfg->srv ? t->cfg->srv : t->cfg->server);
+
+  if (t->cfg->srv)
+    {
+      if (servers_srv(s, t->cfg->srv) < 0)
+	return -1;
+    }
+  else
+    {
+      list = strdup(t->cfg->server);
+      for (entry = strtok_r(list, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr))
+	{
+	  colon = strchr(entry, ':');
+	  if (colon && colon == strrchr(entry, ':'))
+	    {
+	      *colon = '\0';
+	      servers_add(s, entry, colon + 1);
+	    }
+	  else
+	    servers_add(s, entry, t->cfg->port);
+	}
+      xfree(list);
+
+      if (!s->count)
+	{
+	  xlog(LOG_ERROR, "No server in '%s'\n", s->name);
+	  return -1;
+	}
+    }
+
+  if (s->count > 1 && t->cfg->verbose)
+    xlog(LOG_INFO, "%s: %u servers in pool\n", t->name, s->count);
+
+  servers_use(t, 0);
+  return 0;
+}
+
+
+/**
+ * Opens TLS session and addresses cache files of every server, and probe
+ * results cache file of the pool, in cache directory.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise
+ */
+int servers_open(sstp_tunnel_t* t)
+{
+  servers_t* s = &t->servers;
+  char path[PATH_MAX], *c;
+  unsigned int i;
+  int retcode, len;
+
+  for (i=0; i<s->count; i++)
+    {
+      servers_use(t, i);
+
+      retcode = tls_cache_open(t);
+      s->list[i].tls_cache_fd = t->tls_cache_fd;
+      if (retcode == 0)
+	retcode = resolv_open(t);
+      s->list[i].resolv_cache_fd = t->resolv_cache_fd;
+      servers_save(t);
+
+      if (retcode < 0)
+	return -1;
+    }
+
+  servers_use(t, 0);
+
+  if (s->count < 2 || !t->cfg->tls_cache)
+    return 0;
+
+  len = snprintf(path, sizeof(path), "%s/%s.servers", t->cfg->tls_cache, s->name);
+  if (len < 0 || (size_t) len >= sizeof(path))
+    {
+      xlog(LOG_ERROR, "servers_open: path too long\n");
+      return -1;
+    }
+
+  for (c = path + strlen(t->cfg->tls_cache) + 1; *c; c++)
+    if (!(isalnum(*c) || *c == '.' || *c == '-'))
+      *c = '_';
+
+  s->cache_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR);
+  if (s->cache_fd < 0)
+    {
+      xlog(LOG_ERROR, "servers_open: '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: probe results cache '%s'\n", t->name, path);
+
+  return 0;
+}
+
+
+/**
+ * Closes cache files of the pool and empties it.
+ *
+ * @param t : tunnel
+ */
+void servers_close(sstp_tunnel_t* t)
+{
+  servers_t* s = &t->servers;
+  unsigned int i;
+
+  for (i=0; i<s->count; i++)
+    {
+      if (s->list[i].tls_cache_fd >= 0)
+	close(s->list[i].tls_cache_fd);
+      if (s->list[i].resolv_cache_fd >= 0)
+	close(s->list[i].resolv_cache_fd);
+
+      xfree(s->list[i].host);
+      xfree(s->list[i].port);
+    }
+
+  if (s->cache_fd >= 0)
+    close(s->cache_fd);
+  if (s->name)
+    xfree(s->name);
+
+  s->count = 0;
+  s->cache_fd = -1;
+  s->name = NULL;
+  t->tls_cache_fd = t->resolv_cache_fd = -1;
+}
+
+
+/**
+ * Reads probe results of the pool from cache file. A cache of another list
+ * of servers is ignored.
+ *
+ * @param s : pool
+ * @return cached results age in seconds, -1 if none
+ */
+static long servers_cache_read(servers_t* s)
+{
+  servers_entry_t entries[SERVERS_MAX];
+  servers_header_t header;
+  long times[SERVERS_MAX];
+  ssize_t rbytes = -1;
+  unsigned int i, j;
+  uint64_t now;
+
+  flock(s->cache_fd, LOCK_SH);
+  if (pread(s->cache_fd, &header, sizeof(servers_header_t), 0) == sizeof(servers_header_t) &&
+      !memcmp(header.magic, SERVERS_MAGIC, sizeof(header.magic)) &&
+      header.count > 0 && header.count <= SERVERS_MAX)
+    rbytes = pread(s->cache_fd, entries, header.count * sizeof(servers_entry_t),
+		   sizeof(servers_header_t));
+  flock(s->cache_fd, LOCK_UN);
+
+  if (rbytes < 0 || (size_t) rbytes != header.count * sizeof(servers_entry_t))
+    return -1;
+
+  now = time(NULL);
+  if (now < header.stored)
+    return -1;
+
+  for (i=0; i<s->count; i++)
+    {
+      for (j=0; j<header.count; j++)
+	{
+	  entries[j].host[NI_MAXHOST - 1] = entries[j].port[NI_MAXSERV - 1] = '\0';
+	  if (!strcmp(entries[j].host, s->list[i].host) &&
+	      !strcmp(entries[j].port, s->list[i].port))
+	    break;
+	}
+
+      if (j == header.count)
+	return -1;
+
+      times[i] = entries[j].time;
+    }
+
+  for (i=0; i<s->count; i++)
+    s->list[i].time = times[i];
+
+  return now - header.stored;
+}
+
+
+/**
+ * Writes probe results of the pool to cache file.
+ *
+ * @param s : pool
+ */
+static void servers_cache_write(servers_t* s)
+{
+  servers_entry_t entries[SERVERS_MAX];
+  servers_header_t header;
+  unsigned int i;
+
+  memset(&header, 0, sizeof(servers_header_t));
+  memcpy(header.magic, SERVERS_MAGIC, sizeof(header.magic));
+  header.stored = time(NULL);
+  header.count = s->count;
+
+  memset(entries, 0, sizeof(entries));
+  for (i=0; i<s->count; i++)
+    {
+      snprintf(entries[i].host, sizeof(entries[i].host), "%s", s->list[i].host);
+      snprintf(entries[i].port, sizeof(entries[i].port), "%s", s->list[i].port);
+      entries[i].time = s->list[i].time;
+    }
+
+  flock(s->cache_fd, LOCK_EX);
+  if (ftruncate(s->cache_fd, 0) < 0 ||
+      pwrite(s->cache_fd, &header, sizeof(servers_header_t), 0) != sizeof(servers_header_t) ||
+      pwrite(s->cache_fd, entries, s->count * sizeof(servers_entry_t), sizeof(servers_header_t)) !=
+      (ssize_t) (s->count * sizeof(servers_entry_t)))
+    xlog(LOG_ERROR, "servers_cache_write: %s\n", strerror(errno));
+  flock(s->cache_fd, LOCK_UN);
+}
+
+
+/**
+ * Lets probing go, with its lock held: last one frees it.
+ *
+ * @param p : probing
+ */
+static void servers_probe_put(servers_probe_t* p)
+{
+  unsigned int i;
+  int last;
+
+  last = (--p->refs == 0);
+  pthread_mutex_unlock(&p->lock);
+
+  if (!last)
+    return;
+
+  for (i=0; i<p->count; i++)
+    {
+      xfree(p->host[i]);
+      xfree(p->port[i]);
+      xfree(p->priority[i]);
+    }
+
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+  xfree(p);
+}
+
+
+/**
+ * Runs a TLS handshake on a connected socket, server certificate not being
+ * checked: only its time matters. PolarSSL has no priority strings: it offers
+ * its default ciphersuites, only versions tunnel would skip are left out.
+ *
+ * @param sock : socket
+ * @param host : server name, for SNI
+ * @param priority : GnuTLS priority string
+ * @return 0 if all good, -1 otherwise
+ */
+static int servers_handshake(sock_t sock, const char* host, const char* priority)
+{
+#ifdef HAS_GNUTLS
+  gnutls_session_t tls;
+  gnutls_certificate_credentials_t creds;
+  int retcode;
+
+  if (gnutls_certificate_allocate_credentials(&creds) != GNUTLS_E_SUCCESS)
+    return -1;
+
+  gnutls_init(&tls, GNUTLS_CLIENT);
+  gnutls_server_name_set(tls, GNUTLS_NAME_DNS, host, strlen(host));
+  retcode = gnutls_priority_set_direct(tls, priority, NULL);
+  if (retcode == GNUTLS_E_SUCCESS)
+    retcode = gnutls_credentials_set(tls, GNUTLS_CRD_CERTIFICATE, creds);
+
+  if (retcode == GNUTLS_E_SUCCESS)
+    {
+      gnutls_transport_set_int(tls, sock);
+      gnutls_handshake_set_timeout(tls, SERVERS_PROBE_TIMEOUT);
+
+      do
+	retcode = gnutls_handshake(tls);
+      while (retcode < 0 && !gnutls_error_is_fatal(retcode));
+    }
+
+  gnutls_deinit(tls);
+  gnutls_certificate_free_credentials(creds);
+
+  return (retcode == GNUTLS_E_SUCCESS) ? 0 : -1;
+#else
+  entropy_context entropy;
+  ctr_drbg_context ctr_drbg;
+  ssl_context tls;
+  struct timeval tv;
+  int fd = sock;
+  int max_version;
+  int retcode;
+
+  /* blocking socket: a silent server fails the handshake */
+  tv.tv_sec = SERVERS_PROBE_TIMEOUT / 1000;
+  tv.tv_usec = (SERVERS_PROBE_TIMEOUT % 1000) * 1000;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    return -1;
+
+  max_version = SSL_MINOR_VERSION_3;
+  if (strstr(priority, "-VERS-TLS1.2"))
+    max_version = strstr(priority, "-VERS-TLS1.1") ? SSL_MINOR_VERSION_1 : SSL_MINOR_VERSION_2;
+
+  memset(&tls, 0, sizeof(ssl_context));
+  entropy_init(&entropy);
+  retcode = ctr_drbg_init(&ctr_drbg, entropy_func, &entropy,
+			  (const unsigned char *) PROGNAME, strlen(PROGNAME));
+  if (retcode == 0)
+    retcode = ssl_init(&tls);
+
+  if (retcode == 0)
+    {
+      ssl_set_endpoint(&tls, SSL_IS_CLIENT);
+      ssl_set_authmode(&tls, SSL_VERIFY_NONE);
+      ssl_set_min_version(&tls, SSL_MAJOR_VERSION_3, SSL_MINOR_VERSION_1);
+      ssl_set_max_version(&tls, SSL_MAJOR_VERSION_3, max_version);
+      ssl_set_rng(&tls, ctr_drbg_random, &ctr_drbg);
+      ssl_set_bio(&tls, net_recv, &fd, net_send, &fd);
+      retcode = ssl_set_hostname(&tls, host);
+    }
+
+  if (retcode == 0)
+    {
+      do
+	retcode = ssl_handshake(&tls);
+      while (retcode == POLARSSL_ERR_NET_WANT_READ || retcode == POLARSSL_ERR_NET_WANT_WRITE);
+    }
+
+  ssl_free(&tls);
+  entropy_free(&entropy);
+
+  return (retcode == 0) ? 0 : -1;
+#endif
+}
+
+
+/**
+ * Probe thread: times TCP connection and TLS handshake to one server.
+ *
+ * @param data : job
+ * @return NULL
+ */
+static void* servers_probe_thread(void* data)
+{
+  servers_job_t* job = (servers_job_t*) data;
+  servers_probe_t* p = job->probe;
+  struct addrinfo hints, *res;
+  long elapsed = -1;
+  int64_t start;
+  sock_t sock;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  /* name resolution is not timed, it does not tell which server is faster */
+  if (getaddrinfo(p->host[job->index], p->port[job->index], &hints, &res) == 0)
+    {
+      start = servers_now();
+      sock = tcp_connect(res, &p->cfg);
+      freeaddrinfo(res);
+
+      if (sock >= 0)
+	{
+	  if (servers_handshake(sock, p->host[job->index], p->priority[job->index]) == 0)
+	    elapsed = servers_now() - start;
+	  close(sock);
+	}
+    }
+
+  pthread_mutex_lock(&p->lock);
+  p->time[job->index] = elapsed;
+  p->pending--;
+  pthread_cond_signal(&p->cond);
+  servers_probe_put(p);
+
+  return NULL;
+}
+
+
+/**
+ * Probes every server of the pool at once, waiting SERVERS_PROBE_TIMEOUT at
+ * most. Servers not answering in time are marked failed, their threads are
+ * left running on their own.
+ *
+ * @param t : tunnel
+ */
+static void servers_probe(sstp_tunnel_t* t)
+{
+  servers_t* s = &t->servers;
+  servers_probe_t* p;
+  struct timespec deadline;
+  pthread_attr_t attr;
+  pthread_t thread;
+  char priority[1024];
+  uint32_t failed;
+  unsigned int i;
+  int retcode = 0;
+
+  p = (servers_probe_t*) xmalloc(sizeof(servers_probe_t));
+  memset(&p->cfg, 0, sizeof(sstp_config));
+  p->cfg.tcp_user_timeout = SERVERS_PROBE_TIMEOUT;
+  p->cfg.tcp_keepidle = t->cfg->tcp_keepidle;
+  p->cfg.tcp_keepintvl = t->cfg->tcp_keepintvl;
+  p->cfg.tcp_keepcnt = t->cfg->tcp_keepcnt;
+  p->count = s->count;
+  p->refs = 1;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  pthread_mutex_lock(&p->lock);
+  for (i=0; i<s->count; i++)
+    {
+      p->host[i] = strdup(s->list[i].host);
+      p->port[i] = strdup(s->list[i].port);
+
+      /* same handshake as tunnel's one, so that timings compare */
+      failed = (time(NULL) < s->list[i].tls_failed_expire) ? s->list[i].tls_failed_versions : 0;
+      tls_cache_priority(t->cfg, failed, priority, sizeof(priority));
+      p->priority[i] = strdup(priority);
+
+      p->time[i] = -1;
+      p->jobs[i].probe = p;
+      p->jobs[i].index = i;
+
+      retcode = pthread_create(&thread, &attr, servers_probe_thread, &p->jobs[i]);
+      if (retcode != 0)
+	{
+	  xlog(LOG_ERROR, "servers_probe: pthread_create: %s\n", strerror(retcode));
+	  continue;
+	}
+
+      p->refs++;
+      p->pending++;
+    }
+  pthread_attr_destroy(&attr);
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += SERVERS_PROBE_TIMEOUT / 1000;
+  deadline.tv_nsec += (SERVERS_PROBE_TIMEOUT % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+  retcode = 0;
+  while (p->pending && retcode == 0)
+    retcode = pthread_cond_timedwait(&p->cond, &p->lock, &deadline);
+
+  for (i=0; i<s->count; i++)
+    s->list[i].time = p->time[i];
+
+  servers_probe_put(p);
+}
+
+
+/**
+ * @return TRUE if server `a` is to be tried before server `b`
+ */
+static int servers_before(server_t* a, server_t* b)
+{
+  return a->time >= 0 && (b->time < 0 || a->time < b->time);
+}
+
+
+/**
+ * Orders the pool of a tunnel by probing its servers (or from cached
+ * results), before first connection, and points tunnel to the fastest one.
+ * Through a proxy, given order is kept.
+ *
+ * @param t : tunnel
+ */
+void servers_select(sstp_tunnel_t* t)
+{
+  servers_t* s = &t->servers;
+  server_t server;
+  unsigned int i, j;
+  long age = -1;
+
+  if (s->count < 2 || s->probed)
+    return;
+
+  s->probed = TRUE;
+
+  if (t->cfg->proxy)
+    {
+      if (t->cfg->verbose)
+	xlog(LOG_INFO, "%s: servers are not probed through a proxy\n", t->name);
+      return;
+    }
+
+  /* failed TLS versions of current server, for the probe and the sort */
+  servers_save(t);
+
+  if (s->cache_fd >= 0)
+    age = servers_cache_read(s);
+
+  if (age >= 0 && age < SERVERS_PROBE_TTL)
+    {
+      if (t->cfg->verbose > 1)
+	xlog(LOG_DEBUG, "%s: using probe results of %ld sec ago\n", t->name, age);
+    }
+  else
+    {
+      servers_probe(t);
+
+      if (s->cache_fd >= 0)
+	servers_cache_write(s);
+    }
+
+  /* fastest first, unreachable ones last in given order */
+  for (i=1; i<s->count; i++)
+    {
+      server = s->list[i];
+      for (j = i; j > 0 && servers_before(&server, &s->list[j-1]); j--)
+	s->list[j] = s->list[j-1];
+      s->list[j] = server;
+    }
+
+  if (t->cfg->verbose)
+    for (i=0; i<s->count; i++)
+      {
+	if (s->list[i].time >= 0)
+	  xlog(LOG_INFO, "%s: server %s:%s, %ld ms\n", t->name,
+	       s->list[i].host, s->list[i].port, s->list[i].time);
+	else
+	  xlog(LOG_INFO, "%s: server %s:%s, unreachable\n", t->name,
+	       s->list[i].host, s->list[i].port);
+      }
+
+  servers_use(t, 0);
+  xlog(LOG_INFO, "%s: using server %s:%s\n", t->name, t->cfg->server, t->cfg->port);
+}
+
+
+/**
+ * Fails over to next server of the pool, after a connection failure. Once
+ * every server has failed in a row, tunnel is pointed back to the first one
+ * and the failure is reported.
+ *
+ * @param t : tunnel
+ * @return 0 if another server is to be tried, -1 otherwise
+ */
+int servers_next(sstp_tunnel_t* t)
+{
+  servers_t* s = &t->servers;
+
+  if (s->count < 2)
+    return -1;
+
+  if (++s->failed >= s->count)
+    {
+      xlog(LOG_ERROR, "%s: no server of the pool is reachable\n", t->name);
+      s->failed = 0;
+      servers_save(t);
+      servers_use(t, 0);
+      return -1;
+    }
+
+  servers_save(t);
+  servers_use(t, (s->current + 1) % s->count);
+  xlog(LOG_INFO, "%s: failing over to server %s:%s\n", t->name, t->cfg->server, t->cfg->port);
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <netdb.h>
+#include <time.h>
+
+#define SERVERS_MAX 16
+#define SERVERS_PROBE_TIMEOUT 3000	/* ms, probing of every server */
+#define SERVERS_PROBE_TTL 3600		/* sec, cached probe results are used as is */
+#define SERVERS_MAGIC "SSTPSRV1"
+
+/*
+ * Probe results cache file header, followed by `count` entries.
+ */
+typedef struct __servers_header
+{
+  char magic[8];
+  uint64_t stored;
+  uint32_t count;
+  uint32_t reserved;
+} servers_header_t;
+
+typedef struct __servers_entry
+{
+  char host[NI_MAXHOST];
+  char port[NI_MAXSERV];
+  int32_t time;
+  uint32_t reserved;
+} servers_entry_t;
+
+typedef struct __server
+{
+  char* host;
+  char* port;
+  long time;			/* ms, TCP connection plus TLS handshake, -1 if unknown or failed */
+  int tls_cache_fd;		/* see tls_cache_open() */
+  int resolv_cache_fd;		/* see resolv_open() */
+  uint32_t tls_failed_versions;	/* kept while another server is used */
+  time_t tls_failed_expire;
+} server_t;
+
+typedef struct __servers
+{
+  char* name;			/* cfg->server list or cfg->srv */
+  server_t list[SERVERS_MAX];	/* fastest first once probed */
+  unsigned int count;
+  unsigned int current;
+  unsigned int failed;		/* failovers in a row, see servers_next() */
+  int probed;
+  int cache_fd;			/* probe results, see servers_select() */
+} servers_t;
+
+/*
+ * Server pool: -s takes a comma-separated list of host[:port], or -r the
+ * name of an SRV record (RFC 2782) giving them. Each server has its own TLS
+ * session and addresses cache files.
+ *
+ * Before first connection, servers are probed concurrently, one thread each:
+ * time of TCP connection plus TLS handshake (TCP only with PolarSSL), within
+ * SERVERS_PROBE_TIMEOUT. Tunnel connects to the fastest one, others being
+ * tried in turn if connection fails. Results are kept in a file of the cache
+ * directory (-C) for SERVERS_PROBE_TTL, and next start uses them instead of
+ * probing again. Through a proxy, servers are tried in the given order.
+ */
+int servers_init(sstp_tunnel_t* t);
+int servers_open(sstp_tunnel_t* t);
+void servers_close(sstp_tunnel_t* t);
+void servers_select(sstp_tunnel_t* t);
+int servers_next(sstp_tunnel_t* t);
@@ -0,0 +1,299 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "main.h"
+#include "tcp.h"
+
+
+/**
+ * @return monotonic time, in milliseconds
+ */
+static int64_t tcp_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * Orders addresses for connection attempts: families are interleaved,
+ * starting with the one resolver prefers (RFC 8305, section 4).
+ *
+ * @param res : getaddrinfo() results
+ * @param addrs : TCP_MAX_ATTEMPTS addresses
+ * @return number of addresses
+ */
+static int tcp_sort(struct addrinfo* res, struct addrinfo** addrs)
+{
+  struct addrinfo *first[TCP_MAX_ATTEMPTS], *other[TCP_MAX_ATTEMPTS], *ll;
+  int nfirst = 0, nother = 0, i, n = 0;
+
+  for (ll = res; ll; ll = ll->ai_next)
+    {
+      if (ll->ai_family == res->ai_family && nfirst < TCP_MAX_ATTEMPTS)
+	first[nfirst++] = ll;
+      else if (ll->ai_family != res->ai_family && nother < TCP_MAX_ATTEMPTS)
+	other[nother++] = ll;
+    }
+
+  for (i=0; n < TCP_MAX_ATTEMPTS && (i < nfirst || i < nother); i++)
+    {
+      if (i < nfirst)
+	addrs[n++] = first[i];
+      if (i < nother && n < TCP_MAX_ATTEMPTS)
+	addrs[n++] = other[i];
+    }
+
+  return n;
+}
+
+
+/**
+ * @param ll : address
+ * @param buf : buffer for numeric host
+ * @param len : `buf` length
+ * @return numeric host, for logs
+ */
+static const char* tcp_addr(struct addrinfo* ll, char* buf, size_t len)
+{
+  if (getnameinfo(ll->ai_addr, ll->ai_addrlen, buf, len, NULL, 0, NI_NUMERICHOST) != 0)
+    snprintf(buf, len, "?");
+  return buf;
+}
+
+
+/**
+ * Sets dead peer detection options, see tcp.h. Failures are not fatal: the
+ * kernel defaults then apply.
+ *
+ * @param sock : socket
+ * @param cfg : configuration
+ */
+static void tcp_set_timeouts(sock_t sock, sstp_config* cfg)
+{
+  unsigned int user_timeout = cfg->tcp_user_timeout;
+  int one = 1;
+
+  if (cfg->tcp_user_timeout > 0 &&
+      setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout)) < 0)
+    xlog(LOG_WARNING, "init_tcp: TCP user timeout unavailable: %s\n", strerror(errno));
+
+  if (cfg->tcp_keepidle <= 0)
+    return;
+
+  if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) < 0 ||
+      setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &cfg->tcp_keepidle, sizeof(int)) < 0 ||
+      setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &cfg->tcp_keepintvl, sizeof(int)) < 0 ||
+      setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &cfg->tcp_keepcnt, sizeof(int)) < 0)
+    xlog(LOG_WARNING, "init_tcp: TCP keepalive unavailable: %s\n", strerror(errno));
+}
+
+
+/**
+ * Starts a non-blocking connection attempt. With TCP Fast Open and a cookie
+ * for this server, connect() succeeds right away: SYN is sent along with
+ * first data.
+ *
+ * @param ll : address
+ * @param cfg : configuration
+ * @param fastopen : TRUE to use TCP Fast Open
+ * @param connected : set if connect() succeeded right away
+ * @return socket, -1 if attempt failed
+ */
+static sock_t tcp_attempt(struct addrinfo* ll, sstp_config* cfg, int fastopen, int* connected)
+{
+  char host[NI_MAXHOST];
+  int verbose = cfg->verbose, one = 1;
+  sock_t sock;
+
+  if (verbose > 1)
+    xlog(LOG_DEBUG, "Trying %s\n", tcp_addr(ll, host, sizeof(host)));
+
+  sock = socket(ll->ai_family, ll->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		ll->ai_protocol);
+  if (sock == -1)
+    {
+      if (verbose)
+	xlog(LOG_ERROR, "init_tcp: socket: %s\n", strerror(errno));
+      return -1;
+    }
+
+  /* not fatal, connection is then a regular one */
+  if (fastopen &&
+      setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) < 0 && verbose)
+    xlog(LOG_WARNING, "init_tcp: TCP Fast Open unavailable: %s\n", strerror(errno));
+
+  /* user timeout also bounds SYN retransmissions */
+  tcp_set_timeouts(sock, cfg);
+
+  *connected = (connect(sock, ll->ai_addr, ll->ai_addrlen) == 0);
+  if (*connected || errno == EINPROGRESS)
+    return sock;
+
+  if (verbose)
+    xlog(LOG_ERROR, "init_tcp: connect %s: %s\n", tcp_addr(ll, host, sizeof(host)), strerror(errno));
+
+  close(sock);
+  return -1;
+}
+
+
+/**
+ * Races connection attempts to every address, see tcp.h.
+ *
+ * @param res : getaddrinfo() results
+ * @param cfg : configuration
+ * @return connected (blocking) socket, -1 if every attempt failed
+ */
+sock_t tcp_connect(struct addrinfo* res, sstp_config* cfg)
+{
+  struct addrinfo *addrs[TCP_MAX_ATTEMPTS];
+  struct pollfd pfds[TCP_MAX_ATTEMPTS];
+  int attempt[TCP_MAX_ATTEMPTS];
+  char host[NI_MAXHOST];
+  int n, next = 0, npfds = 0, pending = 0, winner = -1, connected, fastopen, i, err, retcode;
+  int64_t next_attempt = 0, timeout;
+  socklen_t err_len;
+  int verbose = cfg->verbose;
+  sock_t sock = -1;
+
+  n = tcp_sort(res, addrs);
+
+  /*
+   * An instant Fast Open connect() sends no SYN, and would win the race
+   * before a dead path shows up: only used with a single address.
+   */
+  fastopen = cfg->tcp_fastopen && n == 1;
+  if (cfg->tcp_fastopen && !fastopen && verbose > 1)
+    xlog(LOG_DEBUG, "init_tcp: %d addresses to race, no TCP Fast Open\n", n);
+
+  while (sock < 0 && (next < n || pending))
+    {
+      /* start next attempt if its time has come, or if none is running */
+      if (next < n && (!pending || tcp_now() >= next_attempt))
+	{
+	  pfds[npfds].fd = tcp_attempt(addrs[next], cfg, fastopen, &connected);
+	  pfds[npfds].events = POLLOUT;
+	  pfds[npfds].revents = 0;
+	  attempt[npfds] = next++;
+
+	  if (pfds[npfds].fd < 0)
+	    continue;
+
+	  if (connected)
+	    {
+	      sock = pfds[npfds].fd;
+	      pfds[npfds].fd = -1;
+	      winner = attempt[npfds];
+	      break;
+	    }
+
+	  npfds++;
+	  pending++;
+	  next_attempt = tcp_now() + TCP_ATTEMPT_DELAY;
+	  continue;
+	}
+
+      timeout = -1;
+      if (next < n)
+	{
+	  timeout = next_attempt - tcp_now();
+	  if (timeout < 0)
+	    timeout = 0;
+	}
+
+      retcode = poll(pfds, npfds, (int) timeout);
+      if (retcode < 0 && errno != EINTR)
+	{
+	  xlog(LOG_ERROR, "init_tcp: poll: %s\n", strerror(errno));
+	  break;
+	}
+
+      for (i=0; retcode > 0 && i<npfds; i++)
+	{
+	  if (pfds[i].fd < 0 || !pfds[i].revents)
+	    continue;
+
+	  err_len = sizeof(err);
+	  if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+	    err = errno;
+
+	  if (!err)
+	    {
+	      sock = pfds[i].fd;
+	      pfds[i].fd = -1;
+	      winner = attempt[i];
+	      break;
+	    }
+
+	  if (verbose)
+	    xlog(LOG_ERROR, "init_tcp: connect %s: %s\n",
+		 tcp_addr(addrs[attempt[i]], host, sizeof(host)), strerror(err));
+
+	  close(pfds[i].fd);
+	  pfds[i].fd = -1;
+	  pending--;
+
+	  /* a failed attempt does not hold up next one */
+	  next_attempt = 0;
+	}
+    }
+
+  /* losers */
+  for (i=0; i<npfds; i++)
+    if (pfds[i].fd >= 0)
+      close(pfds[i].fd);
+
+  if (sock < 0)
+    return -1;
+
+  if (verbose > 1)
+    xlog(LOG_DEBUG, "Connected to %s\n", tcp_addr(addrs[winner], host, sizeof(host)));
+
+  /* TLS and HTTPS negociations expect a blocking socket */
+  if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK) < 0)
+    {
+      xlog(LOG_ERROR, "init_tcp: fcntl: %s\n", strerror(errno));
+      close(sock);
+      return -1;
+    }
+
+  return sock;
+}
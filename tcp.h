@@ -0,0 +1,52 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <netdb.h>
+
+#define TCP_ATTEMPT_DELAY 250	/* ms, "Connection Attempt Delay" of RFC 8305 */
+#define TCP_MAX_ATTEMPTS 16
+#define TCP_KEEPALIVE_INTVL 5	/* s, between keepalive probes, see tcp_set_timeouts() */
+#define TCP_KEEPALIVE_CNT 3	/* probes left unanswered before reset */
+
+/*
+ * Happy Eyeballs (RFC 8305): addresses of both families are interleaved and
+ * tried with non-blocking connect(), a new attempt starting every
+ * TCP_ATTEMPT_DELAY ms (or as soon as one fails) while previous ones still
+ * run. First socket connected wins, others are closed. A dead IPv6 path thus
+ * costs TCP_ATTEMPT_DELAY rather than a full TCP timeout.
+ *
+ * With TCP Fast Open, the TLS ClientHello goes along with SYN once server has
+ * given a cookie; kernel falls back to a regular handshake otherwise. As such
+ * a connect() succeeds before any packet is sent, it cannot take part in the
+ * race: Fast Open is only used when the server has a single address.
+ */
+
+/*
+ * A peer vanishing without a reset is detected by the kernel: data left
+ * unacknowledged for cfg->tcp_user_timeout ms, or an idle connection not
+ * answering cfg->tcp_keepcnt keepalive probes, resets the socket. Pending
+ * or next socket I/O then fails with ETIMEDOUT, and the tunnel is closed,
+ * or reconnected with cfg->reconnect.
+ */
+sock_t tcp_connect(struct addrinfo* res, sstp_config* cfg);
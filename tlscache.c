@@ -0,0 +1,497 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#ifdef HAS_GNUTLS
+#include <gnutls/x509.h>
+#include <gnutls/gnutls.h>
+#else
+#include <polarssl/net.h>
+#include <polarssl/ssl.h>
+#include <polarssl/entropy.h>
+#include <polarssl/ctr_drbg.h>
+#endif
+
+#include "main.h"
+#include "libsstp.h"
+#include "event.h"
+#include "tlscache.h"
+#include "tunnel.h"
+#include "bench.h"
+
+
+static const char* tls_cache_status_str[] =
+  {
+    "disabled",
+    "no cached session",
+    "offered",
+    "hit",
+    "miss",
+  };
+
+
+/**
+ * Takes failed TLS versions of a cache file header, unless they expired.
+ *
+ * @param t : tunnel
+ * @param header : cache file header
+ */
+static void tls_cache_header_versions(sstp_tunnel_t* t, tls_cache_header_t* header)
+{
+  if ((uint64_t) time(NULL) >= header->failed_expire || !header->failed_versions)
+    return;
+
+  t->tls_failed_versions |= header->failed_versions;
+  if ((time_t) header->failed_expire > t->tls_failed_expire)
+    t->tls_failed_expire = header->failed_expire;
+}
+
+
+/**
+ * Opens (or creates) cache file of tunnel server, in cache directory. Server
+ * name characters other than alphanumerics, '.' and '-' are replaced by '_'.
+ *
+ * @param t : tunnel, with cfg->tls_cache set
+ * @return 0 if all good, -1 otherwise
+ */
+int tls_cache_open(sstp_tunnel_t* t)
+{
+  tls_cache_header_t header;
+  char path[PATH_MAX], *c;
+  int len;
+
+  t->tls_cache_fd = -1;
+  t->tls_cache_state = TLS_CACHE_DISABLED;
+
+  if (!t->cfg->tls_cache)
+    return 0;
+
+  len = snprintf(path, sizeof(path), "%s/%s_%s.session",
+		 t->cfg->tls_cache, t->cfg->server, t->cfg->port);
+  if (len < 0 || (size_t) len >= sizeof(path))
+    {
+      xlog(LOG_ERROR, "tls_cache_open: path too long\n");
+      return -1;
+    }
+
+  for (c = path + strlen(t->cfg->tls_cache) + 1; *c; c++)
+    if (!(isalnum(*c) || *c == '.' || *c == '-'))
+      *c = '_';
+
+  t->tls_cache_fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR);
+  if (t->tls_cache_fd < 0)
+    {
+      xlog(LOG_ERROR, "tls_cache_open: '%s': %s\n", path, strerror(errno));
+      return -1;
+    }
+
+  t->tls_cache_state = TLS_CACHE_EMPTY;
+
+  if (pread(t->tls_cache_fd, &header, sizeof(tls_cache_header_t), 0) == sizeof(tls_cache_header_t) &&
+      !memcmp(header.magic, TLS_CACHE_MAGIC, sizeof(header.magic)))
+    tls_cache_header_versions(t, &header);
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: TLS session cache '%s'\n", t->name, path);
+
+  return 0;
+}
+
+
+/**
+ * Closes cache file.
+ *
+ * @param t : tunnel
+ */
+void tls_cache_close(sstp_tunnel_t* t)
+{
+  if (t->tls_cache_fd >= 0)
+    close(t->tls_cache_fd);
+
+  t->tls_cache_fd = -1;
+}
+
+
+/**
+ * Reads cache entry, if it exists and has not expired.
+ *
+ * @param t : tunnel
+ * @param buffer : TLS_CACHE_MAX_SIZE bytes buffer
+ * @return entry length, 0 if none
+ */
+static size_t tls_cache_read(sstp_tunnel_t* t, unsigned char* buffer)
+{
+  tls_cache_header_t header;
+  ssize_t rbytes;
+
+  flock(t->tls_cache_fd, LOCK_SH);
+  rbytes = pread(t->tls_cache_fd, &header, sizeof(tls_cache_header_t), 0);
+  if (rbytes == sizeof(tls_cache_header_t) &&
+      !memcmp(header.magic, TLS_CACHE_MAGIC, sizeof(header.magic)) &&
+      header.length <= TLS_CACHE_MAX_SIZE)
+    {
+      tls_cache_header_versions(t, &header);
+      rbytes = pread(t->tls_cache_fd, buffer, header.length, sizeof(tls_cache_header_t));
+    }
+  else
+    rbytes = -1;
+  flock(t->tls_cache_fd, LOCK_UN);
+
+  if (rbytes < 0 || (size_t) rbytes != header.length || !header.length)
+    return 0;
+
+  if ((uint64_t) time(NULL) >= header.expire)
+    {
+      if (t->cfg->verbose > 1)
+	xlog(LOG_DEBUG, "%s: cached TLS session has expired\n", t->name);
+      return 0;
+    }
+
+  return header.length;
+}
+
+
+/**
+ * Replaces cache entry.
+ *
+ * @param t : tunnel
+ * @param data : TLS library session data
+ * @param len : `data` length
+ * @param expire : entry expiration time
+ */
+static void tls_cache_write(sstp_tunnel_t* t, const void* data, size_t len, time_t expire)
+{
+  tls_cache_header_t header;
+
+  if (len > TLS_CACHE_MAX_SIZE)
+    return;
+
+  memcpy(header.magic, TLS_CACHE_MAGIC, sizeof(header.magic));
+  header.expire = expire;
+  header.length = len;
+  header.failed_versions = t->tls_failed_versions;
+  header.failed_expire = t->tls_failed_versions ? t->tls_failed_expire : 0;
+
+  flock(t->tls_cache_fd, LOCK_EX);
+  if (ftruncate(t->tls_cache_fd, 0) < 0 ||
+      pwrite(t->tls_cache_fd, &header, sizeof(tls_cache_header_t), 0) != sizeof(tls_cache_header_t) ||
+      (len && pwrite(t->tls_cache_fd, data, len, sizeof(tls_cache_header_t)) != (ssize_t) len))
+    xlog(LOG_ERROR, "tls_cache_write: %s\n", strerror(errno));
+  flock(t->tls_cache_fd, LOCK_UN);
+}
+
+
+/**
+ * Removes cached session, eg. after a failed handshake. Failed TLS versions
+ * are kept.
+ *
+ * @param t : tunnel
+ */
+void tls_cache_drop(sstp_tunnel_t* t)
+{
+  if (t->tls_cache_fd < 0)
+    return;
+
+  tls_cache_write(t, NULL, 0, 0);
+}
+
+
+/**
+ * Records that server rejected a TLS version, so that next connections (of
+ * this process, and of next ones if cache is enabled) go straight to an older
+ * version, for TLS_CACHE_FALLBACK_TTL.
+ *
+ * @param t : tunnel
+ * @param version : TLS_VERS_* bit
+ */
+void tls_cache_version_failed(sstp_tunnel_t* t, uint32_t version)
+{
+  t->tls_failed_versions |= version;
+  t->tls_failed_expire = time(NULL) + TLS_CACHE_FALLBACK_TTL;
+
+  /* session of a failed handshake is worthless */
+  tls_cache_drop(t);
+}
+
+
+/**
+ * Records that a handshake succeeded with a TLS version: it and older ones
+ * are no longer failed. Cache file is updated by next tls_cache_store().
+ *
+ * @param t : tunnel
+ * @param version : TLS_VERS_* bit of negociated version
+ */
+void tls_cache_version_ok(sstp_tunnel_t* t, uint32_t version)
+{
+  t->tls_failed_versions &= ~((version << 1) - 1);
+}
+
+
+/**
+ * @param t : tunnel
+ * @return TLS_VERS_* bits of versions not to be offered, none once expired
+ */
+uint32_t tls_cache_failed_versions(sstp_tunnel_t* t)
+{
+  if (t->tls_failed_versions && time(NULL) >= t->tls_failed_expire)
+    {
+      if (t->cfg->verbose > 1)
+	xlog(LOG_DEBUG, "%s: trying failed TLS versions again\n", t->name);
+      t->tls_failed_versions = 0;
+    }
+
+  return t->tls_failed_versions;
+}
+
+
+/**
+ * Builds GnuTLS priority string of a handshake: user priority string (or
+ * AEAD-first default), minus versions server failed to handshake with.
+ *
+ * @param cfg : configuration
+ * @param failed : TLS_VERS_* bits of failed versions
+ * @param priority : buffer
+ * @param len : buffer length
+ */
+void tls_cache_priority(sstp_config* cfg, uint32_t failed, char* priority, size_t len)
+{
+  /*
+   * AEAD ciphers first, CBC ones are kept for older servers. A server
+   * rejecting the highest version offered is dealt with by version fallback,
+   * see init_tls_session(): fallback handshakes carry TLS_FALLBACK_SCSV
+   * (RFC 7507), so that a server supporting that version refuses a downgrade
+   * forced by an attacker.
+   */
+  const char *default_priority = "NORMAL:-CIPHER-ALL:+AES-256-GCM:+AES-128-GCM:"
+    "+CHACHA20-POLY1305:+AES-256-CBC:+AES-128-CBC";
+  const char *order;
+  char timed_priority[256];
+
+  /* same default, with AEAD ciphers sorted by bench_auto() */
+  order = bench_cipher_order();
+  if (!cfg->tls_priority && order)
+    {
+      snprintf(timed_priority, sizeof(timed_priority),
+	       "NORMAL:-CIPHER-ALL:%s:+AES-256-CBC:+AES-128-CBC", order);
+      default_priority = timed_priority;
+    }
+
+  snprintf(priority, len, "%s%s%s%s%s",
+	   cfg->tls_priority ? cfg->tls_priority : default_priority,
+	   failed & TLS_VERS_1_3 ? ":-VERS-TLS1.3" : "",
+	   failed & TLS_VERS_1_2 ? ":-VERS-TLS1.2" : "",
+	   failed & TLS_VERS_1_1 ? ":-VERS-TLS1.1" : "",
+	   failed ? ":%FALLBACK_SCSV" : "");
+}
+
+
+/**
+ * Offers cached session (if any) for next handshake. Must be called after
+ * TLS session initialization, before handshake.
+ *
+ * @param t : tunnel
+ * @return 0 if all good, -1 otherwise
+ */
+int tls_cache_load(sstp_tunnel_t* t)
+{
+  unsigned char *buffer;
+  size_t len;
+  int retcode = 0;
+
+  if (t->tls_cache_fd < 0)
+    return 0;
+
+  t->tls_cache_state = TLS_CACHE_EMPTY;
+
+  buffer = (unsigned char*) xmalloc(TLS_CACHE_MAX_SIZE);
+  len = tls_cache_read(t, buffer);
+  if (!len)
+    goto end;
+
+#ifdef HAS_GNUTLS
+  retcode = gnutls_session_set_data(t->tls, buffer, len);
+  if (retcode != GNUTLS_E_SUCCESS)
+    {
+      xlog(LOG_WARNING, "%s: invalid cached TLS session: %s\n", t->name,
+	   gnutls_strerror(retcode));
+      tls_cache_drop(t);
+      retcode = 0;
+      goto end;
+    }
+#else
+  {
+    ssl_session session;
+
+    if (len < sizeof(ssl_session))
+      goto end;
+
+    /* entry is the session structure, followed by its ticket */
+    memcpy(&session, buffer, sizeof(ssl_session));
+    session.peer_cert = NULL;
+    session.ticket = NULL;
+    if (session.ticket_len && session.ticket_len == len - sizeof(ssl_session))
+      {
+	session.ticket = malloc(session.ticket_len);
+	memcpy(session.ticket, buffer + sizeof(ssl_session), session.ticket_len);
+      }
+    else
+      session.ticket_len = 0;
+
+    retcode = ssl_set_session(&t->tls, &session);
+    ssl_session_free(&session);
+    if (retcode != 0)
+      {
+	xlog(LOG_WARNING, "%s: invalid cached TLS session (%#x)\n", t->name, -retcode);
+	tls_cache_drop(t);
+	retcode = 0;
+	goto end;
+      }
+
+    memcpy(t->tls_cache_id, t->tls.session_negotiate->id, sizeof(t->tls_cache_id));
+  }
+#endif
+
+  t->tls_cache_state = TLS_CACHE_OFFERED;
+
+ end:
+  xfree(buffer);
+  return retcode;
+}
+
+
+/**
+ * Once handshake is done, tells whether server resumed offered session.
+ *
+ * @param t : tunnel
+ * @return new cache state
+ */
+int tls_cache_resumed(sstp_tunnel_t* t)
+{
+  if (t->tls_cache_state != TLS_CACHE_OFFERED)
+    return t->tls_cache_state;
+
+#ifdef HAS_GNUTLS
+  t->tls_cache_state = gnutls_session_is_resumed(t->tls) ? TLS_CACHE_HIT : TLS_CACHE_MISS;
+#else
+  t->tls_cache_state = (t->tls.session->length &&
+			!memcmp(t->tls_cache_id, t->tls.session->id, sizeof(t->tls_cache_id))) ?
+    TLS_CACHE_HIT : TLS_CACHE_MISS;
+#endif
+
+  return t->tls_cache_state;
+}
+
+
+/**
+ * Saves current TLS session for next connections. With TLS 1.3, tickets are
+ * sent by server after handshake, so this is best called once some data was
+ * received (ie after HTTPS negociation).
+ *
+ * @param t : tunnel
+ */
+void tls_cache_store(sstp_tunnel_t* t)
+{
+  time_t expire;
+
+  if (t->tls_cache_fd < 0)
+    return;
+
+  expire = time(NULL) + t->cfg->tls_cache_ttl;
+
+#ifdef HAS_GNUTLS
+  {
+    gnutls_datum_t data;
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+    time_t session_expire;
+#endif
+
+    if (gnutls_protocol_get_version(t->tls) == GNUTLS_TLS1_3 &&
+	!(gnutls_session_get_flags(t->tls) & GNUTLS_SFLAGS_SESSION_TICKET))
+      {
+	if (t->cfg->verbose > 1)
+	  xlog(LOG_DEBUG, "%s: no TLS session ticket received, nothing to cache\n", t->name);
+	return;
+      }
+
+    if (gnutls_session_get_data2(t->tls, &data) != GNUTLS_E_SUCCESS)
+      return;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+    /* never keep a ticket longer than server allows */
+    session_expire = gnutls_db_check_entry_expire_time(&data);
+    if (session_expire > 0 && session_expire < expire)
+      expire = session_expire;
+#endif
+
+    tls_cache_write(t, data.data, data.size, expire);
+    gnutls_free(data.data);
+  }
+#else
+  {
+    ssl_session session;
+    unsigned char *buffer;
+
+    memset(&session, 0, sizeof(ssl_session));
+    if (ssl_get_session(&t->tls, &session) != 0)
+      return;
+
+    if (sizeof(ssl_session) + session.ticket_len <= TLS_CACHE_MAX_SIZE)
+      {
+	buffer = (unsigned char*) xmalloc(sizeof(ssl_session) + session.ticket_len);
+	memcpy(buffer, &session, sizeof(ssl_session));
+	if (session.ticket_len)
+	  memcpy(buffer + sizeof(ssl_session), session.ticket, session.ticket_len);
+
+	tls_cache_write(t, buffer, sizeof(ssl_session) + session.ticket_len, expire);
+	xfree(buffer);
+      }
+
+    ssl_session_free(&session);
+  }
+#endif
+
+  if (t->cfg->verbose > 1)
+    xlog(LOG_DEBUG, "%s: TLS session cached for %lu sec\n", t->name, expire - time(NULL));
+}
+
+
+/**
+ * @param t : tunnel
+ * @return cache state, as a string
+ */
+const char* tls_cache_status(sstp_tunnel_t* t)
+{
+  return tls_cache_status_str[t->tls_cache_state];
+}
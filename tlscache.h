@@ -0,0 +1,79 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+
+#define TLS_CACHE_DEFAULT_TTL 3600
+#define TLS_CACHE_MAX_SIZE 65536
+#define TLS_CACHE_FALLBACK_TTL 86400	/* sec, failed TLS versions are tried again afterwards */
+#define TLS_CACHE_MAGIC "SSTPTLS3"
+
+/* TLS versions, as bits of the per-server fallback memory */
+#define TLS_VERS_1_0 0x01
+#define TLS_VERS_1_1 0x02
+#define TLS_VERS_1_2 0x04
+#define TLS_VERS_1_3 0x08
+
+/* what happened to cached session on last handshake, see tls_cache_resumed() */
+enum
+  {
+    TLS_CACHE_DISABLED = 0,
+    TLS_CACHE_EMPTY,		/* nothing cached, or entry expired */
+    TLS_CACHE_OFFERED,		/* entry offered to server */
+    TLS_CACHE_HIT,		/* server resumed the session */
+    TLS_CACHE_MISS,		/* server asked for a full handshake */
+  };
+
+/*
+ * Cache file header, followed by `length` bytes of TLS library session data.
+ * TLS versions server failed to handshake with are kept even without session,
+ * until `failed_expire`.
+ */
+typedef struct __tls_cache_header
+{
+  char magic[8];
+  uint64_t expire;
+  uint32_t length;
+  uint32_t failed_versions;
+  uint64_t failed_expire;
+} tls_cache_header_t;
+
+/*
+ * TLS session resumption: session tickets (or IDs) of a server are kept in a
+ * file of the cache directory, one per server and port, and offered on next
+ * connection to skip certificate exchange and key agreement. Cache file also
+ * remembers which TLS versions failed with this server. It is opened while
+ * still privileged, so that it can be used after privileges are dropped.
+ */
+int tls_cache_open(sstp_tunnel_t* t);
+void tls_cache_close(sstp_tunnel_t* t);
+int tls_cache_load(sstp_tunnel_t* t);
+void tls_cache_store(sstp_tunnel_t* t);
+void tls_cache_drop(sstp_tunnel_t* t);
+void tls_cache_version_failed(sstp_tunnel_t* t, uint32_t version);
+void tls_cache_version_ok(sstp_tunnel_t* t, uint32_t version);
+uint32_t tls_cache_failed_versions(sstp_tunnel_t* t);
+void tls_cache_priority(sstp_config* cfg, uint32_t failed, char* priority, size_t len);
+int tls_cache_resumed(sstp_tunnel_t* t);
+const char* tls_cache_status(sstp_tunnel_t* t);
@@ -0,0 +1,184 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Must be included after main.h, libsstp.h and event.h.
+ */
+
+#include <pthread.h>
+
+#include "pool.h"
+#include "servers.h"
+
+#define TUNNEL_MAX_ARGS 64
+#define TUNNEL_RECONNECT_DELAY_MIN 500	/* ms, see tunnel_suspend() */
+#define TUNNEL_RECONNECT_DELAY_MAX 60000	/* ms */
+
+typedef struct __sstp_worker sstp_worker_t;
+
+/* reconnection steps run by a connector thread, see tunnel_reconnect_event() */
+enum
+  {
+    TUNNEL_CONNECT_IDLE = 0,
+    TUNNEL_CONNECT_RUNNING,
+    TUNNEL_CONNECT_DONE,
+  };
+
+/*
+ * Connection milestones, see tunnel_phase(). Each is stamped on the
+ * monotonic clock, and reported in ms from TUNNEL_PHASE_OPEN.
+ */
+enum
+  {
+    TUNNEL_PHASE_OPEN = 0,	/* tunnel_open() */
+    TUNNEL_PHASE_DNS,		/* server (or proxy) addresses known */
+    TUNNEL_PHASE_TCP,		/* TCP connected */
+    TUNNEL_PHASE_PROXY,		/* proxy CONNECT 200 */
+    TUNNEL_PHASE_TLS,		/* TLS handshake done */
+    TUNNEL_PHASE_HTTP,		/* SSTP_DUPLEX_POST 200 */
+    TUNNEL_PHASE_CONNECT_ACK,	/* SSTP_MSG_CALL_CONNECT_ACK */
+    TUNNEL_PHASE_CHAP,		/* PPP CHAP success */
+    TUNNEL_PHASE_CONNECTED,	/* SSTP_MSG_CALL_CONNECTED sent */
+    TUNNEL_PHASE_DATA,		/* first data packet after it */
+    TUNNEL_PHASE_MAX,
+  };
+
+/*
+ * A tunnel owns every piece of state of one SSTP connection: configuration,
+ * TCP socket and TLS session, SSTP automaton, buffers, and its PPP side (pppd
+ * pty or TUN interface). A process runs one tunnel, or many in daemon mode.
+ */
+struct __sstp_tunnel
+{
+  char* name;
+  sstp_config* cfg;
+  char* line;			/* tunnels file line, cfg strings point in it */
+
+  sock_t sockfd;
+#ifdef HAS_GNUTLS
+  gnutls_session_t tls;
+  gnutls_x509_crt_t certificate;
+  gnutls_certificate_credentials_t creds;
+  gnutls_priority_t priority;
+#else
+  entropy_context entropy;
+  ctr_drbg_context ctr_drbg;
+  ssl_context tls;
+  x509_crt certificate;
+  int* ciphersuites;
+#endif
+  unsigned char* cert_der;	/* hashed certificate, see crypto_load_certificate() */
+  size_t cert_der_len;
+  unsigned char cert_sha1[SHA1_HASH_LEN];
+  unsigned char cert_sha256[SHA256_HASH_LEN];
+  int early_data;		/* HTTPS request went as TLS 1.3 early data */
+  int ktls_mode;		/* directions handled by the kernel, see ktls.h */
+  int tls_cache_fd;		/* TLS session cache file, see tlscache.h */
+  int tls_cache_state;
+  int resolv_cache_fd;		/* server addresses cache file, see resolv.h */
+  servers_t servers;		/* server pool, see servers.h */
+  uint32_t tls_failed_versions;	/* TLS_VERS_* bits, see tls_cache_version_failed() */
+  time_t tls_failed_expire;
+#ifndef HAS_GNUTLS
+  unsigned char tls_cache_id[32];	/* session ID offered to server */
+#endif
+
+  pid_t pppd_pid;
+  int pppd_ready_fd;		/* closed by pppd execv(), see sstp_fork() */
+  int ppp_fd;			/* pppd pty master, or TUN interface */
+  struct __ppp_context* ppp;	/* native PPP, NULL with pppd */
+
+  sstp_context_t* ctx;
+  sstp_session_t* sess;
+  chap_context_t* chap_ctx;
+  struct __sstp_uring* uring;	/* io_uring backend, NULL with epoll */
+  pool_t packet_pool;		/* control packets */
+  pool_t small_pool;		/* attributes and HMAC results */
+
+  /* event loop handlers, see sstp_tunnel_start() */
+  sstp_worker_t* worker;
+  event_handler_t pty_handler;
+  event_handler_t tls_handler;
+  event_handler_t uring_handler;
+
+  /* worker event loop timers, see sstp_timer_arm() */
+  event_timer_t negociation_timer;
+  event_timer_t keepalive_timer;	/* see sstp_keepalive_event() */
+  event_timer_t tx_timer;	/* transmit delay, see sstp_tx_schedule() */
+
+  /* echo keepalive, RTT in us */
+  struct timespec echo_sent;	/* pending echo request, zero if none */
+  unsigned int echo_lost;	/* requests left unanswered in a row */
+  long keepalive_interval;	/* s */
+  unsigned long keepalive_rx;	/* rx_bytes when link was last checked */
+  long rtt;			/* smoothed, 0 until first response */
+  long rtt_var;			/* mean deviation, ie. jitter */
+
+  /* counters at last -vv report, see sstp_alloc_report() */
+  unsigned long report_packets;
+  unsigned long report_requests;
+  unsigned long report_pool_allocs;
+  unsigned long report_heap_allocs;
+
+  struct timespec phases[TUNNEL_PHASE_MAX];	/* zero if not reached */
+  unsigned int stats_seq;	/* odd while phases or RTT change, see tunnel_stats_begin() */
+  long link_time;		/* ms from tunnel_open() to SSTP link */
+
+  /* reconnection keeping the PPP side up, see tunnel_suspend() */
+  int reconnecting;
+  unsigned int reconnects;	/* attempts since link was lost */
+  long reconnect_delay;		/* ms, doubles on each failure */
+  event_timer_t reconnect_timer;
+  int connect_state;		/* TUNNEL_CONNECT_*, set by connector thread */
+  int connect_retcode;		/* tunnel_open() result, once done */
+  unsigned char* park;		/* PPP side frames, see sstp_park_event() */
+  size_t park_len;
+  unsigned int park_frames;
+  unsigned int park_dropped;
+
+  int running;
+  int privileged;		/* still needs root, see release_privileges() */
+  int kill;			/* disconnection requested by another thread */
+  int retcode;
+};
+
+
+/*
+ * A worker is a thread running one event loop, for the tunnels assigned to
+ * it. The main thread runs no tunnel: it reads signals and waits for every
+ * tunnel to end.
+ */
+struct __sstp_worker
+{
+  unsigned int id;
+  pthread_t thread;
+  event_loop_t loop;
+
+  sstp_tunnel_t** tunnels;
+  unsigned int ntunnels;
+  unsigned int running;
+
+  int wakefd;
+  event_handler_t wake_handler;	/* main thread asks for disconnections */
+};
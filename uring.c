@@ -0,0 +1,297 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			      unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/**
+ * Creates an io_uring instance and maps its rings.
+ *
+ * @param ring : ring to initialize
+ * @param entries : submission queue size
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int uring_init(uring_t* ring, unsigned entries)
+{
+  struct io_uring_params p;
+  int saved_errno;
+
+  memset(ring, 0, sizeof(uring_t));
+  memset(&p, 0, sizeof(struct io_uring_params));
+  ring->sq_ring = ring->cq_ring = MAP_FAILED;
+  ring->sqes = MAP_FAILED;
+
+  ring->fd = sys_io_uring_setup(entries, &p);
+  if (ring->fd < 0)
+    return -1;
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (ring->cq_ring_size > ring->sq_ring_size)
+	ring->sq_ring_size = ring->cq_ring_size;
+      ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto err;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+			   MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+	goto err;
+    }
+
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+		    MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto err;
+
+  ring->sq_head = ring->sq_ring + p.sq_off.head;
+  ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+  ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+  ring->sq_array = ring->sq_ring + p.sq_off.array;
+  ring->sqe_tail = *ring->sq_tail;
+
+  ring->cq_head = ring->cq_ring + p.cq_off.head;
+  ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+  ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+  ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+  return 0;
+
+ err:
+  saved_errno = errno;
+  uring_close(ring);
+  errno = saved_errno;
+  return -1;
+}
+
+
+/**
+ * Unmaps rings and closes io_uring instance. Pending requests are cancelled.
+ *
+ * @param ring : ring to close
+ */
+void uring_close(uring_t* ring)
+{
+  if (ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+
+  ring->sq_ring = ring->cq_ring = MAP_FAILED;
+  ring->sqes = MAP_FAILED;
+  ring->fd = -1;
+}
+
+
+/**
+ * Registers files, which are then referred to by their index in `fds`.
+ *
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int uring_register_files(uring_t* ring, int* fds, unsigned nfds)
+{
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, nfds) < 0)
+    return -1;
+
+  ring->fixed_files = 1;
+  return 0;
+}
+
+
+/**
+ * Registers buffers: they are pinned once, instead of on every request.
+ *
+ * @return 0 if all good, -1 otherwise (errno is set)
+ */
+int uring_register_buffers(uring_t* ring, struct iovec* iov, unsigned nr)
+{
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, nr) < 0)
+    return -1;
+
+  ring->fixed_buffers = 1;
+  return 0;
+}
+
+
+/**
+ * Returns a free SQE, submitting queued ones first if ring is full.
+ *
+ * @return SQE, or NULL if submission failed
+ */
+struct io_uring_sqe* uring_get_sqe(uring_t* ring)
+{
+  struct io_uring_sqe* sqe;
+  unsigned head;
+
+  head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->sqe_tail - head > *ring->sq_mask)
+    {
+      if (uring_submit(ring, 0) < 0)
+	return NULL;
+      head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+      if (ring->sqe_tail - head > *ring->sq_mask)
+	return NULL;
+    }
+
+  sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+  ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+  ring->sqe_tail++;
+  ring->queued++;
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+
+/**
+ * @return number of SQEs uring_get_sqe() can return without submitting
+ */
+unsigned uring_sq_space(uring_t* ring)
+{
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  return *ring->sq_mask + 1 - (ring->sqe_tail - head);
+}
+
+
+/**
+ * Prepares a read or write request. With registered files, `fd` is an index
+ * in registered file table; with registered buffers, READ/WRITE become their
+ * _FIXED variants on buffer 0.
+ *
+ * @param op : IORING_OP_READ or IORING_OP_WRITE
+ */
+void uring_prep_rw(struct io_uring_sqe* sqe, uring_t* ring, int op, int fd,
+		   void* buf, size_t len, uint64_t user_data)
+{
+  if (ring->fixed_buffers)
+    {
+      op = (op == IORING_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+      sqe->buf_index = 0;
+    }
+
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) buf;
+  sqe->len = len;
+  sqe->off = (uint64_t) -1;
+  sqe->user_data = user_data;
+
+  if (ring->fixed_files)
+    sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+
+/**
+ * Hands queued SQEs to the kernel, and optionally waits for completions.
+ *
+ * @param wait_nr : number of completions to wait for
+ * @return number of submitted SQEs, or -1 (errno is set)
+ */
+int uring_submit(uring_t* ring, unsigned wait_nr)
+{
+  unsigned submitted;
+  int retcode;
+
+  if (!ring->queued && !wait_nr)
+    return 0;
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  do
+    retcode = sys_io_uring_enter(ring->fd, ring->queued, wait_nr,
+				 wait_nr ? IORING_ENTER_GETEVENTS : 0);
+  while (retcode < 0 && errno == EINTR);
+
+  if (retcode < 0)
+    return -1;
+
+  submitted = retcode;
+  ring->queued -= (submitted < ring->queued) ? submitted : ring->queued;
+  return submitted;
+}
+
+
+/**
+ * @return next completion, or NULL if none is available
+ */
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring)
+{
+  unsigned head, tail;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return NULL;
+
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+
+/**
+ * Releases completion returned by uring_peek_cqe().
+ */
+void uring_cqe_seen(uring_t* ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,74 @@
+/*
+ * SSToPer, Linux SSTP Client
+ * Christophe Alladoum < christophe __DOT__ alladoum __AT__ hsc __DOT__ fr>
+ * Herve Schauer Consultants (http://www.hsc.fr)
+ *
+ *            GNU GENERAL PUBLIC LICENSE
+ *              Version 2, June 1991
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or (
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper over raw system calls. SQEs are queued with
+ * uring_get_sqe() and only handed to the kernel by uring_submit(), so that
+ * many requests cost a single io_uring_enter(2).
+ */
+typedef struct __uring
+{
+  int fd;
+
+  /* submission queue */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;
+  unsigned queued;
+
+  /* completion queue */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  int fixed_files;
+  int fixed_buffers;
+} uring_t;
+
+
+int uring_init(uring_t* ring, unsigned entries);
+void uring_close(uring_t* ring);
+int uring_register_files(uring_t* ring, int* fds, unsigned nfds);
+int uring_register_buffers(uring_t* ring, struct iovec* iov, unsigned nr);
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+unsigned uring_sq_space(uring_t* ring);
+void uring_prep_rw(struct io_uring_sqe* sqe, uring_t* ring, int op, int fd,
+		   void* buf, size_t len, uint64_t user_data);
+int uring_submit(uring_t* ring, unsigned wait_nr);
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+void uring_cqe_seen(uring_t* ring);